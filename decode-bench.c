@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2013, Red Hat
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.  Redistributions in binary
+ * form must reproduce the above copyright notice, this list of conditions and
+ * the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark for the response decoders.  It includes the library source
+ * directly, so the static parse callbacks can be called on their own with no
+ * curl or server involved, and runs each one over every response in a corpus
+ * that it applies to.  For each pair it prints ns/op, MB/s of JSON, and
+ * allocations per op (counted by wrapping malloc and friends, which glibc
+ * lets a program do for every library it loads, YAJL included).
+ *
+ * The corpus is generated in the same format etcd v2 uses, unless -r points
+ * at a directory of recorded responses, e.g. captured with curl from a real
+ * cluster.  Files there are named KIND-whatever.json, where KIND says which
+ * decoders apply: get, dir, set, watch or leader.  -w writes out the
+ * generated corpus in that form, as a starting point.
+ *
+ * To try a replacement decoder, add it to the decoders table with the kinds
+ * of response it handles.
+ */
+
+#include "etcd-api.c"
+
+#include <dirent.h>
+#include <getopt.h>
+
+#define DEFAULT_MIN_MS  200
+
+extern void     *__libc_malloc (size_t size);
+extern void     *__libc_calloc (size_t nmemb, size_t size);
+extern void     *__libc_realloc (void *ptr, size_t size);
+extern void     __libc_free (void *ptr);
+
+static uint64_t num_allocs;
+
+/*
+ * Everything is built with -fvisibility=hidden, but these have to be seen
+ * from outside for YAJL's and curl's allocations to land here too.
+ */
+#pragma GCC visibility push(default)
+
+void *
+malloc (size_t size)
+{
+        ++num_allocs;
+        return __libc_malloc(size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+        ++num_allocs;
+        return __libc_calloc(nmemb,size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+        ++num_allocs;
+        return __libc_realloc(ptr,size);
+}
+
+void
+free (void *ptr)
+{
+        __libc_free(ptr);
+}
+
+#pragma GCC visibility pop
+
+enum { K_GET, K_DIR, K_SET, K_WATCH, K_LEADER, NUM_KINDS };
+
+static const char *kind_names[NUM_KINDS] = {
+        "get", "dir", "set", "watch", "leader"
+};
+
+typedef struct {
+        char    *name;
+        int     kind;
+        char    *data;
+        size_t  len;
+} sample;
+
+static sample   *corpus;
+static size_t   corpus_len;
+
+/*
+ * Decoders.  Each one runs a parse callback exactly the way the library
+ * would and frees whatever it produced, so allocations balance.
+ */
+
+static void
+dec_get (char *data, size_t len)
+{
+        char    *value  = NULL;
+
+        parse_get_response(data,1,len,&value);
+        free(value);
+}
+
+static void
+dec_get_ex (char *data, size_t len)
+{
+        etcd_node       node;
+        etcd_get_t      get;
+
+        memset(&node,0,sizeof(node));
+        memset(&get,0,sizeof(get));
+        get.node = &node;
+        parse_get_ex_response(data,1,len,&get);
+        free(node.value);
+}
+
+static int
+count_leaf (void *arg, yajl_val node)
+{
+        ++*(size_t *)arg;
+        return 0;
+}
+
+static void
+dec_tree (char *data, size_t len)
+{
+        etcd_tree_t     tree;
+        size_t          leaves  = 0;
+
+        memset(&tree,0,sizeof(tree));
+        tree.cb = count_leaf;
+        tree.arg = &leaves;
+        parse_tree_response(data,1,len,&tree);
+}
+
+static void
+dec_watch (char *data, size_t len)
+{
+        etcd_watch_t    watch;
+
+        memset(&watch,0,sizeof(watch));
+        parse_watch_response(data,1,len,&watch);
+        free(watch.key);
+        free(watch.value);
+}
+
+static void
+dec_set (char *data, size_t len)
+{
+        etcd_result     res     = ETCD_WTF;
+
+        parse_set_response(data,1,len,&res);
+}
+
+static void
+dec_write (char *data, size_t len)
+{
+        etcd_write_t    write;
+
+        memset(&write,0,sizeof(write));
+        parse_write_response(data,1,len,&write);
+        free(write.key);
+}
+
+static void
+dec_leader (char *data, size_t len)
+{
+        char    *value  = NULL;
+
+        store_leader(data,1,len,&value);
+        free(value);
+}
+
+#define KINDS(x)        (1 << (x))
+
+static struct {
+        const char      *name;
+        unsigned int    kinds;
+        void            (*fn) (char *data, size_t len);
+} decoders[] = {
+        { "get",        KINDS(K_GET) | KINDS(K_DIR),    dec_get         },
+        { "get_ex",     KINDS(K_GET),                   dec_get_ex      },
+        { "tree",       KINDS(K_DIR),                   dec_tree        },
+        { "watch",      KINDS(K_WATCH) | KINDS(K_SET),  dec_watch       },
+        { "set",        KINDS(K_SET),                   dec_set         },
+        { "write",      KINDS(K_SET),                   dec_write       },
+        { "leader",     KINDS(K_LEADER),                dec_leader      },
+};
+
+#define NUM_DECODERS    (sizeof(decoders) / sizeof(decoders[0]))
+
+/*
+ * The generated corpus.
+ */
+
+static void
+add_sample (const char *name, int kind, char *data)
+{
+        sample  *s;
+
+        s = realloc(corpus,(corpus_len+1)*sizeof(*corpus));
+        if (!s || !data) {
+                fprintf(stderr,"out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        corpus = s;
+        s = &corpus[corpus_len++];
+        s->name = strdup(name);
+        s->kind = kind;
+        s->data = data;
+        s->len = strlen(data);
+}
+
+/* Printable filler, the sort of thing people keep in etcd. */
+static char *
+filler (size_t len, unsigned int seed)
+{
+        static const char       chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                          "abcdefghijklmnopqrstuvwxyz"
+                                          "0123456789+/";
+        char                    *text;
+        size_t                  i;
+
+        text = malloc(len+1);
+        if (!text) {
+                return NULL;
+        }
+        for (i = 0; i < len; ++i) {
+                text[i] = chars[rand_r(&seed)%(sizeof(chars)-1)];
+        }
+        text[len] = '\0';
+        return text;
+}
+
+static char *
+get_body (const char *key, const char *json_value, uint64_t index)
+{
+        char    *body;
+
+        if (asprintf(&body,"{\"action\":\"get\",\"node\":{\"key\":\"%s\","
+                           "\"value\":\"%s\",\"modifiedIndex\":%"PRIu64","
+                           "\"createdIndex\":%"PRIu64"}}",key,json_value,
+                     index,index) < 0) {
+                return NULL;
+        }
+        return body;
+}
+
+static char *
+dir_body (size_t children)
+{
+        FILE    *fp;
+        char    *body   = NULL;
+        size_t  len;
+        size_t  i;
+
+        fp = open_memstream(&body,&len);
+        if (!fp) {
+                return NULL;
+        }
+        fprintf(fp,"{\"action\":\"get\",\"node\":{\"key\":\"/dir\","
+                   "\"dir\":true,\"nodes\":[");
+        for (i = 0; i < children; ++i) {
+                fprintf(fp,"%s{\"key\":\"/dir/member%08zu\","
+                           "\"value\":\"10.0.%zu.%zu:4001\","
+                           "\"modifiedIndex\":%zu,\"createdIndex\":%zu}",
+                        i ? "," : "",i,(i>>8)&255,i&255,i+100,i+100);
+        }
+        fprintf(fp,"],\"modifiedIndex\":5,\"createdIndex\":5}}");
+        fclose(fp);
+        return body;
+}
+
+static void
+make_corpus (void)
+{
+        char    *text;
+        char    name[32];
+        size_t  children;
+
+        add_sample("get-small",K_GET,get_body("/config/mode","active",42));
+
+        text = filler(64*1024,1);
+        add_sample("get-large",K_GET,get_body("/blobs/cert",text,43));
+        free(text);
+
+        /* Quotes, backslashes, control characters and non-ASCII. */
+        add_sample("get-escaped",K_GET,get_body("/config/motd",
+                "line one\\nline \\\"two\\\"\\tand C:\\\\path\\\\to\\\\file "
+                "caf\\u00e9 \\u2603 snow\\r\\n\\u0001\\u001f"
+                "line one\\nline \\\"two\\\"\\tand C:\\\\path\\\\to\\\\file "
+                "caf\\u00e9 \\u2603 snow\\r\\n\\u0001\\u001f"
+                "line one\\nline \\\"two\\\"\\tand C:\\\\path\\\\to\\\\file "
+                "caf\\u00e9 \\u2603 snow\\r\\n\\u0001\\u001f",44));
+
+        for (children = 10; children <= 100000; children *= 10) {
+                snprintf(name,sizeof(name),"dir-%zu",children);
+                add_sample(name,K_DIR,dir_body(children));
+        }
+
+        if (asprintf(&text,"{\"action\":\"set\",\"node\":{\"key\":\"/config/"
+                           "mode\",\"value\":\"standby\",\"modifiedIndex\":"
+                           "50,\"createdIndex\":50},\"prevNode\":{\"key\":"
+                           "\"/config/mode\",\"value\":\"active\","
+                           "\"modifiedIndex\":42,\"createdIndex\":42}}") < 0) {
+                text = NULL;
+        }
+        add_sample("set-prev",K_SET,text);
+        if (asprintf(&text,"{\"errorCode\":101,\"message\":\"Compare failed\","
+                           "\"cause\":\"[active != standby]\",\"index\":50}")
+                        < 0) {
+                text = NULL;
+        }
+        add_sample("set-failed",K_SET,text);
+
+        if (asprintf(&text,"{\"action\":\"compareAndSwap\",\"node\":{\"key\":"
+                           "\"/queue/00000000000000000123\",\"value\":"
+                           "\"job 123\",\"modifiedIndex\":124,"
+                           "\"createdIndex\":123},\"prevNode\":{\"key\":"
+                           "\"/queue/00000000000000000123\",\"value\":"
+                           "\"job 123\",\"modifiedIndex\":123,"
+                           "\"createdIndex\":123}}") < 0) {
+                text = NULL;
+        }
+        add_sample("watch-cas",K_WATCH,text);
+        if (asprintf(&text,"{\"action\":\"expire\",\"node\":{\"key\":"
+                           "\"/leases/worker7\",\"modifiedIndex\":125,"
+                           "\"createdIndex\":99},\"prevNode\":{\"key\":"
+                           "\"/leases/worker7\",\"value\":\"10.0.0.7\","
+                           "\"modifiedIndex\":118,\"createdIndex\":99}}") < 0) {
+                text = NULL;
+        }
+        add_sample("watch-expire",K_WATCH,text);
+
+        if (asprintf(&text,"{\"leader\":\"8e9e05c52164694d\",\"followers\":{"
+                           "\"91bc3c398fb3c146\":{\"latency\":{\"current\":"
+                           "0.000852,\"average\":0.0012,\"standardDeviation\":"
+                           "0.0009,\"minimum\":0.000501,\"maximum\":0.2131},"
+                           "\"counts\":{\"fail\":0,\"success\":74564}},"
+                           "\"fd422379fda50e48\":{\"latency\":{\"current\":"
+                           "0.000713,\"average\":0.0011,\"standardDeviation\":"
+                           "0.0008,\"minimum\":0.000482,\"maximum\":0.1972},"
+                           "\"counts\":{\"fail\":2,\"success\":74560}}}}") < 0) {
+                text = NULL;
+        }
+        add_sample("leader-3",K_LEADER,text);
+}
+
+static int
+read_corpus (const char *path)
+{
+        DIR             *dir;
+        struct dirent   *ent;
+        char            *file;
+        FILE            *fp;
+        char            *data;
+        long            len;
+        int             kind;
+
+        dir = opendir(path);
+        if (!dir) {
+                perror(path);
+                return -1;
+        }
+        while ((ent = readdir(dir))) {
+                for (kind = 0; kind < NUM_KINDS; ++kind) {
+                        len = strlen(kind_names[kind]);
+                        if (!strncmp(ent->d_name,kind_names[kind],len)
+                                        && (ent->d_name[len] == '-')) {
+                                break;
+                        }
+                }
+                if (kind == NUM_KINDS) {
+                        continue;
+                }
+                if (asprintf(&file,"%s/%s",path,ent->d_name) < 0) {
+                        break;
+                }
+                fp = fopen(file,"r");
+                free(file);
+                if (!fp) {
+                        continue;
+                }
+                fseek(fp,0,SEEK_END);
+                len = ftell(fp);
+                rewind(fp);
+                data = malloc(len+1);
+                if (data && (fread(data,1,len,fp) == (size_t)len)) {
+                        data[len] = '\0';
+                        add_sample(ent->d_name,kind,data);
+                }
+                else {
+                        free(data);
+                }
+                fclose(fp);
+        }
+        closedir(dir);
+        return corpus_len ? 0 : -1;
+}
+
+static int
+write_corpus (const char *path)
+{
+        char    *file;
+        FILE    *fp;
+        size_t  i;
+
+        for (i = 0; i < corpus_len; ++i) {
+                if (asprintf(&file,"%s/%s.json",path,corpus[i].name) < 0) {
+                        return -1;
+                }
+                fp = fopen(file,"w");
+                if (!fp) {
+                        perror(file);
+                        free(file);
+                        return -1;
+                }
+                fwrite(corpus[i].data,1,corpus[i].len,fp);
+                fclose(fp);
+                free(file);
+        }
+        return 0;
+}
+
+static double
+now_ns (void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Run one decoder on one sample, doubling the count until a run takes at
+ * least min_ms, so tiny responses get enough iterations to time.
+ */
+static void
+run_one (int d, sample *s, unsigned int min_ms)
+{
+        uint64_t        iters   = 1;
+        uint64_t        allocs;
+        uint64_t        i;
+        double          t0;
+        double          ns      = 0;
+
+        /* Warm up, unless it's big enough that one run is plenty. */
+        if (s->len < (1024 * 1024)) {
+                decoders[d].fn(s->data,s->len);
+        }
+
+        for (;;) {
+                allocs = num_allocs;
+                t0 = now_ns();
+                for (i = 0; i < iters; ++i) {
+                        decoders[d].fn(s->data,s->len);
+                }
+                ns = now_ns() - t0;
+                allocs = num_allocs - allocs;
+                if ((ns >= min_ms * 1e6) || (iters >= (1ULL << 40))) {
+                        break;
+                }
+                iters *= (ns > 0) && (ns * 8 > min_ms * 1e6) ? 2 : 8;
+        }
+
+        printf("%-8s %-16s %10zu %10"PRIu64" %12.0f %10.1f %11.1f\n",
+               decoders[d].name,s->name,s->len,iters,ns/iters,
+               s->len*iters/(ns/1e9)/1e6,(double)allocs/iters);
+}
+
+struct option my_opts[] = {
+        { "corpus",     required_argument,      NULL,   'c' },
+        { "decoder",    required_argument,      NULL,   'd' },
+        { "help",       no_argument,            NULL,   'h' },
+        { "read",       required_argument,      NULL,   'r' },
+        { "time",       required_argument,      NULL,   't' },
+        { "write",      required_argument,      NULL,   'w' },
+        { NULL }
+};
+
+static int
+print_usage (char *prog)
+{
+        fprintf(stderr,"Usage: %s [options]\n",prog);
+        fprintf(stderr,"  -c|--corpus   CCC  only samples whose names "
+                       "contain this\n");
+        fprintf(stderr,"  -d|--decoder  DDD  only this decoder\n");
+        fprintf(stderr,"  -r|--read     DIR  use recorded responses from "
+                       "DIR\n");
+        fprintf(stderr,"  -t|--time     TTT  minimum ms per case, default "
+                       "%d\n",DEFAULT_MIN_MS);
+        fprintf(stderr,"  -w|--write    DIR  write the generated corpus to "
+                       "DIR and exit\n");
+        return EXIT_FAILURE;
+}
+
+int
+main (int argc, char **argv)
+{
+        char            *only_corpus    = NULL;
+        char            *only_decoder   = NULL;
+        char            *read_dir       = NULL;
+        char            *write_dir      = NULL;
+        unsigned int    min_ms          = DEFAULT_MIN_MS;
+        size_t          d;
+        size_t          i;
+        int             opt;
+
+        for (;;) {
+                opt = getopt_long(argc,argv,"c:d:hr:t:w:",my_opts,NULL);
+                if (opt == (-1)) {
+                        break;
+                }
+                switch (opt) {
+                case 'c':
+                        only_corpus = optarg;
+                        break;
+                case 'd':
+                        only_decoder = optarg;
+                        break;
+                case 'r':
+                        read_dir = optarg;
+                        break;
+                case 't':
+                        min_ms = strtoul(optarg,NULL,10);
+                        break;
+                case 'w':
+                        write_dir = optarg;
+                        break;
+                default:
+                        return print_usage(argv[0]);
+                }
+        }
+
+        if (read_dir) {
+                if (read_corpus(read_dir) != 0) {
+                        fprintf(stderr,"no usable responses in %s\n",read_dir);
+                        return EXIT_FAILURE;
+                }
+        }
+        else {
+                make_corpus();
+        }
+        if (write_dir) {
+                return write_corpus(write_dir) ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+
+        printf("%-8s %-16s %10s %10s %12s %10s %11s\n","decoder","sample",
+               "bytes","iters","ns/op","MB/s","allocs/op");
+        for (d = 0; d < NUM_DECODERS; ++d) {
+                if (only_decoder && strcmp(only_decoder,decoders[d].name)) {
+                        continue;
+                }
+                for (i = 0; i < corpus_len; ++i) {
+                        if (!(decoders[d].kinds & KINDS(corpus[i].kind))) {
+                                continue;
+                        }
+                        if (only_corpus && !strstr(corpus[i].name,
+                                                   only_corpus)) {
+                                continue;
+                        }
+                        run_one(d,&corpus[i],min_ms);
+                        fflush(stdout);
+                }
+        }
+
+        return EXIT_SUCCESS;
+}
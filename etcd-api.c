@@ -29,627 +29,7467 @@
 #define _GNU_SOURCE
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <curl/curl.h>
 #include <yajl/yajl_tree.h>
 #include "etcd-api.h"
+#include "etcd-sidecar.h"
 
 
 #define DEFAULT_ETCD_PORT       4001
 #define SL_DELIM                "\n\r\t ,;"
+#define DEFAULT_RING_SIZE       1024
+#define DEFAULT_BATCH_WINDOW    16
+#define RESTORE_CHUNK           4096
+#define SNAP_MAGIC              "ETCDSNP1"
+#define SNAP_BYTE_ORDER         0x01020304
+#define SHC_MAGIC               "ETCDSHC1"
+#define DEFAULT_SHC_SLOTS       4096
+#define DEFAULT_SHC_DATA        (1024 * 1024)
+#define MAX_BACKOFF_MS          3200
 
-typedef struct {
-        etcd_server     *servers;
-} _etcd_session;
+/* etcd's own error codes, as opposed to ours. */
+#define EC_KEY_NOT_FOUND        100
+#define EC_TEST_FAILED          101
+#define EC_NODE_EXIST           105
+#define EC_INDEX_CLEARED        401
 
+/*
+ * Allocation.  Everything the library allocates goes through these, so that
+ * etcd_set_allocator can send it somewhere other than the C library.  Which
+ * allocator is in effect is per thread: each public entry point points
+ * cur_alloc at its session's (or whatever owns the object it was handed) for
+ * the duration of the call, and background threads point it at theirs when
+ * they start.  That way the helpers at the bottom of the stack don't all need
+ * a session passed down to them.
+ */
 typedef struct {
-        char            *key;
-        char            *value;
-        int             *index_in;      /* pointer so NULL can be special */
-        int             index_out;      /* NULL would be meaningless */
-} etcd_watch_t;
+        etcd_malloc_fn          *malloc_fn;     /* NULL means the C library */
+        etcd_realloc_fn         *realloc_fn;
+        etcd_free_fn            *free_fn;
+        void                    *ctx;
+} etcd_allocator;
 
-typedef size_t curl_callback_t (void *, size_t, size_t, void *);
+static etcd_allocator                   global_alloc;
+static __thread const etcd_allocator    *cur_alloc;
 
-int             g_inited        = 0;
-const char      *value_path[]   = { "node", "value", NULL };
-const char      *nodes_path[]   = { "node", "nodes", NULL };
-const char      *entry_path[]   = { "key", NULL };
+static void
+restore_alloc (const etcd_allocator **saved)
+{
+        cur_alloc = *saved;
+}
 
-/*
- * We only call this in case where it should be safe, but gcc doesn't know
- * that so we use this to shut it up.
- */
-static char *
-MY_YAJL_GET_STRING (yajl_val x)
+/* Only one per scope, and it has to come after the declarations. */
+#define USE_ALLOCATOR(a)                                                \
+        const etcd_allocator *saved_alloc                               \
+                __attribute__((cleanup(restore_alloc))) = cur_alloc;    \
+        cur_alloc = (a)
+
+static inline const etcd_allocator *
+my_alloc (void)
 {
-        char *y = YAJL_GET_STRING(x);
+        return cur_alloc ? cur_alloc : &global_alloc;
+}
 
-        return y ? y : (char *)"bogus";
+static void *
+e_malloc (size_t size)
+{
+        const etcd_allocator    *a      = my_alloc();
+
+        if (a->malloc_fn) {
+                return a->malloc_fn(a->ctx,size);
+        }
+        return malloc(size);
 }
 
-#if defined(DEBUG)
-void
-print_curl_error (char *intro, CURLcode res)
+static void *
+e_calloc (size_t nmemb, size_t size)
 {
-        printf("%s: %s\n",intro,curl_easy_strerror(res));
+        const etcd_allocator    *a      = my_alloc();
+        void                    *ptr;
+
+        if (!a->malloc_fn) {
+                return calloc(nmemb,size);
+        }
+        if (size && (nmemb > SIZE_MAX / size)) {
+                return NULL;
+        }
+        ptr = a->malloc_fn(a->ctx,nmemb*size);
+        if (ptr) {
+                memset(ptr,0,nmemb*size);
+        }
+        return ptr;
 }
-#else
-#define print_curl_error(intro,res)
-#endif
 
- 
-etcd_session
-etcd_open (etcd_server *server_list)
+static void *
+e_realloc (void *ptr, size_t size)
 {
-        _etcd_session   *session;
+        const etcd_allocator    *a      = my_alloc();
 
-        if (!g_inited) {
-                curl_global_init(CURL_GLOBAL_ALL);
-                g_inited = 1;
+        if (a->malloc_fn) {
+                return a->realloc_fn(a->ctx,ptr,size);
         }
+        return realloc(ptr,size);
+}
 
-        session = malloc(sizeof(*session));
-        if (!session) {
-                return NULL;
+static void
+e_free (void *ptr)
+{
+        const etcd_allocator    *a      = my_alloc();
+
+        if (!ptr) {
+                return;
         }
+        if (a->malloc_fn) {
+                a->free_fn(a->ctx,ptr);
+        }
+        else {
+                free(ptr);
+        }
+}
 
-        /*
-         * Some day we'll set up more persistent connections, and keep track
-         * (via redirects) of which server is leader so that we can always
-         * try it first.  For now we just push that to the individual request
-         * functions, which do the most brain-dead thing that can work.
-         */
+static char *
+e_strndup (const char *s, size_t n)
+{
+        size_t  len     = strnlen(s,n);
+        char    *copy;
 
-        session->servers = server_list;
-        return session;
+        copy = e_malloc(len+1);
+        if (copy) {
+                memcpy(copy,s,len);
+                copy[len] = '\0';
+        }
+        return copy;
 }
 
+static char *
+e_strdup (const char *s)
+{
+        size_t  len     = strlen(s);
+        char    *copy;
+
+        copy = e_malloc(len+1);
+        if (copy) {
+                memcpy(copy,s,len+1);
+        }
+        return copy;
+}
 
-void
-etcd_close (etcd_session session)
+/* Same contract as asprintf: -1 on failure, and then *strp is undefined. */
+static int __attribute__((format(printf,2,3)))
+e_asprintf (char **strp, const char *fmt, ...)
 {
-        free(session);
+        va_list ap;
+        int     len;
+
+        va_start(ap,fmt);
+        len = vsnprintf(NULL,0,fmt,ap);
+        va_end(ap);
+        if (len < 0) {
+                return -1;
+        }
+
+        *strp = e_malloc((size_t)len+1);
+        if (!*strp) {
+                return -1;
+        }
+        va_start(ap,fmt);
+        (void)vsnprintf(*strp,(size_t)len+1,fmt,ap);
+        va_end(ap);
+        return len;
 }
 
 /*
- * Normal yajl_tree_get is returning NULL for these paths even when I can
- * verify (in gdb) that they exist.  I suppose I could debug this for them, but
- * this is way easier.
- *
- * TBD: see if common distros are packaging a JSON library that isn't total
- * crap.
+ * curl gets the global allocator too, but only if it's set before curl is
+ * initialized, and it keeps the one it started with.
  */
-static yajl_val
-my_yajl_tree_get (yajl_val root, char const **path, yajl_type type)
+static etcd_allocator   curl_alloc;
+
+static void *
+curl_malloc_cb (size_t size)
 {
-        yajl_val        obj    = root;
-        int             i;
+        return curl_alloc.malloc_fn(curl_alloc.ctx,size);
+}
 
-        for (;;) {
-                if (!*path) {
-                        if (obj && (obj->type != type)) {
-                                return NULL;
-                        }
-                        return obj;
-                }
-                if (obj->type != yajl_t_object) {
-                        return NULL;
-                }
-                for (i = 0; /* nothing */; ++i) {
-                        if (i >= obj->u.object.len) {
-                                return NULL;
-                        }
-                        if (!strcmp(obj->u.object.keys[i],*path)) {
-                                obj = obj->u.object.values[i];
-                                ++path;
-                                break;
-                        }
-                }
+static void
+curl_free_cb (void *ptr)
+{
+        if (ptr) {
+                curl_alloc.free_fn(curl_alloc.ctx,ptr);
         }
 }
 
+static void *
+curl_realloc_cb (void *ptr, size_t size)
+{
+        return curl_alloc.realloc_fn(curl_alloc.ctx,ptr,size);
+}
 
-/*
- * Looking directly at node->u.array seems terribly un-modular, but the YAJL
- * tree interface doesn't seem to have any exposed API for iterating over the
- * elements of an array.  I tried using yajl_tree_get with an index in the
- * path, either as a type-casted integer or as a string, but that didn't work.
- */
 static char *
-parse_array_response (yajl_val parent)
+curl_strdup_cb (const char *s)
 {
-        size_t          i;
-        yajl_val        item;
-        yajl_val        value;
-        char            *retval = NULL;
-        char            *saved;
-        yajl_val        node;
+        size_t  len     = strlen(s) + 1;
+        char    *copy;
 
-        node = my_yajl_tree_get(parent,nodes_path,yajl_t_array);
-        if (!node) {
-                return NULL;
+        copy = curl_alloc.malloc_fn(curl_alloc.ctx,len);
+        if (copy) {
+                memcpy(copy,s,len);
         }
+        return copy;
+}
 
-        for (i = 0; i < node->u.array.len; ++i) {
-                item = node->u.array.values[i];
-                if (!item) {
-                        break;
-                }
-                value = my_yajl_tree_get(item,entry_path,yajl_t_string);
-                if (!value) {
-                        break;
-                }
-                if (retval) {
-                        saved = retval;
-                        retval = NULL;
-                        (void)asprintf (&retval, "%s\n%s",
-                                        saved, MY_YAJL_GET_STRING(value));
-                        free(saved);
-                }
-                else {
-                        retval = strdup(MY_YAJL_GET_STRING(value));
-                }
-                if (!retval) {
-                        break;
-                }
-        }
+static void *
+curl_calloc_cb (size_t nmemb, size_t size)
+{
+        void    *ptr;
 
-        return retval;
+        if (size && (nmemb > SIZE_MAX / size)) {
+                return NULL;
+        }
+        ptr = curl_alloc.malloc_fn(curl_alloc.ctx,nmemb*size);
+        if (ptr) {
+                memset(ptr,0,nmemb*size);
+        }
+        return ptr;
 }
 
+
+/*
+ * A simple chained hash table of keys, with a little bit of information about
+ * each.  A watcher uses it to remember just enough (key and modifiedIndex) to
+ * tell what changed when it has to resync; the "gen" field lets a resync mark
+ * what it saw, so anything left unmarked was deleted.  Write combining uses
+ * it to hold the latest value and TTL for each key until the next flush.
+ */
+typedef struct etcd_kent {
+        struct etcd_kent        *next;
+        etcd_index              index;
+        unsigned int            gen;
+        char                    *value;
+        unsigned int            ttl;
+        char                    key[];
+} etcd_kent;
+
+typedef struct {
+        etcd_kent       **buckets;
+        size_t          nbuckets;       /* always a power of two */
+        size_t          count;
+} etcd_kmap;
+
 static size_t
-parse_get_response (void *ptr, size_t size, size_t nmemb, void *stream)
+hash_key (const char *key)
 {
-        yajl_val        node;
-        yajl_val        value;
+        size_t  hash    = 2166136261u;
 
-        node = yajl_tree_parse(ptr,NULL,0);
-        if (node) {
-                value = my_yajl_tree_get(node,value_path,yajl_t_string);
-                if (value) {
-                        /* 
-                         * YAJL probably copied it once, now we're going to
-                         * copy it again.  If anybody really cares for such
-                         * small and infrequently used values, we'd have to do
-                         * do something much more complicated (like using the
-                         * stream interface) to avoid the copy.  Right now it's
-                         * just not worth it.
-                         */
-                        *((char **)stream) = strdup(MY_YAJL_GET_STRING(value));
-                }
-                else {
-                        /* Might as well try this. */
-                        *((char **)stream) = parse_array_response(node);
-                }
-                yajl_tree_free(node);
+        while (*key) {
+                hash = (hash ^ (unsigned char)*key++) * 16777619u;
         }
+        return hash;
+}
 
-        return size*nmemb;
+
+static int
+kmap_init (etcd_kmap *map)
+{
+        map->nbuckets = 64;
+        map->count = 0;
+        map->buckets = e_calloc(map->nbuckets,sizeof(*map->buckets));
+        return map->buckets ? 0 : -1;
 }
 
 
-static etcd_result
-etcd_get_one (_etcd_session *session, const char *key, etcd_server *srv, const char *prefix,
-              const char *post, curl_callback_t cb, char **stream)
+static etcd_kent **
+kmap_link (etcd_kmap *map, const char *key)
 {
-        char            *url;
-        CURL            *curl;
-        CURLcode        curl_res;
-        etcd_result     res             = ETCD_WTF;
-        void            *err_label      = &&done;
+        etcd_kent       **link;
 
-        if (asprintf(&url,"http://%s:%u/v2/%s%s",
-                     srv->host,srv->port,prefix,key) < 0) {
-                goto *err_label;
+        link = &map->buckets[hash_key(key) & (map->nbuckets-1)];
+        while (*link && strcmp((*link)->key,key)) {
+                link = &(*link)->next;
         }
-        err_label = &&free_url;
+        return link;
+}
 
-        curl = curl_easy_init();
-        if (!curl) {
-                goto *err_label;
-        }
-        err_label = &&cleanup_curl;
 
-        /* TBD: add error checking for these */
-        curl_easy_setopt(curl,CURLOPT_URL,url);
-        curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1L);
-        curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,cb);
-        curl_easy_setopt(curl,CURLOPT_WRITEDATA,stream);
-        if (post) {
-                curl_easy_setopt(curl,CURLOPT_POST,1L);
-                curl_easy_setopt(curl,CURLOPT_POSTFIELDS,post);
-        }
-#if defined(DEBUG)
-        curl_easy_setopt(curl,CURLOPT_VERBOSE,1L);
-#endif
+static void
+kmap_grow (etcd_kmap *map)
+{
+        etcd_kent       **buckets;
+        etcd_kent       *ent;
+        etcd_kent       *next;
+        size_t          nbuckets        = map->nbuckets * 2;
+        size_t          i;
+        size_t          slot;
 
-        curl_res = curl_easy_perform(curl);
-        if (curl_res != CURLE_OK) {
-                print_curl_error("perform",curl_res);
-                goto *err_label;
+        buckets = e_calloc(nbuckets,sizeof(*buckets));
+        if (!buckets) {
+                /* Longer chains are slower, but still correct. */
+                return;
         }
 
-        res = ETCD_OK;
+        for (i = 0; i < map->nbuckets; ++i) {
+                for (ent = map->buckets[i]; ent; ent = next) {
+                        next = ent->next;
+                        slot = hash_key(ent->key) & (nbuckets-1);
+                        ent->next = buckets[slot];
+                        buckets[slot] = ent;
+                }
+        }
 
-cleanup_curl:
-        curl_easy_cleanup(curl);
-free_url:
-        free(url);
-done:
-        return res;
+        e_free(map->buckets);
+        map->buckets = buckets;
+        map->nbuckets = nbuckets;
 }
 
 
-char *
-etcd_get (etcd_session session_as_void, char *key)
+static etcd_kent *
+kmap_put (etcd_kmap *map, const char *key)
 {
-        _etcd_session   *session   = session_as_void;
-        etcd_server     *srv;
-        etcd_result     res;
-        char            *value  = NULL;
+        etcd_kent       **link;
+        size_t          len;
 
-        for (srv = session->servers; srv->host; ++srv) {
-                res = etcd_get_one(session,key,srv, (const char *)"keys/",NULL,
-                                   parse_get_response,&value);
-                if ((res == ETCD_OK) && value) {
-                        return value;
+        if (map->count >= map->nbuckets) {
+                kmap_grow(map);
+        }
+
+        link = kmap_link(map,key);
+        if (!*link) {
+                len = strlen(key) + 1;
+                *link = e_calloc(1,sizeof(**link)+len);
+                if (!*link) {
+                        return NULL;
                 }
+                memcpy((*link)->key,key,len);
+                ++map->count;
         }
 
-        return NULL;
+        return *link;
 }
 
 
-static size_t
-parse_watch_response (void *ptr, size_t size, size_t nmemb, void *stream)
+static void
+kmap_remove (etcd_kmap *map, const char *key)
 {
-        yajl_val                node;
-        yajl_val                value;
-        etcd_watch_t            *watch  = stream;
-        static const char       *i_path[] = { "node", "modifiedIndex", NULL };
-        static const char       *k_path[] = { "node", "key", NULL };
-        static const char       *v_path[] = { "node", "value", NULL };
+        etcd_kent       **link;
+        etcd_kent       *ent;
 
-        node = yajl_tree_parse(ptr,NULL,0);
-        if (node) {
-                value = my_yajl_tree_get(node,i_path,yajl_t_number);
-                if (value) {
-                        watch->index_out = strtoul(YAJL_GET_NUMBER(value),
-                                                   NULL,10);
-                }
-                value = my_yajl_tree_get(node,k_path,yajl_t_string);
-                if (value) {
-                        watch->key = strdup(MY_YAJL_GET_STRING(value));
-                }
-                value = my_yajl_tree_get(node,v_path,yajl_t_string);
-                if (value) {
-                        watch->value = strdup(MY_YAJL_GET_STRING(value));
-                }
+        link = kmap_link(map,key);
+        ent = *link;
+        if (ent) {
+                *link = ent->next;
+                e_free(ent->value);
+                e_free(ent);
+                --map->count;
         }
-
-        return size*nmemb;
 }
 
 
-etcd_result
-etcd_watch (etcd_session session_as_void, char *pfx,
-            char **keyp, char **valuep, int *index_in, int *index_out)
-{
-        _etcd_session   *session   = session_as_void;
+/*
+ * Remove everything under a directory.  This is a full scan, but deleting
+ * whole directories out from under a watcher should be rare.
+ */
+static void
+kmap_remove_dir (etcd_kmap *map, const char *dir)
+{
+        etcd_kent       **link;
+        etcd_kent       *ent;
+        size_t          len     = strlen(dir);
+        size_t          i;
+
+        for (i = 0; i < map->nbuckets; ++i) {
+                link = &map->buckets[i];
+                while ((ent = *link) != NULL) {
+                        if (!strncmp(ent->key,dir,len) &&
+                            (ent->key[len] == '/')) {
+                                *link = ent->next;
+                                e_free(ent->value);
+                                e_free(ent);
+                                --map->count;
+                        }
+                        else {
+                                link = &ent->next;
+                        }
+                }
+        }
+}
+
+
+static void
+kmap_free (etcd_kmap *map)
+{
+        etcd_kent       *ent;
+        etcd_kent       *next;
+        size_t          i;
+
+        for (i = 0; i < map->nbuckets; ++i) {
+                for (ent = map->buckets[i]; ent; ent = next) {
+                        next = ent->next;
+                        e_free(ent->value);
+                        e_free(ent);
+                }
+        }
+        e_free(map->buckets);
+}
+
+
+/*
+ * A server whose host starts with a slash is really the path of a Unix
+ * socket, e.g. for an etcd proxy on the same machine.  curl still wants a
+ * URL, but only takes the Host header and the path from it, so the URL gets a
+ * placeholder host and server_transport points the handle at the socket.
+ */
+#define SRV_IS_UNIX(srv)        ((srv)->host[0] == '/')
+#define SRV_IS_LOCAL(srv)       (SRV_IS_UNIX(srv) || SRV_IS_SIDECAR(srv))
+#define SRV_URL_HOST(srv)       (SRV_IS_LOCAL(srv) ? "localhost" : (srv)->host)
+#define SRV_URL_PORT(srv)       (SRV_IS_LOCAL(srv) ? 80u : (srv)->port)
+
+/*
+ * A host of "sidecar:/path" means an etcd-sidecar daemon listening on that
+ * socket.  Requests still get a URL built the same way, but only its path
+ * goes over the wire; see sidecar_perform.
+ */
+#define SIDECAR_PREFIX          "sidecar:"
+#define SIDECAR_PREFIX_LEN      (sizeof(SIDECAR_PREFIX)-1)
+#define SRV_IS_SIDECAR(srv)     (!strncmp((srv)->host,SIDECAR_PREFIX,\
+                                          SIDECAR_PREFIX_LEN))
+#define SRV_SIDECAR_PATH(srv)   ((srv)->host+SIDECAR_PREFIX_LEN)
+
+
+/*
+ * A server list, with the per-server statistics that go along with it.
+ * Discovery (see etcd_set_discovery) can replace a session's list at any
+ * moment, so anything that walks one holds a reference (see USE_MEMBERS) and
+ * an old list only goes away once the last request using it is done.
+ */
+typedef struct {
+        int             refs;
+        size_t          num_servers;
+        etcd_server     *servers;       /* the last one has host=NULL */
+        etcd_histogram  *stats;         /* same order as servers */
+        char            **bases;        /* "http://host:port/", likewise */
+        int             owned;          /* servers and hosts are ours */
+        etcd_allocator  alloc;          /* where they all came from */
+} etcd_members;
+
+typedef struct {
+        /* The current server list; see USE_MEMBERS. */
+        pthread_mutex_t members_lock;
+        etcd_members    *members;
+        /* Membership discovery; see etcd_set_discovery. */
+        pthread_mutex_t discovery_lock;
+        pthread_cond_t  discovery_cond;
+        pthread_t       discovery_thread;
+        unsigned int    discovery_ms;   /* zero means off */
+        int             discovery_stop;
+        /* Write combining; see etcd_set_combine. */
+        pthread_mutex_t combine_lock;   /* guards pending */
+        pthread_mutex_t flush_lock;     /* one flush at a time */
+        pthread_cond_t  combine_cond;
+        pthread_t       combine_thread;
+        unsigned int    combine_ms;     /* zero means off */
+        int             combine_stop;
+        etcd_kmap       pending;
+        void            *combine_batch;
+        etcd_result     combine_res;    /* from the last background flush */
+        /* One easy handle kept warm for the blocking calls. */
+        pthread_mutex_t curl_lock;
+        CURL            *curl;
+        /* Likewise one sidecar connection; also under curl_lock. */
+        int             sidecar_fd;
+        char            sidecar_path[sizeof(((struct sockaddr_un *)0)
+                                            ->sun_path)];
+        /* Statistics; see etcd_stats_snapshot. */
+        etcd_histogram  op_stats[ETCD_STAT_NUM_OPS];
+        uint64_t        failovers;
+        uint64_t        bytes_in;
+        uint64_t        bytes_out;
+        /* Tracing; see etcd_set_trace. */
+        etcd_trace_cb   *trace_cb;
+        void            *trace_arg;
+        unsigned int    slow_ms;
+        FILE            *slow_fp;
+        /* See etcd_set_allocator.  The session itself came from "owner". */
+        etcd_allocator  alloc;
+        etcd_allocator  owner;
+        /* Event-loop integration; see etcd_session_set_loop. */
+        CURLM           *loop_multi;
+        etcd_socket_cb  *socket_cb;
+        etcd_timer_cb   *timer_cb;
+        void            *loop_arg;
+        struct etcd_async_op *async_ops;        /* in flight */
+} _etcd_session;
+
+static void async_close (_etcd_session *session);
+
+
+static void
+members_free_bases (etcd_members *m)
+{
+        size_t          i;
+
+        if (m->bases) {
+                for (i = 0; i < m->num_servers; ++i) {
+                        e_free(m->bases[i]);
+                }
+                e_free(m->bases);
+        }
+}
+
+
+static etcd_members *
+members_new (etcd_server *server_list, int owned)
+{
+        etcd_members    *m;
+        size_t          i;
+
+        m = e_calloc(1,sizeof(*m));
+        if (!m) {
+                return NULL;
+        }
+        while (server_list[m->num_servers].host) {
+                ++m->num_servers;
+        }
+        m->stats = e_calloc(m->num_servers,sizeof(*m->stats));
+        if (!m->stats && m->num_servers) {
+                e_free(m);
+                return NULL;
+        }
+        /* Prepared keys (see etcd_key_prepare) build their URLs from these. */
+        m->bases = e_calloc(m->num_servers+1,sizeof(*m->bases));
+        if (!m->bases) {
+                goto fail;
+        }
+        for (i = 0; i < m->num_servers; ++i) {
+                if (e_asprintf(&m->bases[i],"http://%s:%u/",
+                               SRV_URL_HOST(&server_list[i]),
+                               SRV_URL_PORT(&server_list[i])) < 0) {
+                        goto fail;
+                }
+        }
+        m->refs = 1;
+        m->servers = server_list;
+        m->owned = owned;
+        m->alloc = *my_alloc();
+        return m;
+
+fail:
+        members_free_bases(m);
+        e_free(m->stats);
+        e_free(m);
+        return NULL;
+}
+
+
+static void
+members_put (etcd_members *m)
+{
+        etcd_allocator  alloc   = m->alloc;
+        size_t          i;
+        USE_ALLOCATOR(&alloc);
+
+        if (__atomic_sub_fetch(&m->refs,1,__ATOMIC_ACQ_REL)) {
+                return;
+        }
+        if (m->owned) {
+                for (i = 0; i < m->num_servers; ++i) {
+                        e_free(m->servers[i].host);
+                }
+                e_free(m->servers);
+        }
+        members_free_bases(m);
+        e_free(m->stats);
+        e_free(m);
+}
+
+
+/*
+ * The lock only covers loading the pointer and taking a reference, so that a
+ * swap can't free the list in between; it's never held across a request.
+ */
+static etcd_members *
+members_get (_etcd_session *session)
+{
+        etcd_members    *m;
+
+        pthread_mutex_lock(&session->members_lock);
+        m = session->members;
+        __atomic_add_fetch(&m->refs,1,__ATOMIC_RELAXED);
+        pthread_mutex_unlock(&session->members_lock);
+        return m;
+}
+
+
+static void
+members_swap (_etcd_session *session, etcd_members *m)
+{
+        etcd_members    *old;
+
+        pthread_mutex_lock(&session->members_lock);
+        old = session->members;
+        session->members = m;
+        pthread_mutex_unlock(&session->members_lock);
+        members_put(old);
+}
+
+
+static void
+release_members (etcd_members **mp)
+{
+        members_put(*mp);
+}
+
+/* Holds the session's current server list until the end of the scope. */
+#define USE_MEMBERS(s,m)                                                \
+        etcd_members *m __attribute__((cleanup(release_members)))       \
+                = members_get(s)
+
+typedef struct {
+        char            *key;
+        char            *value;
+        etcd_index      index_out;
+        int             is_dir;
+        int             deleted;        /* delete, expire, etc. */
+        int             error_code;     /* etcd's, not ours */
+} etcd_watch_t;
+
+/*
+ * Responses can arrive in any number of pieces, and YAJL wants a single
+ * null-terminated string, so we collect the whole thing before handing it to
+ * a parse callback.  We also pick up X-Etcd-Index along the way, because
+ * that's the only way to know where a get left off so a watch can continue.
+ */
+typedef struct {
+        char            *data;
+        size_t          len;
+        size_t          size;
+        etcd_index      etcd_index;
+        int             *cancel;        /* non-zero means give up */
+        long            timeout_ms;     /* zero means wait forever */
+} etcd_response;
+
+typedef size_t curl_callback_t (void *, size_t, size_t, void *);
+
+int             g_inited        = 0;
+const char      *value_path[]   = { "node", "value", NULL };
+const char      *nodes_path[]   = { "node", "nodes", NULL };
+const char      *entry_path[]   = { "key", NULL };
+const char      *node_path[]    = { "node", NULL };
+const char      *errcode_path[] = { "errorCode", NULL };
+
+/*
+ * We only call this in case where it should be safe, but gcc doesn't know
+ * that so we use this to shut it up.
+ */
+static char *
+MY_YAJL_GET_STRING (yajl_val x)
+{
+        char *y = YAJL_GET_STRING(x);
+
+        return y ? y : (char *)"bogus";
+}
+
+#if defined(DEBUG)
+void
+print_curl_error (char *intro, CURLcode res)
+{
+        printf("%s: %s\n",intro,curl_easy_strerror(res));
+}
+#else
+#define print_curl_error(intro,res)
+#endif
+
+
+/*
+ * Form values have to be escaped, and not just for the usual reasons: we
+ * separate parameters with semicolons, so a semicolon in a value would end it
+ * early.  curl_easy_escape would do, but then we'd have to use curl_free
+ * instead of free and keep track of which is which.  Prepared keys use the
+ * same thing for paths, keeping the slashes.
+ */
+static char *
+escape_keeping (const char *text, const char *keep)
+{
+        static const char       hex[]   = "0123456789ABCDEF";
+        const unsigned char     *t;
+        char                    *result;
+        char                    *r;
+
+        result = e_malloc(strlen(text)*3+1);
+        if (!result) {
+                return NULL;
+        }
+
+        for (t = (const unsigned char *)text, r = result; *t; ++t) {
+                if (((*t >= 'a') && (*t <= 'z')) ||
+                    ((*t >= 'A') && (*t <= 'Z')) ||
+                    ((*t >= '0') && (*t <= '9')) || strchr(keep,*t)) {
+                        *r++ = *t;
+                }
+                else {
+                        *r++ = '%';
+                        *r++ = hex[*t >> 4];
+                        *r++ = hex[*t & 15];
+                }
+        }
+        *r = '\0';
+
+        return result;
+}
+
+static char *
+url_escape (const char *text)
+{
+        return escape_keeping(text,"-._~");
+}
+
+
+static void
+server_transport (CURL *curl, const etcd_server *srv)
+{
+        if (SRV_IS_UNIX(srv)) {
+                curl_easy_setopt(curl,CURLOPT_UNIX_SOCKET_PATH,srv->host);
+        }
+}
+
+
+/* For stats and logs: host:port, or just the path for a local socket. */
+static void
+server_name (char *buf, size_t size, const etcd_server *srv)
+{
+        if (SRV_IS_LOCAL(srv)) {
+                snprintf(buf,size,"%s",srv->host);
+        }
+        else {
+                snprintf(buf,size,"%s:%u",srv->host,srv->port);
+        }
+}
+
+ 
+etcd_session
+etcd_open (etcd_server *server_list)
+{
+        _etcd_session   *session;
+
+        if (!g_inited) {
+                if (global_alloc.malloc_fn) {
+                        curl_alloc = global_alloc;
+                        curl_global_init_mem(CURL_GLOBAL_ALL,curl_malloc_cb,
+                                             curl_free_cb,curl_realloc_cb,
+                                             curl_strdup_cb,curl_calloc_cb);
+                }
+                else {
+                        curl_global_init(CURL_GLOBAL_ALL);
+                }
+                g_inited = 1;
+        }
+
+        session = e_calloc(1,sizeof(*session));
+        if (!session) {
+                return NULL;
+        }
+        session->members = members_new(server_list,0);
+        if (!session->members) {
+                e_free(session);
+                return NULL;
+        }
+        session->alloc = session->owner = *my_alloc();
+        pthread_mutex_init(&session->members_lock,NULL);
+        pthread_mutex_init(&session->discovery_lock,NULL);
+        pthread_cond_init(&session->discovery_cond,NULL);
+        pthread_mutex_init(&session->combine_lock,NULL);
+        pthread_mutex_init(&session->flush_lock,NULL);
+        pthread_cond_init(&session->combine_cond,NULL);
+        pthread_mutex_init(&session->curl_lock,NULL);
+        session->sidecar_fd = -1;
+
+        /*
+         * Some day we'll set up more persistent connections, and keep track
+         * (via redirects) of which server is leader so that we can always
+         * try it first.  For now we just push that to the individual request
+         * functions, which do the most brain-dead thing that can work.
+         */
+
+        return session;
+}
+
+
+void
+etcd_close (etcd_session session_as_void)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_allocator  owner           = session->owner;
+        USE_ALLOCATOR(&owner);
+
+        /* Turning combining off flushes anything still pending. */
+        (void)etcd_set_combine(session,0);
+        (void)etcd_set_discovery(session,0);
+        async_close(session);
+        if (session->curl) {
+                curl_easy_cleanup(session->curl);
+        }
+        if (session->sidecar_fd >= 0) {
+                close(session->sidecar_fd);
+        }
+        pthread_mutex_destroy(&session->curl_lock);
+        pthread_cond_destroy(&session->combine_cond);
+        pthread_mutex_destroy(&session->flush_lock);
+        pthread_mutex_destroy(&session->combine_lock);
+        pthread_cond_destroy(&session->discovery_cond);
+        pthread_mutex_destroy(&session->discovery_lock);
+        pthread_mutex_destroy(&session->members_lock);
+        members_put(session->members);
+        e_free(session);
+}
+
+
+void
+etcd_set_allocator (etcd_session session_as_void, etcd_malloc_fn *malloc_fn,
+                    etcd_realloc_fn *realloc_fn, etcd_free_fn *free_fn,
+                    void *ctx)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_allocator  *a;
+
+        a = session ? &session->alloc : &global_alloc;
+        if (malloc_fn && realloc_fn && free_fn) {
+                a->malloc_fn = malloc_fn;
+                a->realloc_fn = realloc_fn;
+                a->free_fn = free_fn;
+                a->ctx = ctx;
+        }
+        else {
+                memset(a,0,sizeof(*a));
+        }
+}
+
+
+void
+etcd_free (etcd_session session_as_void, void *ptr)
+{
+        _etcd_session   *session        = session_as_void;
+        USE_ALLOCATOR(session ? &session->alloc : &global_alloc);
+
+        e_free(ptr);
+}
+
+/*
+ * Normal yajl_tree_get is returning NULL for these paths even when I can
+ * verify (in gdb) that they exist.  I suppose I could debug this for them, but
+ * this is way easier.
+ *
+ * TBD: see if common distros are packaging a JSON library that isn't total
+ * crap.
+ */
+static yajl_val
+my_yajl_tree_get (yajl_val root, char const **path, yajl_type type)
+{
+        yajl_val        obj    = root;
+        int             i;
+
+        for (;;) {
+                if (!*path) {
+                        if (obj && (obj->type != type)) {
+                                return NULL;
+                        }
+                        return obj;
+                }
+                if (obj->type != yajl_t_object) {
+                        return NULL;
+                }
+                for (i = 0; /* nothing */; ++i) {
+                        if (i >= obj->u.object.len) {
+                                return NULL;
+                        }
+                        if (!strcmp(obj->u.object.keys[i],*path)) {
+                                obj = obj->u.object.values[i];
+                                ++path;
+                                break;
+                        }
+                }
+        }
+}
+
+
+/*
+ * Small helpers for picking fields out of a single node (or the top level of
+ * a response) without building a whole path array every time.
+ */
+static yajl_val
+node_field (yajl_val node, const char *name, yajl_type type)
+{
+        const char      *path[] = { name, NULL };
+
+        return my_yajl_tree_get(node,path,type);
+}
+
+
+static etcd_index
+node_index (yajl_val node, const char *name)
+{
+        yajl_val        value;
+
+        value = node_field(node,name,yajl_t_number);
+        return value ? strtoull(YAJL_GET_NUMBER(value),NULL,10) : 0;
+}
+
+
+static int
+error_code (yajl_val root)
+{
+        yajl_val        value;
+
+        value = my_yajl_tree_get(root,errcode_path,yajl_t_number);
+        return value ? (int)strtol(YAJL_GET_NUMBER(value),NULL,10) : 0;
+}
+
+
+/*
+ * Looking directly at node->u.array seems terribly un-modular, but the YAJL
+ * tree interface doesn't seem to have any exposed API for iterating over the
+ * elements of an array.  I tried using yajl_tree_get with an index in the
+ * path, either as a type-casted integer or as a string, but that didn't work.
+ */
+static char *
+parse_array_response (yajl_val parent)
+{
+        size_t          i;
+        yajl_val        item;
+        yajl_val        value;
+        char            *retval = NULL;
+        char            *saved;
+        yajl_val        node;
+
+        node = my_yajl_tree_get(parent,nodes_path,yajl_t_array);
+        if (!node) {
+                return NULL;
+        }
+
+        for (i = 0; i < node->u.array.len; ++i) {
+                item = node->u.array.values[i];
+                if (!item) {
+                        break;
+                }
+                value = my_yajl_tree_get(item,entry_path,yajl_t_string);
+                if (!value) {
+                        break;
+                }
+                if (retval) {
+                        saved = retval;
+                        retval = NULL;
+                        (void)e_asprintf (&retval, "%s\n%s",
+                                          saved, MY_YAJL_GET_STRING(value));
+                        e_free(saved);
+                }
+                else {
+                        retval = e_strdup(MY_YAJL_GET_STRING(value));
+                }
+                if (!retval) {
+                        break;
+                }
+        }
+
+        return retval;
+}
+
+static size_t
+parse_get_response (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+        yajl_val        node;
+        yajl_val        value;
+
+        node = yajl_tree_parse(ptr,NULL,0);
+        if (node) {
+                value = my_yajl_tree_get(node,value_path,yajl_t_string);
+                if (value) {
+                        /* 
+                         * YAJL probably copied it once, now we're going to
+                         * copy it again.  If anybody really cares for such
+                         * small and infrequently used values, we'd have to do
+                         * do something much more complicated (like using the
+                         * stream interface) to avoid the copy.  Right now it's
+                         * just not worth it.
+                         */
+                        *((char **)stream) =
+                                e_strdup(MY_YAJL_GET_STRING(value));
+                }
+                else {
+                        /* Might as well try this. */
+                        *((char **)stream) = parse_array_response(node);
+                }
+                yajl_tree_free(node);
+        }
+
+        return size*nmemb;
+}
+
+
+static size_t
+collect_body (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+        etcd_response   *rsp    = stream;
+        size_t          len     = size * nmemb;
+        size_t          new_size;
+        char            *new_data;
+
+        if ((rsp->len + len + 1) > rsp->size) {
+                new_size = rsp->size ? rsp->size : 4096;
+                while (new_size < (rsp->len + len + 1)) {
+                        new_size *= 2;
+                }
+                new_data = e_realloc(rsp->data,new_size);
+                if (!new_data) {
+                        /* Returning short makes curl fail the transfer. */
+                        return 0;
+                }
+                rsp->data = new_data;
+                rsp->size = new_size;
+        }
+
+        memcpy(rsp->data+rsp->len,ptr,len);
+        rsp->len += len;
+        rsp->data[rsp->len] = '\0';
+        return len;
+}
+
+
+static size_t
+collect_header (char *ptr, size_t size, size_t nmemb, void *stream)
+{
+        etcd_response           *rsp    = stream;
+        size_t                  len     = size * nmemb;
+        static const char       name[]  = "X-Etcd-Index:";
+
+        /* Header lines always end in CRLF, so strtoull will stop in time. */
+        if ((len > (sizeof(name)-1)) && !strncasecmp(ptr,name,sizeof(name)-1)) {
+                rsp->etcd_index = strtoull(ptr+sizeof(name)-1,NULL,10);
+        }
+
+        return len;
+}
+
+
+static int
+check_cancel (void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+              curl_off_t ultotal, curl_off_t ulnow)
+{
+        etcd_response   *rsp    = clientp;
+
+        return __atomic_load_n(rsp->cancel,__ATOMIC_ACQUIRE) != 0;
+}
+
+
+/*
+ * Statistics.  Everything is bumped with relaxed atomic adds from whatever
+ * thread made the request, and read the same way, so a snapshot can be a
+ * little inconsistent between fields but never torn within one.
+ */
+#define STATS_SUB_BITS  3
+#define STATS_SUB       (1 << STATS_SUB_BITS)
+#define STATS_MAX_US    ((1ULL << 40) - 1)
+
+static const char       *stat_op_names[ETCD_STAT_NUM_OPS] = {
+        "get", "set", "delete", "watch", "lock", "other"
+};
+
+static unsigned int
+stats_bucket (uint64_t us)
+{
+        unsigned int    shift;
+
+        if (us < 2 * STATS_SUB) {
+                return (unsigned int)us;
+        }
+        if (us > STATS_MAX_US) {
+                us = STATS_MAX_US;
+        }
+        shift = 63 - __builtin_clzll(us) - STATS_SUB_BITS;
+        return shift * STATS_SUB + (unsigned int)(us >> shift);
+}
+
+
+uint64_t
+etcd_stats_bucket_limit (unsigned int bucket)
+{
+        unsigned int    shift;
+
+        if (bucket < 2 * STATS_SUB) {
+                return bucket;
+        }
+        shift = bucket / STATS_SUB - 1;
+        return ((uint64_t)(bucket % STATS_SUB + STATS_SUB + 1) << shift) - 1;
+}
+
+
+static void
+stats_add (uint64_t *counter, uint64_t n)
+{
+        __atomic_fetch_add(counter,n,__ATOMIC_RELAXED);
+}
+
+
+static void
+hist_add (etcd_histogram *hist, uint64_t us, int failed)
+{
+        stats_add(&hist->count,1);
+        stats_add(&hist->sum_us,us);
+        stats_add(&hist->buckets[stats_bucket(us)],1);
+        if (failed) {
+                stats_add(&hist->errors,1);
+        }
+}
+
+
+/*
+ * Call this once per request to a server.  "failed" means we never got an
+ * answer, as opposed to a timeout or cancellation we asked for.
+ */
+static void
+stats_note (_etcd_session *session, etcd_members *members,
+            etcd_server *srv, etcd_stat_op op, uint64_t us,
+            uint64_t bytes_out, uint64_t bytes_in, int failed)
+{
+        size_t          which           = srv - members->servers;
+
+        hist_add(&session->op_stats[op],us,failed);
+        if (which < members->num_servers) {
+                hist_add(&members->stats[which],us,failed);
+        }
+        stats_add(&session->bytes_out,bytes_out);
+        stats_add(&session->bytes_in,bytes_in);
+        if (failed && srv[1].host) {
+                stats_add(&session->failovers,1);
+        }
+}
+
+
+/* The same, for a curl request, after curl is done but before reuse. */
+static void
+stats_record (_etcd_session *session, etcd_members *members,
+              etcd_server *srv, etcd_stat_op op, CURL *curl, int failed)
+{
+        curl_off_t      total_us        = 0;
+        curl_off_t      up              = 0;
+        curl_off_t      down            = 0;
+        long            req_size        = 0;
+        long            hdr_size        = 0;
+
+        curl_easy_getinfo(curl,CURLINFO_TOTAL_TIME_T,&total_us);
+        curl_easy_getinfo(curl,CURLINFO_SIZE_UPLOAD_T,&up);
+        curl_easy_getinfo(curl,CURLINFO_SIZE_DOWNLOAD_T,&down);
+        curl_easy_getinfo(curl,CURLINFO_REQUEST_SIZE,&req_size);
+        curl_easy_getinfo(curl,CURLINFO_HEADER_SIZE,&hdr_size);
+
+        stats_note(session,members,srv,op,(uint64_t)total_us,
+                   (uint64_t)(up+req_size),(uint64_t)(down+hdr_size),failed);
+}
+
+
+static void
+hist_copy (etcd_histogram *dst, etcd_histogram *src)
+{
+        unsigned int    b;
+
+        dst->count = __atomic_load_n(&src->count,__ATOMIC_RELAXED);
+        dst->errors = __atomic_load_n(&src->errors,__ATOMIC_RELAXED);
+        dst->sum_us = __atomic_load_n(&src->sum_us,__ATOMIC_RELAXED);
+        for (b = 0; b < ETCD_STATS_BUCKETS; ++b) {
+                dst->buckets[b] = __atomic_load_n(&src->buckets[b],
+                                                  __ATOMIC_RELAXED);
+        }
+}
+
+
+static etcd_result
+stats_snapshot (_etcd_session *session, etcd_members *members,
+                etcd_stats *stats)
+{
+        size_t          i;
+
+        memset(stats,0,sizeof(*stats));
+        stats->servers = e_calloc(members->num_servers,sizeof(*stats->servers));
+        if (!stats->servers && members->num_servers) {
+                return ETCD_WTF;
+        }
+        stats->num_servers = members->num_servers;
+
+        for (i = 0; i < ETCD_STAT_NUM_OPS; ++i) {
+                hist_copy(&stats->ops[i],&session->op_stats[i]);
+        }
+        for (i = 0; i < members->num_servers; ++i) {
+                hist_copy(&stats->servers[i],&members->stats[i]);
+        }
+        stats->failovers = __atomic_load_n(&session->failovers,
+                                           __ATOMIC_RELAXED);
+        stats->bytes_in = __atomic_load_n(&session->bytes_in,__ATOMIC_RELAXED);
+        stats->bytes_out = __atomic_load_n(&session->bytes_out,
+                                           __ATOMIC_RELAXED);
+        return ETCD_OK;
+}
+
+
+etcd_result
+etcd_stats_snapshot (etcd_session session_as_void, etcd_stats *stats)
+{
+        _etcd_session   *session        = session_as_void;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
+
+        return stats_snapshot(session,members,stats);
+}
+
+
+void
+etcd_stats_free (etcd_session session_as_void, etcd_stats *stats)
+{
+        _etcd_session   *session        = session_as_void;
+        USE_ALLOCATOR(&session->alloc);
+
+        e_free(stats->servers);
+        stats->servers = NULL;
+        stats->num_servers = 0;
+}
+
+
+uint64_t
+etcd_stats_percentile (const etcd_histogram *hist, double pct)
+{
+        uint64_t        total   = 0;
+        uint64_t        want;
+        uint64_t        seen    = 0;
+        unsigned int    b;
+
+        /* Buckets, not count, in case a snapshot caught them mid-update. */
+        for (b = 0; b < ETCD_STATS_BUCKETS; ++b) {
+                total += hist->buckets[b];
+        }
+        if (!total) {
+                return 0;
+        }
+        want = (uint64_t)(total * pct / 100.0);
+        if (want >= total) {
+                want = total - 1;
+        }
+        for (b = 0; b < ETCD_STATS_BUCKETS; ++b) {
+                seen += hist->buckets[b];
+                if (seen > want) {
+                        return etcd_stats_bucket_limit(b);
+                }
+        }
+        return 0;
+}
+
+
+/*
+ * Prometheus doesn't need every bucket, just a consistent set of upper
+ * bounds, so we give it the ones at each power of two.
+ */
+static void
+prom_histogram (FILE *fp, const char *name, const char *label,
+                const char *value, const etcd_histogram *hist)
+{
+        uint64_t        cum     = 0;
+        unsigned int    b;
+
+        for (b = 0; b < ETCD_STATS_BUCKETS; ++b) {
+                cum += hist->buckets[b];
+                if ((b % STATS_SUB) == (STATS_SUB - 1)) {
+                        fprintf(fp,"%s_bucket{%s=\"%s\",le=\"%g\"} %"PRIu64
+                                   "\n",name,label,value,
+                                etcd_stats_bucket_limit(b)/1e6,cum);
+                }
+        }
+        fprintf(fp,"%s_bucket{%s=\"%s\",le=\"+Inf\"} %"PRIu64"\n",
+                name,label,value,cum);
+        fprintf(fp,"%s_sum{%s=\"%s\"} %g\n",name,label,value,
+                hist->sum_us/1e6);
+        fprintf(fp,"%s_count{%s=\"%s\"} %"PRIu64"\n",name,label,value,cum);
+}
+
+
+char *
+etcd_stats_prometheus (etcd_session session_as_void)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_stats      stats;
+        FILE            *fp;
+        char            *text           = NULL;
+        char            *copy;
+        size_t          len;
+        char            name[300];
+        size_t          i;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
+
+        if (stats_snapshot(session,members,&stats) != ETCD_OK) {
+                return NULL;
+        }
+        fp = open_memstream(&text,&len);
+        if (!fp) {
+                etcd_stats_free(session,&stats);
+                return NULL;
+        }
+
+        fprintf(fp,"# HELP etcd_client_request_duration_seconds "
+                   "Request latency by operation.\n"
+                   "# TYPE etcd_client_request_duration_seconds "
+                   "histogram\n");
+        for (i = 0; i < ETCD_STAT_NUM_OPS; ++i) {
+                prom_histogram(fp,"etcd_client_request_duration_seconds",
+                               "op",stat_op_names[i],&stats.ops[i]);
+        }
+        fprintf(fp,"# HELP etcd_client_request_errors_total "
+                   "Requests that got no answer, by operation.\n"
+                   "# TYPE etcd_client_request_errors_total counter\n");
+        for (i = 0; i < ETCD_STAT_NUM_OPS; ++i) {
+                fprintf(fp,"etcd_client_request_errors_total{op=\"%s\"} %"
+                           PRIu64"\n",stat_op_names[i],stats.ops[i].errors);
+        }
+
+        fprintf(fp,"# HELP etcd_client_server_request_duration_seconds "
+                   "Request latency by server.\n"
+                   "# TYPE etcd_client_server_request_duration_seconds "
+                   "histogram\n");
+        for (i = 0; i < stats.num_servers; ++i) {
+                server_name(name,sizeof(name),&members->servers[i]);
+                prom_histogram(fp,
+                               "etcd_client_server_request_duration_seconds",
+                               "server",name,&stats.servers[i]);
+        }
+        fprintf(fp,"# HELP etcd_client_server_errors_total "
+                   "Requests that got no answer, by server.\n"
+                   "# TYPE etcd_client_server_errors_total counter\n");
+        for (i = 0; i < stats.num_servers; ++i) {
+                server_name(name,sizeof(name),&members->servers[i]);
+                fprintf(fp,"etcd_client_server_errors_total{server=\"%s\"} "
+                           "%"PRIu64"\n",name,stats.servers[i].errors);
+        }
+
+        fprintf(fp,"# HELP etcd_client_failovers_total "
+                   "Requests passed on to the next server.\n"
+                   "# TYPE etcd_client_failovers_total counter\n"
+                   "etcd_client_failovers_total %"PRIu64"\n"
+                   "# HELP etcd_client_received_bytes_total "
+                   "Bytes received, headers included.\n"
+                   "# TYPE etcd_client_received_bytes_total counter\n"
+                   "etcd_client_received_bytes_total %"PRIu64"\n"
+                   "# HELP etcd_client_sent_bytes_total "
+                   "Bytes sent, headers included.\n"
+                   "# TYPE etcd_client_sent_bytes_total counter\n"
+                   "etcd_client_sent_bytes_total %"PRIu64"\n",
+                stats.failovers,stats.bytes_in,stats.bytes_out);
+
+        etcd_stats_free(session,&stats);
+        if (fclose(fp) != 0) {
+                free(text);
+                return NULL;
+        }
+
+        /* That came from the C library, so copy it into our own memory. */
+        copy = e_strndup(text,len);
+        free(text);
+        return copy;
+}
+
+
+/*
+ * Tracing.  Each request picks up the hook once at the start and uses the
+ * same one at the end, so a hook that's switched off mid-request still sees
+ * both halves.
+ */
+void
+etcd_set_trace (etcd_session session_as_void, etcd_trace_cb *cb, void *arg)
+{
+        _etcd_session   *session        = session_as_void;
+
+        session->trace_arg = arg;
+        session->trace_cb = cb;
+}
+
+
+static void
+trace_slow (void *arg, etcd_trace_event what, etcd_trace *trace)
+{
+        _etcd_session   *session        = arg;
+        char            name[300];
+
+        if ((what != ETCD_TRACE_END)
+                        || (trace->total_us < session->slow_ms * 1000ULL)) {
+                return;
+        }
+        server_name(name,sizeof(name),trace->server);
+        fprintf(session->slow_fp ? session->slow_fp : stderr,
+                "etcd: slow %s %s on %s (attempt %d): status %ld "
+                "curl %d, dns %.3fms connect %.3fms first byte %.3fms "
+                "redirect %.3fms total %.3fms\n",
+                trace->method,trace->path,name,trace->attempt,trace->status,
+                trace->curl_code,trace->namelookup_us/1e3,
+                trace->connect_us/1e3,trace->starttransfer_us/1e3,
+                trace->redirect_us/1e3,trace->total_us/1e3);
+}
+
+
+void
+etcd_trace_slow (etcd_session session_as_void, unsigned int threshold_ms,
+                 FILE *fp)
+{
+        _etcd_session   *session        = session_as_void;
+
+        etcd_set_trace(session,NULL,NULL);
+        if (threshold_ms) {
+                session->slow_ms = threshold_ms;
+                session->slow_fp = fp;
+                etcd_set_trace(session,trace_slow,session);
+        }
+}
+
+
+/* Returns the hook to pass to trace_end, or NULL if there isn't one. */
+static etcd_trace_cb *
+trace_begin (_etcd_session *session, etcd_members *members,
+             etcd_trace *trace, const char *method, const char *url,
+             etcd_server *srv, void **argp)
+{
+        etcd_trace_cb   *cb;
+        const char      *path;
+
+        cb = session->trace_cb;
+        if (!cb) {
+                return NULL;
+        }
+        *argp = session->trace_arg;
+
+        /* Skip "http://host:port". */
+        path = strchr(url+7,'/');
+        memset(trace,0,sizeof(*trace));
+        trace->method = method;
+        trace->path = path ? path : "/";
+        trace->server = srv;
+        trace->attempt = (int)(srv - members->servers);
+        cb(*argp,ETCD_TRACE_START,trace);
+        return cb;
+}
+
+
+static void
+trace_end (etcd_trace_cb *cb, void *arg, etcd_trace *trace, CURL *curl,
+           CURLcode curl_res)
+{
+        curl_off_t      t;
+
+        trace->curl_code = curl_res;
+        curl_easy_getinfo(curl,CURLINFO_RESPONSE_CODE,&trace->status);
+        if (curl_easy_getinfo(curl,CURLINFO_NAMELOOKUP_TIME_T,&t) == CURLE_OK) {
+                trace->namelookup_us = t;
+        }
+        if (curl_easy_getinfo(curl,CURLINFO_CONNECT_TIME_T,&t) == CURLE_OK) {
+                trace->connect_us = t;
+        }
+        if (curl_easy_getinfo(curl,CURLINFO_STARTTRANSFER_TIME_T,&t)
+                        == CURLE_OK) {
+                trace->starttransfer_us = t;
+        }
+        if (curl_easy_getinfo(curl,CURLINFO_REDIRECT_TIME_T,&t) == CURLE_OK) {
+                trace->redirect_us = t;
+        }
+        if (curl_easy_getinfo(curl,CURLINFO_TOTAL_TIME_T,&t) == CURLE_OK) {
+                trace->total_us = t;
+        }
+        cb(arg,ETCD_TRACE_END,trace);
+}
+
+
+/*
+ * Each session keeps one easy handle between calls, so that a caller doing
+ * one request after another - a compare-and-swap retry loop, say - reuses
+ * its connection instead of paying for a new one every time.  A thread that
+ * finds the handle in use (e.g. by a long watch) just makes its own.
+ */
+static CURL *
+session_curl (_etcd_session *session)
+{
+        CURL    *curl;
+
+        pthread_mutex_lock(&session->curl_lock);
+        curl = session->curl;
+        session->curl = NULL;
+        pthread_mutex_unlock(&session->curl_lock);
+
+        if (curl) {
+                /* This keeps the connection cache, just not the options. */
+                curl_easy_reset(curl);
+                return curl;
+        }
+        return curl_easy_init();
+}
+
+
+static void
+session_curl_done (_etcd_session *session, CURL *curl)
+{
+        pthread_mutex_lock(&session->curl_lock);
+        if (!session->curl) {
+                session->curl = curl;
+                curl = NULL;
+        }
+        pthread_mutex_unlock(&session->curl_lock);
+
+        if (curl) {
+                curl_easy_cleanup(curl);
+        }
+}
+
+
+/*
+ * Sidecar connections are cached just like session_curl's handle, one per
+ * session, and a thread that finds it busy or pointed elsewhere makes its
+ * own.  "cached" tells the caller whether a failure might just mean the
+ * daemon went away since we last used it.
+ */
+static int
+sidecar_take (_etcd_session *session, const char *path, int *cached)
+{
+        struct sockaddr_un      addr;
+        int                     fd      = -1;
+
+        pthread_mutex_lock(&session->curl_lock);
+        if ((session->sidecar_fd >= 0) &&
+            !strcmp(session->sidecar_path,path)) {
+                fd = session->sidecar_fd;
+                session->sidecar_fd = -1;
+        }
+        pthread_mutex_unlock(&session->curl_lock);
+
+        *cached = (fd >= 0);
+        if (fd >= 0) {
+                return fd;
+        }
+
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                return -1;
+        }
+        memset(&addr,0,sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path,path);
+
+        fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+        if (fd < 0) {
+                return -1;
+        }
+        if (connect(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+
+static void
+sidecar_done (_etcd_session *session, const char *path, int fd)
+{
+        pthread_mutex_lock(&session->curl_lock);
+        if (session->sidecar_fd < 0) {
+                session->sidecar_fd = fd;
+                strcpy(session->sidecar_path,path);
+                fd = -1;
+        }
+        pthread_mutex_unlock(&session->curl_lock);
+
+        if (fd >= 0) {
+                close(fd);
+        }
+}
+
+
+static uint64_t
+sidecar_now_us (void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/*
+ * Read exactly len bytes, waking up every so often to check for cancellation
+ * or the caller's timeout.  A clean EOF before the first byte gets its own
+ * code so that sidecar_perform can tell a stale connection from a real one.
+ */
+static CURLcode
+sidecar_read (int fd, void *buf, size_t len, etcd_response *rsp,
+              uint64_t deadline)
+{
+        struct pollfd   pfd;
+        size_t          done    = 0;
+        ssize_t         n;
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        while (done < len) {
+                if (rsp && rsp->cancel &&
+                    __atomic_load_n(rsp->cancel,__ATOMIC_ACQUIRE)) {
+                        return CURLE_ABORTED_BY_CALLBACK;
+                }
+                if (deadline && (sidecar_now_us() >= deadline)) {
+                        return CURLE_OPERATION_TIMEDOUT;
+                }
+                if (poll(&pfd,1,100) <= 0) {
+                        continue;
+                }
+                n = read(fd,(char *)buf+done,len-done);
+                if (n < 0) {
+                        if ((errno == EINTR) || (errno == EAGAIN)) {
+                                continue;
+                        }
+                        return done ? CURLE_RECV_ERROR : CURLE_GOT_NOTHING;
+                }
+                if (!n) {
+                        return done ? CURLE_RECV_ERROR : CURLE_GOT_NOTHING;
+                }
+                done += n;
+        }
+        return CURLE_OK;
+}
+
+
+static CURLcode
+sidecar_write (int fd, const void *buf, size_t len)
+{
+        size_t          done    = 0;
+        ssize_t         n;
+
+        while (done < len) {
+                n = send(fd,(const char *)buf+done,len-done,MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return CURLE_SEND_ERROR;
+                }
+                done += n;
+        }
+        return CURLE_OK;
+}
+
+
+/*
+ * The sidecar equivalent of setting up and performing a curl request, for
+ * the blocking calls and batches.  The body goes to cb as if curl had
+ * delivered it in one piece, rsp (if any) supplies the timeout and cancel
+ * flag and gets the index, and status gets the HTTP status the daemon
+ * relayed.  A daemon that couldn't reach any server looks just like one we
+ * couldn't reach ourselves, so the caller moves on to the next in its list.
+ */
+static CURLcode
+sidecar_perform (_etcd_session *session, etcd_members *members,
+                 etcd_server *srv, etcd_stat_op op, const char *method,
+                 const char *url, const char *contents, curl_callback_t *cb,
+                 void *stream, etcd_response *rsp, long *status)
+{
+        const char      *path;
+        const char      *sock_path      = SRV_SIDECAR_PATH(srv);
+        size_t          path_len;
+        size_t          body_len        = contents ? strlen(contents) : 0;
+        size_t          msg_len;
+        unsigned char   *msg;
+        unsigned char   hdr[4];
+        unsigned char   *reply          = NULL;
+        uint32_t        reply_len       = 0;
+        unsigned int    code;
+        uint64_t        start           = sidecar_now_us();
+        uint64_t        deadline        = 0;
+        uint64_t        bytes_in        = 0;
+        CURLcode        curl_res        = CURLE_COULDNT_CONNECT;
+        int             fd;
+        int             cached;
+        int             tries;
+
+        for (code = 0; code < SC_NUM_METHODS; ++code) {
+                if (!strcmp(method,sc_methods[code])) {
+                        break;
+                }
+        }
+        /* Skip the scheme and placeholder host; see SRV_URL_HOST. */
+        path = strchr(url+7,'/');
+        if ((code == SC_NUM_METHODS) || !path) {
+                return CURLE_URL_MALFORMAT;
+        }
+        path_len = strlen(++path);
+        msg_len = 4 + SC_REQ_HEAD + path_len + body_len;
+        if ((path_len > 0xffff) || (msg_len > SC_MAX_MESSAGE)) {
+                return CURLE_URL_MALFORMAT;
+        }
+        if (rsp && rsp->timeout_ms) {
+                deadline = start + (uint64_t)rsp->timeout_ms * 1000;
+        }
+
+        msg = e_malloc(msg_len);
+        if (!msg) {
+                return CURLE_OUT_OF_MEMORY;
+        }
+        sc_put32(msg,msg_len-4);
+        msg[4] = code;
+        sc_put16(msg+5,path_len);
+        memcpy(msg+4+SC_REQ_HEAD,path,path_len);
+        if (body_len) {
+                memcpy(msg+4+SC_REQ_HEAD+path_len,contents,body_len);
+        }
+
+        /* A cached connection gets one retry on a fresh one. */
+        for (tries = 0; tries < 2; ++tries) {
+                fd = sidecar_take(session,sock_path,&cached);
+                if (fd < 0) {
+                        curl_res = CURLE_COULDNT_CONNECT;
+                        break;
+                }
+                curl_res = sidecar_write(fd,msg,msg_len);
+                if (curl_res == CURLE_OK) {
+                        curl_res = sidecar_read(fd,hdr,sizeof(hdr),rsp,
+                                                deadline);
+                }
+                if ((curl_res == CURLE_OK) || !cached ||
+                    ((curl_res != CURLE_SEND_ERROR) &&
+                     (curl_res != CURLE_GOT_NOTHING))) {
+                        break;
+                }
+                close(fd);
+                fd = -1;
+        }
+        if (curl_res != CURLE_OK) {
+                goto finish;
+        }
+
+        reply_len = sc_get32(hdr);
+        if ((reply_len < SC_RSP_HEAD) || (reply_len > SC_MAX_MESSAGE)) {
+                curl_res = CURLE_WEIRD_SERVER_REPLY;
+                goto finish;
+        }
+        reply = e_malloc(reply_len+1);
+        if (!reply) {
+                curl_res = CURLE_OUT_OF_MEMORY;
+                goto finish;
+        }
+        curl_res = sidecar_read(fd,reply,reply_len,rsp,deadline);
+        if (curl_res != CURLE_OK) {
+                if (curl_res == CURLE_GOT_NOTHING) {
+                        curl_res = CURLE_RECV_ERROR;
+                }
+                goto finish;
+        }
+        reply[reply_len] = '\0';
+        bytes_in = sizeof(hdr) + reply_len;
+
+        if (!sc_get16(reply)) {
+                curl_res = CURLE_COULDNT_CONNECT;
+                goto finish;
+        }
+        if (status) {
+                *status = sc_get16(reply);
+        }
+        if (rsp) {
+                rsp->etcd_index = sc_get64(reply+2);
+        }
+        reply_len -= SC_RSP_HEAD;
+        if (reply_len && (cb(reply+SC_RSP_HEAD,1,reply_len,stream)
+                          != reply_len)) {
+                curl_res = CURLE_WRITE_ERROR;
+        }
+
+finish:
+        if (fd >= 0) {
+                /* Anything but a complete exchange leaves it out of step. */
+                if (curl_res == CURLE_OK) {
+                        sidecar_done(session,sock_path,fd);
+                }
+                else {
+                        close(fd);
+                }
+        }
+        stats_note(session,members,srv,op,sidecar_now_us()-start,
+                   msg_len,bytes_in,
+                   (curl_res != CURLE_OK)
+                   && (curl_res != CURLE_ABORTED_BY_CALLBACK)
+                   && (curl_res != CURLE_OPERATION_TIMEDOUT));
+        e_free(reply);
+        e_free(msg);
+        return curl_res;
+}
+
+
+/*
+ * The parse callback only gets called once, with the complete body, and only
+ * if the transfer worked.  If the caller passes in a response structure it
+ * can also see the X-Etcd-Index header and provide a cancellation flag;
+ * otherwise it can just pass NULL.
+ */
+static etcd_result
+etcd_get_url (_etcd_session *session, etcd_members *members, const char *url,
+              etcd_server *srv, etcd_stat_op stat_op, const char *post,
+              curl_callback_t cb, char **stream, etcd_response *rsp)
+{
+        CURL            *curl           = NULL;
+        CURLcode        curl_res;
+        etcd_result     res             = ETCD_WTF;
+        void            *err_label      = &&done;
+        etcd_response   my_rsp;
+        etcd_trace      trace;
+        etcd_trace_cb   *trace_cb;
+        void            *trace_arg;
+
+        if (!rsp) {
+                memset(&my_rsp,0,sizeof(my_rsp));
+                rsp = &my_rsp;
+        }
+        rsp->len = 0;
+        rsp->etcd_index = 0;
+
+        if (SRV_IS_SIDECAR(srv)) {
+                /* No handle, so the cleanup below has nothing to do. */
+                curl_res = sidecar_perform(session,members,srv,stat_op,
+                                           post ? "POST" : "GET",url,post,
+                                           collect_body,rsp,rsp,NULL);
+                goto performed;
+        }
+
+        curl = session_curl(session);
+        if (!curl) {
+                goto *err_label;
+        }
+        err_label = &&cleanup_curl;
+
+        /* TBD: add error checking for these */
+        curl_easy_setopt(curl,CURLOPT_URL,url);
+        server_transport(curl,srv);
+        curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1L);
+        curl_easy_setopt(curl,CURLOPT_NOSIGNAL,1L);
+        curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,collect_body);
+        curl_easy_setopt(curl,CURLOPT_WRITEDATA,rsp);
+        curl_easy_setopt(curl,CURLOPT_HEADERFUNCTION,collect_header);
+        curl_easy_setopt(curl,CURLOPT_HEADERDATA,rsp);
+        if (rsp->timeout_ms) {
+                curl_easy_setopt(curl,CURLOPT_TIMEOUT_MS,rsp->timeout_ms);
+        }
+        if (rsp->cancel) {
+                curl_easy_setopt(curl,CURLOPT_NOPROGRESS,0L);
+                curl_easy_setopt(curl,CURLOPT_XFERINFOFUNCTION,check_cancel);
+                curl_easy_setopt(curl,CURLOPT_XFERINFODATA,rsp);
+        }
+        if (post) {
+                curl_easy_setopt(curl,CURLOPT_POST,1L);
+                curl_easy_setopt(curl,CURLOPT_POSTFIELDS,post);
+        }
+#if defined(DEBUG)
+        curl_easy_setopt(curl,CURLOPT_VERBOSE,1L);
+#endif
+
+        trace_cb = trace_begin(session,members,&trace,post ? "POST" : "GET",
+                               url,srv,&trace_arg);
+        curl_res = curl_easy_perform(curl);
+        if (trace_cb) {
+                trace_end(trace_cb,trace_arg,&trace,curl,curl_res);
+        }
+        stats_record(session,members,srv,stat_op,
+                     curl,(curl_res != CURLE_OK)
+                          && (curl_res != CURLE_ABORTED_BY_CALLBACK)
+                          && !((curl_res == CURLE_OPERATION_TIMEDOUT)
+                               && rsp->timeout_ms));
+performed:
+        if ((curl_res == CURLE_OPERATION_TIMEDOUT) && rsp->timeout_ms) {
+                /* Not a server problem, so don't go trying the next one. */
+                res = ETCD_TIMEOUT;
+                goto *err_label;
+        }
+        if (curl_res != CURLE_OK) {
+                print_curl_error("perform",curl_res);
+                goto *err_label;
+        }
+
+        if (rsp->len) {
+                cb(rsp->data,1,rsp->len,stream);
+        }
+        res = ETCD_OK;
+
+cleanup_curl:
+        session_curl_done(session,curl);
+done:
+        if (rsp == &my_rsp) {
+                e_free(my_rsp.data);
+        }
+        return res;
+}
+
+
+static etcd_result
+etcd_get_one (_etcd_session *session, etcd_members *members, const char *key,
+              etcd_server *srv, const char *prefix, const char *post,
+              curl_callback_t cb, char **stream, etcd_response *rsp)
+{
+        char            *url;
+        etcd_result     res;
+        etcd_stat_op    stat_op;
+
+        if (e_asprintf(&url,"http://%s:%u/v2/%s%s",
+                       SRV_URL_HOST(srv),SRV_URL_PORT(srv),prefix,key) < 0) {
+                return ETCD_WTF;
+        }
+        stat_op = strncmp(prefix,"keys/",5) ? ETCD_STAT_OTHER
+                : strstr(key,"wait=true") ? ETCD_STAT_WATCH
+                : ETCD_STAT_GET;
+
+        res = etcd_get_url(session,members,url,srv,stat_op,post,cb,stream,rsp);
+        e_free(url);
+        return res;
+}
+
+
+char *
+etcd_get (etcd_session session_as_void, char *key)
+{
+        _etcd_session   *session   = session_as_void;
+        etcd_server     *srv;
+        etcd_result     res;
+        char            *value  = NULL;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
+
+        for (srv = members->servers; srv->host; ++srv) {
+                res = etcd_get_one(session,members,key,srv,"keys/",NULL,
+                                   parse_get_response,&value,NULL);
+                if ((res == ETCD_OK) && value) {
+                        return value;
+                }
+        }
+
+        return NULL;
+}
+
+
+typedef struct {
+        etcd_node       *node;
+        int             parsed;
+        int             error_code;
+} etcd_get_t;
+
+static size_t
+parse_get_ex_response (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+        etcd_get_t      *get    = stream;
+        yajl_val        root;
+        yajl_val        node;
+        yajl_val        value;
+
+        root = yajl_tree_parse(ptr,NULL,0);
+        if (!root) {
+                return size*nmemb;
+        }
+
+        get->parsed = 1;
+        get->error_code = error_code(root);
+        node = my_yajl_tree_get(root,node_path,yajl_t_object);
+        if (node) {
+                get->node->modified_index = node_index(node,"modifiedIndex");
+                get->node->created_index = node_index(node,"createdIndex");
+                get->node->ttl = (int64_t)node_index(node,"ttl");
+                value = node_field(node,"value",yajl_t_string);
+                if (value) {
+                        get->node->value = e_strdup(MY_YAJL_GET_STRING(value));
+                }
+                else {
+                        /* Same as etcd_get: a directory gives a listing. */
+                        get->node->value = parse_array_response(root);
+                        if (!get->node->value &&
+                            node_field(node,"dir",yajl_t_true)) {
+                                get->node->value = e_strdup("");
+                        }
+                }
+        }
+
+        yajl_tree_free(root);
+        return size*nmemb;
+}
+
+
+etcd_result
+etcd_get_ex (etcd_session session_as_void, char *key, etcd_node *node)
+{
+        _etcd_session   *session   = session_as_void;
+        etcd_server     *srv;
+        etcd_result     res        = ETCD_WTF;
+        etcd_get_t      get;
+        etcd_response   rsp;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
+
+        memset(&rsp,0,sizeof(rsp));
+
+        for (srv = members->servers; srv->host; ++srv) {
+                memset(node,0,sizeof(*node));
+                memset(&get,0,sizeof(get));
+                get.node = node;
+                res = etcd_get_one(session,members,key,srv,"keys/",NULL,
+                                   parse_get_ex_response,(char **)&get,&rsp);
+                if (res != ETCD_OK) {
+                        continue;
+                }
+                node->etcd_index = rsp.etcd_index;
+                if (get.error_code == EC_KEY_NOT_FOUND) {
+                        res = ETCD_NOT_FOUND;
+                }
+                else if (!get.parsed || get.error_code) {
+                        res = ETCD_PROTOCOL_ERROR;
+                }
+                else if (!node->value) {
+                        res = ETCD_WTF;
+                }
+                break;
+        }
+
+        e_free(rsp.data);
+        return res;
+}
+
+
+static size_t
+parse_watch_response (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+        yajl_val                root;
+        yajl_val                node;
+        yajl_val                value;
+        etcd_watch_t            *watch  = stream;
+        static const char       *a_path[] = { "action", NULL };
+
+        root = yajl_tree_parse(ptr,NULL,0);
+        if (!root) {
+                return size*nmemb;
+        }
+
+        watch->error_code = error_code(root);
+        node = my_yajl_tree_get(root,node_path,yajl_t_object);
+        if (node) {
+                watch->index_out = node_index(node,"modifiedIndex");
+                watch->is_dir = node_field(node,"dir",yajl_t_true) != NULL;
+                value = node_field(node,"key",yajl_t_string);
+                if (value) {
+                        watch->key = e_strdup(MY_YAJL_GET_STRING(value));
+                }
+                value = node_field(node,"value",yajl_t_string);
+                if (value) {
+                        watch->value = e_strdup(MY_YAJL_GET_STRING(value));
+                }
+        }
+
+        value = my_yajl_tree_get(root,a_path,yajl_t_string);
+        if (value) {
+                /* Covers delete, compareAndDelete, and expire. */
+                watch->deleted = strstr(MY_YAJL_GET_STRING(value),"elete") ||
+                                 !strcmp(MY_YAJL_GET_STRING(value),"expire");
+        }
+
+        yajl_tree_free(root);
+        return size*nmemb;
+}
+
+
+static etcd_result
+etcd_watch_internal (_etcd_session *session, const char *pfx,
+                     etcd_index *index_in, etcd_watch_t *watch,
+                     etcd_response *rsp)
+{
+        etcd_server     *srv;
+        etcd_result     res = ETCD_WTF;
+        char            *path = NULL;
+        USE_MEMBERS(session,members);
+
+        memset(watch,0,sizeof(*watch));
+        if (index_in) {
+                if (e_asprintf(&path,
+                               "%s?wait=true&recursive=true&waitIndex=%"PRIu64,
+                               pfx,*index_in) < 0) {
+                        return ETCD_WTF;
+                }
+        }
+        else {
+                if (e_asprintf(&path,"%s?wait=true&recursive=true",pfx) < 0) {
+                        return ETCD_WTF;
+                }
+        }
+
+        for (srv = members->servers; srv->host; ++srv) {
+                memset(watch,0,sizeof(*watch));
+                res = etcd_get_one(session,members,path,srv,"keys/",NULL,
+                                   parse_watch_response,(char **)watch,rsp);
+                if (res == ETCD_TIMEOUT) {
+                        break;
+                }
+                if (res == ETCD_OK) {
+                        if (watch->error_code == EC_INDEX_CLEARED) {
+                                res = ETCD_INDEX_CLEARED;
+                        }
+                        else if (watch->error_code) {
+                                res = ETCD_PROTOCOL_ERROR;
+                        }
+                        break;
+                }
+        }
+
+        e_free(path);
+        return res;
+}
+
+
+etcd_result
+etcd_watch_ex (etcd_session session_as_void, char *pfx,
+               char **keyp, char **valuep,
+               etcd_index *index_in, etcd_index *index_out)
+{
+        _etcd_session   *session   = session_as_void;
+        etcd_result     res;
+        etcd_watch_t    watch;
+        USE_ALLOCATOR(&session->alloc);
+
+        res = etcd_watch_internal(session,pfx,index_in,&watch,NULL);
+        if (res != ETCD_OK) {
+                e_free(watch.key);
+                e_free(watch.value);
+                return res;
+        }
+
+        if (keyp) {
+                *keyp = watch.key;
+        }
+        else {
+                e_free(watch.key);
+        }
+        if (valuep) {
+                *valuep = watch.value;
+        }
+        else {
+                e_free(watch.value);
+        }
+        if (index_out) {
+                *index_out = watch.index_out;
+        }
+
+        return ETCD_OK;
+}
+
+
+etcd_result
+etcd_watch (etcd_session session, char *pfx,
+            char **keyp, char **valuep, int *index_in, int *index_out)
+{
+        etcd_result     res;
+        etcd_index      index;
+
+        if (index_in) {
+                index = *index_in;
+        }
+
+        res = etcd_watch_ex(session,pfx,keyp,valuep,index_in ? &index : NULL,
+                            &index);
+        if ((res == ETCD_OK) && index_out) {
+                *index_out = (int)index;
+        }
+
+        return res;
+}
+
+
+/*
+ * Recursive get, calling back for every leaf under a prefix (including the
+ * prefix itself if it's not a directory).  A missing prefix isn't an error;
+ * it just means there are no leaves.  The index returned is X-Etcd-Index,
+ * which is where a subsequent watch should pick up.
+ */
+typedef int etcd_leaf_cb (void *arg, yajl_val node);
+
+typedef struct {
+        etcd_leaf_cb    *cb;
+        void            *arg;
+        int             parsed;
+        int             failed;
+        int             error_code;
+        etcd_index      error_index;
+} etcd_tree_t;
+
+static int
+walk_leaves (yajl_val node, etcd_leaf_cb *cb, void *arg)
+{
+        yajl_val        nodes;
+        size_t          i;
+
+        if (!node_field(node,"dir",yajl_t_true)) {
+                return cb(arg,node);
+        }
+
+        nodes = node_field(node,"nodes",yajl_t_array);
+        if (nodes) {
+                for (i = 0; i < nodes->u.array.len; ++i) {
+                        if (walk_leaves(nodes->u.array.values[i],cb,arg) != 0) {
+                                return -1;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+
+static size_t
+parse_tree_response (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+        yajl_val        root;
+        yajl_val        node;
+        etcd_tree_t     *tree   = stream;
+
+        root = yajl_tree_parse(ptr,NULL,0);
+        if (!root) {
+                return size*nmemb;
+        }
+
+        tree->parsed = 1;
+        tree->error_code = error_code(root);
+        if (tree->error_code) {
+                tree->error_index = node_index(root,"index");
+        }
+        else {
+                node = my_yajl_tree_get(root,node_path,yajl_t_object);
+                if (node) {
+                        tree->failed = walk_leaves(node,tree->cb,tree->arg);
+                }
+        }
+
+        yajl_tree_free(root);
+        return size*nmemb;
+}
+
+
+static etcd_result
+etcd_get_tree (_etcd_session *session, const char *pfx, etcd_leaf_cb *cb,
+               void *arg, etcd_index *index_out, int *cancel)
+{
+        etcd_server     *srv;
+        etcd_result     res             = ETCD_WTF;
+        char            *path;
+        etcd_tree_t     tree;
+        etcd_response   rsp;
+        USE_MEMBERS(session,members);
+
+        if (e_asprintf(&path,"%s?recursive=true",pfx) < 0) {
+                return ETCD_WTF;
+        }
+
+        memset(&rsp,0,sizeof(rsp));
+        rsp.cancel = cancel;
+
+        for (srv = members->servers; srv->host; ++srv) {
+                memset(&tree,0,sizeof(tree));
+                tree.cb = cb;
+                tree.arg = arg;
+                res = etcd_get_one(session,members,path,srv,"keys/",NULL,
+                                   parse_tree_response,(char **)&tree,&rsp);
+                if (res != ETCD_OK) {
+                        continue;
+                }
+                if (!tree.parsed || tree.failed ||
+                    (tree.error_code &&
+                     (tree.error_code != EC_KEY_NOT_FOUND))) {
+                        res = ETCD_PROTOCOL_ERROR;
+                        break;
+                }
+                *index_out = rsp.etcd_index ? rsp.etcd_index
+                                            : tree.error_index;
+                break;
+        }
+
+        e_free(rsp.data);
+        e_free(path);
+        return res;
+}
+
+
+/*
+ * The ring between the network thread and consumers is a bounded queue in the
+ * style of Dmitry Vyukov's: each cell carries a sequence number that says
+ * whether it's ready to be filled (seq == pos) or drained (seq == pos+1).
+ * There's only ever one producer, so filling is trivial, while consumers race
+ * on the tail with compare-and-swap.  Locks are only involved when somebody
+ * has to sleep because the ring is empty or full.
+ */
+typedef struct {
+        uint64_t        seq;
+        etcd_event      ev;
+} etcd_cell;
+
+typedef struct {
+        _etcd_session   *session;
+        char            *pfx;
+        pthread_t       thread;
+        etcd_cell       *cells;
+        uint64_t        mask;
+        uint64_t        head;           /* only the network thread uses it */
+        char            pad1[64];
+        uint64_t        tail;           /* consumers fight over this */
+        char            pad2[64];
+        int             stop;
+        int             waiters;        /* consumers asleep on "ready" */
+        int             blocked;        /* network thread asleep on "room" */
+        int             users;          /* threads inside etcd_watcher_next */
+        pthread_mutex_t lock;
+        pthread_cond_t  ready;
+        pthread_cond_t  room;
+        etcd_kmap       known;
+        unsigned int    gen;
+        int             emit;           /* report differences on resync? */
+        etcd_index      next_index;     /* zero means resync first */
+} etcd_watcher_t;
+
+static int
+ring_put (etcd_watcher_t *w, etcd_event *ev)
+{
+        etcd_cell       *cell   = &w->cells[w->head & w->mask];
+
+        if (__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE) != w->head) {
+                return 0;
+        }
+
+        cell->ev = *ev;
+        __atomic_store_n(&cell->seq,w->head+1,__ATOMIC_RELEASE);
+        ++w->head;
+        return 1;
+}
+
+
+static int
+ring_get (etcd_watcher_t *w, etcd_event *ev)
+{
+        etcd_cell       *cell;
+        uint64_t        pos;
+        int64_t         diff;
+
+        pos = __atomic_load_n(&w->tail,__ATOMIC_RELAXED);
+        for (;;) {
+                cell = &w->cells[pos & w->mask];
+                diff = (int64_t)(__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE)
+                                 - (pos + 1));
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&w->tail,&pos,pos+1,1,
+                                                        __ATOMIC_RELAXED,
+                                                        __ATOMIC_RELAXED)) {
+                                break;
+                        }
+                        /* Failed CAS updated pos for us. */
+                }
+                else if (diff < 0) {
+                        return 0;
+                }
+                else {
+                        pos = __atomic_load_n(&w->tail,__ATOMIC_RELAXED);
+                }
+        }
+
+        *ev = cell->ev;
+        __atomic_store_n(&cell->seq,pos+w->mask+1,__ATOMIC_RELEASE);
+        return 1;
+}
+
+
+static int
+ring_empty (etcd_watcher_t *w)
+{
+        uint64_t        pos     = __atomic_load_n(&w->tail,__ATOMIC_ACQUIRE);
+        etcd_cell       *cell   = &w->cells[pos & w->mask];
+
+        return __atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE) != (pos + 1);
+}
+
+
+static int
+ring_full (etcd_watcher_t *w)
+{
+        etcd_cell       *cell   = &w->cells[w->head & w->mask];
+
+        return __atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE) != w->head;
+}
+
+
+static int
+watcher_stopping (etcd_watcher_t *w)
+{
+        return __atomic_load_n(&w->stop,__ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Hand an event to the consumers, waiting for room if we have to.  This is
+ * where back-pressure comes from: while we're waiting here we're not reading
+ * from etcd, and if that goes on long enough the resync logic takes over.
+ * Ownership of the strings passes to the ring, or back to us on failure.
+ */
+static int
+watcher_push (etcd_watcher_t *w, etcd_event *ev)
+{
+        while (!ring_put(w,ev)) {
+                pthread_mutex_lock(&w->lock);
+                __atomic_store_n(&w->blocked,1,__ATOMIC_SEQ_CST);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (ring_full(w) && !watcher_stopping(w)) {
+                        pthread_cond_wait(&w->room,&w->lock);
+                }
+                __atomic_store_n(&w->blocked,0,__ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&w->lock);
+                if (watcher_stopping(w)) {
+                        return -1;
+                }
+        }
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&w->waiters,__ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&w->lock);
+                pthread_cond_signal(&w->ready);
+                pthread_mutex_unlock(&w->lock);
+        }
+        return 0;
+}
+
+
+static int
+watcher_emit (etcd_watcher_t *w, const char *key, const char *value,
+              etcd_index index, int is_dir, int deleted, int resync)
+{
+        etcd_event      ev;
+
+        ev.key = e_strdup(key);
+        ev.value = value ? e_strdup(value) : NULL;
+        ev.index = index;
+        ev.is_dir = is_dir;
+        ev.deleted = deleted;
+        ev.resync = resync;
+
+        if (!ev.key || (value && !ev.value) || (watcher_push(w,&ev) != 0)) {
+                e_free(ev.key);
+                e_free(ev.value);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+static int
+resync_leaf (void *arg, yajl_val node)
+{
+        etcd_watcher_t  *w      = arg;
+        yajl_val        key;
+        yajl_val        value;
+        etcd_kent       *ent;
+        etcd_index      index;
+        int             changed;
+
+        key = node_field(node,"key",yajl_t_string);
+        if (!key) {
+                return 0;
+        }
+        value = node_field(node,"value",yajl_t_string);
+        index = node_index(node,"modifiedIndex");
+
+        ent = kmap_put(&w->known,MY_YAJL_GET_STRING(key));
+        if (!ent) {
+                return -1;
+        }
+        changed = (ent->index != index);
+        ent->index = index;
+        ent->gen = w->gen;
+
+        if (changed && w->emit) {
+                return watcher_emit(w,MY_YAJL_GET_STRING(key),
+                                    value ? MY_YAJL_GET_STRING(value) : "",
+                                    index,0,0,1);
+        }
+
+        return 0;
+}
+
+
+/*
+ * Bring our picture of the prefix up to date with a recursive get, reporting
+ * anything that's new or changed as a set and anything that's gone as a
+ * delete (at the index where we noticed), then arrange for the watch to
+ * resume just past the get.
+ */
+static etcd_result
+watcher_resync (etcd_watcher_t *w)
+{
+        etcd_result     res;
+        etcd_index      index   = 0;
+        etcd_kent       **link;
+        etcd_kent       *ent;
+        size_t          i;
+
+        ++w->gen;
+        res = etcd_get_tree(w->session,w->pfx,resync_leaf,w,&index,&w->stop);
+        if (res != ETCD_OK) {
+                return res;
+        }
+        if (!index) {
+                return ETCD_PROTOCOL_ERROR;
+        }
+
+        for (i = 0; i < w->known.nbuckets; ++i) {
+                link = &w->known.buckets[i];
+                while ((ent = *link) != NULL) {
+                        if (ent->gen == w->gen) {
+                                link = &ent->next;
+                                continue;
+                        }
+                        if (w->emit &&
+                            (watcher_emit(w,ent->key,NULL,index,0,1,1) != 0)) {
+                                return ETCD_WTF;
+                        }
+                        *link = ent->next;
+                        e_free(ent->value);
+                        e_free(ent);
+                        --w->known.count;
+                }
+        }
+
+        w->emit = 1;
+        w->next_index = index + 1;
+        return ETCD_OK;
+}
+
+
+/* An absolute time for pthread_cond_timedwait, ms from now. */
+static void
+deadline_after_ms (struct timespec *deadline, unsigned int ms)
+{
+        clock_gettime(CLOCK_REALTIME,deadline);
+        deadline->tv_sec += ms / 1000;
+        deadline->tv_nsec += (ms % 1000) * 1000000L;
+        if (deadline->tv_nsec >= 1000000000L) {
+                ++deadline->tv_sec;
+                deadline->tv_nsec -= 1000000000L;
+        }
+}
+
+
+static void
+watcher_pause (etcd_watcher_t *w, unsigned int ms)
+{
+        struct timespec deadline;
+
+        deadline_after_ms(&deadline,ms);
+
+        pthread_mutex_lock(&w->lock);
+        if (!watcher_stopping(w)) {
+                (void)pthread_cond_timedwait(&w->room,&w->lock,&deadline);
+        }
+        pthread_mutex_unlock(&w->lock);
+}
+
+
+static void *
+watcher_main (void *arg)
+{
+        etcd_watcher_t  *w      = arg;
+        etcd_watch_t    watch;
+        etcd_response   rsp;
+        etcd_result     res;
+        etcd_kent       *ent;
+        unsigned int    backoff = 0;
+
+        cur_alloc = &w->session->alloc;
+        memset(&rsp,0,sizeof(rsp));
+        rsp.cancel = &w->stop;
+
+        while (!watcher_stopping(w)) {
+                memset(&watch,0,sizeof(watch));
+                if (!w->next_index) {
+                        /* A resync does its own reporting. */
+                        res = watcher_resync(w);
+                        if (res == ETCD_OK) {
+                                backoff = 0;
+                                continue;
+                        }
+                }
+                else {
+                        res = etcd_watch_internal(w->session,w->pfx,
+                                                  &w->next_index,&watch,&rsp);
+                }
+
+                if (res == ETCD_INDEX_CLEARED) {
+                        w->next_index = 0;
+                }
+                if ((res != ETCD_OK) || !watch.key) {
+                        e_free(watch.key);
+                        e_free(watch.value);
+                }
+                if (res == ETCD_INDEX_CLEARED) {
+                        continue;
+                }
+                if (res != ETCD_OK) {
+                        /* Nobody's answering, or somebody's confused. */
+                        backoff = backoff ? backoff * 2 : 100;
+                        if (backoff > MAX_BACKOFF_MS) {
+                                backoff = MAX_BACKOFF_MS;
+                        }
+                        watcher_pause(w,backoff);
+                        continue;
+                }
+                backoff = 0;
+                if (!watch.key) {
+                        /* Long poll timed out without news.  Ask again. */
+                        continue;
+                }
+
+                if (watch.deleted) {
+                        if (watch.is_dir) {
+                                kmap_remove_dir(&w->known,watch.key);
+                        }
+                        kmap_remove(&w->known,watch.key);
+                        e_free(watch.value);
+                        watch.value = NULL;
+                }
+                else if (!watch.is_dir) {
+                        ent = kmap_put(&w->known,watch.key);
+                        if (ent) {
+                                ent->index = watch.index_out;
+                        }
+                        if (!watch.value) {
+                                watch.value = e_strdup("");
+                        }
+                }
+                w->next_index = watch.index_out + 1;
+
+                if (watcher_emit(w,watch.key,watch.value,watch.index_out,
+                                 watch.is_dir,watch.deleted,0) != 0) {
+                        /* Either we're stopping or we're out of memory. */
+                        w->next_index = 0;
+                }
+                e_free(watch.key);
+                e_free(watch.value);
+        }
+
+        e_free(rsp.data);
+        return NULL;
+}
+
+
+etcd_watcher
+etcd_watcher_start (etcd_session session_as_void, char *pfx,
+                    etcd_index *index_in, unsigned int ring_size)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_watcher_t  *w;
+        uint64_t        i;
+        uint64_t        size            = 1;
+        void            *err_label      = &&done;
+        USE_ALLOCATOR(&session->alloc);
+
+        if (!ring_size) {
+                ring_size = DEFAULT_RING_SIZE;
+        }
+        while (size < ring_size) {
+                size <<= 1;
+        }
+
+        w = e_calloc(1,sizeof(*w));
+        if (!w) {
+                goto *err_label;
+        }
+        err_label = &&free_w;
+
+        w->session = session_as_void;
+        w->pfx = e_strdup(pfx);
+        if (!w->pfx) {
+                goto *err_label;
+        }
+        err_label = &&free_pfx;
+
+        w->cells = e_calloc(size,sizeof(*w->cells));
+        if (!w->cells) {
+                goto *err_label;
+        }
+        err_label = &&free_cells;
+        w->mask = size - 1;
+        for (i = 0; i < size; ++i) {
+                w->cells[i].seq = i;
+        }
+
+        if (kmap_init(&w->known) != 0) {
+                goto *err_label;
+        }
+        err_label = &&free_known;
+
+        if (index_in) {
+                /*
+                 * We don't know what was there before this index, so the
+                 * first resync (if any) will report everything it finds.
+                 */
+                w->next_index = *index_in;
+                w->emit = 1;
+        }
+
+        pthread_mutex_init(&w->lock,NULL);
+        pthread_cond_init(&w->ready,NULL);
+        pthread_cond_init(&w->room,NULL);
+        if (pthread_create(&w->thread,NULL,watcher_main,w) != 0) {
+                pthread_cond_destroy(&w->room);
+                pthread_cond_destroy(&w->ready);
+                pthread_mutex_destroy(&w->lock);
+                goto *err_label;
+        }
+
+        return w;
+
+free_known:
+        kmap_free(&w->known);
+free_cells:
+        e_free(w->cells);
+free_pfx:
+        e_free(w->pfx);
+free_w:
+        e_free(w);
+done:
+        return NULL;
+}
+
+
+etcd_result
+etcd_watcher_next (etcd_watcher watcher, etcd_event *ev, int timeout_ms)
+{
+        etcd_watcher_t  *w      = watcher;
+        etcd_result     res     = ETCD_TIMEOUT;
+        struct timespec deadline;
+        int             rc      = 0;
+        USE_ALLOCATOR(&w->session->alloc);
+
+        __atomic_add_fetch(&w->users,1,__ATOMIC_SEQ_CST);
+
+        if (timeout_ms > 0) {
+                deadline_after_ms(&deadline,timeout_ms);
+        }
+
+        for (;;) {
+                if (watcher_stopping(w)) {
+                        res = ETCD_WTF;
+                        break;
+                }
+                if (ring_get(w,ev)) {
+                        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                        if (__atomic_load_n(&w->blocked,__ATOMIC_SEQ_CST)) {
+                                pthread_mutex_lock(&w->lock);
+                                pthread_cond_signal(&w->room);
+                                pthread_mutex_unlock(&w->lock);
+                        }
+                        res = ETCD_OK;
+                        break;
+                }
+                if (!timeout_ms || (rc == ETIMEDOUT)) {
+                        break;
+                }
+                pthread_mutex_lock(&w->lock);
+                __atomic_add_fetch(&w->waiters,1,__ATOMIC_SEQ_CST);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (ring_empty(w) && !watcher_stopping(w)) {
+                        if (timeout_ms < 0) {
+                                pthread_cond_wait(&w->ready,&w->lock);
+                        }
+                        else {
+                                rc = pthread_cond_timedwait(&w->ready,&w->lock,
+                                                            &deadline);
+                        }
+                }
+                __atomic_sub_fetch(&w->waiters,1,__ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&w->lock);
+        }
+
+        __atomic_sub_fetch(&w->users,1,__ATOMIC_SEQ_CST);
+        return res;
+}
+
+
+void
+etcd_watcher_stop (etcd_watcher watcher)
+{
+        etcd_watcher_t  *w      = watcher;
+        etcd_event      ev;
+        USE_ALLOCATOR(&w->session->alloc);
+
+        pthread_mutex_lock(&w->lock);
+        __atomic_store_n(&w->stop,1,__ATOMIC_RELEASE);
+        pthread_cond_broadcast(&w->room);
+        pthread_cond_broadcast(&w->ready);
+        pthread_mutex_unlock(&w->lock);
+
+        /* The watch in progress will notice within a second or so. */
+        pthread_join(w->thread,NULL);
+
+        while (__atomic_load_n(&w->users,__ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&w->lock);
+                pthread_cond_broadcast(&w->ready);
+                pthread_mutex_unlock(&w->lock);
+                sched_yield();
+        }
+
+        while (ring_get(w,&ev)) {
+                e_free(ev.key);
+                e_free(ev.value);
+        }
+
+        pthread_cond_destroy(&w->room);
+        pthread_cond_destroy(&w->ready);
+        pthread_mutex_destroy(&w->lock);
+        kmap_free(&w->known);
+        e_free(w->cells);
+        e_free(w->pfx);
+        e_free(w);
+}
+
+
+static size_t
+parse_set_response (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+        yajl_val        node;
+        yajl_val        value;
+        etcd_result     res     = ETCD_PROTOCOL_ERROR;
+        /*
+         * Success responses contain prevValue and index.  Failure responses
+         * contain errorCode and cause.  Among all these, index seems to be the
+         * one we're most likely to need later, so look for that.
+         */
+        static const char       *path[] = { "node", "modifiedIndex", NULL };
+
+        node = yajl_tree_parse(ptr,NULL,0);
+        if (node) {
+                value = my_yajl_tree_get(node,path,yajl_t_number);
+                if (value) {
+                        res = ETCD_OK;
+                }
+                else if (error_code(node) == EC_TEST_FAILED) {
+                        res = ETCD_PRECOND_FAILED;
+                }
+                yajl_tree_free(node);
+        }
+
+        *((etcd_result *)stream) = res;
+        return size*nmemb;
+}
+
+static size_t
+parse_lock_response (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+        *((char **)stream) = e_strdup(ptr);
+        return size*nmemb;
+}
+
+
+/* 
+ * There are two use cases, based on is_lock.
+ *
+ * If is_lock is null, we use the "keys" namespace.  A null value means an
+ * HTTP DELETE; precond and ttl are both ignored.  Otherwise we're setting a
+ * value, with *optional* precond and ttl.
+ *
+ * If is_lock is set, we use the "locks" namespace.  A null value means an
+ * HTTP DELETE as before, and we still ignore ttl as before, but now precond
+ * must be set to represent the lock index.  Otherwise ttl must be present,
+ * and we decide what to do based on precond.  If it's null, this is an
+ * initial lock so we use an HTTP POST.  Otherwise it's a renewal so we use
+ * an HTTP PUT instead.
+ */
+static etcd_result
+etcd_set_one (_etcd_session *session, etcd_members *members, const char *key,
+              const char *value, const char *precond, unsigned int ttl,
+              etcd_server *srv, char **is_lock)
+{
+        char                    *url = NULL;
+        char                    *contents       = NULL;
+        CURL                    *curl           = NULL;
+        etcd_result             res             = ETCD_WTF;
+        CURLcode                curl_res;
+        void                    *err_label      = &&done;
+        char                    *namespace = NULL;
+        char                    *http_cmd = NULL;
+        char                    *orig_index = NULL;
+        etcd_trace              trace;
+        etcd_trace_cb           *trace_cb;
+        void                    *trace_arg;
+        curl_callback_t         *write_cb;
+        void                    *write_data;
+        etcd_stat_op            stat_op;
+        char                    *escaped;
+        int                     len;
+
+        if (is_lock) {
+          namespace = (char *)"mod/v2/lock";
+                if (value) {
+                        if (!ttl) {
+                                /* Lock/renew must specify ttl. */
+                                return ETCD_WTF;
+                        }
+                        http_cmd = precond ? (char *)"PUT" : (char *)"POST";
+                }
+                else {
+                        if (!precond) {
+                                /* Unlock must specify index. */
+                                return ETCD_WTF;
+                        }
+                        http_cmd = (char *)"DELETE";
+                }
+                orig_index = *is_lock;
+        }
+        else {
+                namespace = (char *)"v2/keys";
+                http_cmd = value ? (char *)"PUT" : (char *)"DELETE";
+        }
+
+        if (e_asprintf(&url,"http://%s:%u/%s/%s",
+                       SRV_URL_HOST(srv),SRV_URL_PORT(srv),namespace,key) < 0) {
+                goto *err_label;
+        }
+        err_label = &&free_url;
+
+        if (is_lock) {
+                if (precond) {
+                        if (e_asprintf(&contents,"index=%s",precond) < 0) {
+                                goto *err_label;
+                        }
+                        err_label = &&free_contents;
+                }
+                if (ttl) {
+                        if (contents) {
+                                char *c2;
+                                if (e_asprintf(&c2,"ttl=%u;%s",ttl,
+                                               contents) < 0) {
+                                        goto *err_label;
+                                }
+                                e_free(contents);
+                                contents = c2;
+                        }
+                        else {
+                                if (e_asprintf(&contents,"ttl=%u",ttl) < 0) {
+                                        goto *err_label;
+                                }
+                        }
+                        err_label = &&free_contents;
+                }
+        }
+        else {
+                /* Both go in the form, so see url_escape. */
+                if (value) {
+                        escaped = url_escape(value);
+                        if (!escaped) {
+                                goto *err_label;
+                        }
+                        len = e_asprintf(&contents,"value=%s",escaped);
+                        e_free(escaped);
+                        if (len < 0) {
+                                goto *err_label;
+                        }
+                        err_label = &&free_contents;
+                }
+                if (precond) {
+                        char *c2;
+                        escaped = url_escape(precond);
+                        if (!escaped) {
+                                goto *err_label;
+                        }
+                        len = e_asprintf(&c2,"%s;prevValue=%s",contents,
+                                         escaped);
+                        e_free(escaped);
+                        if (len < 0) {
+                                goto *err_label;
+                        }
+                        e_free(contents);
+                        contents = c2;
+                        err_label = &&free_contents;
+                }
+                if (ttl) {
+                        char *c2;
+                        if (e_asprintf(&c2,"%s;ttl=%u",contents,ttl) < 0) {
+                                goto *err_label;
+                        }
+                        e_free(contents);
+                        contents = c2;
+                        err_label = &&free_contents;
+                }
+        }
+
+        if (is_lock && value && !precond) {
+                /* Only do this for an initial lock, not a renewal. */
+                write_cb = parse_lock_response;
+                write_data = is_lock;
+        }
+        else {
+                write_cb = parse_set_response;
+                write_data = &res;
+        }
+        stat_op = is_lock ? ETCD_STAT_LOCK
+                : value ? ETCD_STAT_SET : ETCD_STAT_DELETE;
+
+        if (SRV_IS_SIDECAR(srv)) {
+                /* curl stays NULL, which curl_easy_cleanup doesn't mind. */
+                curl_res = sidecar_perform(session,members,srv,stat_op,
+                                           http_cmd,url,contents,write_cb,
+                                           write_data,NULL,NULL);
+                goto performed;
+        }
+
+        curl = curl_easy_init();
+        if (!curl) {
+                goto *err_label;
+        }
+        err_label = &&cleanup_curl;
+
+        /* TBD: add error checking for these */
+        curl_easy_setopt(curl,CURLOPT_CUSTOMREQUEST,http_cmd);
+        curl_easy_setopt(curl,CURLOPT_URL,url);
+        server_transport(curl,srv);
+        curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1L);
+        curl_easy_setopt(curl,CURLOPT_POSTREDIR,CURL_REDIR_POST_ALL);
+        curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,write_cb);
+        curl_easy_setopt(curl,CURLOPT_WRITEDATA,write_data);
+
+        /*
+         * CURLOPT_HTTPPOST would be easier, but it looks like etcd will barf on
+         * that.  Sigh.
+         */
+        if (contents) {
+                curl_easy_setopt(curl,CURLOPT_POST,1L);
+                curl_easy_setopt(curl,CURLOPT_POSTFIELDS,contents);
+        }
+#if defined(DEBUG)
+        curl_easy_setopt(curl,CURLOPT_VERBOSE,1L);
+#endif
+
+        trace_cb = trace_begin(session,members,&trace,http_cmd,url,srv,
+                               &trace_arg);
+        curl_res = curl_easy_perform(curl);
+        if (trace_cb) {
+                trace_end(trace_cb,trace_arg,&trace,curl,curl_res);
+        }
+        stats_record(session,members,srv,stat_op,curl,curl_res != CURLE_OK);
+performed:
+        if (curl_res != CURLE_OK) {
+                print_curl_error("perform",curl_res);
+                goto *err_label;
+        }
+
+        if (is_lock && value) {
+                if (!precond) {
+                        /*
+                         * If this is an initial lock, parse_lock_response would
+                         * have been unable to set "res" for us.  Instead, we
+                         * set it here if the index string got updated.
+                         */
+                        if (*is_lock != orig_index) {
+                                res = ETCD_OK;
+                        }
+                }
+                else {
+                        /*
+                         * If this is a lock renewal, then a successful call
+                         * will pass through neither parse_lock_response nor
+                         * parse_get_response.  The curl response code alone
+                         * is sufficient.
+                         */
+                        res = ETCD_OK;
+                }
+        }
+
+        /*
+         * If the request succeeded, or at least got to the server and failed
+         * there, parse_set_response should have set res appropriately.
+         */
+
+cleanup_curl:
+        curl_easy_cleanup(curl);
+free_contents:
+        e_free(contents); /* might already be NULL for delete, but that's OK */
+free_url:
+        e_free(url);
+done:
+        return res;
+}
+
+
+static etcd_result
+etcd_set_direct (_etcd_session *session, char *key, char *value,
+                 char *precond, unsigned int ttl)
+{
+        etcd_server     *srv;
+        etcd_result     res = ETCD_WTF;
+        USE_MEMBERS(session,members);
+
+        for (srv = members->servers; srv->host; ++srv) {
+                res = etcd_set_one(session,members,key,value,precond,ttl,
+                                   srv,NULL);
+                /*
+                 * Precondition failures, and protocol errors which are likely
+                 * to be much the same, won't be helped by retrying on another
+                 * server.
+                 */
+                if ((res == ETCD_OK) || (res == ETCD_PROTOCOL_ERROR) ||
+                    (res == ETCD_PRECOND_FAILED)) {
+                        return res;
+                }
+        }
+
+        return ETCD_WTF;
+}
+
+
+/*
+ * This uses the same path and status checks as SET, but with a different HTTP
+ * command instead of data.  Precondition and TTL are obviously not used in
+ * this case; a conditional delete goes through etcd_write instead (see
+ * etcd_cad).  I think you can get a timed delete by doing a conditional set
+ * to the current value with a TTL, but I haven't actually tried it.
+ */
+static etcd_result
+etcd_delete_direct (_etcd_session *session, char *key)
+{
+        etcd_server     *srv;
+        etcd_result     res        = ETCD_WTF;
+        USE_MEMBERS(session,members);
+
+        for (srv = members->servers; srv->host; ++srv) {
+                res = etcd_set_one(session,members,key,NULL,NULL,0,srv,
+                                   NULL);
+                if (res == ETCD_OK) {
+                        break;
+                }
+        }
+
+        return res;
+}
+
+
+/*
+ * Write combining.  Plain sets go into a table instead of to the server, and
+ * a later set of the same key just replaces the value there.  A background
+ * thread writes out whatever's in the table every combine_ms, using a batch,
+ * so each key costs at most one write per window no matter how often it's
+ * set.  Anything that can't be combined (a conditional set, a delete, or an
+ * explicit etcd_set_now) holds flush_lock so it can't overtake or be
+ * overtaken by a flush, and deals with any pending value for its key first.
+ * Entries taken out of the table for something that then fails go back in
+ * with combine_put_back, except where the key has been set again since.
+ */
+static void
+combine_put_back (_etcd_session *session, etcd_kent *list)
+{
+        etcd_kent       **link;
+        etcd_kent       *next;
+
+        pthread_mutex_lock(&session->combine_lock);
+        for (; list; list = next) {
+                next = list->next;
+                link = kmap_link(&session->pending,list->key);
+                if (*link) {
+                        e_free(list->value);
+                        e_free(list);
+                }
+                else {
+                        list->next = NULL;
+                        *link = list;
+                        ++session->pending.count;
+                }
+        }
+        pthread_mutex_unlock(&session->combine_lock);
+}
+
+
+static void
+combine_free_list (etcd_kent *list)
+{
+        etcd_kent       *next;
+
+        for (; list; list = next) {
+                next = list->next;
+                e_free(list->value);
+                e_free(list);
+        }
+}
+
+
+static etcd_result
+combine_flush (_etcd_session *session)
+{
+        etcd_kmap       old;
+        etcd_kent       **link;
+        etcd_kent       *ent;
+        etcd_kent       *retry  = NULL;
+        etcd_result     res     = ETCD_OK;
+        etcd_result     op_res;
+        size_t          i;
+        int             op_num;
+
+        pthread_mutex_lock(&session->flush_lock);
+
+        pthread_mutex_lock(&session->combine_lock);
+        old = session->pending;
+        if (kmap_init(&session->pending) != 0) {
+                /* Can't swap, so leave it all for the next try. */
+                session->pending = old;
+                pthread_mutex_unlock(&session->combine_lock);
+                pthread_mutex_unlock(&session->flush_lock);
+                return ETCD_WTF;
+        }
+        pthread_mutex_unlock(&session->combine_lock);
+
+        if (old.count) {
+                for (i = 0; i < old.nbuckets; ++i) {
+                        for (ent = old.buckets[i]; ent; ent = ent->next) {
+                                /* Once out of memory, stop adding. */
+                                if ((res == ETCD_OK) &&
+                                    (etcd_batch_set(session->combine_batch,
+                                                    ent->key,ent->value,NULL,
+                                                    ent->ttl) < 0)) {
+                                        res = ETCD_WTF;
+                                }
+                        }
+                }
+                if (etcd_batch_submit(session->combine_batch,0) != ETCD_OK) {
+                        res = ETCD_PROTOCOL_ERROR;
+                }
+                /*
+                 * Anything that didn't get written goes back in the table
+                 * for the next window, except where the server turned it
+                 * down (which it would just do again).  Ops were added in
+                 * table order, so walking it again lines them back up, and
+                 * any we never got to add are out of range so they count
+                 * as failed.
+                 */
+                op_num = 0;
+                for (i = 0; i < old.nbuckets; ++i) {
+                        link = &old.buckets[i];
+                        while ((ent = *link) != NULL) {
+                                op_res = etcd_batch_result(
+                                                session->combine_batch,
+                                                op_num++,NULL,NULL);
+                                if ((op_res == ETCD_OK) ||
+                                    (op_res == ETCD_PROTOCOL_ERROR)) {
+                                        link = &ent->next;
+                                        continue;
+                                }
+                                *link = ent->next;
+                                ent->next = retry;
+                                retry = ent;
+                        }
+                }
+                etcd_batch_clear(session->combine_batch);
+                combine_put_back(session,retry);
+        }
+        kmap_free(&old);
+
+        pthread_mutex_unlock(&session->flush_lock);
+        return res;
+}
+
+
+static void *
+combine_main (void *arg)
+{
+        _etcd_session   *session        = arg;
+        struct timespec deadline;
+        etcd_result     res;
+        int             stop;
+
+        cur_alloc = &session->alloc;
+        do {
+                pthread_mutex_lock(&session->combine_lock);
+                deadline_after_ms(&deadline,session->combine_ms);
+                if (!session->combine_stop) {
+                        (void)pthread_cond_timedwait(&session->combine_cond,
+                                                     &session->combine_lock,
+                                                     &deadline);
+                }
+                stop = session->combine_stop;
+                pthread_mutex_unlock(&session->combine_lock);
+
+                res = combine_flush(session);
+                pthread_mutex_lock(&session->combine_lock);
+                session->combine_res = res;
+                pthread_mutex_unlock(&session->combine_lock);
+        } while (!stop);
+
+        return NULL;
+}
+
+
+etcd_result
+etcd_set_combine (etcd_session session_as_void, unsigned int window_ms)
+{
+        _etcd_session   *session        = session_as_void;
+        int             running;
+        USE_ALLOCATOR(&session->alloc);
+
+        pthread_mutex_lock(&session->combine_lock);
+        running = (session->combine_ms != 0);
+        if (running && window_ms) {
+                /* Just a change of window, which the thread will pick up. */
+                session->combine_ms = window_ms;
+                pthread_mutex_unlock(&session->combine_lock);
+                return ETCD_OK;
+        }
+        pthread_mutex_unlock(&session->combine_lock);
+
+        if (running) {
+                /* The thread does one last flush on its way out. */
+                pthread_mutex_lock(&session->combine_lock);
+                session->combine_stop = 1;
+                pthread_cond_signal(&session->combine_cond);
+                pthread_mutex_unlock(&session->combine_lock);
+                pthread_join(session->combine_thread,NULL);
+                pthread_mutex_lock(&session->combine_lock);
+                session->combine_ms = 0;
+                pthread_mutex_unlock(&session->combine_lock);
+                kmap_free(&session->pending);
+                etcd_batch_free(session->combine_batch);
+                return session->combine_res;
+        }
+
+        if (!window_ms) {
+                return ETCD_OK;
+        }
+
+        if (kmap_init(&session->pending) != 0) {
+                return ETCD_WTF;
+        }
+        session->combine_batch = etcd_batch_create(session);
+        if (!session->combine_batch) {
+                kmap_free(&session->pending);
+                return ETCD_WTF;
+        }
+        session->combine_stop = 0;
+        session->combine_res = ETCD_OK;
+        session->combine_ms = window_ms;
+        if (pthread_create(&session->combine_thread,NULL,combine_main,
+                           session) != 0) {
+                session->combine_ms = 0;
+                etcd_batch_free(session->combine_batch);
+                kmap_free(&session->pending);
+                return ETCD_WTF;
+        }
+
+        return ETCD_OK;
+}
+
+
+etcd_result
+etcd_flush (etcd_session session_as_void)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res;
+        USE_ALLOCATOR(&session->alloc);
+
+        pthread_mutex_lock(&session->combine_lock);
+        res = session->combine_res;
+        session->combine_res = ETCD_OK;
+        if (!session->combine_ms) {
+                pthread_mutex_unlock(&session->combine_lock);
+                return ETCD_OK;
+        }
+        pthread_mutex_unlock(&session->combine_lock);
+
+        /* Report a failure from the background too, but only once. */
+        if (combine_flush(session) != ETCD_OK) {
+                res = ETCD_PROTOCOL_ERROR;
+        }
+        return res;
+}
+
+
+/*
+ * Returns 1 if the value went into the table, 0 if combining is off so the
+ * caller should just go ahead, or -1 if we ran out of memory.
+ */
+static int
+combine_set (_etcd_session *session, char *key, char *value, unsigned int ttl)
+{
+        etcd_kent       *ent;
+        char            *copy   = NULL;
+        int             res     = 1;
+
+        pthread_mutex_lock(&session->combine_lock);
+        if (!session->combine_ms || session->combine_stop) {
+                /* Off, or on the way to being off. */
+                res = 0;
+        }
+        else if (!(copy = e_strdup(value)) ||
+                 !(ent = kmap_put(&session->pending,key))) {
+                e_free(copy);
+                res = -1;
+        }
+        else {
+                e_free(ent->value);
+                ent->value = copy;
+                ent->ttl = ttl;
+        }
+        pthread_mutex_unlock(&session->combine_lock);
+
+        return res;
+}
+
+
+/*
+ * Take a key's pending entry (if any) out of the table, to be handed to
+ * combine_put_back or combine_free_list once the caller knows whether what
+ * it was for worked.  Returns 0 if combining is off, in which case
+ * flush_lock isn't held; otherwise 1, with flush_lock held until the caller
+ * calls combine_done.
+ */
+static int
+combine_take (_etcd_session *session, char *key, etcd_kent **entp)
+{
+        etcd_kent       **link;
+
+        *entp = NULL;
+        pthread_mutex_lock(&session->combine_lock);
+        if (!session->combine_ms) {
+                pthread_mutex_unlock(&session->combine_lock);
+                return 0;
+        }
+        pthread_mutex_unlock(&session->combine_lock);
+
+        pthread_mutex_lock(&session->flush_lock);
+        pthread_mutex_lock(&session->combine_lock);
+        if (session->combine_ms) {
+                link = kmap_link(&session->pending,key);
+                if (*link) {
+                        *entp = *link;
+                        *link = (*entp)->next;
+                        (*entp)->next = NULL;
+                        --session->pending.count;
+                }
+        }
+        pthread_mutex_unlock(&session->combine_lock);
+
+        return 1;
+}
+
+
+/*
+ * The same for a whole subtree, handing back everything pending at or under
+ * dir as a list.  The caller decides what happens to it: see combine_put_back
+ * and combine_free_list.
+ */
+static int
+combine_take_dir (_etcd_session *session, const char *dir,
+                  etcd_kent **listp)
+{
+        etcd_kent       **link;
+        etcd_kent       *ent;
+        size_t          len     = strlen(dir);
+        size_t          i;
+
+        *listp = NULL;
+        pthread_mutex_lock(&session->combine_lock);
+        if (!session->combine_ms) {
+                pthread_mutex_unlock(&session->combine_lock);
+                return 0;
+        }
+        pthread_mutex_unlock(&session->combine_lock);
+
+        pthread_mutex_lock(&session->flush_lock);
+        pthread_mutex_lock(&session->combine_lock);
+        if (session->combine_ms) {
+                for (i = 0; i < session->pending.nbuckets; ++i) {
+                        link = &session->pending.buckets[i];
+                        while ((ent = *link) != NULL) {
+                                if (!strncmp(ent->key,dir,len) &&
+                                    (!ent->key[len] || ent->key[len] == '/')) {
+                                        *link = ent->next;
+                                        ent->next = *listp;
+                                        *listp = ent;
+                                        --session->pending.count;
+                                }
+                                else {
+                                        link = &ent->next;
+                                }
+                        }
+                }
+        }
+        pthread_mutex_unlock(&session->combine_lock);
+
+        return 1;
+}
+
+
+static void
+combine_done (_etcd_session *session)
+{
+        pthread_mutex_unlock(&session->flush_lock);
+}
+
+
+etcd_result
+etcd_set (etcd_session session_as_void, char *key, char *value,
+          char *precond, unsigned int ttl)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res;
+        etcd_kent       *pending;
+        int             combining;
+        USE_ALLOCATOR(&session->alloc);
+
+        if (!precond) {
+                switch (combine_set(session,key,value,ttl)) {
+                case 1:
+                        return ETCD_OK;
+                case -1:
+                        return ETCD_WTF;
+                default:
+                        return etcd_set_direct(session,key,value,NULL,ttl);
+                }
+        }
+
+        /*
+         * The caller's precondition is about the last value they set, so
+         * that had better actually be there before we check it.
+         */
+        combining = combine_take(session,key,&pending);
+        if (pending) {
+                res = etcd_set_direct(session,key,pending->value,NULL,
+                                      pending->ttl);
+                if (res != ETCD_OK) {
+                        combine_put_back(session,pending);
+                        combine_done(session);
+                        return res;
+                }
+                combine_free_list(pending);
+        }
+        res = etcd_set_direct(session,key,value,precond,ttl);
+        if (combining) {
+                combine_done(session);
+        }
+        return res;
+}
+
+
+etcd_result
+etcd_set_now (etcd_session session_as_void, char *key, char *value,
+              char *precond, unsigned int ttl)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res;
+        etcd_kent       *pending;
+        int             combining;
+        USE_ALLOCATOR(&session->alloc);
+
+        if (precond) {
+                return etcd_set(session,key,value,precond,ttl);
+        }
+
+        /* Anything pending for this key is superseded. */
+        combining = combine_take(session,key,&pending);
+        combine_free_list(pending);
+        res = etcd_set_direct(session,key,value,NULL,ttl);
+        if (combining) {
+                combine_done(session);
+        }
+        return res;
+}
+
+
+etcd_result
+etcd_delete (etcd_session session_as_void, char *key)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res;
+        etcd_kent       *pending;
+        int             combining;
+        USE_ALLOCATOR(&session->alloc);
+
+        /* Until the delete has happened, the pending value still counts. */
+        combining = combine_take(session,key,&pending);
+        res = etcd_delete_direct(session,key);
+        if ((res == ETCD_OK) || (res == ETCD_NOT_FOUND)) {
+                combine_free_list(pending);
+        }
+        else if (pending) {
+                combine_put_back(session,pending);
+        }
+        if (combining) {
+                combine_done(session);
+        }
+        return res;
+}
+
+
+/*
+ * A more general write in the keys namespace than etcd_set_one, for newer
+ * calls that need to send arbitrary parameters and care about what comes
+ * back.  Parameters that etcd only looks for in the URL (e.g. for DELETE) go
+ * in query, and the rest go in contents.  Either can be NULL.
+ */
+typedef struct {
+        int             parsed;
+        int             error_code;
+        etcd_index      modified_index;
+        char            *key;           /* which matters for in-order POSTs */
+} etcd_write_t;
+
+static size_t
+parse_write_response (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+        etcd_write_t    *write  = stream;
+        yajl_val        root;
+        yajl_val        node;
+        yajl_val        value;
+
+        root = yajl_tree_parse(ptr,NULL,0);
+        if (!root) {
+                return size*nmemb;
+        }
+
+        write->parsed = 1;
+        write->error_code = error_code(root);
+        node = my_yajl_tree_get(root,node_path,yajl_t_object);
+        if (node) {
+                write->modified_index = node_index(node,"modifiedIndex");
+                value = node_field(node,"key",yajl_t_string);
+                if (value) {
+                        write->key = e_strdup(MY_YAJL_GET_STRING(value));
+                }
+        }
+
+        yajl_tree_free(root);
+        return size*nmemb;
+}
+
+
+static etcd_result
+write_result (etcd_write_t *write)
+{
+        if (!write->parsed) {
+                return ETCD_PROTOCOL_ERROR;
+        }
+        if (write->error_code == EC_KEY_NOT_FOUND) {
+                return ETCD_NOT_FOUND;
+        }
+        if ((write->error_code == EC_TEST_FAILED) ||
+            (write->error_code == EC_NODE_EXIST)) {
+                return ETCD_PRECOND_FAILED;
+        }
+        if (write->error_code) {
+                return ETCD_PROTOCOL_ERROR;
+        }
+        return ETCD_OK;
+}
+
+
+static etcd_result
+etcd_write_url (_etcd_session *session, etcd_members *members,
+                etcd_server *srv, const char *method, const char *url,
+                const char *contents, etcd_write_t *write)
+{
+        CURL            *curl           = NULL;
+        CURLcode        curl_res;
+        etcd_result     res             = ETCD_WTF;
+        void            *err_label      = &&done;
+        etcd_response   rsp;
+        etcd_trace      trace;
+        etcd_trace_cb   *trace_cb;
+        void            *trace_arg;
+        etcd_stat_op    stat_op;
+
+        memset(&rsp,0,sizeof(rsp));
+        memset(write,0,sizeof(*write));
+        stat_op = strcmp(method,"DELETE") ? ETCD_STAT_SET : ETCD_STAT_DELETE;
+
+        if (SRV_IS_SIDECAR(srv)) {
+                /* No handle, so the cleanup below has nothing to do. */
+                curl_res = sidecar_perform(session,members,srv,stat_op,method,
+                                           url,contents,collect_body,&rsp,
+                                           NULL,NULL);
+                goto performed;
+        }
+
+        curl = session_curl(session);
+        if (!curl) {
+                goto *err_label;
+        }
+        err_label = &&cleanup_curl;
+
+        /* TBD: add error checking for these */
+        curl_easy_setopt(curl,CURLOPT_CUSTOMREQUEST,method);
+        curl_easy_setopt(curl,CURLOPT_URL,url);
+        server_transport(curl,srv);
+        curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1L);
+        curl_easy_setopt(curl,CURLOPT_POSTREDIR,CURL_REDIR_POST_ALL);
+        curl_easy_setopt(curl,CURLOPT_NOSIGNAL,1L);
+        curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,collect_body);
+        curl_easy_setopt(curl,CURLOPT_WRITEDATA,&rsp);
+        if (contents) {
+                curl_easy_setopt(curl,CURLOPT_POST,1L);
+                curl_easy_setopt(curl,CURLOPT_POSTFIELDS,contents);
+        }
+#if defined(DEBUG)
+        curl_easy_setopt(curl,CURLOPT_VERBOSE,1L);
+#endif
+
+        trace_cb = trace_begin(session,members,&trace,method,url,srv,
+                               &trace_arg);
+        curl_res = curl_easy_perform(curl);
+        if (trace_cb) {
+                trace_end(trace_cb,trace_arg,&trace,curl,curl_res);
+        }
+        stats_record(session,members,srv,stat_op,curl,curl_res != CURLE_OK);
+performed:
+        if (curl_res != CURLE_OK) {
+                print_curl_error("perform",curl_res);
+                goto *err_label;
+        }
+
+        if (rsp.len) {
+                parse_write_response(rsp.data,1,rsp.len,write);
+        }
+        res = write_result(write);
+
+cleanup_curl:
+        session_curl_done(session,curl);
+done:
+        e_free(rsp.data);
+        return res;
+}
+
+
+static etcd_result
+etcd_write_one (_etcd_session *session, etcd_members *members,
+                etcd_server *srv, const char *method, const char *key,
+                const char *query, const char *contents, etcd_write_t *write)
+{
+        char            *url;
+        etcd_result     res;
+
+        memset(write,0,sizeof(*write));
+        if (e_asprintf(&url,"http://%s:%u/v2/keys/%s%s%s",SRV_URL_HOST(srv),
+                       SRV_URL_PORT(srv),key,query?"?":"",query?query:"") < 0) {
+                return ETCD_WTF;
+        }
+
+        res = etcd_write_url(session,members,srv,method,url,contents,write);
+        e_free(url);
+        return res;
+}
+
+
+/*
+ * Only a failure to talk to a server at all is worth retrying on the next
+ * one.  Anything the server actually said will be the same everywhere.
+ */
+static etcd_result
+etcd_write (_etcd_session *session, const char *method, const char *key,
+            const char *query, const char *contents, etcd_write_t *write)
+{
+        etcd_server     *srv;
+        etcd_result     res     = ETCD_WTF;
+        USE_MEMBERS(session,members);
+
+        memset(write,0,sizeof(*write));
+        for (srv = members->servers; srv->host; ++srv) {
+                res = etcd_write_one(session,members,srv,method,key,query,
+                                     contents,write);
+                if (res != ETCD_WTF) {
+                        break;
+                }
+        }
+
+        return res;
+}
+
+
+/*
+ * etcd will only skip notifying watchers if we use refresh=true, which in
+ * turn requires that we *not* send a value, and it's only legal for a key
+ * that already exists, hence prevExist.
+ */
+etcd_result
+etcd_refresh_ttl (etcd_session session_as_void, char *key, unsigned int ttl,
+                  etcd_index *prev_index)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res;
+        etcd_write_t    write;
+        char            *contents;
+        int             len;
+        USE_ALLOCATOR(&session->alloc);
+
+        if (prev_index && *prev_index) {
+                len = e_asprintf(&contents,
+                                 "ttl=%u;refresh=true;prevExist=true;"
+                                 "prevIndex=%"PRIu64,ttl,*prev_index);
+        }
+        else {
+                len = e_asprintf(&contents,"ttl=%u;refresh=true;prevExist=true",
+                                 ttl);
+        }
+        if (len < 0) {
+                return ETCD_WTF;
+        }
+
+        res = etcd_write(session,"PUT",key,NULL,contents,&write);
+        if ((res == ETCD_OK) && prev_index) {
+                *prev_index = write.modified_index;
+        }
+        e_free(write.key);
+
+        e_free(contents);
+        return res;
+}
+
+
+etcd_result
+etcd_cas (etcd_session session_as_void, char *key, char *value,
+          etcd_index *prev_index, unsigned int ttl)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res;
+        etcd_write_t    write;
+        char            *e_value;
+        char            *contents;
+        char            ttl_str[16]     = "";
+        etcd_kent       *pending;
+        int             combining;
+        int             len;
+        USE_ALLOCATOR(&session->alloc);
+
+        e_value = url_escape(value);
+        if (!e_value) {
+                return ETCD_WTF;
+        }
+        if (ttl) {
+                snprintf(ttl_str,sizeof(ttl_str),";ttl=%u",ttl);
+        }
+        if (*prev_index) {
+                len = e_asprintf(&contents,"value=%s;prevIndex=%"PRIu64"%s",
+                                 e_value,*prev_index,ttl_str);
+        }
+        else {
+                len = e_asprintf(&contents,"value=%s;prevExist=false%s",
+                                 e_value,ttl_str);
+        }
+        e_free(e_value);
+        if (len < 0) {
+                return ETCD_WTF;
+        }
+
+        /* As for etcd_set with a precondition. */
+        combining = combine_take(session,key,&pending);
+        if (pending) {
+                res = etcd_set_direct(session,key,pending->value,NULL,
+                                      pending->ttl);
+                if (res != ETCD_OK) {
+                        combine_put_back(session,pending);
+                        combine_done(session);
+                        e_free(contents);
+                        return res;
+                }
+                combine_free_list(pending);
+        }
+        res = etcd_write(session,"PUT",key,NULL,contents,&write);
+        if (combining) {
+                combine_done(session);
+        }
+
+        if (res == ETCD_OK) {
+                *prev_index = write.modified_index;
+        }
+        e_free(write.key);
+
+        e_free(contents);
+        return res;
+}
+
+
+/*
+ * Subtrees.  A recursive delete is one request, and one event for watchers,
+ * however many keys it takes away, and a directory with a TTL takes its
+ * whole subtree with it when it expires.  "how" is recursive=true or
+ * dir=true, which etcd only looks for in the query string.  There's no
+ * conditional version because etcd won't do a compareAndDelete on a
+ * directory.
+ */
+static etcd_result
+etcd_delete_tree (_etcd_session *session, char *key, const char *how)
+{
+        etcd_result     res             = ETCD_OK;
+        etcd_write_t    write;
+        etcd_kent       *pending;
+        etcd_kent       *ent;
+        int             combining;
+
+        combining = combine_take_dir(session,key,&pending);
+
+        /*
+         * A recursive delete would take pending writes away with everything
+         * else, but dir=true only works on an empty directory, so they have
+         * to get there first for it to fail the way it should.
+         */
+        if (strcmp(how,"recursive=true")) {
+                while ((ent = pending) != NULL) {
+                        res = etcd_set_direct(session,ent->key,ent->value,NULL,
+                                              ent->ttl);
+                        if (res != ETCD_OK) {
+                                break;
+                        }
+                        pending = ent->next;
+                        e_free(ent->value);
+                        e_free(ent);
+                }
+        }
+
+        if (res == ETCD_OK) {
+                res = etcd_write(session,"DELETE",key,how,NULL,&write);
+                e_free(write.key);
+        }
+
+        /* As in etcd_delete, only a delete that happened drops them. */
+        if ((res == ETCD_OK) || (res == ETCD_NOT_FOUND)) {
+                combine_free_list(pending);
+        }
+        else if (pending) {
+                combine_put_back(session,pending);
+        }
+        if (combining) {
+                combine_done(session);
+        }
+
+        return res;
+}
+
+
+etcd_result
+etcd_delete_prefix (etcd_session session_as_void, char *pfx)
+{
+        _etcd_session   *session        = session_as_void;
+        USE_ALLOCATOR(&session->alloc);
+
+        return etcd_delete_tree(session,pfx,"recursive=true");
+}
+
+
+etcd_result
+etcd_rmdir (etcd_session session_as_void, char *key)
+{
+        _etcd_session   *session        = session_as_void;
+        USE_ALLOCATOR(&session->alloc);
+
+        return etcd_delete_tree(session,key,"dir=true");
+}
+
+
+etcd_result
+etcd_cad (etcd_session session_as_void, char *key, etcd_index *prev_index)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res;
+        etcd_write_t    write;
+        char            query[32];
+        etcd_kent       *pending;
+        int             combining;
+        USE_ALLOCATOR(&session->alloc);
+
+        snprintf(query,sizeof(query),"prevIndex=%"PRIu64,*prev_index);
+
+        /* As for etcd_cas. */
+        combining = combine_take(session,key,&pending);
+        if (pending) {
+                res = etcd_set_direct(session,key,pending->value,NULL,
+                                      pending->ttl);
+                if (res != ETCD_OK) {
+                        combine_put_back(session,pending);
+                        combine_done(session);
+                        return res;
+                }
+                combine_free_list(pending);
+        }
+        res = etcd_write(session,"DELETE",key,query,NULL,&write);
+        if (combining) {
+                combine_done(session);
+        }
+
+        if (res == ETCD_OK) {
+                *prev_index = write.modified_index;
+        }
+        e_free(write.key);
+
+        return res;
+}
+
+
+etcd_result
+etcd_mkdir (etcd_session session_as_void, char *key, unsigned int ttl)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res;
+        etcd_write_t    write;
+        char            contents[64];
+        USE_ALLOCATOR(&session->alloc);
+
+        if (ttl) {
+                snprintf(contents,sizeof(contents),
+                         "dir=true;prevExist=false;ttl=%u",ttl);
+        }
+        else {
+                snprintf(contents,sizeof(contents),"dir=true;prevExist=false");
+        }
+
+        res = etcd_write(session,"PUT",key,NULL,contents,&write);
+        e_free(write.key);
+        return res;
+}
+
+/*
+ * Prepared keys.  Everything in a key's URL except the server part is worked
+ * out once, in etcd_key_prepare, and each server's "http://host:port/" once
+ * per member list (see members_new), so a request just glues the two together
+ * on the stack.  Keeping the server part with the members means a handle
+ * can't go stale when discovery changes them.  The handle also remembers the
+ * highest modifiedIndex it has seen, which is where etcd_key_watch picks up.
+ */
+typedef struct {
+        _etcd_session   *session;
+        char            *key;           /* as the caller gave it */
+        char            *path;          /* "v2/keys/" and the escaped key */
+        size_t          path_len;
+        etcd_index      index;          /* highest modifiedIndex seen */
+} etcd_key_t;
+
+#define KEY_URL_SIZE    256
+
+/* Uses buf if the URL fits, so only free the result if it's something else. */
+static char *
+key_url (etcd_key_t *k, etcd_members *members, etcd_server *srv,
+         const char *query, char *buf)
+{
+        const char      *base   = members->bases[srv-members->servers];
+        size_t          b_len   = strlen(base);
+        size_t          q_len   = query ? strlen(query) : 0;
+        char            *url    = buf;
+
+        if (b_len+k->path_len+q_len >= KEY_URL_SIZE) {
+                url = e_malloc(b_len+k->path_len+q_len+1);
+                if (!url) {
+                        return NULL;
+                }
+        }
+        memcpy(url,base,b_len);
+        memcpy(url+b_len,k->path,k->path_len);
+        if (query) {
+                memcpy(url+b_len+k->path_len,query,q_len);
+        }
+        url[b_len+k->path_len+q_len] = '\0';
+        return url;
+}
+
+
+static void
+key_url_done (char *url, char *buf)
+{
+        if (url != buf) {
+                e_free(url);
+        }
+}
+
+
+static void
+key_saw (etcd_key_t *k, etcd_index index)
+{
+        etcd_index      old     = __atomic_load_n(&k->index,__ATOMIC_RELAXED);
+
+        while ((index > old) &&
+               !__atomic_compare_exchange_n(&k->index,&old,index,0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+        }
+}
+
+
+etcd_key
+etcd_key_prepare (etcd_session session_as_void, char *key)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_key_t      *k;
+        char            *escaped;
+        int             len;
+        USE_ALLOCATOR(&session->alloc);
+
+        k = e_calloc(1,sizeof(*k));
+        if (!k) {
+                return NULL;
+        }
+        k->session = session;
+
+        k->key = e_strdup(key);
+        escaped = escape_keeping(key,"-._~/");
+        if (!k->key || !escaped) {
+                goto fail;
+        }
+        len = e_asprintf(&k->path,"v2/keys/%s",escaped);
+        e_free(escaped);
+        if (len < 0) {
+                e_free(k->key);
+                e_free(k);
+                return NULL;
+        }
+        k->path_len = len;
+        return k;
+
+fail:
+        e_free(escaped);
+        e_free(k->key);
+        e_free(k);
+        return NULL;
+}
+
+
+void
+etcd_key_free (etcd_key key_as_void)
+{
+        etcd_key_t      *k      = key_as_void;
+
+        if (!k) {
+                return;
+        }
+
+        USE_ALLOCATOR(&k->session->alloc);
+        e_free(k->path);
+        e_free(k->key);
+        e_free(k);
+}
+
+
+etcd_index
+etcd_key_index (etcd_key key_as_void)
+{
+        etcd_key_t      *k      = key_as_void;
+
+        return __atomic_load_n(&k->index,__ATOMIC_RELAXED);
+}
+
+
+/* Same as etcd_get, except for the URL and remembering the index. */
+char *
+etcd_key_get (etcd_key key_as_void)
+{
+        etcd_key_t      *k              = key_as_void;
+        _etcd_session   *session        = k->session;
         etcd_server     *srv;
-        etcd_result     res = ETCD_WTF;
+        etcd_result     res;
+        etcd_node       node;
+        etcd_get_t      get;
+        char            buf[KEY_URL_SIZE];
+        char            *url;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
+
+        for (srv = members->servers; srv->host; ++srv) {
+                url = key_url(k,members,srv,NULL,buf);
+                if (!url) {
+                        return NULL;
+                }
+                memset(&node,0,sizeof(node));
+                memset(&get,0,sizeof(get));
+                get.node = &node;
+                res = etcd_get_url(session,members,url,srv,ETCD_STAT_GET,NULL,
+                                   parse_get_ex_response,(char **)&get,NULL);
+                key_url_done(url,buf);
+                if ((res == ETCD_OK) && !get.error_code && node.value) {
+                        key_saw(k,node.modified_index);
+                        return node.value;
+                }
+                e_free(node.value);
+        }
+
+        return NULL;
+}
+
+
+etcd_result
+etcd_key_set (etcd_key key_as_void, char *value, char *precond,
+              unsigned int ttl)
+{
+        etcd_key_t      *k              = key_as_void;
+        _etcd_session   *session        = k->session;
+        etcd_server     *srv;
+        etcd_result     res             = ETCD_WTF;
+        etcd_write_t    write;
+        char            *e_value;
+        char            *e_precond      = NULL;
+        char            *contents;
+        char            ttl_str[16]     = "";
+        char            buf[KEY_URL_SIZE];
+        char            *url;
+        int             len;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
+
+        /* Combining goes by key name, so let etcd_set keep things in order. */
+        if (__atomic_load_n(&session->combine_ms,__ATOMIC_RELAXED)) {
+                return etcd_set(session,k->key,value,precond,ttl);
+        }
+
+        e_value = url_escape(value);
+        if (!e_value) {
+                return ETCD_WTF;
+        }
+        if (precond) {
+                e_precond = url_escape(precond);
+                if (!e_precond) {
+                        e_free(e_value);
+                        return ETCD_WTF;
+                }
+        }
+        if (ttl) {
+                snprintf(ttl_str,sizeof(ttl_str),";ttl=%u",ttl);
+        }
+        len = e_asprintf(&contents,"value=%s%s%s%s",e_value,
+                         e_precond ? ";prevValue=" : "",
+                         e_precond ? e_precond : "",ttl_str);
+        e_free(e_precond);
+        e_free(e_value);
+        if (len < 0) {
+                return ETCD_WTF;
+        }
+
+        for (srv = members->servers; srv->host; ++srv) {
+                url = key_url(k,members,srv,NULL,buf);
+                if (!url) {
+                        break;
+                }
+                res = etcd_write_url(session,members,srv,"PUT",url,contents,
+                                     &write);
+                key_url_done(url,buf);
+                e_free(write.key);
+                if (res != ETCD_WTF) {
+                        break;
+                }
+        }
+        e_free(contents);
+
+        if (res == ETCD_OK) {
+                key_saw(k,write.modified_index);
+        }
+        else if (res == ETCD_NOT_FOUND) {
+                /* A prevValue on a missing key, which etcd_set reports so. */
+                res = ETCD_PROTOCOL_ERROR;
+        }
+        return res;
+}
+
+
+etcd_result
+etcd_key_watch (etcd_key key_as_void, char **valuep,
+                etcd_index *index_in, etcd_index *index_out)
+{
+        etcd_key_t      *k              = key_as_void;
+        _etcd_session   *session        = k->session;
+        etcd_server     *srv;
+        etcd_result     res             = ETCD_WTF;
+        etcd_watch_t    watch;
+        etcd_index      wait;
+        char            query[64];
+        char            buf[KEY_URL_SIZE];
+        char            *url;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
+
+        if (index_in) {
+                wait = *index_in;
+        }
+        else {
+                wait = etcd_key_index(k);
+                if (wait) {
+                        ++wait;
+                }
+        }
+        if (wait) {
+                snprintf(query,sizeof(query),"?wait=true&waitIndex=%"PRIu64,
+                         wait);
+        }
+        else {
+                strcpy(query,"?wait=true");
+        }
+
+        memset(&watch,0,sizeof(watch));
+        for (srv = members->servers; srv->host; ++srv) {
+                url = key_url(k,members,srv,query,buf);
+                if (!url) {
+                        break;
+                }
+                memset(&watch,0,sizeof(watch));
+                res = etcd_get_url(session,members,url,srv,ETCD_STAT_WATCH,
+                                   NULL,parse_watch_response,(char **)&watch,
+                                   NULL);
+                key_url_done(url,buf);
+                if (res == ETCD_OK) {
+                        if (watch.error_code == EC_INDEX_CLEARED) {
+                                res = ETCD_INDEX_CLEARED;
+                        }
+                        else if (watch.error_code) {
+                                res = ETCD_PROTOCOL_ERROR;
+                        }
+                        break;
+                }
+        }
+
+        e_free(watch.key);
+        if (res != ETCD_OK) {
+                e_free(watch.value);
+                return res;
+        }
+
+        key_saw(k,watch.index_out);
+        if (valuep) {
+                *valuep = watch.value;
+        }
+        else {
+                e_free(watch.value);
+        }
+        if (index_out) {
+                *index_out = watch.index_out;
+        }
+        return ETCD_OK;
+}
+
+/*
+ * Batches.  Each operation remembers everything needed to (re)issue it,
+ * because a connection failure means trying again on the next server, and
+ * then holds its results until the caller comes to collect them.  The curl
+ * multi handle and the easy handles outlive any one submission, so that
+ * connections stay warm across etcd_batch_clear.
+ */
+typedef enum {
+        BATCH_GET,
+        BATCH_SET,
+        BATCH_DELETE,
+        BATCH_RENEW                     /* lock renewal, for leases */
+} etcd_batch_type;
+
+static const etcd_stat_op       batch_stat_ops[] = {
+        ETCD_STAT_GET, ETCD_STAT_SET, ETCD_STAT_DELETE, ETCD_STAT_LOCK
+};
+
+static const char               *batch_methods[] = {
+        "GET", "PUT", "DELETE", "PUT"
+};
+
+typedef struct {
+        etcd_batch_type type;
+        char            *key;
+        char            *contents;      /* form data for a set or renewal */
+        etcd_server     *srv;           /* where we're trying now */
+        CURL            *curl;          /* while in flight */
+        etcd_response   rsp;
+        long            status;         /* HTTP response code */
+        etcd_result     res;
+        char            *value;         /* for a get */
+        etcd_index      index;
+} etcd_batch_op;
+
+typedef struct {
+        _etcd_session   *session;
+        etcd_batch_op   *ops;
+        size_t          num_ops;
+        size_t          max_ops;
+        CURLM           *multi;
+        CURL            **idle;         /* easy handles ready for reuse */
+        size_t          num_idle;
+        size_t          max_idle;
+        size_t          num_curls;      /* how many we've created */
+} etcd_batch_t;
+
+etcd_batch
+etcd_batch_create (etcd_session session_as_void)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_batch_t    *batch;
+        USE_ALLOCATOR(&session->alloc);
+
+        batch = e_calloc(1,sizeof(*batch));
+        if (!batch) {
+                return NULL;
+        }
+
+        batch->multi = curl_multi_init();
+        if (!batch->multi) {
+                e_free(batch);
+                return NULL;
+        }
+
+        batch->session = session_as_void;
+        return batch;
+}
+
+
+static etcd_batch_op *
+batch_add (etcd_batch_t *batch, etcd_batch_type type, const char *key)
+{
+        etcd_batch_op   *ops;
+        etcd_batch_op   *op;
+        size_t          max_ops;
+
+        if (batch->num_ops == batch->max_ops) {
+                max_ops = batch->max_ops ? batch->max_ops * 2 : 64;
+                ops = e_realloc(batch->ops,max_ops*sizeof(*ops));
+                if (!ops) {
+                        return NULL;
+                }
+                batch->ops = ops;
+                batch->max_ops = max_ops;
+        }
+
+        op = &batch->ops[batch->num_ops];
+        memset(op,0,sizeof(*op));
+        op->type = type;
+        op->res = ETCD_WTF;
+        op->key = e_strdup(key);
+        if (!op->key) {
+                return NULL;
+        }
+
+        ++batch->num_ops;
+        return op;
+}
+
+
+int
+etcd_batch_get (etcd_batch batch_as_void, char *key)
+{
+        etcd_batch_t    *batch  = batch_as_void;
+        USE_ALLOCATOR(&batch->session->alloc);
+
+        if (!batch_add(batch,BATCH_GET,key)) {
+                return -1;
+        }
+        return (int)(batch->num_ops - 1);
+}
+
+
+int
+etcd_batch_set (etcd_batch batch_as_void, char *key, char *value,
+                char *precond, unsigned int ttl)
+{
+        etcd_batch_t    *batch  = batch_as_void;
+        etcd_batch_op   *op;
+        char            *e_value;
+        char            *e_precond      = NULL;
+        char            ttl_str[16]     = "";
+        int             len;
+        USE_ALLOCATOR(&batch->session->alloc);
+
+        e_value = url_escape(value);
+        if (!e_value) {
+                return -1;
+        }
+        if (precond) {
+                e_precond = url_escape(precond);
+                if (!e_precond) {
+                        e_free(e_value);
+                        return -1;
+                }
+        }
+        if (ttl) {
+                snprintf(ttl_str,sizeof(ttl_str),";ttl=%u",ttl);
+        }
+
+        op = batch_add(batch,BATCH_SET,key);
+        if (op) {
+                len = e_asprintf(&op->contents,"value=%s%s%s%s",e_value,
+                                 e_precond ? ";prevValue=" : "",
+                                 e_precond ? e_precond : "",ttl_str);
+                if (len < 0) {
+                        op->contents = NULL;
+                        e_free(op->key);
+                        --batch->num_ops;
+                        op = NULL;
+                }
+        }
+
+        e_free(e_precond);
+        e_free(e_value);
+        return op ? (int)(batch->num_ops - 1) : -1;
+}
+
+
+int
+etcd_batch_delete (etcd_batch batch_as_void, char *key)
+{
+        etcd_batch_t    *batch  = batch_as_void;
+        USE_ALLOCATOR(&batch->session->alloc);
+
+        if (!batch_add(batch,BATCH_DELETE,key)) {
+                return -1;
+        }
+        return (int)(batch->num_ops - 1);
+}
+
+
+static etcd_result
+batch_start (etcd_batch_t *batch, etcd_batch_op *op)
+{
+        CURL            *curl;
+        char            *url;
+
+        if (batch->num_idle) {
+                curl = batch->idle[--batch->num_idle];
+                curl_easy_reset(curl);
+        }
+        else {
+                curl = curl_easy_init();
+                if (!curl) {
+                        return ETCD_WTF;
+                }
+                ++batch->num_curls;
+        }
+
+        if (e_asprintf(&url,"http://%s:%u/%s/%s",SRV_URL_HOST(op->srv),
+                       SRV_URL_PORT(op->srv),
+                       (op->type == BATCH_RENEW) ? "mod/v2/lock" : "v2/keys",
+                       op->key) < 0) {
+                batch->idle[batch->num_idle++] = curl;
+                return ETCD_WTF;
+        }
+
+        /* TBD: add error checking for these */
+        curl_easy_setopt(curl,CURLOPT_URL,url);
+        server_transport(curl,op->srv);
+        curl_easy_setopt(curl,CURLOPT_CUSTOMREQUEST,batch_methods[op->type]);
+        curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1L);
+        curl_easy_setopt(curl,CURLOPT_POSTREDIR,CURL_REDIR_POST_ALL);
+        curl_easy_setopt(curl,CURLOPT_NOSIGNAL,1L);
+        curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,collect_body);
+        curl_easy_setopt(curl,CURLOPT_WRITEDATA,&op->rsp);
+        curl_easy_setopt(curl,CURLOPT_PRIVATE,op);
+        if (op->contents) {
+                curl_easy_setopt(curl,CURLOPT_POST,1L);
+                curl_easy_setopt(curl,CURLOPT_POSTFIELDS,op->contents);
+        }
+#if defined(DEBUG)
+        curl_easy_setopt(curl,CURLOPT_VERBOSE,1L);
+#endif
+
+        /* curl copies the URL, so we don't need to keep it. */
+        e_free(url);
+
+        op->rsp.len = 0;
+        op->curl = curl;
+        if (curl_multi_add_handle(batch->multi,curl) != CURLM_OK) {
+                op->curl = NULL;
+                batch->idle[batch->num_idle++] = curl;
+                return ETCD_WTF;
+        }
+
+        return ETCD_OK;
+}
+
+
+static void
+batch_finish (etcd_batch_op *op)
+{
+        etcd_get_t      get;
+        etcd_node       node;
+        etcd_write_t    write;
+
+        if (op->type == BATCH_GET) {
+                memset(&get,0,sizeof(get));
+                memset(&node,0,sizeof(node));
+                get.node = &node;
+                if (op->rsp.len) {
+                        parse_get_ex_response(op->rsp.data,1,op->rsp.len,&get);
+                }
+                if (get.error_code == EC_KEY_NOT_FOUND) {
+                        op->res = ETCD_NOT_FOUND;
+                }
+                else if (!get.parsed || get.error_code) {
+                        op->res = ETCD_PROTOCOL_ERROR;
+                }
+                else {
+                        op->res = node.value ? ETCD_OK : ETCD_WTF;
+                }
+                op->value = node.value;
+                op->index = node.modified_index;
+        }
+        else if (op->type == BATCH_RENEW) {
+                /* The lock module doesn't say much, but it does say no. */
+                op->res = ((op->status / 100) == 2) ? ETCD_OK
+                                                    : ETCD_PROTOCOL_ERROR;
+        }
+        else {
+                memset(&write,0,sizeof(write));
+                if (op->rsp.len) {
+                        parse_write_response(op->rsp.data,1,op->rsp.len,
+                                             &write);
+                }
+                op->res = write_result(&write);
+                op->index = write.modified_index;
+                e_free(write.key);
+        }
+
+        e_free(op->rsp.data);
+        memset(&op->rsp,0,sizeof(op->rsp));
+}
+
+
+/*
+ * A sidecar already multiplexes for us, so there's nothing to gain from
+ * keeping its ops in flight together; each one just runs to completion.
+ */
+static etcd_result
+batch_sidecar (etcd_batch_t *batch, etcd_members *members, etcd_batch_op *op)
+{
+        char            *url;
+        CURLcode        curl_res;
+
+        if (e_asprintf(&url,"http://%s:%u/%s/%s",SRV_URL_HOST(op->srv),
+                       SRV_URL_PORT(op->srv),
+                       (op->type == BATCH_RENEW) ? "mod/v2/lock" : "v2/keys",
+                       op->key) < 0) {
+                return ETCD_WTF;
+        }
+
+        op->rsp.len = 0;
+        curl_res = sidecar_perform(batch->session,members,op->srv,
+                                   batch_stat_ops[op->type],
+                                   batch_methods[op->type],url,op->contents,
+                                   collect_body,&op->rsp,NULL,&op->status);
+        e_free(url);
+        if (curl_res != CURLE_OK) {
+                print_curl_error("batch",curl_res);
+                return ETCD_WTF;
+        }
+
+        batch_finish(op);
+        return ETCD_OK;
+}
+
+
+/*
+ * Start op on the first server from op->srv onward that will take it, and
+ * return whether it's now in flight.  It might instead have finished
+ * already, on a sidecar, or failed everywhere.
+ */
+static int
+batch_start_any (etcd_batch_t *batch, etcd_members *members,
+                 etcd_batch_op *op)
+{
+        for (; op->srv->host; ++op->srv) {
+                if (SRV_IS_SIDECAR(op->srv)) {
+                        if (batch_sidecar(batch,members,op) == ETCD_OK) {
+                                return 0;
+                        }
+                }
+                else if (batch_start(batch,op) == ETCD_OK) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+
+etcd_result
+etcd_batch_submit (etcd_batch batch_as_void, unsigned int window)
+{
+        etcd_batch_t    *batch  = batch_as_void;
+        etcd_batch_op   *op;
+        CURL            **idle;
+        CURLMsg         *msg;
+        size_t          next    = 0;
+        size_t          active  = 0;
+        size_t          i;
+        int             running;
+        int             left;
+        etcd_result     res     = ETCD_OK;
+        USE_ALLOCATOR(&batch->session->alloc);
+        USE_MEMBERS(batch->session,members);
+
+        if (!window) {
+                window = DEFAULT_BATCH_WINDOW;
+        }
+        if ((batch->num_curls + window) > batch->max_idle) {
+                /* Room for every handle we could possibly end up with. */
+                idle = e_realloc(batch->idle,(batch->num_curls+window)*
+                                             sizeof(*idle));
+                if (!idle) {
+                        return ETCD_WTF;
+                }
+                batch->idle = idle;
+                batch->max_idle = batch->num_curls + window;
+        }
+        curl_multi_setopt(batch->multi,CURLMOPT_MAXCONNECTS,(long)window);
+        curl_multi_setopt(batch->multi,CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                          (long)window);
+
+        while ((next < batch->num_ops) || active) {
+                while ((active < window) && (next < batch->num_ops)) {
+                        op = &batch->ops[next++];
+                        if (op->res == ETCD_OK) {
+                                /* Already done in an earlier submission. */
+                                continue;
+                        }
+                        op->res = ETCD_WTF;
+                        op->srv = members->servers;
+                        active += batch_start_any(batch,members,op);
+                }
+
+                curl_multi_perform(batch->multi,&running);
+
+                while ((msg = curl_multi_info_read(batch->multi,&left))) {
+                        if (msg->msg != CURLMSG_DONE) {
+                                continue;
+                        }
+                        curl_easy_getinfo(msg->easy_handle,CURLINFO_PRIVATE,
+                                          (char **)&op);
+                        curl_easy_getinfo(msg->easy_handle,
+                                          CURLINFO_RESPONSE_CODE,&op->status);
+                        stats_record(batch->session,members,op->srv,
+                                     batch_stat_ops[op->type],op->curl,
+                                     msg->data.result != CURLE_OK);
+                        curl_multi_remove_handle(batch->multi,op->curl);
+                        batch->idle[batch->num_idle++] = op->curl;
+                        op->curl = NULL;
+                        --active;
+
+                        if (msg->data.result == CURLE_OK) {
+                                batch_finish(op);
+                                continue;
+                        }
+                        print_curl_error("batch",msg->data.result);
+                        /* Same as the blocking calls: try the next server. */
+                        ++op->srv;
+                        active += batch_start_any(batch,members,op);
+                }
+
+                if (active) {
+                        curl_multi_poll(batch->multi,NULL,0,1000,NULL);
+                }
+        }
+
+        for (i = 0; i < batch->num_ops; ++i) {
+                if (batch->ops[i].res != ETCD_OK) {
+                        res = batch->ops[i].res;
+                        break;
+                }
+        }
+
+        return res;
+}
+
+
+size_t
+etcd_batch_count (etcd_batch batch_as_void)
+{
+        return ((etcd_batch_t *)batch_as_void)->num_ops;
+}
+
+
+etcd_result
+etcd_batch_result (etcd_batch batch_as_void, int op_num, char **valuep,
+                   etcd_index *index)
+{
+        etcd_batch_t    *batch  = batch_as_void;
+        etcd_batch_op   *op;
+        USE_ALLOCATOR(&batch->session->alloc);
+
+        if ((op_num < 0) || ((size_t)op_num >= batch->num_ops)) {
+                return ETCD_WTF;
+        }
+        op = &batch->ops[op_num];
+
+        if (valuep) {
+                *valuep = op->value;
+                op->value = NULL;
+        }
+        if (index) {
+                *index = op->index;
+        }
+
+        return op->res;
+}
+
+
+void
+etcd_batch_clear (etcd_batch batch_as_void)
+{
+        etcd_batch_t    *batch  = batch_as_void;
+        etcd_batch_op   *op;
+        size_t          i;
+        USE_ALLOCATOR(&batch->session->alloc);
+
+        for (i = 0; i < batch->num_ops; ++i) {
+                op = &batch->ops[i];
+                e_free(op->key);
+                e_free(op->contents);
+                e_free(op->value);
+                e_free(op->rsp.data);
+        }
+        batch->num_ops = 0;
+}
+
+
+void
+etcd_batch_free (etcd_batch batch_as_void)
+{
+        etcd_batch_t    *batch  = batch_as_void;
+        USE_ALLOCATOR(&batch->session->alloc);
+
+        etcd_batch_clear(batch);
+        while (batch->num_idle) {
+                curl_easy_cleanup(batch->idle[--batch->num_idle]);
+        }
+        curl_multi_cleanup(batch->multi);
+        e_free(batch->idle);
+        e_free(batch->ops);
+        e_free(batch);
+}
+
+
+/*
+ * Event-loop integration.  Asynchronous requests share one curl multi handle
+ * per session, driven through curl's multi_socket interface, so the
+ * application's loop does all the waiting and we only ever run inside one of
+ * its calls.  Each request remembers enough to move on to the next server,
+ * the same as a batch operation does.
+ */
+typedef enum {
+        ASYNC_GET,
+        ASYNC_SET,
+        ASYNC_DELETE,
+        ASYNC_WATCH,
+        ASYNC_LOCK,                     /* including renewal */
+        ASYNC_UNLOCK,
+        ASYNC_RAW                       /* see etcd_async_request */
+} etcd_async_type;
+
+static const etcd_stat_op       async_stat_ops[] = {
+        ETCD_STAT_GET, ETCD_STAT_SET, ETCD_STAT_DELETE, ETCD_STAT_WATCH,
+        ETCD_STAT_LOCK, ETCD_STAT_LOCK, ETCD_STAT_OTHER
+};
+
+typedef struct etcd_async_op {
+        struct etcd_async_op    *next;
+        struct etcd_async_op    *prev;
+        _etcd_session           *session;
+        etcd_async_type         type;
+        const char              *method;
+        const char              *ns;            /* v2/keys or mod/v2/lock */
+        char                    *key;
+        char                    *path;          /* key plus any query */
+        char                    *contents;      /* form data */
+        etcd_members            *members;       /* held until we're done */
+        etcd_server             *srv;           /* where we're trying now */
+        CURL                    *curl;
+        etcd_response           rsp;
+        long                    status;         /* HTTP response code */
+        etcd_async_cb           *cb;
+        etcd_async_raw_cb       *raw_cb;        /* instead, for ASYNC_RAW */
+        void                    *arg;
+        etcd_trace              trace;
+        etcd_trace_cb           *trace_cb;
+        void                    *trace_arg;
+} etcd_async_op;
+
+
+static int
+loop_socket (CURL *curl, curl_socket_t fd, int what, void *userp,
+             void *socketp)
+{
+        _etcd_session   *session        = userp;
+        int             events          = 0;
+
+        if (what == CURL_POLL_REMOVE) {
+                events = ETCD_POLL_REMOVE;
+        }
+        else {
+                if (what & CURL_POLL_IN) {
+                        events |= ETCD_POLL_IN;
+                }
+                if (what & CURL_POLL_OUT) {
+                        events |= ETCD_POLL_OUT;
+                }
+        }
+        session->socket_cb(session->loop_arg,(int)fd,events);
+        return 0;
+}
+
+
+static int
+loop_timer (CURLM *multi, long timeout_ms, void *userp)
+{
+        _etcd_session   *session        = userp;
+
+        session->timer_cb(session->loop_arg,timeout_ms);
+        return 0;
+}
+
+
+etcd_result
+etcd_session_set_loop (etcd_session session_as_void,
+                       etcd_socket_cb *socket_cb, etcd_timer_cb *timer_cb,
+                       void *arg)
+{
+        _etcd_session   *session        = session_as_void;
+
+        if (session->loop_multi || !socket_cb || !timer_cb) {
+                return ETCD_WTF;
+        }
+        session->loop_multi = curl_multi_init();
+        if (!session->loop_multi) {
+                return ETCD_WTF;
+        }
+        session->socket_cb = socket_cb;
+        session->timer_cb = timer_cb;
+        session->loop_arg = arg;
+
+        curl_multi_setopt(session->loop_multi,CURLMOPT_SOCKETFUNCTION,
+                          loop_socket);
+        curl_multi_setopt(session->loop_multi,CURLMOPT_SOCKETDATA,session);
+        curl_multi_setopt(session->loop_multi,CURLMOPT_TIMERFUNCTION,
+                          loop_timer);
+        curl_multi_setopt(session->loop_multi,CURLMOPT_TIMERDATA,session);
+        return ETCD_OK;
+}
+
+
+static etcd_result
+async_start (etcd_async_op *op)
+{
+        _etcd_session   *session        = op->session;
+        char            *url;
+
+        if (SRV_IS_SIDECAR(op->srv)) {
+                /* The blocking sidecar protocol has no place in a loop. */
+                return ETCD_WTF;
+        }
+
+        if (op->curl) {
+                curl_easy_reset(op->curl);
+        }
+        else {
+                op->curl = curl_easy_init();
+                if (!op->curl) {
+                        return ETCD_WTF;
+                }
+        }
+
+        if (e_asprintf(&url,"http://%s:%u/%s%s%s",SRV_URL_HOST(op->srv),
+                       SRV_URL_PORT(op->srv),op->ns,*op->ns ? "/" : "",
+                       op->path) < 0) {
+                return ETCD_WTF;
+        }
+
+        /* TBD: add error checking for these */
+        curl_easy_setopt(op->curl,CURLOPT_URL,url);
+        server_transport(op->curl,op->srv);
+        curl_easy_setopt(op->curl,CURLOPT_CUSTOMREQUEST,op->method);
+        curl_easy_setopt(op->curl,CURLOPT_FOLLOWLOCATION,1L);
+        curl_easy_setopt(op->curl,CURLOPT_POSTREDIR,CURL_REDIR_POST_ALL);
+        curl_easy_setopt(op->curl,CURLOPT_NOSIGNAL,1L);
+        curl_easy_setopt(op->curl,CURLOPT_WRITEFUNCTION,collect_body);
+        curl_easy_setopt(op->curl,CURLOPT_WRITEDATA,&op->rsp);
+        curl_easy_setopt(op->curl,CURLOPT_HEADERFUNCTION,collect_header);
+        curl_easy_setopt(op->curl,CURLOPT_HEADERDATA,&op->rsp);
+        curl_easy_setopt(op->curl,CURLOPT_PRIVATE,op);
+        if (op->contents) {
+                curl_easy_setopt(op->curl,CURLOPT_POST,1L);
+                curl_easy_setopt(op->curl,CURLOPT_POSTFIELDS,op->contents);
+        }
+#if defined(DEBUG)
+        curl_easy_setopt(op->curl,CURLOPT_VERBOSE,1L);
+#endif
+
+        op->rsp.len = 0;
+        op->rsp.etcd_index = 0;
+        op->trace_cb = trace_begin(session,op->members,&op->trace,op->method,
+                                   url,op->srv,&op->trace_arg);
+        e_free(url);
+
+        if (curl_multi_add_handle(session->loop_multi,op->curl) != CURLM_OK) {
+                if (op->trace_cb) {
+                        trace_end(op->trace_cb,op->trace_arg,&op->trace,
+                                  op->curl,CURLE_FAILED_INIT);
+                }
+                return ETCD_WTF;
+        }
+        return ETCD_OK;
+}
+
+
+/* Try servers from op->srv on, until one of them takes. */
+static etcd_result
+async_start_any (etcd_async_op *op)
+{
+        for (; op->srv->host; ++op->srv) {
+                if (async_start(op) == ETCD_OK) {
+                        return ETCD_OK;
+                }
+        }
+        return ETCD_WTF;
+}
+
+
+static void
+async_free (etcd_async_op *op)
+{
+        _etcd_session   *session        = op->session;
+
+        if (op->prev) {
+                op->prev->next = op->next;
+        }
+        else {
+                session->async_ops = op->next;
+        }
+        if (op->next) {
+                op->next->prev = op->prev;
+        }
+
+        if (op->curl) {
+                curl_easy_cleanup(op->curl);
+        }
+        members_put(op->members);
+        e_free(op->key);
+        e_free(op->path);
+        e_free(op->contents);
+        e_free(op->rsp.data);
+        e_free(op);
+}
+
+
+/* Decode the response, call back, and get rid of the request. */
+static void
+async_finish (etcd_async_op *op, etcd_result res)
+{
+        etcd_event      ev;
+        etcd_get_t      get;
+        etcd_node       node;
+        etcd_write_t    write;
+        etcd_watch_t    watch;
+
+        if (op->type == ASYNC_RAW) {
+                op->raw_cb(op->arg,res,op->status,op->rsp.etcd_index,
+                           op->rsp.len ? op->rsp.data : "",op->rsp.len);
+                async_free(op);
+                return;
+        }
+
+        memset(&ev,0,sizeof(ev));
+        memset(&node,0,sizeof(node));
+        memset(&write,0,sizeof(write));
+        memset(&watch,0,sizeof(watch));
+        ev.key = op->key;
+
+        if (res != ETCD_OK) {
+                /* Nothing to decode. */
+        }
+        else if (op->type == ASYNC_GET) {
+                memset(&get,0,sizeof(get));
+                get.node = &node;
+                if (op->rsp.len) {
+                        parse_get_ex_response(op->rsp.data,1,op->rsp.len,&get);
+                }
+                if (get.error_code == EC_KEY_NOT_FOUND) {
+                        res = ETCD_NOT_FOUND;
+                }
+                else if (!get.parsed || get.error_code) {
+                        res = ETCD_PROTOCOL_ERROR;
+                }
+                else if (!node.value) {
+                        res = ETCD_WTF;
+                }
+                ev.value = node.value;
+                ev.index = node.modified_index;
+        }
+        else if ((op->type == ASYNC_LOCK) || (op->type == ASYNC_UNLOCK)) {
+                /* The lock module doesn't say much, but it does say no. */
+                if ((op->status / 100) != 2) {
+                        res = ETCD_PROTOCOL_ERROR;
+                }
+                else if ((op->type == ASYNC_LOCK) && op->rsp.len) {
+                        ev.value = op->rsp.data;
+                }
+        }
+        else if (op->type == ASYNC_WATCH) {
+                if (op->rsp.len) {
+                        parse_watch_response(op->rsp.data,1,op->rsp.len,
+                                             &watch);
+                }
+                if (watch.error_code == EC_INDEX_CLEARED) {
+                        res = ETCD_INDEX_CLEARED;
+                }
+                else if (watch.error_code || !watch.key) {
+                        res = ETCD_PROTOCOL_ERROR;
+                }
+                else {
+                        ev.key = watch.key;
+                        ev.value = watch.deleted ? NULL : watch.value;
+                        ev.index = watch.index_out;
+                        ev.is_dir = watch.is_dir;
+                        ev.deleted = watch.deleted;
+                }
+        }
+        else {
+                if (op->rsp.len) {
+                        parse_write_response(op->rsp.data,1,op->rsp.len,
+                                             &write);
+                }
+                res = write_result(&write);
+                if (write.key) {
+                        ev.key = write.key;
+                }
+                ev.index = write.modified_index;
+        }
+
+        op->cb(op->arg,res,&ev);
+
+        e_free(node.value);
+        e_free(write.key);
+        e_free(watch.key);
+        e_free(watch.value);
+        async_free(op);
+}
+
+
+static void
+async_done (etcd_async_op *op, CURLcode curl_res)
+{
+        _etcd_session   *session        = op->session;
+
+        if (op->trace_cb) {
+                trace_end(op->trace_cb,op->trace_arg,&op->trace,op->curl,
+                          curl_res);
+        }
+        curl_easy_getinfo(op->curl,CURLINFO_RESPONSE_CODE,&op->status);
+        stats_record(session,op->members,op->srv,async_stat_ops[op->type],
+                     op->curl,curl_res != CURLE_OK);
+        curl_multi_remove_handle(session->loop_multi,op->curl);
+
+        if (curl_res == CURLE_OK) {
+                async_finish(op,ETCD_OK);
+                return;
+        }
+        print_curl_error("async",curl_res);
+        /* Same as the blocking calls: try the next server. */
+        ++op->srv;
+        if (async_start_any(op) != ETCD_OK) {
+                async_finish(op,ETCD_WTF);
+        }
+}
+
+
+static void
+async_check (_etcd_session *session)
+{
+        CURLMsg         *msg;
+        etcd_async_op   *op;
+        int             left;
+
+        while ((msg = curl_multi_info_read(session->loop_multi,&left))) {
+                if (msg->msg != CURLMSG_DONE) {
+                        continue;
+                }
+                curl_easy_getinfo(msg->easy_handle,CURLINFO_PRIVATE,
+                                  (char **)&op);
+                async_done(op,msg->data.result);
+        }
+}
+
+
+void
+etcd_session_on_fd_ready (etcd_session session_as_void, int fd, int what)
+{
+        _etcd_session   *session        = session_as_void;
+        int             mask            = 0;
+        int             running;
+        USE_ALLOCATOR(&session->alloc);
+
+        if (what & ETCD_POLL_IN) {
+                mask |= CURL_CSELECT_IN;
+        }
+        if (what & ETCD_POLL_OUT) {
+                mask |= CURL_CSELECT_OUT;
+        }
+        if (what & ETCD_POLL_ERR) {
+                mask |= CURL_CSELECT_ERR;
+        }
+        curl_multi_socket_action(session->loop_multi,fd,mask,&running);
+        async_check(session);
+}
+
+
+void
+etcd_session_on_timeout (etcd_session session_as_void)
+{
+        _etcd_session   *session        = session_as_void;
+        int             running;
+        USE_ALLOCATOR(&session->alloc);
+
+        curl_multi_socket_action(session->loop_multi,CURL_SOCKET_TIMEOUT,0,
+                                 &running);
+        async_check(session);
+}
+
+
+/* Takes ownership of contents, even on failure. */
+static etcd_result
+async_submit (_etcd_session *session, etcd_async_type type,
+              const char *method, const char *key, const char *query,
+              char *contents, etcd_async_cb *cb, etcd_async_raw_cb *raw_cb,
+              void *arg)
+{
+        etcd_async_op   *op;
+        int             len;
+
+        if (!session->loop_multi || !(cb || raw_cb)) {
+                e_free(contents);
+                return ETCD_WTF;
+        }
+        op = e_calloc(1,sizeof(*op));
+        if (!op) {
+                e_free(contents);
+                return ETCD_WTF;
+        }
+        op->session = session;
+        op->type = type;
+        op->method = method;
+        op->ns = (type == ASYNC_RAW) ? ""
+               : (type >= ASYNC_LOCK) ? "mod/v2/lock" : "v2/keys";
+        op->contents = contents;
+        op->cb = cb;
+        op->raw_cb = raw_cb;
+        op->arg = arg;
+        op->members = members_get(session);
+        op->srv = op->members->servers;
+        op->key = e_strdup(key);
+        len = e_asprintf(&op->path,"%s%s",key,query ? query : "");
+        if (len < 0) {
+                op->path = NULL;
+        }
+
+        op->next = session->async_ops;
+        if (op->next) {
+                op->next->prev = op;
+        }
+        session->async_ops = op;
+
+        if (!op->key || !op->path || (async_start_any(op) != ETCD_OK)) {
+                async_free(op);
+                return ETCD_WTF;
+        }
+        return ETCD_OK;
+}
+
+
+etcd_result
+etcd_async_get (etcd_session session_as_void, char *key, etcd_async_cb *cb,
+                void *arg)
+{
+        _etcd_session   *session        = session_as_void;
+        USE_ALLOCATOR(&session->alloc);
+
+        return async_submit(session,ASYNC_GET,"GET",key,NULL,NULL,cb,NULL,
+                            arg);
+}
+
+
+etcd_result
+etcd_async_set (etcd_session session_as_void, char *key, char *value,
+                char *precond, unsigned int ttl, etcd_async_cb *cb, void *arg)
+{
+        _etcd_session   *session        = session_as_void;
+        char            *e_value;
+        char            *e_precond      = NULL;
+        char            *contents;
+        char            ttl_str[16]     = "";
+        int             len;
+        USE_ALLOCATOR(&session->alloc);
+
+        e_value = url_escape(value);
+        if (!e_value) {
+                return ETCD_WTF;
+        }
+        if (precond) {
+                e_precond = url_escape(precond);
+                if (!e_precond) {
+                        e_free(e_value);
+                        return ETCD_WTF;
+                }
+        }
+        if (ttl) {
+                snprintf(ttl_str,sizeof(ttl_str),";ttl=%u",ttl);
+        }
+
+        len = e_asprintf(&contents,"value=%s%s%s%s",e_value,
+                         e_precond ? ";prevValue=" : "",
+                         e_precond ? e_precond : "",ttl_str);
+        e_free(e_precond);
+        e_free(e_value);
+        if (len < 0) {
+                return ETCD_WTF;
+        }
+
+        return async_submit(session,ASYNC_SET,"PUT",key,NULL,contents,cb,
+                            NULL,arg);
+}
+
+
+etcd_result
+etcd_async_delete (etcd_session session_as_void, char *key,
+                   etcd_async_cb *cb, void *arg)
+{
+        _etcd_session   *session        = session_as_void;
+        USE_ALLOCATOR(&session->alloc);
+
+        return async_submit(session,ASYNC_DELETE,"DELETE",key,NULL,NULL,cb,
+                            NULL,arg);
+}
+
+
+etcd_result
+etcd_async_watch (etcd_session session_as_void, char *pfx,
+                  etcd_index *index_in, etcd_async_cb *cb, void *arg)
+{
+        _etcd_session   *session        = session_as_void;
+        char            query[64];
+        USE_ALLOCATOR(&session->alloc);
+
+        if (index_in) {
+                snprintf(query,sizeof(query),
+                         "?wait=true&recursive=true&waitIndex=%"PRIu64,
+                         *index_in);
+        }
+        else {
+                snprintf(query,sizeof(query),"?wait=true&recursive=true");
+        }
+        return async_submit(session,ASYNC_WATCH,"GET",pfx,query,NULL,cb,
+                            NULL,arg);
+}
+
+
+etcd_result
+etcd_async_lock (etcd_session session_as_void, char *key, unsigned int ttl,
+                 char *index_in, etcd_async_cb *cb, void *arg)
+{
+        _etcd_session   *session        = session_as_void;
+        char            *contents;
+        int             len;
+        USE_ALLOCATOR(&session->alloc);
+
+        if (!ttl) {
+                return ETCD_WTF;
+        }
+        if (index_in) {
+                len = e_asprintf(&contents,"ttl=%u;index=%s",ttl,index_in);
+        }
+        else {
+                len = e_asprintf(&contents,"ttl=%u",ttl);
+        }
+        if (len < 0) {
+                return ETCD_WTF;
+        }
+
+        /* POST takes a new lock, PUT renews one we have. */
+        return async_submit(session,ASYNC_LOCK,index_in ? "PUT" : "POST",key,
+                            NULL,contents,cb,NULL,arg);
+}
+
+
+etcd_result
+etcd_async_unlock (etcd_session session_as_void, char *key, char *index,
+                   etcd_async_cb *cb, void *arg)
+{
+        _etcd_session   *session        = session_as_void;
+        char            *contents;
+        USE_ALLOCATOR(&session->alloc);
+
+        if (!index || (e_asprintf(&contents,"index=%s",index) < 0)) {
+                return ETCD_WTF;
+        }
+        return async_submit(session,ASYNC_UNLOCK,"DELETE",key,NULL,contents,
+                            cb,NULL,arg);
+}
+
+
+etcd_result
+etcd_async_request (etcd_session session_as_void, const char *method,
+                    const char *path, const char *contents,
+                    etcd_async_raw_cb *cb, void *arg)
+{
+        _etcd_session   *session        = session_as_void;
+        static const char *methods[]    = { "GET", "PUT", "POST", "DELETE" };
+        char            *copy           = NULL;
+        size_t          i;
+        USE_ALLOCATOR(&session->alloc);
+
+        /* The op keeps the method around, so it had better be one of ours. */
+        for (i = 0; strcmp(method,methods[i]); ) {
+                if (++i == sizeof(methods)/sizeof(methods[0])) {
+                        return ETCD_WTF;
+                }
+        }
+        if (contents) {
+                copy = e_strdup(contents);
+                if (!copy) {
+                        return ETCD_WTF;
+                }
+        }
+        return async_submit(session,ASYNC_RAW,methods[i],path,NULL,copy,NULL,
+                            cb,arg);
+}
+
+
+/*
+ * Called from etcd_close.  Whatever's still in flight gets ETCD_WTF.  The
+ * multi handle is taken away first, so that callbacks can't start anything
+ * new while we're at it.
+ */
+static void
+async_close (_etcd_session *session)
+{
+        CURLM           *multi          = session->loop_multi;
+        etcd_async_op   *op;
+        USE_ALLOCATOR(&session->alloc);
+
+        if (!multi) {
+                return;
+        }
+        session->loop_multi = NULL;
+        while ((op = session->async_ops)) {
+                if (op->trace_cb) {
+                        trace_end(op->trace_cb,op->trace_arg,&op->trace,
+                                  op->curl,CURLE_ABORTED_BY_CALLBACK);
+                }
+                curl_multi_remove_handle(multi,op->curl);
+                async_finish(op,ETCD_WTF);
+        }
+        curl_multi_cleanup(multi);
+}
+
+
+/*
+ * Leases.  Each registered lock sits in a hashed timer wheel, in the slot for
+ * the tick when it's next due for renewal.  Once per tick the manager thread
+ * takes out everything that's due and renews it all as one batch, so the
+ * number of requests in flight is bounded by the batch window however many
+ * leases come due together.  The renewal point is picked at random between a
+ * third and a half of the way through the TTL.  That keeps locks taken at the
+ * same moment from being renewed in lockstep forever after, and leaves time
+ * for another try if no server could be reached the first time.
+ */
+#define LEASE_TICK_MS   100
+#define LEASE_SLOTS     256
+#define LEASE_RETRY_MS  1000
+
+typedef struct etcd_lease {
+        struct etcd_lease       *next;
+        char                    *key;
+        char                    *index;
+        unsigned int            ttl;
+        etcd_lease_cb           *cb;
+        void                    *arg;
+        uint64_t                due;            /* tick to renew at */
+        uint64_t                expires;        /* when etcd will drop it */
+        int                     removed;        /* while being renewed */
+        int                     op_num;
+} etcd_lease;
+
+typedef struct {
+        _etcd_session   *session;
+        unsigned int    concurrency;
+        pthread_t       thread;
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;
+        int             stop;
+        etcd_lease      *slots[LEASE_SLOTS];
+        etcd_lease      *busy;          /* out of the wheel, being renewed */
+        uint64_t        tick;           /* last one we've handled */
+        unsigned int    seed;
+        etcd_batch      batch;
+} etcd_lease_mgr_t;
+
+
+static uint64_t
+lease_now (void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+
+static void
+lease_free (etcd_lease *lease)
+{
+        e_free(lease->key);
+        e_free(lease->index);
+        e_free(lease);
+}
+
+
+/* Call with the lock held. */
+static void
+lease_schedule (etcd_lease_mgr_t *mgr, etcd_lease *lease, uint64_t delay_ms)
+{
+        etcd_lease      **slot;
+
+        lease->due = (lease_now() + delay_ms) / LEASE_TICK_MS;
+        if (lease->due <= mgr->tick) {
+                lease->due = mgr->tick + 1;
+        }
+        slot = &mgr->slots[lease->due % LEASE_SLOTS];
+        lease->next = *slot;
+        *slot = lease;
+}
+
+
+static uint64_t
+lease_delay (etcd_lease_mgr_t *mgr, unsigned int ttl)
+{
+        uint64_t        ttl_ms  = (uint64_t)ttl * 1000;
+
+        return ttl_ms / 3 + (uint64_t)rand_r(&mgr->seed) % (ttl_ms / 6 + 1);
+}
+
+
+/*
+ * Pull out everything due up to now_tick.  A lease is always scheduled after
+ * the tick we'd handled at the time, so only the slots for ticks since then
+ * need looking at - or every slot, once, if we've fallen a whole lap behind.
+ */
+static etcd_lease *
+lease_collect (etcd_lease_mgr_t *mgr, uint64_t now_tick)
+{
+        etcd_lease      *due    = NULL;
+        etcd_lease      **prev;
+        etcd_lease      *lease;
+        uint64_t        t;
+
+        t = mgr->tick + 1;
+        if ((now_tick - mgr->tick) > LEASE_SLOTS) {
+                t = now_tick - LEASE_SLOTS + 1;
+        }
+        for (; t <= now_tick; ++t) {
+                prev = &mgr->slots[t % LEASE_SLOTS];
+                while ((lease = *prev)) {
+                        if (lease->due <= now_tick) {
+                                *prev = lease->next;
+                                lease->next = due;
+                                due = lease;
+                        }
+                        else {
+                                prev = &lease->next;
+                        }
+                }
+        }
+
+        mgr->tick = now_tick;
+        return due;
+}
+
+
+static int
+batch_renew (etcd_batch_t *batch, const char *key, unsigned int ttl,
+             const char *index)
+{
+        etcd_batch_op   *op;
+
+        op = batch_add(batch,BATCH_RENEW,key);
+        if (!op) {
+                return -1;
+        }
+        if (e_asprintf(&op->contents,"ttl=%u;index=%s",ttl,index) < 0) {
+                op->contents = NULL;
+                e_free(op->key);
+                --batch->num_ops;
+                return -1;
+        }
+        return (int)(batch->num_ops - 1);
+}
+
+
+/*
+ * Renew everything on the busy list, then put each lease back in the wheel
+ * or on the lost list.  Only the manager thread touches a busy lease, except
+ * to set its removed flag (under the lock), so we can read it unlocked.
+ */
+static etcd_lease *
+lease_renew (etcd_lease_mgr_t *mgr)
+{
+        etcd_lease      *lease;
+        etcd_lease      *next;
+        etcd_lease      *lost   = NULL;
+        etcd_result     res;
+        uint64_t        now;
+
+        pthread_mutex_unlock(&mgr->lock);
+        for (lease = mgr->busy; lease; lease = lease->next) {
+                lease->op_num = batch_renew(mgr->batch,lease->key,lease->ttl,
+                                            lease->index);
+        }
+        (void)etcd_batch_submit(mgr->batch,mgr->concurrency);
+        pthread_mutex_lock(&mgr->lock);
+
+        now = lease_now();
+        for (lease = mgr->busy; lease; lease = next) {
+                next = lease->next;
+                if (lease->removed) {
+                        lease_free(lease);
+                        continue;
+                }
+                res = etcd_batch_result(mgr->batch,lease->op_num,NULL,NULL);
+                if (res == ETCD_OK) {
+                        lease->expires = now + (uint64_t)lease->ttl * 1000;
+                        lease_schedule(mgr,lease,lease_delay(mgr,lease->ttl));
+                }
+                else if ((res == ETCD_WTF) && (now < lease->expires)) {
+                        /* Nobody answered.  Keep trying while it may live. */
+                        lease_schedule(mgr,lease,LEASE_RETRY_MS);
+                }
+                else {
+                        lease->next = lost;
+                        lost = lease;
+                }
+        }
+        mgr->busy = NULL;
+
+        etcd_batch_clear(mgr->batch);
+        return lost;
+}
+
+
+static void *
+lease_main (void *arg)
+{
+        etcd_lease_mgr_t        *mgr    = arg;
+        etcd_lease              *lost;
+        etcd_lease              *next;
+        struct timespec         deadline;
+
+        cur_alloc = &mgr->session->alloc;
+        pthread_mutex_lock(&mgr->lock);
+        while (!mgr->stop) {
+                mgr->busy = lease_collect(mgr,lease_now()/LEASE_TICK_MS);
+                if (mgr->busy) {
+                        lost = lease_renew(mgr);
+                        if (lost) {
+                                pthread_mutex_unlock(&mgr->lock);
+                                for (; lost; lost = next) {
+                                        next = lost->next;
+                                        lost->cb(lost->arg,lost->key,
+                                                 lost->index);
+                                        lease_free(lost);
+                                }
+                                pthread_mutex_lock(&mgr->lock);
+                        }
+                        continue;
+                }
+                deadline_after_ms(&deadline,LEASE_TICK_MS);
+                (void)pthread_cond_timedwait(&mgr->cond,&mgr->lock,&deadline);
+        }
+        pthread_mutex_unlock(&mgr->lock);
+
+        return NULL;
+}
+
+
+etcd_lease_mgr
+etcd_lease_mgr_start (etcd_session session_as_void, unsigned int concurrency)
+{
+        _etcd_session           *session        = session_as_void;
+        etcd_lease_mgr_t        *mgr;
+        USE_ALLOCATOR(&session->alloc);
+
+        mgr = e_calloc(1,sizeof(*mgr));
+        if (!mgr) {
+                return NULL;
+        }
+
+        mgr->batch = etcd_batch_create(session_as_void);
+        if (!mgr->batch) {
+                e_free(mgr);
+                return NULL;
+        }
+        mgr->session = session_as_void;
+        mgr->concurrency = concurrency ? concurrency : DEFAULT_BATCH_WINDOW;
+        mgr->tick = lease_now() / LEASE_TICK_MS;
+        mgr->seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)mgr;
+        pthread_mutex_init(&mgr->lock,NULL);
+        pthread_cond_init(&mgr->cond,NULL);
+
+        if (pthread_create(&mgr->thread,NULL,lease_main,mgr) != 0) {
+                pthread_cond_destroy(&mgr->cond);
+                pthread_mutex_destroy(&mgr->lock);
+                etcd_batch_free(mgr->batch);
+                e_free(mgr);
+                return NULL;
+        }
+
+        return mgr;
+}
+
+
+etcd_result
+etcd_lease_add (etcd_lease_mgr mgr_as_void, char *key, unsigned int ttl,
+                char *index, etcd_lease_cb *cb, void *arg)
+{
+        etcd_lease_mgr_t        *mgr    = mgr_as_void;
+        etcd_lease              *lease;
+        USE_ALLOCATOR(&mgr->session->alloc);
+
+        if (!ttl || !index || !cb) {
+                return ETCD_WTF;
+        }
+
+        lease = e_calloc(1,sizeof(*lease));
+        if (!lease) {
+                return ETCD_WTF;
+        }
+        lease->key = e_strdup(key);
+        lease->index = e_strdup(index);
+        if (!lease->key || !lease->index) {
+                lease_free(lease);
+                return ETCD_WTF;
+        }
+        lease->ttl = ttl;
+        lease->cb = cb;
+        lease->arg = arg;
+
+        pthread_mutex_lock(&mgr->lock);
+        /* The caller has only just taken or renewed it. */
+        lease->expires = lease_now() + (uint64_t)ttl * 1000;
+        lease_schedule(mgr,lease,lease_delay(mgr,ttl));
+        pthread_mutex_unlock(&mgr->lock);
+
+        return ETCD_OK;
+}
+
+
+etcd_result
+etcd_lease_remove (etcd_lease_mgr mgr_as_void, char *key, char *index)
+{
+        etcd_lease_mgr_t        *mgr    = mgr_as_void;
+        etcd_lease              **prev;
+        etcd_lease              *lease;
+        etcd_result             res     = ETCD_NOT_FOUND;
+        size_t                  i;
+        USE_ALLOCATOR(&mgr->session->alloc);
+
+        pthread_mutex_lock(&mgr->lock);
+        for (i = 0; (i < LEASE_SLOTS) && (res != ETCD_OK); ++i) {
+                for (prev = &mgr->slots[i]; (lease = *prev);
+                     prev = &lease->next) {
+                        if (!strcmp(lease->key,key) &&
+                            !strcmp(lease->index,index)) {
+                                *prev = lease->next;
+                                lease_free(lease);
+                                res = ETCD_OK;
+                                break;
+                        }
+                }
+        }
+        for (lease = mgr->busy; lease && (res != ETCD_OK);
+             lease = lease->next) {
+                if (!lease->removed && !strcmp(lease->key,key) &&
+                    !strcmp(lease->index,index)) {
+                        /* The manager thread will free it when it's done. */
+                        lease->removed = 1;
+                        res = ETCD_OK;
+                }
+        }
+        pthread_mutex_unlock(&mgr->lock);
+
+        return res;
+}
+
+
+void
+etcd_lease_mgr_stop (etcd_lease_mgr mgr_as_void)
+{
+        etcd_lease_mgr_t        *mgr    = mgr_as_void;
+        etcd_lease              *lease;
+        size_t                  i;
+        USE_ALLOCATOR(&mgr->session->alloc);
+
+        pthread_mutex_lock(&mgr->lock);
+        mgr->stop = 1;
+        pthread_cond_signal(&mgr->cond);
+        pthread_mutex_unlock(&mgr->lock);
+        pthread_join(mgr->thread,NULL);
+
+        for (i = 0; i < LEASE_SLOTS; ++i) {
+                while ((lease = mgr->slots[i])) {
+                        mgr->slots[i] = lease->next;
+                        lease_free(lease);
+                }
+        }
+        etcd_batch_free(mgr->batch);
+        pthread_cond_destroy(&mgr->cond);
+        pthread_mutex_destroy(&mgr->lock);
+        e_free(mgr);
+}
+
+
+/*
+ * Queues.  Jobs are in-order keys under one directory, so etcd hands out the
+ * names and they sort by when they were added.  A consumer claims a job by
+ * deleting it with prevIndex, which only one consumer can win, and the
+ * winner gets the value in the same breath.  Each queue handle caches its
+ * last listing and works through it, only going back to etcd for a new one
+ * when it runs out, and when the queue is empty it waits on a watch instead
+ * of polling.  Consumers working from the same listing would all go for the
+ * oldest job first, so the first few are shuffled.  That costs a little
+ * strictness of order, which etcd couldn't promise with more than one
+ * consumer anyway.
+ */
+#define QUEUE_SPREAD    8
+
+typedef struct {
+        char            *key;
+        char            *value;
+        etcd_index      created;
+        etcd_index      modified;
+} etcd_qitem;
+
+typedef struct {
+        _etcd_session   *session;
+        char            *dir;
+        etcd_qitem      *items;         /* last listing, oldest first */
+        size_t          num_items;
+        size_t          max_items;
+        size_t          next;           /* first one not tried yet */
+        etcd_index      watch_index;    /* where the listing left off */
+        unsigned int    seed;
+} etcd_queue_t;
+
+
+etcd_queue
+etcd_queue_open (etcd_session session_as_void, char *dir)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_queue_t    *q;
+        USE_ALLOCATOR(&session->alloc);
+
+        q = e_calloc(1,sizeof(*q));
+        if (!q) {
+                return NULL;
+        }
+        /* Keys come back with a leading slash; don't double it in URLs. */
+        q->dir = e_strdup(dir + strspn(dir,"/"));
+        if (!q->dir) {
+                e_free(q);
+                return NULL;
+        }
+        q->session = session_as_void;
+        q->seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)q;
+        return q;
+}
+
+
+static void
+queue_forget (etcd_queue_t *q)
+{
+        size_t  i;
+
+        for (i = q->next; i < q->num_items; ++i) {
+                e_free(q->items[i].key);
+                e_free(q->items[i].value);
+        }
+        q->num_items = q->next = 0;
+}
+
+
+static int
+queue_add (etcd_queue_t *q, const char *key, const char *value,
+           etcd_index created, etcd_index modified)
+{
+        etcd_qitem      *items;
+        size_t          max_items;
+        etcd_qitem      *item;
+
+        if (q->num_items == q->max_items) {
+                max_items = q->max_items ? q->max_items * 2 : 64;
+                items = e_realloc(q->items,max_items*sizeof(*items));
+                if (!items) {
+                        return -1;
+                }
+                q->items = items;
+                q->max_items = max_items;
+        }
+
+        item = &q->items[q->num_items];
+        item->key = e_strdup(key + strspn(key,"/"));
+        item->value = e_strdup(value);
+        if (!item->key || !item->value) {
+                e_free(item->key);
+                e_free(item->value);
+                return -1;
+        }
+        item->created = created;
+        item->modified = modified;
+        ++q->num_items;
+        return 0;
+}
+
+
+static int
+queue_leaf (void *arg, yajl_val node)
+{
+        yajl_val        key;
+        yajl_val        value;
+
+        key = node_field(node,"key",yajl_t_string);
+        value = node_field(node,"value",yajl_t_string);
+        if (!key || !value) {
+                return 0;
+        }
+        return queue_add(arg,MY_YAJL_GET_STRING(key),
+                         MY_YAJL_GET_STRING(value),
+                         node_index(node,"createdIndex"),
+                         node_index(node,"modifiedIndex"));
+}
+
+
+static int
+queue_compare (const void *a, const void *b)
+{
+        etcd_index      x       = ((const etcd_qitem *)a)->created;
+        etcd_index      y       = ((const etcd_qitem *)b)->created;
+
+        return (x < y) ? -1 : (x > y);
+}
+
+
+static etcd_result
+queue_list (etcd_queue_t *q)
+{
+        etcd_result     res;
+        etcd_index      index   = 0;
+        etcd_qitem      tmp;
+        size_t          spread;
+        size_t          i;
+        size_t          j;
+
+        queue_forget(q);
+        res = etcd_get_tree(q->session,q->dir,queue_leaf,q,&index,NULL);
+        if (res != ETCD_OK) {
+                queue_forget(q);
+                return res;
+        }
+        q->watch_index = index + 1;
+
+        qsort(q->items,q->num_items,sizeof(*q->items),queue_compare);
+        spread = (q->num_items < QUEUE_SPREAD) ? q->num_items : QUEUE_SPREAD;
+        for (i = spread; i > 1; --i) {
+                j = (size_t)rand_r(&q->seed) % i;
+                tmp = q->items[i-1];
+                q->items[i-1] = q->items[j];
+                q->items[j] = tmp;
+        }
+
+        return ETCD_OK;
+}
+
+
+static etcd_result
+queue_claim (etcd_queue_t *q, etcd_qitem *item)
+{
+        etcd_write_t    write;
+        etcd_result     res;
+        char            query[32];
+
+        snprintf(query,sizeof(query),"prevIndex=%"PRIu64,item->modified);
+        res = etcd_write(q->session,"DELETE",item->key,query,NULL,&write);
+        e_free(write.key);
+        return res;
+}
+
+
+etcd_result
+etcd_enqueue (etcd_queue q_as_void, char *value, unsigned int ttl,
+              char **keyp)
+{
+        etcd_queue_t    *q      = q_as_void;
+        etcd_write_t    write;
+        etcd_result     res;
+        char            *e_value;
+        char            *contents;
+        int             len;
+        USE_ALLOCATOR(&q->session->alloc);
+
+        e_value = url_escape(value);
+        if (!e_value) {
+                return ETCD_WTF;
+        }
+        if (ttl) {
+                len = e_asprintf(&contents,"value=%s;ttl=%u",e_value,ttl);
+        }
+        else {
+                len = e_asprintf(&contents,"value=%s",e_value);
+        }
+        e_free(e_value);
+        if (len < 0) {
+                return ETCD_WTF;
+        }
+
+        res = etcd_write(q->session,"POST",q->dir,NULL,contents,&write);
+        if ((res == ETCD_OK) && keyp) {
+                *keyp = write.key;
+                write.key = NULL;
+        }
+
+        e_free(write.key);
+        e_free(contents);
+        return res;
+}
+
+
+etcd_result
+etcd_dequeue (etcd_queue q_as_void, char **keyp, char **valuep,
+              unsigned int timeout_ms)
+{
+        etcd_queue_t    *q      = q_as_void;
+        etcd_qitem      *item;
+        etcd_result     res;
         etcd_watch_t    watch;
-        char            *path = NULL;
+        etcd_response   rsp;
+        struct timespec now;
+        uint64_t        deadline        = 0;
+        uint64_t        now_ms;
+        int             need_list       = 1;
+        USE_ALLOCATOR(&q->session->alloc);
+
+        if (timeout_ms) {
+                clock_gettime(CLOCK_MONOTONIC,&now);
+                deadline = (uint64_t)now.tv_sec * 1000
+                         + (uint64_t)now.tv_nsec / 1000000 + timeout_ms;
+        }
+
+        for (;;) {
+                while (q->next < q->num_items) {
+                        item = &q->items[q->next++];
+                        res = queue_claim(q,item);
+                        if (res == ETCD_OK) {
+                                *keyp = item->key;
+                                *valuep = item->value;
+                                return ETCD_OK;
+                        }
+                        e_free(item->key);
+                        e_free(item->value);
+                        if ((res != ETCD_PRECOND_FAILED) &&
+                            (res != ETCD_NOT_FOUND)) {
+                                return res;
+                        }
+                        /* Somebody else got that one; try the next. */
+                        need_list = 1;
+                }
+
+                if (need_list) {
+                        res = queue_list(q);
+                        if (res != ETCD_OK) {
+                                return res;
+                        }
+                        need_list = 0;
+                        if (q->num_items) {
+                                continue;
+                        }
+                }
+                queue_forget(q);
+
+                /* Nothing there, so wait for something to show up. */
+                memset(&rsp,0,sizeof(rsp));
+                if (timeout_ms) {
+                        clock_gettime(CLOCK_MONOTONIC,&now);
+                        now_ms = (uint64_t)now.tv_sec * 1000
+                               + (uint64_t)now.tv_nsec / 1000000;
+                        if (now_ms >= deadline) {
+                                return ETCD_TIMEOUT;
+                        }
+                        rsp.timeout_ms = (long)(deadline - now_ms);
+                }
+                res = etcd_watch_internal(q->session,q->dir,&q->watch_index,
+                                          &watch,&rsp);
+                e_free(rsp.data);
+                if (res == ETCD_INDEX_CLEARED) {
+                        need_list = 1;
+                        continue;
+                }
+                if (res != ETCD_OK) {
+                        return res;
+                }
+                q->watch_index = watch.index_out + 1;
+                if (!watch.deleted && watch.key && watch.value &&
+                    (queue_add(q,watch.key,watch.value,watch.index_out,
+                               watch.index_out) != 0)) {
+                        need_list = 1;
+                }
+                e_free(watch.key);
+                e_free(watch.value);
+        }
+}
+
+
+etcd_result
+etcd_queue_consume (etcd_queue q_as_void, etcd_queue_cb *cb, void *arg,
+                    unsigned int idle_ms)
+{
+        etcd_queue_t    *q      = q_as_void;
+        etcd_result     res;
+        char            *key;
+        char            *value;
+        int             stop;
+        USE_ALLOCATOR(&q->session->alloc);
+
+        for (;;) {
+                res = etcd_dequeue(q,&key,&value,idle_ms);
+                if (res == ETCD_TIMEOUT) {
+                        if (cb(arg,NULL,NULL) != 0) {
+                                return ETCD_OK;
+                        }
+                        continue;
+                }
+                if (res != ETCD_OK) {
+                        return res;
+                }
+                stop = cb(arg,key,value);
+                e_free(key);
+                e_free(value);
+                if (stop) {
+                        return ETCD_OK;
+                }
+        }
+}
+
+
+void
+etcd_queue_close (etcd_queue q_as_void)
+{
+        etcd_queue_t    *q      = q_as_void;
+        USE_ALLOCATOR(&q->session->alloc);
+
+        queue_forget(q);
+        e_free(q->items);
+        e_free(q->dir);
+        e_free(q);
+}
+
+
+/*
+ * Snapshots.  The file is a header, then one entry per key (in whatever order
+ * etcd gave them to us), then an array of entry offsets sorted by key.  All
+ * numbers are in native byte order; the header says which that was so we can
+ * refuse files from the other kind of machine.  Keys and values are stored
+ * with a null terminator, and each entry starts on an 8-byte boundary, so a
+ * reader can use everything in place once the file is mapped.
+ */
+typedef struct {
+        char            magic[8];
+        uint32_t        byte_order;
+        uint32_t        flags;
+        uint64_t        count;
+        uint64_t        etcd_index;     /* X-Etcd-Index when dumped */
+        uint64_t        index_offset;   /* where the sorted offsets are */
+        uint64_t        reserved;
+} etcd_snap_header;
+
+typedef struct {
+        uint64_t        modified_index;
+        uint64_t        created_index;
+        int64_t         ttl;
+        uint32_t        key_len;
+        uint32_t        value_len;
+        /* key, null, value, null, padding */
+} etcd_snap_entry;
+
+typedef struct {
+        char            *base;
+        size_t          size;
+        etcd_snap_header *header;
+        uint64_t        *index;
+} etcd_snapshot_t;
+
+#define SNAP_ENTRY(s,o)         ((etcd_snap_entry *)((s)->base+(o)))
+#define SNAP_KEY(e)             ((char *)((e)+1))
+#define SNAP_VALUE(e)           (SNAP_KEY(e)+(e)->key_len+1)
+#define SNAP_PAD(n)             (((n)+7) & ~(uint64_t)7)
+
+typedef struct {
+        FILE            *fp;
+        uint64_t        offset;
+        uint64_t        *offsets;
+        size_t          count;
+        size_t          max;
+} etcd_dump_t;
+
+static int
+dump_leaf (void *arg, yajl_val node)
+{
+        etcd_dump_t             *dump   = arg;
+        etcd_snap_entry         entry;
+        yajl_val                key;
+        yajl_val                value;
+        const char              *v;
+        uint64_t                *offsets;
+        size_t                  len;
+        static const char       zeros[8];
+
+        key = node_field(node,"key",yajl_t_string);
+        if (!key) {
+                return 0;
+        }
+        value = node_field(node,"value",yajl_t_string);
+        v = value ? MY_YAJL_GET_STRING(value) : "";
+
+        if (dump->count == dump->max) {
+                dump->max = dump->max ? dump->max * 2 : 1024;
+                offsets = e_realloc(dump->offsets,
+                                    dump->max*sizeof(*offsets));
+                if (!offsets) {
+                        return -1;
+                }
+                dump->offsets = offsets;
+        }
+
+        memset(&entry,0,sizeof(entry));
+        entry.modified_index = node_index(node,"modifiedIndex");
+        entry.created_index = node_index(node,"createdIndex");
+        entry.ttl = (int64_t)node_index(node,"ttl");
+        entry.key_len = strlen(MY_YAJL_GET_STRING(key));
+        entry.value_len = strlen(v);
+
+        len = sizeof(entry) + entry.key_len + entry.value_len + 2;
+        if ((fwrite(&entry,sizeof(entry),1,dump->fp) != 1) ||
+            (fwrite(MY_YAJL_GET_STRING(key),entry.key_len+1,1,dump->fp) != 1) ||
+            (fwrite(v,entry.value_len+1,1,dump->fp) != 1)) {
+                return -1;
+        }
+        if ((SNAP_PAD(len) != len) &&
+            (fwrite(zeros,SNAP_PAD(len)-len,1,dump->fp) != 1)) {
+                return -1;
+        }
+
+        dump->offsets[dump->count++] = dump->offset;
+        dump->offset += SNAP_PAD(len);
+        return 0;
+}
+
+
+static int
+snap_compare (const void *a, const void *b, void *arg)
+{
+        etcd_snapshot_t *snap   = arg;
+
+        return strcmp(SNAP_KEY(SNAP_ENTRY(snap,*(uint64_t *)a)),
+                      SNAP_KEY(SNAP_ENTRY(snap,*(uint64_t *)b)));
+}
+
+
+/*
+ * Rather than keep every key in memory just so we can sort them, we map what
+ * we've written so far and sort the offsets by looking at the file itself.
+ * Everything goes to a temporary file first, so a failed dump never leaves a
+ * half-written snapshot where a good one used to be.
+ */
+etcd_result
+etcd_dump (etcd_session session_as_void, char *pfx, char *path)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res             = ETCD_WTF;
+        etcd_dump_t     dump;
+        etcd_snap_header header;
+        etcd_snapshot_t snap;
+        etcd_index      index           = 0;
+        char            *tmp_path;
+        void            *err_label      = &&done;
+        USE_ALLOCATOR(&session->alloc);
+
+        memset(&dump,0,sizeof(dump));
+        memset(&header,0,sizeof(header));
+
+        if (e_asprintf(&tmp_path,"%s.tmp",path) < 0) {
+                goto *err_label;
+        }
+        err_label = &&free_path;
+
+        dump.fp = fopen(tmp_path,"w+");
+        if (!dump.fp) {
+                goto *err_label;
+        }
+        err_label = &&remove_tmp;
+
+        if (fwrite(&header,sizeof(header),1,dump.fp) != 1) {
+                goto *err_label;
+        }
+        dump.offset = sizeof(header);
+
+        res = etcd_get_tree(session,pfx,dump_leaf,&dump,&index,NULL);
+        if (res != ETCD_OK) {
+                goto *err_label;
+        }
+        res = ETCD_WTF;
+
+        if (fflush(dump.fp) != 0) {
+                goto *err_label;
+        }
+        if (dump.count) {
+                snap.size = dump.offset;
+                snap.base = mmap(NULL,snap.size,PROT_READ,MAP_SHARED,
+                                 fileno(dump.fp),0);
+                if (snap.base == MAP_FAILED) {
+                        goto *err_label;
+                }
+                qsort_r(dump.offsets,dump.count,sizeof(*dump.offsets),
+                        snap_compare,&snap);
+                munmap(snap.base,snap.size);
+                if (fwrite(dump.offsets,sizeof(*dump.offsets),dump.count,
+                           dump.fp) != dump.count) {
+                        goto *err_label;
+                }
+        }
+
+        memcpy(header.magic,SNAP_MAGIC,sizeof(header.magic));
+        header.byte_order = SNAP_BYTE_ORDER;
+        header.count = dump.count;
+        header.etcd_index = index;
+        header.index_offset = dump.offset;
+        if ((fseek(dump.fp,0,SEEK_SET) != 0) ||
+            (fwrite(&header,sizeof(header),1,dump.fp) != 1)) {
+                goto *err_label;
+        }
+
+        if (fclose(dump.fp) != 0) {
+                dump.fp = NULL;
+                goto *err_label;
+        }
+        dump.fp = NULL;
+        if (rename(tmp_path,path) != 0) {
+                goto *err_label;
+        }
+        res = ETCD_OK;
+        err_label = &&free_path;
+        goto *err_label;
+
+remove_tmp:
+        if (dump.fp) {
+                fclose(dump.fp);
+        }
+        unlink(tmp_path);
+free_path:
+        e_free(tmp_path);
+done:
+        e_free(dump.offsets);
+        return res;
+}
+
+
+etcd_snapshot
+etcd_snapshot_open (char *path)
+{
+        etcd_snapshot_t *snap;
+        struct stat     st;
+        etcd_snap_entry *entry;
+        uint64_t        i;
+        uint64_t        off;
+        int             fd;
+
+        fd = open(path,O_RDONLY);
+        if (fd < 0) {
+                return NULL;
+        }
+        if ((fstat(fd,&st) != 0) ||
+            (st.st_size < (off_t)sizeof(etcd_snap_header))) {
+                close(fd);
+                return NULL;
+        }
+
+        snap = e_calloc(1,sizeof(*snap));
+        if (!snap) {
+                close(fd);
+                return NULL;
+        }
+        snap->size = st.st_size;
+        snap->base = mmap(NULL,snap->size,PROT_READ,MAP_SHARED,fd,0);
+        close(fd);
+        if (snap->base == MAP_FAILED) {
+                e_free(snap);
+                return NULL;
+        }
+
+        /* Don't trust anything in the file until we've checked it. */
+        snap->header = (etcd_snap_header *)snap->base;
+        if (memcmp(snap->header->magic,SNAP_MAGIC,8) ||
+            (snap->header->byte_order != SNAP_BYTE_ORDER) ||
+            (snap->header->index_offset > snap->size) ||
+            (snap->header->count > ((snap->size - snap->header->index_offset)
+                                    / sizeof(uint64_t)))) {
+                goto bad;
+        }
+        snap->index = (uint64_t *)(snap->base + snap->header->index_offset);
+        for (i = 0; i < snap->header->count; ++i) {
+                off = snap->index[i];
+                if ((off < sizeof(etcd_snap_header)) || (off & 7) ||
+                    ((off + sizeof(*entry)) > snap->header->index_offset)) {
+                        goto bad;
+                }
+                entry = SNAP_ENTRY(snap,off);
+                if ((off + sizeof(*entry) + (uint64_t)entry->key_len +
+                     entry->value_len + 2) > snap->header->index_offset) {
+                        goto bad;
+                }
+                if (SNAP_KEY(entry)[entry->key_len] ||
+                    SNAP_VALUE(entry)[entry->value_len]) {
+                        goto bad;
+                }
+        }
+
+        return snap;
+
+bad:
+        munmap(snap->base,snap->size);
+        e_free(snap);
+        return NULL;
+}
+
+
+size_t
+etcd_snapshot_count (etcd_snapshot snap_as_void)
+{
+        return ((etcd_snapshot_t *)snap_as_void)->header->count;
+}
+
+
+const char *
+etcd_snapshot_key (etcd_snapshot snap_as_void, size_t n, const char **valuep)
+{
+        etcd_snapshot_t *snap   = snap_as_void;
+        etcd_snap_entry *entry;
+
+        if (n >= snap->header->count) {
+                return NULL;
+        }
+
+        entry = SNAP_ENTRY(snap,snap->index[n]);
+        if (valuep) {
+                *valuep = SNAP_VALUE(entry);
+        }
+        return SNAP_KEY(entry);
+}
+
+
+const char *
+etcd_snapshot_get (etcd_snapshot snap_as_void, char *key)
+{
+        etcd_snapshot_t *snap   = snap_as_void;
+        etcd_snap_entry *entry;
+        size_t          lo      = 0;
+        size_t          hi      = snap->header->count;
+        size_t          mid;
+        int             cmp;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                entry = SNAP_ENTRY(snap,snap->index[mid]);
+                cmp = strcmp(key,SNAP_KEY(entry));
+                if (!cmp) {
+                        return SNAP_VALUE(entry);
+                }
+                if (cmp < 0) {
+                        hi = mid;
+                }
+                else {
+                        lo = mid + 1;
+                }
+        }
+
+        return NULL;
+}
+
+
+void
+etcd_snapshot_close (etcd_snapshot snap_as_void)
+{
+        etcd_snapshot_t *snap   = snap_as_void;
+
+        munmap(snap->base,snap->size);
+        e_free(snap);
+}
+
+
+/*
+ * Keys and values go straight from the mapped file into the batch, which
+ * makes its own (escaped) copies.  TTLs are whatever was left at dump time.
+ */
+etcd_result
+etcd_restore (etcd_session session, char *path, unsigned int concurrency)
+{
+        etcd_snapshot_t *snap;
+        etcd_snap_entry *entry;
+        etcd_batch      batch;
+        etcd_result     res             = ETCD_OK;
+        etcd_result     chunk_res;
+        char            *key;
+        uint64_t        i;
+
+        snap = etcd_snapshot_open(path);
+        if (!snap) {
+                return ETCD_WTF;
+        }
+        batch = etcd_batch_create(session);
+        if (!batch) {
+                etcd_snapshot_close(snap);
+                return ETCD_WTF;
+        }
+
+        for (i = 0; i < snap->header->count; ++i) {
+                entry = SNAP_ENTRY(snap,snap->index[i]);
+                /* Keys come from etcd with a leading slash, URLs don't. */
+                key = SNAP_KEY(entry);
+                while (*key == '/') {
+                        ++key;
+                }
+                if (etcd_batch_set(batch,key,SNAP_VALUE(entry),
+                                   NULL,(unsigned int)entry->ttl) < 0) {
+                        res = ETCD_WTF;
+                        break;
+                }
+                if ((etcd_batch_count(batch) == RESTORE_CHUNK) ||
+                    ((i + 1) == snap->header->count)) {
+                        chunk_res = etcd_batch_submit(batch,concurrency);
+                        if (res == ETCD_OK) {
+                                res = chunk_res;
+                        }
+                        etcd_batch_clear(batch);
+                }
+        }
+
+        etcd_batch_free(batch);
+        etcd_snapshot_close(snap);
+        return res;
+}
+
+
+/*
+ * Shared caches.  The file is a header, a power-of-two array of slots for
+ * open addressing with linear probing, then a data area where each key and
+ * its value are appended (with null terminators) and never changed after.
+ * Each slot is a seqlock: the publisher makes seq odd, changes the slot, then
+ * makes it even again, and a reader starts over if seq was odd or moved
+ * while it looked.  Since data is never rewritten in place, a reader racing
+ * with an update still finds the bytes it expects, just maybe not the
+ * latest ones.  Deleted slots become tombstones rather than empty, so probes
+ * for other keys don't stop short.
+ *
+ * When either part fills up, or a resync has to start from scratch, the
+ * publisher writes a whole new file, renames it over the old one and marks
+ * the old one retired.  Readers notice that on their next lookup and map the
+ * new one, but have to keep the old mapping too while another thread might
+ * still be in the middle of reading it.  Each lookup counts itself in and
+ * out of the cache handle, and whichever one leaves it with nobody inside
+ * unmaps whatever has been retired in the meantime.
+ */
+#define SHC_EMPTY               0
+#define SHC_LIVE                1
+#define SHC_DEAD                2
+#define SHC_MAX_SPINS           100000
+
+typedef struct {
+        char            magic[8];
+        uint32_t        byte_order;
+        uint32_t        retired;        /* a newer file has replaced this */
+        uint64_t        num_slots;
+        uint64_t        data_size;
+        uint64_t        etcd_index;     /* everything up to here is in */
+        uint64_t        reserved;
+} etcd_shc_header;
+
+typedef struct {
+        uint64_t        seq;
+        uint64_t        hash;
+        uint64_t        offset;         /* of the key, in the data area */
+        uint64_t        modified_index;
+        uint32_t        key_len;
+        uint32_t        value_len;
+        uint32_t        state;
+        uint32_t        pad;
+} etcd_shc_slot;
+
+typedef struct etcd_shc_map {
+        struct etcd_shc_map     *next;  /* retired ones, for readers */
+        char                    *base;
+        size_t                  size;
+        etcd_shc_header         *header;
+        etcd_shc_slot           *slots;
+        char                    *data;
+        /* Only the publisher keeps these. */
+        uint64_t                used;   /* bytes of data, live or not */
+        uint64_t                live;   /* slots */
+        uint64_t                dead;
+} etcd_shc_map;
+
+typedef struct {
+        char            *path;
+        etcd_shc_map    *map;           /* the newest */
+        etcd_shc_map    *retired;       /* older ones, maybe still in use */
+        unsigned int    readers;        /* lookups in progress */
+        pthread_mutex_t lock;           /* for switching and retiring maps */
+} etcd_shcache_t;
+
+typedef struct {
+        _etcd_session   *session;
+        char            *pfx;
+        char            *path;
+        char            *tmp_path;
+        etcd_shc_map    *map;
+        etcd_index      next_index;
+        int             stop;
+        pthread_t       thread;
+        pthread_mutex_t lock;           /* just for pausing */
+        pthread_cond_t  wake;
+} etcd_shc_pub;
+
+#define SHC_SIZE(slots,data)    (sizeof(etcd_shc_header) + \
+                                 (slots) * sizeof(etcd_shc_slot) + (data))
+
+
+static int
+shc_map_init (etcd_shc_map *map, char *base, size_t size)
+{
+        etcd_shc_header *header = (etcd_shc_header *)base;
+
+        map->base = base;
+        map->size = size;
+        map->header = header;
+        if (memcmp(header->magic,SHC_MAGIC,sizeof(header->magic)) ||
+            (header->byte_order != SNAP_BYTE_ORDER) ||
+            !header->num_slots ||
+            (header->num_slots & (header->num_slots - 1)) ||
+            (header->num_slots > (size / sizeof(etcd_shc_slot))) ||
+            (SHC_SIZE(header->num_slots,header->data_size) != size)) {
+                return -1;
+        }
+        map->slots = (etcd_shc_slot *)(header + 1);
+        map->data = (char *)(map->slots + header->num_slots);
+        return 0;
+}
+
+
+static etcd_shc_map *
+shc_map_open (const char *path)
+{
+        etcd_shc_map    *map;
+        struct stat     st;
+        char            *base;
+        int             fd;
+
+        fd = open(path,O_RDONLY);
+        if (fd < 0) {
+                return NULL;
+        }
+        if ((fstat(fd,&st) != 0) ||
+            (st.st_size < (off_t)sizeof(etcd_shc_header))) {
+                close(fd);
+                return NULL;
+        }
+        base = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+        close(fd);
+        if (base == MAP_FAILED) {
+                return NULL;
+        }
+
+        map = e_calloc(1,sizeof(*map));
+        if (!map) {
+                munmap(base,st.st_size);
+                return NULL;
+        }
+        if (shc_map_init(map,base,st.st_size) != 0) {
+                munmap(base,st.st_size);
+                e_free(map);
+                return NULL;
+        }
+        return map;
+}
+
+
+static void
+shc_map_close (etcd_shc_map *map)
+{
+        munmap(map->base,map->size);
+        e_free(map);
+}
 
-        if (index_in) {
-                if (asprintf(&path,"%s?wait=true&recursive=true&waitIndex=%d",
-                             pfx,*index_in) < 0) {
-                        return ETCD_WTF;
+
+etcd_shcache
+etcd_shcache_open (char *path)
+{
+        etcd_shcache_t  *cache;
+
+        cache = e_calloc(1,sizeof(*cache));
+        if (!cache) {
+                return NULL;
+        }
+        cache->path = e_strdup(path);
+        if (!cache->path) {
+                e_free(cache);
+                return NULL;
+        }
+        cache->map = shc_map_open(path);
+        if (!cache->map) {
+                e_free(cache->path);
+                e_free(cache);
+                return NULL;
+        }
+        pthread_mutex_init(&cache->lock,NULL);
+        return cache;
+}
+
+
+/*
+ * Count a lookup in, and switch to a newer file if the publisher has retired
+ * ours.  If the new one can't be opened for some reason, the old one is still
+ * perfectly readable, just frozen, so carry on with that and try again next
+ * time.  The old map can't go yet, since other lookups may still be using
+ * it, so it waits on the retired list for shc_leave.
+ *
+ * Counting in before loading the map is what makes that safe.  A map only
+ * goes on the retired list after it has stopped being cache->map, and only
+ * comes off (under the lock) when there are no readers, so any lookup that
+ * could have loaded it is still counted.
+ */
+static etcd_shc_map *
+shc_enter (etcd_shcache_t *cache)
+{
+        etcd_shc_map    *map;
+        etcd_shc_map    *fresh;
+
+        __atomic_add_fetch(&cache->readers,1,__ATOMIC_SEQ_CST);
+        map = __atomic_load_n(&cache->map,__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&map->header->retired,__ATOMIC_ACQUIRE)) {
+                return map;
+        }
+
+        pthread_mutex_lock(&cache->lock);
+        map = cache->map;
+        if (map->header->retired) {
+                fresh = shc_map_open(cache->path);
+                if (fresh) {
+                        __atomic_store_n(&cache->map,fresh,__ATOMIC_SEQ_CST);
+                        map->next = cache->retired;
+                        __atomic_store_n(&cache->retired,map,
+                                         __ATOMIC_RELEASE);
+                        map = fresh;
                 }
         }
+        pthread_mutex_unlock(&cache->lock);
+        return map;
+}
+
+
+static void
+shc_leave (etcd_shcache_t *cache)
+{
+        etcd_shc_map    *map;
+        etcd_shc_map    *next;
+
+        if (__atomic_sub_fetch(&cache->readers,1,__ATOMIC_SEQ_CST) ||
+            !__atomic_load_n(&cache->retired,__ATOMIC_ACQUIRE)) {
+                return;
+        }
+
+        pthread_mutex_lock(&cache->lock);
+        if (__atomic_load_n(&cache->readers,__ATOMIC_SEQ_CST)) {
+                /* Somebody else came in, and will try again on the way out. */
+                map = NULL;
+        }
         else {
-                if (asprintf(&path,"%s?wait=true&recursive=true",pfx) < 0) {
-                        return ETCD_WTF;
-                }
+                map = cache->retired;
+                cache->retired = NULL;
         }
+        pthread_mutex_unlock(&cache->lock);
 
-        memset(&watch,0,sizeof(watch));
-        watch.index_in = index_in;
+        for (; map; map = next) {
+                next = map->next;
+                shc_map_close(map);
+        }
+}
 
-        for (srv = session->servers; srv->host; ++srv) {
-                res = etcd_get_one(session,path,srv,"keys/",NULL,
-                                   parse_watch_response,(char **)&watch);
-                if (res == ETCD_OK) {
-                        if (keyp) {
-                                *keyp = watch.key;
+
+/*
+ * Everything read from a slot is checked against the mapping before use, so
+ * a torn read can waste a little time but never go out of bounds.
+ */
+char *
+etcd_shcache_get (etcd_shcache cache_as_void, char *key)
+{
+        etcd_shcache_t  *cache  = cache_as_void;
+        etcd_shc_map    *map;
+        etcd_shc_slot   *slot;
+        uint64_t        hash;
+        uint64_t        mask;
+        uint64_t        i;
+        uint64_t        n;
+        uint64_t        seq;
+        uint64_t        offset;
+        uint32_t        key_len;
+        uint32_t        value_len;
+        uint32_t        state;
+        size_t          len;
+        char            *value;
+        int             found;
+        unsigned int    spins;
+
+        while (*key == '/') {
+                ++key;
+        }
+        len = strlen(key);
+        hash = hash_key(key);
+
+        map = shc_enter(cache);
+        mask = map->header->num_slots - 1;
+        for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+                slot = &map->slots[i];
+                for (spins = 0; ; ++spins) {
+                        seq = __atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE);
+                        if (seq & 1) {
+                                if (spins >= SHC_MAX_SPINS) {
+                                        /* The publisher died mid-update. */
+                                        shc_leave(cache);
+                                        return NULL;
+                                }
+                                sched_yield();
+                                continue;
                         }
-                        if (valuep) {
-                                *valuep = watch.value;
+                        state = __atomic_load_n(&slot->state,__ATOMIC_RELAXED);
+                        offset = __atomic_load_n(&slot->offset,
+                                                 __ATOMIC_RELAXED);
+                        key_len = __atomic_load_n(&slot->key_len,
+                                                  __ATOMIC_RELAXED);
+                        value_len = __atomic_load_n(&slot->value_len,
+                                                    __ATOMIC_RELAXED);
+                        value = NULL;
+                        found = 0;
+                        if ((state == SHC_LIVE) && (key_len == len) &&
+                            (__atomic_load_n(&slot->hash,__ATOMIC_RELAXED)
+                                        == hash) &&
+                            (offset <= map->header->data_size) &&
+                            (((uint64_t)key_len + value_len + 2) <=
+                                        (map->header->data_size - offset)) &&
+                            !memcmp(map->data+offset,key,len)) {
+                                value = e_malloc(value_len+1);
+                                if (value) {
+                                        memcpy(value,
+                                               map->data+offset+key_len+1,
+                                               value_len);
+                                        value[value_len] = '\0';
+                                }
+                                found = 1;
                         }
-                        if (index_out) {
-                                *index_out = watch.index_out;
+                        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                        if (__atomic_load_n(&slot->seq,__ATOMIC_RELAXED)
+                                        == seq) {
+                                break;
                         }
+                        e_free(value);
+                }
+                if (found) {
+                        shc_leave(cache);
+                        return value;
+                }
+                if (state == SHC_EMPTY) {
                         break;
                 }
         }
 
-        free(path);
-        return res;
+        shc_leave(cache);
+        return NULL;
 }
 
 
-static size_t
-parse_set_response (void *ptr, size_t size, size_t nmemb, void *stream)
+etcd_index
+etcd_shcache_index (etcd_shcache cache_as_void)
 {
-        yajl_val        node;
-        yajl_val        value;
-        etcd_result     res     = ETCD_PROTOCOL_ERROR;
-        /*
-         * Success responses contain prevValue and index.  Failure responses
-         * contain errorCode and cause.  Among all these, index seems to be the
-         * one we're most likely to need later, so look for that.
-         */
-        static const char       *path[] = { "node", "modifiedIndex", NULL };
+        etcd_shcache_t  *cache  = cache_as_void;
+        etcd_shc_map    *map;
+        etcd_index      index;
 
-        node = yajl_tree_parse(ptr,NULL,0);
-        if (node) {
-                value = my_yajl_tree_get(node,path,yajl_t_number);
-                if (value) {
-                        res = ETCD_OK;
+        map = shc_enter(cache);
+        index = __atomic_load_n(&map->header->etcd_index,__ATOMIC_ACQUIRE);
+        shc_leave(cache);
+        return index;
+}
+
+
+void
+etcd_shcache_close (etcd_shcache cache_as_void)
+{
+        etcd_shcache_t  *cache  = cache_as_void;
+        etcd_shc_map    *map;
+        etcd_shc_map    *next;
+
+        shc_map_close(cache->map);
+        for (map = cache->retired; map; map = next) {
+                next = map->next;
+                shc_map_close(map);
+        }
+        pthread_mutex_destroy(&cache->lock);
+        e_free(cache->path);
+        e_free(cache);
+}
+
+
+/*
+ * The publisher's side.  Only its thread ever writes, so the bookkeeping
+ * (how much is used, how many slots are taken) lives in its etcd_shc_map
+ * rather than the file.
+ */
+static etcd_shc_map *
+shc_map_create (const char *path, uint64_t num_slots, uint64_t data_size)
+{
+        etcd_shc_map    *map;
+        size_t          size    = SHC_SIZE(num_slots,data_size);
+        char            *base;
+        int             fd;
+
+        fd = open(path,O_RDWR|O_CREAT|O_TRUNC,0644);
+        if (fd < 0) {
+                return NULL;
+        }
+        if (ftruncate(fd,size) != 0) {
+                close(fd);
+                unlink(path);
+                return NULL;
+        }
+        base = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+        close(fd);
+        if (base == MAP_FAILED) {
+                unlink(path);
+                return NULL;
+        }
+
+        map = e_calloc(1,sizeof(*map));
+        if (!map) {
+                munmap(base,size);
+                unlink(path);
+                return NULL;
+        }
+        /* ftruncate gave us zeroes, so every slot is already SHC_EMPTY. */
+        memcpy(base,SHC_MAGIC,sizeof(((etcd_shc_header *)0)->magic));
+        ((etcd_shc_header *)base)->byte_order = SNAP_BYTE_ORDER;
+        ((etcd_shc_header *)base)->num_slots = num_slots;
+        ((etcd_shc_header *)base)->data_size = data_size;
+        (void)shc_map_init(map,base,size);
+        return map;
+}
+
+
+static void
+shc_slot_write (etcd_shc_slot *slot, uint32_t state, uint64_t hash,
+                uint64_t offset, uint32_t key_len, uint32_t value_len,
+                etcd_index index)
+{
+        uint64_t        seq     = slot->seq;
+
+        __atomic_store_n(&slot->seq,seq+1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&slot->state,state,__ATOMIC_RELAXED);
+        __atomic_store_n(&slot->hash,hash,__ATOMIC_RELAXED);
+        __atomic_store_n(&slot->offset,offset,__ATOMIC_RELAXED);
+        __atomic_store_n(&slot->key_len,key_len,__ATOMIC_RELAXED);
+        __atomic_store_n(&slot->value_len,value_len,__ATOMIC_RELAXED);
+        __atomic_store_n(&slot->modified_index,index,__ATOMIC_RELAXED);
+        __atomic_store_n(&slot->seq,seq+2,__ATOMIC_RELEASE);
+}
+
+
+/* Returns -1 if there's no room, in which case nothing has changed. */
+static int
+shc_put (etcd_shc_map *map, const char *key, const char *value,
+         etcd_index index)
+{
+        etcd_shc_slot   *slot;
+        etcd_shc_slot   *target = NULL;
+        uint64_t        hash;
+        uint64_t        mask    = map->header->num_slots - 1;
+        uint64_t        i;
+        uint64_t        n;
+        size_t          key_len;
+        size_t          value_len;
+
+        while (*key == '/') {
+                ++key;
+        }
+        key_len = strlen(key);
+        value_len = strlen(value);
+        hash = hash_key(key);
+        if ((key_len + value_len + 2) > (map->header->data_size - map->used)) {
+                return -1;
+        }
+
+        for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+                slot = &map->slots[i];
+                if (slot->state == SHC_EMPTY) {
+                        break;
+                }
+                if (slot->state == SHC_DEAD) {
+                        if (!target) {
+                                target = slot;
+                        }
+                        continue;
                 }
+                if ((slot->hash == hash) && (slot->key_len == key_len) &&
+                    !memcmp(map->data+slot->offset,key,key_len)) {
+                        target = slot;
+                        break;
+                }
+        }
+        if (!target) {
+                /* Keep a quarter free so that misses stay short. */
+                if ((n > mask) ||
+                    ((map->live + map->dead + 1) > (mask + 1) / 4 * 3)) {
+                        return -1;
+                }
+                target = slot;
         }
 
-        *((etcd_result *)stream) = res;
-        return size*nmemb;
+        /* The bytes have to be there before the slot points at them. */
+        memcpy(map->data+map->used,key,key_len+1);
+        memcpy(map->data+map->used+key_len+1,value,value_len+1);
+        if (target->state != SHC_LIVE) {
+                if (target->state == SHC_DEAD) {
+                        --map->dead;
+                }
+                ++map->live;
+        }
+        shc_slot_write(target,SHC_LIVE,hash,map->used,key_len,value_len,
+                       index);
+        map->used += key_len + value_len + 2;
+        return 0;
 }
 
-static size_t
-parse_lock_response (void *ptr, size_t size, size_t nmemb, void *stream)
+
+static void
+shc_kill (etcd_shc_map *map, etcd_shc_slot *slot)
 {
-        *((char **)stream) = strdup(ptr);
-        return size*nmemb;
+        shc_slot_write(slot,SHC_DEAD,slot->hash,slot->offset,slot->key_len,
+                       slot->value_len,slot->modified_index);
+        --map->live;
+        ++map->dead;
 }
 
 
-/* 
- * There are two use cases, based on is_lock.
- *
- * If is_lock is null, we use the "keys" namespace.  A null value means an
- * HTTP DELETE; precond and ttl are both ignored.  Otherwise we're setting a
- * value, with *optional* precond and ttl.
- *
- * If is_lock is set, we use the "locks" namespace.  A null value means an
- * HTTP DELETE as before, and we still ignore ttl as before, but now precond
- * must be set to represent the lock index.  Otherwise ttl must be present,
- * and we decide what to do based on precond.  If it's null, this is an
- * initial lock so we use an HTTP POST.  Otherwise it's a renewal so we use
- * an HTTP PUT instead.
+/*
+ * A single key is found the same way shc_put placed it.  With is_dir,
+ * everything under key goes as well, which means looking at every slot.
  */
-static etcd_result
-etcd_set_one (_etcd_session *session, const char *key, const char *value,
-              const char *precond, unsigned int ttl, etcd_server *srv,
-              char **is_lock)
+static void
+shc_delete (etcd_shc_map *map, const char *key, int is_dir)
 {
-        char                    *url = NULL;
-        char                    *contents       = NULL;
-        CURL                    *curl           = NULL;
-        etcd_result             res             = ETCD_WTF;
-        CURLcode                curl_res;
-        void                    *err_label      = &&done;
-        char                    *namespace = NULL;
-        char                    *http_cmd = NULL;
-        char                    *orig_index = NULL;
+        etcd_shc_slot   *slot;
+        uint64_t        hash;
+        uint64_t        mask    = map->header->num_slots - 1;
+        uint64_t        i;
+        uint64_t        n;
+        size_t          key_len;
+        const char      *k;
 
-        if (is_lock) {
-          namespace = (char *)"mod/v2/lock";
-                if (value) {
-                        if (!ttl) {
-                                /* Lock/renew must specify ttl. */
-                                return ETCD_WTF;
+        while (*key == '/') {
+                ++key;
+        }
+        key_len = strlen(key);
+
+        if (!is_dir) {
+                hash = hash_key(key);
+                for (i = hash & mask, n = 0; n <= mask;
+                     i = (i + 1) & mask, ++n) {
+                        slot = &map->slots[i];
+                        if (slot->state == SHC_EMPTY) {
+                                break;
                         }
-                        http_cmd = precond ? (char *)"PUT" : (char *)"POST";
-                }
-                else {
-                        if (!precond) {
-                                /* Unlock must specify index. */
-                                return ETCD_WTF;
+                        if ((slot->state == SHC_LIVE) &&
+                            (slot->hash == hash) &&
+                            (slot->key_len == key_len) &&
+                            !memcmp(map->data+slot->offset,key,key_len)) {
+                                shc_kill(map,slot);
+                                break;
                         }
-                        http_cmd = (char *)"DELETE";
                 }
-                orig_index = *is_lock;
+                return;
         }
-        else {
-                namespace = (char *)"v2/keys";
-                http_cmd = value ? (char *)"PUT" : (char *)"DELETE";
+
+        for (i = 0; i <= mask; ++i) {
+                slot = &map->slots[i];
+                if (slot->state != SHC_LIVE) {
+                        continue;
+                }
+                k = map->data + slot->offset;
+                if (strncmp(k,key,key_len) ||
+                    (k[key_len] && (k[key_len] != '/'))) {
+                        continue;
+                }
+                shc_kill(map,slot);
         }
+}
 
-        if (asprintf(&url,"http://%s:%u/%s/%s",
-                     srv->host,srv->port,namespace,key) < 0) {
-                goto *err_label;
+
+/*
+ * Put a new file in place of the old one.  The rename has to come first, so
+ * that a reader who sees "retired" and opens the path again gets the new one.
+ */
+static int
+shc_install (etcd_shc_pub *pub, etcd_shc_map *fresh, etcd_index index)
+{
+        __atomic_store_n(&fresh->header->etcd_index,index,__ATOMIC_RELEASE);
+        if (rename(pub->tmp_path,pub->path) != 0) {
+                shc_map_close(fresh);
+                unlink(pub->tmp_path);
+                return -1;
         }
-        err_label = &&free_url;
+        if (pub->map) {
+                __atomic_store_n(&pub->map->header->retired,1,
+                                 __ATOMIC_RELEASE);
+                shc_map_close(pub->map);
+        }
+        pub->map = fresh;
+        return 0;
+}
 
-        if (is_lock) {
-                if (precond) {
-                        if (asprintf(&contents,"index=%s",precond) < 0) {
-                                goto *err_label;
-                        }
-                        err_label = &&free_contents;
+
+/*
+ * Make room: a new file with only the live entries, at least twice as big
+ * as they need (plus whatever's about to be added) so this doesn't happen
+ * again right away.
+ */
+static int
+shc_rebuild (etcd_shc_pub *pub, size_t extra)
+{
+        etcd_shc_map    *old    = pub->map;
+        etcd_shc_map    *fresh;
+        etcd_shc_slot   *slot;
+        uint64_t        num_slots       = old->header->num_slots;
+        uint64_t        data_size       = extra;
+        uint64_t        i;
+
+        for (i = 0; i < old->header->num_slots; ++i) {
+                slot = &old->slots[i];
+                if (slot->state == SHC_LIVE) {
+                        data_size += slot->key_len + slot->value_len + 2;
                 }
-                if (ttl) {
-                        if (contents) {
-                                char *c2;
-                                if (asprintf(&c2,"ttl=%u;%s",ttl,contents) < 0) {
-                                        goto *err_label;
-                                }
-                                free(contents);
-                                contents = c2;
-                        }
-                        else {
-                                if (asprintf(&contents,"ttl=%u",ttl) < 0) {
-                                        goto *err_label;
-                                }
-                        }
-                        err_label = &&free_contents;
+        }
+        data_size *= 2;
+        if (data_size < old->header->data_size) {
+                data_size = old->header->data_size;
+        }
+        while (((old->live + 1) * 2) > num_slots) {
+                num_slots *= 2;
+        }
+
+        fresh = shc_map_create(pub->tmp_path,num_slots,data_size);
+        if (!fresh) {
+                return -1;
+        }
+        for (i = 0; i < old->header->num_slots; ++i) {
+                slot = &old->slots[i];
+                if (slot->state == SHC_LIVE) {
+                        /* Can't fail, given the sizes above. */
+                        (void)shc_put(fresh,old->data+slot->offset,
+                                      old->data+slot->offset+slot->key_len+1,
+                                      slot->modified_index);
+                }
+        }
+        return shc_install(pub,fresh,old->header->etcd_index);
+}
+
+
+typedef struct {
+        etcd_shc_map    *map;
+        int             full;
+} etcd_shc_load_t;
+
+static int
+shc_load_leaf (void *arg, yajl_val node)
+{
+        etcd_shc_load_t *load   = arg;
+        yajl_val        key;
+        yajl_val        value;
+
+        key = node_field(node,"key",yajl_t_string);
+        if (!key) {
+                return 0;
+        }
+        value = node_field(node,"value",yajl_t_string);
+        if (shc_put(load->map,MY_YAJL_GET_STRING(key),
+                    value ? MY_YAJL_GET_STRING(value) : "",
+                    node_index(node,"modifiedIndex")) != 0) {
+                load->full = 1;
+                return -1;
+        }
+        return 0;
+}
+
+
+/*
+ * Start over from a recursive get, into a new file the size of the current
+ * one (or bigger, until it all fits), and resume watching just past it.
+ */
+static etcd_result
+shc_resync (etcd_shc_pub *pub, uint64_t num_slots, uint64_t data_size)
+{
+        etcd_shc_load_t load;
+        etcd_result     res;
+        etcd_index      index;
+
+        if (pub->map) {
+                num_slots = pub->map->header->num_slots;
+                data_size = pub->map->header->data_size;
+        }
+
+        for (;;) {
+                load.full = 0;
+                load.map = shc_map_create(pub->tmp_path,num_slots,data_size);
+                if (!load.map) {
+                        return ETCD_WTF;
                 }
+                index = 0;
+                res = etcd_get_tree(pub->session,pub->pfx,shc_load_leaf,&load,
+                                    &index,&pub->stop);
+                if ((res == ETCD_OK) && index) {
+                        break;
+                }
+                shc_map_close(load.map);
+                unlink(pub->tmp_path);
+                if (!load.full) {
+                        return (res == ETCD_OK) ? ETCD_PROTOCOL_ERROR : res;
+                }
+                num_slots *= 2;
+                data_size *= 2;
+        }
+
+        if (shc_install(pub,load.map,index) != 0) {
+                return ETCD_WTF;
+        }
+        pub->next_index = index + 1;
+        return ETCD_OK;
+}
+
+
+static int
+shc_stopping (etcd_shc_pub *pub)
+{
+        return __atomic_load_n(&pub->stop,__ATOMIC_ACQUIRE);
+}
+
+
+static void
+shc_pause (etcd_shc_pub *pub, unsigned int ms)
+{
+        struct timespec deadline;
+
+        deadline_after_ms(&deadline,ms);
+
+        pthread_mutex_lock(&pub->lock);
+        if (!shc_stopping(pub)) {
+                (void)pthread_cond_timedwait(&pub->wake,&pub->lock,&deadline);
         }
-        else {
-                if (value) {
-                        if (asprintf(&contents,"value=%s",value) < 0) {
-                                goto *err_label;
+        pthread_mutex_unlock(&pub->lock);
+}
+
+
+/* Much the same as watcher_main, except that events go into the file. */
+static void *
+shc_main (void *arg)
+{
+        etcd_shc_pub    *pub    = arg;
+        etcd_watch_t    watch;
+        etcd_response   rsp;
+        etcd_result     res;
+        unsigned int    backoff = 0;
+        size_t          need;
+
+        cur_alloc = &pub->session->alloc;
+        memset(&rsp,0,sizeof(rsp));
+        rsp.cancel = &pub->stop;
+
+        while (!shc_stopping(pub)) {
+                memset(&watch,0,sizeof(watch));
+                if (!pub->next_index) {
+                        res = shc_resync(pub,0,0);
+                        if (res == ETCD_OK) {
+                                backoff = 0;
+                                continue;
                         }
-                        err_label = &&free_contents;
                 }
-                if (precond) {
-                        char *c2;
-                        if (asprintf(&c2,"%s;prevValue=%s",contents,
-                                     precond) < 0) {
-                                goto *err_label;
+                else {
+                        res = etcd_watch_internal(pub->session,pub->pfx,
+                                                  &pub->next_index,&watch,
+                                                  &rsp);
+                }
+
+                if (res == ETCD_INDEX_CLEARED) {
+                        pub->next_index = 0;
+                }
+                if ((res != ETCD_OK) || !watch.key) {
+                        e_free(watch.key);
+                        e_free(watch.value);
+                }
+                if (res == ETCD_INDEX_CLEARED) {
+                        continue;
+                }
+                if (res != ETCD_OK) {
+                        backoff = backoff ? backoff * 2 : 100;
+                        if (backoff > MAX_BACKOFF_MS) {
+                                backoff = MAX_BACKOFF_MS;
                         }
-                        free(contents);
-                        contents = c2;
-                        err_label = &&free_contents;
+                        shc_pause(pub,backoff);
+                        continue;
                 }
-                if (ttl) {
-                        char *c2;
-                        if (asprintf(&c2,"%s;ttl=%u",contents,ttl) < 0) {
-                                goto *err_label;
+                backoff = 0;
+                if (!watch.key) {
+                        continue;
+                }
+
+                if (watch.deleted) {
+                        shc_delete(pub->map,watch.key,watch.is_dir);
+                }
+                else if (!watch.is_dir) {
+                        if (!watch.value) {
+                                watch.value = e_strdup("");
                         }
-                        free(contents);
-                        contents = c2;
-                        err_label = &&free_contents;
+                        need = strlen(watch.key) + strlen(watch.value) + 2;
+                        if (!watch.value ||
+                            ((shc_put(pub->map,watch.key,watch.value,
+                                      watch.index_out) != 0) &&
+                             ((shc_rebuild(pub,need) != 0) ||
+                              (shc_put(pub->map,watch.key,watch.value,
+                                       watch.index_out) != 0)))) {
+                                /* Can't keep up incrementally; start over. */
+                                pub->next_index = 0;
+                        }
+                }
+                if (pub->next_index) {
+                        __atomic_store_n(&pub->map->header->etcd_index,
+                                         watch.index_out,__ATOMIC_RELEASE);
+                        pub->next_index = watch.index_out + 1;
                 }
+                e_free(watch.key);
+                e_free(watch.value);
         }
 
-        curl = curl_easy_init();
-        if (!curl) {
-                goto *err_label;
-        }
-        err_label = &&cleanup_curl;
+        e_free(rsp.data);
+        return NULL;
+}
 
-        /* TBD: add error checking for these */
-        curl_easy_setopt(curl,CURLOPT_CUSTOMREQUEST,http_cmd);
-        curl_easy_setopt(curl,CURLOPT_URL,url);
-        curl_easy_setopt(curl,CURLOPT_FOLLOWLOCATION,1L);
-        curl_easy_setopt(curl,CURLOPT_POSTREDIR,CURL_REDIR_POST_ALL);
 
-        if (is_lock && value && !precond) {
-                /* Only do this for an initial lock, not a renewal. */
-                curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION,
-                                  parse_lock_response);
-                curl_easy_setopt(curl,CURLOPT_WRITEDATA,is_lock);
+etcd_shcache_pub
+etcd_shcache_publish (etcd_session session_as_void, char *pfx, char *path,
+                      size_t slots, size_t data_size)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_shc_pub    *pub;
+        uint64_t        num_slots       = 64;
+        void            *err_label      = &&done;
+        USE_ALLOCATOR(&session->alloc);
+
+        if (!slots) {
+                slots = DEFAULT_SHC_SLOTS;
         }
-        else {
-                curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION,
-                                  parse_set_response);
-                curl_easy_setopt(curl,CURLOPT_WRITEDATA,&res);
+        if (!data_size) {
+                data_size = DEFAULT_SHC_DATA;
         }
-
-        /*
-         * CURLOPT_HTTPPOST would be easier, but it looks like etcd will barf on
-         * that.  Sigh.
-         */
-        if (contents) {
-                curl_easy_setopt(curl,CURLOPT_POST,1L);
-                curl_easy_setopt(curl,CURLOPT_POSTFIELDS,contents);
+        while (num_slots < slots) {
+                num_slots <<= 1;
         }
-#if defined(DEBUG)
-        curl_easy_setopt(curl,CURLOPT_VERBOSE,1L);
-#endif
 
-        curl_res = curl_easy_perform(curl);
-        if (curl_res != CURLE_OK) {
-                print_curl_error("perform",curl_res);
+        pub = e_calloc(1,sizeof(*pub));
+        if (!pub) {
                 goto *err_label;
         }
+        err_label = &&free_pub;
+        pub->session = session;
 
-        if (is_lock && value) {
-                if (!precond) {
-                        /*
-                         * If this is an initial lock, parse_lock_response would
-                         * have been unable to set "res" for us.  Instead, we
-                         * set it here if the index string got updated.
-                         */
-                        if (*is_lock != orig_index) {
-                                res = ETCD_OK;
-                        }
-                }
-                else {
-                        /*
-                         * If this is a lock renewal, then a successful call
-                         * will pass through neither parse_lock_response nor
-                         * parse_get_response.  The curl response code alone
-                         * is sufficient.
-                         */
-                        res = ETCD_OK;
-                }
+        pub->pfx = e_strdup(pfx);
+        if (!pub->pfx) {
+                goto *err_label;
         }
+        err_label = &&free_pfx;
 
-        /*
-         * If the request succeeded, or at least got to the server and failed
-         * there, parse_set_response should have set res appropriately.
-         */
-
-cleanup_curl:
-        curl_easy_cleanup(curl);
-free_contents:
-        free(contents); /* might already be NULL for delete, but that's OK */
-free_url:
-        free(url);
-done:
-        return res;
-}
+        pub->path = e_strdup(path);
+        if (!pub->path) {
+                goto *err_label;
+        }
+        err_label = &&free_path;
 
+        if (e_asprintf(&pub->tmp_path,"%s.tmp",path) < 0) {
+                goto *err_label;
+        }
+        err_label = &&free_tmp_path;
 
-etcd_result
-etcd_set (etcd_session session_as_void, char *key, char *value,
-          char *precond, unsigned int ttl)
-{
-        _etcd_session   *session   = session_as_void;
-        etcd_server     *srv;
-        etcd_result     res = ETCD_WTF;
+        /* Readers can count on the file being complete from the start. */
+        if (shc_resync(pub,num_slots,data_size) != ETCD_OK) {
+                goto *err_label;
+        }
+        err_label = &&close_map;
 
-        for (srv = session->servers; srv->host; ++srv) {
-                res = etcd_set_one(session,key,value,precond,ttl,srv,NULL);
-                /*
-                 * Protocol errors are likely to be things like precondition
-                 * failures, which won't be helped by retrying on another
-                 * server.
-                 */
-                if ((res == ETCD_OK) || (res == ETCD_PROTOCOL_ERROR)) {
-                        return res;
-                }
+        pthread_mutex_init(&pub->lock,NULL);
+        pthread_cond_init(&pub->wake,NULL);
+        if (pthread_create(&pub->thread,NULL,shc_main,pub) != 0) {
+                pthread_cond_destroy(&pub->wake);
+                pthread_mutex_destroy(&pub->lock);
+                goto *err_label;
         }
 
-        return ETCD_WTF;
+        return pub;
+
+close_map:
+        shc_map_close(pub->map);
+free_tmp_path:
+        e_free(pub->tmp_path);
+free_path:
+        e_free(pub->path);
+free_pfx:
+        e_free(pub->pfx);
+free_pub:
+        e_free(pub);
+done:
+        return NULL;
 }
 
 
-/*
- * This uses the same path and status checks as SET, but with a different HTTP
- * command instead of data.  Precondition and TTL are obviously not used in
- * this case, though a conditional delete would be a cool feature for etcd.  I
- * think you can get a timed delete by doing a conditional set to the current
- * value with a TTL, but I haven't actually tried it.
- */
-etcd_result
-etcd_delete (etcd_session session_as_void, char *key)
+void
+etcd_shcache_unpublish (etcd_shcache_pub pub_as_void)
 {
-        _etcd_session   *session   = session_as_void;
-        etcd_server     *srv;
-        etcd_result     res        = ETCD_WTF;
+        etcd_shc_pub    *pub    = pub_as_void;
+        USE_ALLOCATOR(&pub->session->alloc);
 
-        for (srv = session->servers; srv->host; ++srv) {
-                res = etcd_set_one(session,key,NULL,NULL,0,srv,NULL);
-                if (res == ETCD_OK) {
-                        break;
-                }
-        }
+        pthread_mutex_lock(&pub->lock);
+        __atomic_store_n(&pub->stop,1,__ATOMIC_RELEASE);
+        pthread_cond_broadcast(&pub->wake);
+        pthread_mutex_unlock(&pub->lock);
+        pthread_join(pub->thread,NULL);
 
-        return res;
+        pthread_cond_destroy(&pub->wake);
+        pthread_mutex_destroy(&pub->lock);
+        shc_map_close(pub->map);
+        e_free(pub->tmp_path);
+        e_free(pub->path);
+        e_free(pub->pfx);
+        e_free(pub);
 }
 
 
@@ -661,9 +7501,12 @@ etcd_lock (etcd_session session_as_void, char *key, unsigned int ttl,
         etcd_server     *srv;
         etcd_result     res             = ETCD_WTF;
         char            *tmp            = NULL;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
 
-        for (srv = session->servers; srv->host; ++srv) {
-                res = etcd_set_one(session,key,"hack",index_in,ttl,srv,&tmp);
+        for (srv = members->servers; srv->host; ++srv) {
+                res = etcd_set_one(session,members,key,"hack",index_in,ttl,
+                                   srv,&tmp);
                 if (res == ETCD_OK) {
                         if (index_out) {
                                 *index_out = tmp;
@@ -683,9 +7526,12 @@ etcd_unlock (etcd_session session_as_void, char *key, char *index)
         etcd_server     *srv;
         etcd_result     res        = ETCD_WTF;
         char            *tmp       = NULL;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
 
-        for (srv = session->servers; srv->host; ++srv) {
-                res = etcd_set_one(session,key,NULL,index,0,srv,&tmp);
+        for (srv = members->servers; srv->host; ++srv) {
+                res = etcd_set_one(session,members,key,NULL,index,0,srv,
+                                   &tmp);
                 if (res == ETCD_OK) {
                         break;
                 }
@@ -705,7 +7551,8 @@ store_leader (void *ptr, size_t size, size_t nmemb, void *stream)
         if (node) {
                 value = my_yajl_tree_get(node,path,yajl_t_string);
                 if (value) {
-                        *((char **)stream) = strdup(MY_YAJL_GET_STRING(value));
+                        *((char **)stream) =
+                                e_strdup(MY_YAJL_GET_STRING(value));
                 }
         }
 
@@ -720,10 +7567,12 @@ etcd_leader (etcd_session session_as_void)
         etcd_server     *srv;
         etcd_result     res        = ETCD_WTF;
         char            *value     = NULL;
+        USE_ALLOCATOR(&session->alloc);
+        USE_MEMBERS(session,members);
 
-        for (srv = session->servers; srv->host; ++srv) {
-                res = etcd_get_one(session,"stats/leader",srv,"",NULL,
-                                   store_leader,&value);
+        for (srv = members->servers; srv->host; ++srv) {
+                res = etcd_get_one(session,members,"stats/leader",srv,"",
+                                   NULL,store_leader,&value,NULL);
                 if ((res == ETCD_OK) && value) {
                         return value;
                 }
@@ -739,9 +7588,9 @@ free_sl (etcd_server *server_list)
         size_t          num_servers;
 
         for (num_servers = 0; server_list[num_servers].host; ++num_servers) {
-                free(server_list[num_servers].host);
+                e_free(server_list[num_servers].host);
         }
-        free(server_list);
+        e_free(server_list);
 }
 
 
@@ -765,15 +7614,23 @@ _count_matching (const char *text, const char *cset, int result)
 #define count_nonmatching(t,cs) _count_matching(t,cs,0)
 
 
-etcd_session
-etcd_open_str (char *server_names)
+/*
+ * Turn a list of servers into an array for etcd_open.  Entries are host:port
+ * (or just host) separated by anything in SL_DELIM, or the absolute path of
+ * a Unix socket, optionally after "unix:".  With "urls" set, as for
+ * what the machines endpoint sends back, each one has to look like
+ * http://host:port instead, possibly followed by a path we don't care about;
+ * anything else means we got something other than a member list, so we give
+ * up rather than start sending requests to nonsense.
+ */
+static etcd_server *
+parse_sl (const char *server_names, int urls)
 {
-        char            *snp;
+        const char      *snp;
         int             run_len;
         int             host_len;
-        size_t           num_servers;
+        size_t          num_servers;
         etcd_server     *server_list;
-        etcd_session    *session;
 
         /*
          * Yeah, we iterate over the string twice so we can allocate an
@@ -798,7 +7655,7 @@ etcd_open_str (char *server_names)
                 return NULL;
         }
 
-        server_list = calloc(num_servers+1,sizeof(*server_list));
+        server_list = e_calloc(num_servers+1,sizeof(*server_list));
         if (!server_list) {
                 return NULL;
         }
@@ -811,24 +7668,71 @@ etcd_open_str (char *server_names)
                         snp += count_matching(snp,SL_DELIM);
                         continue;
                 }
-                host_len = count_nonmatching(snp,":");
-                if ((run_len - host_len) > 1) {
-                        server_list[num_servers].host = strndup(snp,host_len);
+                if (urls) {
+                        if ((run_len <= 7) || strncmp(snp,"http://",7)) {
+                                free_sl(server_list);
+                                return NULL;
+                        }
+                        snp += 7;
+                        run_len -= 7;
+                }
+                else if (!strncmp(snp,"unix:/",6) || (*snp == '/') ||
+                         !strncmp(snp,SIDECAR_PREFIX "/",
+                                  SIDECAR_PREFIX_LEN+1)) {
+                        /* A sidecar keeps its prefix; see SRV_IS_SIDECAR. */
+                        host_len = !strncmp(snp,"unix:",5) ? 5 : 0;
+                        server_list[num_servers].host =
+                                e_strndup(snp+host_len,run_len-host_len);
+                        if (!server_list[num_servers].host) {
+                                free_sl(server_list);
+                                return NULL;
+                        }
+                        ++num_servers;
+                        snp += run_len;
+                        continue;
+                }
+                host_len = count_nonmatching(snp,":/");
+                if (host_len > run_len) {
+                        host_len = run_len;
+                }
+                server_list[num_servers].host = e_strndup(snp,host_len);
+                if (!server_list[num_servers].host) {
+                        free_sl(server_list);
+                        return NULL;
+                }
+                if ((snp[host_len] == ':') && ((run_len - host_len) > 1)) {
                         server_list[num_servers].port = (unsigned short)
                                 strtoul(snp+host_len+1,NULL,10);
                 }
                 else {
-                        server_list[num_servers].host = strndup(snp,run_len);
                         server_list[num_servers].port = DEFAULT_ETCD_PORT;
                 }
                 ++num_servers;
                 snp += run_len;
         }
 
+        return server_list;
+}
+
+
+etcd_session
+etcd_open_str (char *server_names)
+{
+        etcd_server     *server_list;
+        _etcd_session   *session;
+
+        server_list = parse_sl(server_names,0);
+        if (!server_list) {
+                return NULL;
+        }
+
         session = etcd_open(server_list);
         if (!session) {
                 free_sl(server_list);
+                return NULL;
         }
+        /* From here on the list goes wherever the members go. */
+        session->members->owned = 1;
         return session;
 }
 
@@ -836,6 +7740,184 @@ etcd_open_str (char *server_names)
 void
 etcd_close_str (etcd_session session)
 {
-        free_sl(((_etcd_session *)session)->servers);
         etcd_close(session);
 }
+
+
+/*
+ * Membership discovery.  The machines endpoint answers with a plain list of
+ * client URLs, e.g. "http://10.0.0.1:2379, http://10.0.0.2:2379".  If that's
+ * not what we already have, it becomes the session's new server list, with
+ * the statistics carried over for servers that were in the old one.  Requests
+ * already in flight keep the old list until they're done with it.
+ */
+static size_t
+store_machines (void *ptr, size_t size, size_t nmemb, void *stream)
+{
+        *((char **)stream) = e_strndup(ptr,size*nmemb);
+        return size * nmemb;
+}
+
+
+static int
+same_server (const etcd_server *a, const etcd_server *b)
+{
+        return (a->port == b->port) && !strcmp(a->host,b->host);
+}
+
+
+static etcd_result
+discover (_etcd_session *session)
+{
+        etcd_server     *srv;
+        etcd_server     *server_list;
+        etcd_members    *fresh;
+        etcd_result     res             = ETCD_WTF;
+        char            *text           = NULL;
+        size_t          i;
+        size_t          j;
+        USE_MEMBERS(session,members);
+
+        for (srv = members->servers; srv->host; ++srv) {
+                if (SRV_IS_LOCAL(srv)) {
+                        /*
+                         * A local proxy or sidecar keeps its own list, and
+                         * the cluster would only tell us TCP addresses that
+                         * we were meant to go around.
+                         */
+                        return ETCD_OK;
+                }
+        }
+
+        for (srv = members->servers; srv->host; ++srv) {
+                res = etcd_get_one(session,members,"machines",srv,"",NULL,
+                                   store_machines,&text,NULL);
+                if ((res == ETCD_OK) && text) {
+                        break;
+                }
+        }
+        if (!text) {
+                return (res == ETCD_OK) ? ETCD_PROTOCOL_ERROR : res;
+        }
+
+        server_list = parse_sl(text,1);
+        e_free(text);
+        if (!server_list) {
+                return ETCD_PROTOCOL_ERROR;
+        }
+
+        for (i = 0; server_list[i].host && members->servers[i].host; ++i) {
+                if (!same_server(&server_list[i],&members->servers[i])) {
+                        break;
+                }
+        }
+        if (!server_list[i].host && !members->servers[i].host) {
+                free_sl(server_list);
+                return ETCD_OK;
+        }
+
+        fresh = members_new(server_list,1);
+        if (!fresh) {
+                free_sl(server_list);
+                return ETCD_WTF;
+        }
+        for (i = 0; i < fresh->num_servers; ++i) {
+                for (j = 0; j < members->num_servers; ++j) {
+                        if (same_server(&fresh->servers[i],
+                                        &members->servers[j])) {
+                                hist_copy(&fresh->stats[i],
+                                          &members->stats[j]);
+                                break;
+                        }
+                }
+        }
+        members_swap(session,fresh);
+        return ETCD_OK;
+}
+
+
+static void *
+discovery_main (void *arg)
+{
+        _etcd_session   *session        = arg;
+        struct timespec deadline;
+        int             stop;
+
+        cur_alloc = &session->alloc;
+        for (;;) {
+                pthread_mutex_lock(&session->discovery_lock);
+                deadline_after_ms(&deadline,session->discovery_ms);
+                while (!session->discovery_stop &&
+                       (pthread_cond_timedwait(&session->discovery_cond,
+                                               &session->discovery_lock,
+                                               &deadline) != ETIMEDOUT)) {
+                        /* Spurious wakeup; keep waiting. */
+                }
+                stop = session->discovery_stop;
+                pthread_mutex_unlock(&session->discovery_lock);
+                if (stop) {
+                        break;
+                }
+                /* A failure just leaves the old list, until next time. */
+                (void)discover(session);
+        }
+
+        return NULL;
+}
+
+
+etcd_result
+etcd_discover (etcd_session session_as_void)
+{
+        _etcd_session   *session        = session_as_void;
+        USE_ALLOCATOR(&session->alloc);
+
+        return discover(session);
+}
+
+
+etcd_result
+etcd_set_discovery (etcd_session session_as_void, unsigned int interval_ms)
+{
+        _etcd_session   *session        = session_as_void;
+        etcd_result     res;
+        int             running;
+        USE_ALLOCATOR(&session->alloc);
+
+        pthread_mutex_lock(&session->discovery_lock);
+        running = (session->discovery_ms != 0);
+        if (running && interval_ms) {
+                /* Takes effect after the current wait. */
+                session->discovery_ms = interval_ms;
+                pthread_mutex_unlock(&session->discovery_lock);
+                return ETCD_OK;
+        }
+        if (running) {
+                session->discovery_stop = 1;
+                pthread_cond_signal(&session->discovery_cond);
+        }
+        pthread_mutex_unlock(&session->discovery_lock);
+
+        if (running) {
+                pthread_join(session->discovery_thread,NULL);
+                pthread_mutex_lock(&session->discovery_lock);
+                session->discovery_ms = 0;
+                pthread_mutex_unlock(&session->discovery_lock);
+                return ETCD_OK;
+        }
+
+        if (!interval_ms) {
+                return ETCD_OK;
+        }
+
+        res = discover(session);
+        session->discovery_stop = 0;
+        session->discovery_ms = interval_ms;
+        if (pthread_create(&session->discovery_thread,NULL,discovery_main,
+                           session) != 0) {
+                session->discovery_ms = 0;
+                return ETCD_WTF;
+        }
+
+        return res;
+}
@@ -24,6 +24,19 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The library is built with -fvisibility=hidden, so that the compiler is free
+ * to inline or drop its internal helpers.  Everything declared here is the
+ * public API and has to stay visible.
+ */
+#if defined(__GNUC__)
+#pragma GCC visibility push(default)
+#endif
+
 /*
  * Description of an etcd server.  For now it just includes the name and
  * port, but some day it might include other stuff like SSL certificate
@@ -33,10 +46,25 @@
 typedef enum {
         ETCD_OK = 0,
         ETCD_PROTOCOL_ERROR,
+        ETCD_INDEX_CLEARED,     /* watch index fell out of etcd's history */
+        ETCD_TIMEOUT,           /* nothing happened within the time limit */
+        ETCD_NOT_FOUND,         /* no such key */
+        ETCD_PRECOND_FAILED,    /* prevValue/prevIndex/prevExist didn't hold */
                                 /* TBD: add other error categories here */
         ETCD_WTF                /* anything we can't easily categorize */
 } etcd_result;
 
+/*
+ * etcd's own indices are 64-bit, and a long-lived cluster can overflow
+ * anything smaller.
+ */
+typedef uint64_t etcd_index;
+
+/*
+ * A host that starts with a slash is the path of a Unix socket instead, e.g.
+ * "/run/etcd/proxy.sock" for a proxy on the same machine, and the port is
+ * then ignored.
+ */
 typedef struct {
         char            *host;
         unsigned short  port;
@@ -62,7 +90,12 @@ etcd_session    etcd_open       (etcd_server *server_list);
  * etcd_open_str
  *
  * Same as etcd_open, except that the servers are specified as a list of
- * host:port strings, separated by comma/semicolon or whitespace.
+ * host:port strings, separated by comma/semicolon or whitespace.  A Unix
+ * socket can be given as its absolute path, optionally prefixed with "unix:",
+ * e.g. "unix:/run/etcd/proxy.sock,10.0.0.1:2379".  "sidecar:/path" means an
+ * etcd-sidecar daemon listening on that socket, which shares its connections
+ * to the cluster among every process on the host; the same host string works
+ * in an etcd_server too.
  */
 etcd_session    etcd_open_str   (char *server_names);
 
@@ -79,12 +112,96 @@ void            etcd_close      (etcd_session session);
 /*
  * etcd_close
  *
- * Same as etcd_close, but also free the server list as etcd_open_str would
- * have allocated it.
+ * Same as etcd_close, which now frees the server list from etcd_open_str by
+ * itself; this is still here for callers that pair it with etcd_open_str.
  */
 void            etcd_close_str  (etcd_session session);
 
 
+/*
+ * etcd_discover
+ *
+ * Ask the cluster who its members are, via the machines endpoint, and make
+ * that the session's server list from now on.  Requests already in flight
+ * finish with the list they started with, and per-server statistics carry
+ * over for servers that are in both.  Nothing changes if the answer is the
+ * same list, or if no server gives a usable answer (in which case the result
+ * says why).  Requests that started before a change can still be using the
+ * list etcd_open was given, so keep that valid for as long as the session
+ * anyway.  Discovered lists come from the session's allocator.  A list with
+ * a Unix socket or sidecar server in it is left alone (and the result is
+ * ETCD_OK), since whatever is behind the socket is doing the routing.
+ */
+etcd_result     etcd_discover   (etcd_session session);
+
+
+/*
+ * etcd_set_discovery
+ *
+ * Do etcd_discover now, and then again every interval_ms in the background,
+ * so that the session follows the cluster as members are added and replaced
+ * instead of trying dead ones until it's reopened.  A failed refresh just
+ * leaves the list as it was until the next one.  Returns the result of the
+ * first discovery; even if that fails the background refreshes go ahead.
+ *
+ *      interval_ms
+ *      How often to refresh, in milliseconds.  Zero turns it off.  A change
+ *      while it's on takes effect after the current wait.  Don't turn it on
+ *      or off from more than one thread at once.
+ */
+etcd_result     etcd_set_discovery      (etcd_session session,
+                                         unsigned int interval_ms);
+
+
+/*
+ * etcd_set_allocator
+ *
+ * Route the library's memory allocation through the caller's own functions,
+ * e.g. to use a jemalloc arena or a per-request bump allocator.  That covers
+ * internal buffers as well as everything handed back to the caller (values,
+ * keys, watcher events, batch results and so on), which must then be released
+ * with etcd_free instead of free.
+ *
+ *      session
+ *      The session to apply this to, or NULL to set the global allocator.
+ *      New sessions (and everything not tied to a session, like snapshots
+ *      and the server list from etcd_open_str) use whatever the global
+ *      allocator is at the time.  The global allocator should be set before
+ *      anything else in the library is used, and a session's before anything
+ *      else is done with that session; switching allocators while memory
+ *      from the old one is still live is the caller's problem.
+ *
+ *      malloc_fn, realloc_fn, free_fn
+ *      Same contract as the C library functions, plus the context pointer.
+ *      Passing NULL for any of them goes back to the C library.
+ *
+ *      ctx
+ *      Handed to each of the above as their first argument.
+ *
+ * If a global allocator is set before the first etcd_open, curl's own
+ * allocations go through it too.  YAJL's tree parser has no allocator hook,
+ * so the temporary parse trees it builds still come from the C library.
+ */
+typedef void *  etcd_malloc_fn  (void *ctx, size_t size);
+typedef void *  etcd_realloc_fn (void *ctx, void *ptr, size_t size);
+typedef void    etcd_free_fn    (void *ctx, void *ptr);
+
+void            etcd_set_allocator (etcd_session session,
+                                    etcd_malloc_fn *malloc_fn,
+                                    etcd_realloc_fn *realloc_fn,
+                                    etcd_free_fn *free_fn, void *ctx);
+
+
+/*
+ * etcd_free
+ *
+ * Free memory that the library handed back for the caller to free, using
+ * the session's allocator (or the global one if session is NULL).  With the
+ * default allocator this is just free.
+ */
+void            etcd_free       (etcd_session session, void *ptr);
+
+
 /*
  * etcd_get
  *
@@ -97,6 +214,35 @@ void            etcd_close_str  (etcd_session session);
 char *          etcd_get (etcd_session session, char *key);
 
 
+/*
+ * etcd_get_ex
+ *
+ * Same as etcd_get, but also return the indices and TTL that go with the
+ * value, plus X-Etcd-Index from the response.  The last is what makes it
+ * possible to get a value and then watch for changes without a window in
+ * between: just watch from etcd_index+1.  That works even when the result is
+ * ETCD_NOT_FOUND, in which case everything but etcd_index will be zero.
+ *
+ *      key
+ *      The etcd key (path) to fetch.
+ *
+ *      node
+ *      Space for the results.  The value is a newly allocated string, which
+ *      must be freed by the caller.
+ */
+
+typedef struct {
+        char            *value;
+        etcd_index      modified_index;
+        etcd_index      created_index;
+        int64_t         ttl;            /* seconds left, or zero for none */
+        etcd_index      etcd_index;     /* X-Etcd-Index from the response */
+} etcd_node;
+
+etcd_result     etcd_get_ex (etcd_session session, char *key,
+                             etcd_node *node);
+
+
 /*
  * etcd_watch
  * Watch the set of keys matching a prefix.
@@ -130,6 +276,88 @@ etcd_result     etcd_watch (etcd_session session, char *pfx,
                             int *index_in, int *index_out);
 
 
+/*
+ * etcd_watch_ex
+ *
+ * Same as etcd_watch, but with 64-bit indices to match etcd's own.  New code
+ * should use this instead.
+ */
+
+etcd_result     etcd_watch_ex (etcd_session session, char *pfx,
+                               char **keyp, char **valuep,
+                               etcd_index *index_in, etcd_index *index_out);
+
+
+/*
+ * etcd_watcher_start
+ *
+ * Start a background watch on a prefix.  A network thread issues the watches
+ * and hands events to any number of consumer threads through a bounded
+ * lock-free ring.  If the consumers fall so far behind that etcd has thrown
+ * away the history we need (ETCD_INDEX_CLEARED), the watcher does a recursive
+ * get of the prefix, emits synthetic events for whatever changed in the
+ * meantime, and carries on watching from there.
+ *
+ *      pfx
+ *      The etcd key prefix (like a path) to watch.
+ *
+ *      index_in
+ *      Pointer to the first index to watch for, or NULL to mean "now".  In
+ *      the latter case the watcher starts with a recursive get so that it
+ *      knows what's already there, but doesn't report those keys as events.
+ *
+ *      ring_size
+ *      Number of events that can be queued before the network thread stops
+ *      reading from etcd.  Rounded up to a power of two; zero means a
+ *      reasonable default.
+ */
+
+typedef void *etcd_watcher;
+
+typedef struct {
+        char            *key;
+        char            *value;         /* NULL for a delete or a dir */
+        etcd_index      index;          /* modifiedIndex of the change */
+        int             is_dir;
+        int             deleted;        /* delete or expire */
+        int             resync;         /* synthesized after a resync */
+} etcd_event;
+
+etcd_watcher    etcd_watcher_start (etcd_session session, char *pfx,
+                                    etcd_index *index_in,
+                                    unsigned int ring_size);
+
+
+/*
+ * etcd_watcher_next
+ *
+ * Take the next event from a watcher.  Safe to call from several threads at
+ * once; each event goes to exactly one of them.  The key and value in the
+ * event are newly allocated strings, which must be freed by the caller.  A
+ * directory being created has no value either, so look at "deleted" rather
+ * than at the value to tell the two apart.
+ *
+ *      timeout_ms
+ *      How long to wait for an event.  Zero means don't wait at all, and a
+ *      negative number means wait forever.  Returns ETCD_TIMEOUT if nothing
+ *      arrived in time, or ETCD_WTF if the watcher is being stopped.
+ */
+
+etcd_result     etcd_watcher_next (etcd_watcher watcher, etcd_event *ev,
+                                   int timeout_ms);
+
+
+/*
+ * etcd_watcher_stop
+ *
+ * Stop the network thread and free the watcher, including any events that
+ * were never consumed.  Consumers already waiting in etcd_watcher_next will
+ * get ETCD_WTF, but nobody may call it once etcd_watcher_stop has started.
+ */
+
+void            etcd_watcher_stop (etcd_watcher watcher);
+
+
 /*
  * etcd_set
  *
@@ -144,7 +372,8 @@ etcd_result     etcd_watch (etcd_session session, char *pfx,
  *
  *      precond
  *      Required previous value as a null-terminated string, or NULL to mean
- *      an unconditional set.
+ *      an unconditional set.  If it doesn't match, the result is
+ *      ETCD_PRECOND_FAILED.
  *
  *      ttl
  *      Time in seconds after which the value will automatically expire and be
@@ -155,6 +384,100 @@ etcd_result     etcd_set        (etcd_session session, char *key, char *value,
                                  char *precond, unsigned int ttl);
 
 
+/*
+ * etcd_set_combine
+ *
+ * Turn write combining on or off for a session.  While it's on, an
+ * unconditional etcd_set just records the new value and returns, and a
+ * background thread writes out the latest value for each key once per
+ * window.  Keys that are set many times a second then only cost one write
+ * per window.  The price is that the write happens later, a failure can only
+ * be reported by etcd_flush, and an etcd_get in the meantime will see the old
+ * value.  A write that fails stays pending and is tried again in the next
+ * window, unless the server turned it down.  Conditional sets and deletes
+ * are never combined, and always happen after any pending write to the same
+ * key; one that fails leaves the pending write where it was.
+ *
+ *      window_ms
+ *      How often to write, in milliseconds.  Zero turns combining off, after
+ *      writing out anything that's pending.  Don't turn it on or off from
+ *      more than one thread at once.
+ */
+
+etcd_result     etcd_set_combine (etcd_session session,
+                                  unsigned int window_ms);
+
+
+/*
+ * etcd_flush
+ *
+ * Write out all pending combined sets now, instead of waiting for the window
+ * to expire.  Returns an error if this flush or any background flush since
+ * the last etcd_flush failed.
+ */
+
+etcd_result     etcd_flush      (etcd_session session);
+
+
+/*
+ * etcd_set_now
+ *
+ * Same as etcd_set, but never combined, so the value is on the server by the
+ * time this returns.  Any pending combined value for the key is discarded.
+ */
+
+etcd_result     etcd_set_now    (etcd_session session, char *key, char *value,
+                                 char *precond, unsigned int ttl);
+
+
+/*
+ * etcd_refresh_ttl
+ *
+ * Reset the TTL on an existing key without changing its value, and without
+ * waking up anyone who's watching it.  That makes it suitable for heartbeats
+ * and leader leases, which would otherwise generate a stream of events that
+ * say nothing has changed.
+ *
+ *      key
+ *      The etcd key (path) to refresh.  Returns ETCD_NOT_FOUND if it has
+ *      already expired (or never existed).
+ *
+ *      ttl
+ *      New time in seconds until the key expires.
+ *
+ *      prev_index (optional)
+ *      If this points to a non-zero index, the refresh only happens if the
+ *      key's modifiedIndex still matches, so we don't extend somebody else's
+ *      lease by mistake.  On success it's updated with the new index.
+ */
+
+etcd_result     etcd_refresh_ttl (etcd_session session, char *key,
+                                  unsigned int ttl, etcd_index *prev_index);
+
+
+/*
+ * etcd_cas
+ *
+ * Compare-and-swap on a key's modifiedIndex instead of its value, so the old
+ * value never has to be sent back.  The usual loop is etcd_get_ex, compute,
+ * then etcd_cas with the index from the get, starting over on
+ * ETCD_PRECOND_FAILED.  The session keeps its connection open between calls,
+ * so a loop like that doesn't pay for a new one each time around.
+ *
+ *      key, value, ttl
+ *      As for etcd_set.
+ *
+ *      prev_index
+ *      The modifiedIndex the key must still have, or zero to mean it must not
+ *      exist yet.  On success it's updated with the new modifiedIndex, ready
+ *      for the next call.  A mismatch returns ETCD_PRECOND_FAILED, or
+ *      ETCD_NOT_FOUND if the key has gone away.
+ */
+
+etcd_result     etcd_cas        (etcd_session session, char *key, char *value,
+                                 etcd_index *prev_index, unsigned int ttl);
+
+
 /*
  * etcd_delete
  *
@@ -167,6 +490,257 @@ etcd_result     etcd_set        (etcd_session session, char *key, char *value,
 etcd_result     etcd_delete     (etcd_session session, char *key);
 
 
+/*
+ * etcd_delete_prefix, etcd_rmdir
+ *
+ * Delete a whole subtree in one request, or just an empty directory, instead
+ * of listing the children and deleting them one at a time.  Watchers see a
+ * single delete event for the top.  Pending writes under it in the
+ * write-combining table (see etcd_set_combine) are dropped once a recursive
+ * delete has happened or found nothing there, and kept if it fails.
+ * etcd_rmdir writes them out first, so a directory that only looks empty
+ * fails as it should.
+ *
+ *      pfx, key
+ *      The etcd key (path) to delete.  For etcd_delete_prefix that can be a
+ *      directory or a plain key; for etcd_rmdir it has to be a directory
+ *      with nothing in it, or the result is ETCD_PROTOCOL_ERROR.
+ */
+
+etcd_result     etcd_delete_prefix (etcd_session session, char *pfx);
+etcd_result     etcd_rmdir      (etcd_session session, char *key);
+
+
+/*
+ * etcd_cad
+ *
+ * Compare-and-delete, the counterpart of etcd_cas: delete a key only if its
+ * modifiedIndex still matches.  etcd won't do this for a directory, so a
+ * subtree can't be deleted conditionally; the usual way around that is a
+ * lock or a lease key that gets checked first.
+ *
+ *      key
+ *      The etcd key (path) to delete.
+ *
+ *      prev_index
+ *      The modifiedIndex the key must still have.  On success it's updated
+ *      with the index of the delete, which is where a watch can pick up.  A
+ *      mismatch returns ETCD_PRECOND_FAILED, or ETCD_NOT_FOUND if the key has
+ *      already gone away.
+ */
+
+etcd_result     etcd_cad        (etcd_session session, char *key,
+                                 etcd_index *prev_index);
+
+
+/*
+ * etcd_mkdir
+ *
+ * Create a directory.  With a TTL, the directory and everything under it go
+ * away together when it expires, which makes it a cheap way to tie a group
+ * of keys to one session or lease.  Returns ETCD_PRECOND_FAILED if the key
+ * already exists.
+ *
+ *      key
+ *      The etcd key (path) of the directory.
+ *
+ *      ttl (optional)
+ *      Time in seconds until the directory expires, or zero for never.
+ *      etcd_refresh_ttl extends it.
+ */
+
+etcd_result     etcd_mkdir      (etcd_session session, char *key,
+                                 unsigned int ttl);
+
+
+/*
+ * Prepared keys
+ *
+ * For a key that gets read or written over and over, a handle that does the
+ * work of building and escaping its URL once, instead of on every call, and
+ * keeps track of the highest modifiedIndex seen for it.  A handle belongs to
+ * a session and must be freed before the session is closed, but can be used
+ * from any number of threads, and survives membership changes.
+ *
+ *      etcd_key_prepare
+ *      Make a handle for a key, or return NULL if we ran out of memory.
+ *      Unlike the other calls, this escapes anything in the key that isn't
+ *      legal in a URL path.
+ *
+ *      etcd_key_get, etcd_key_set
+ *      The same as etcd_get and etcd_set, for the handle's key.
+ *
+ *      etcd_key_watch
+ *      Wait for the key (and only the key) to change, with the same arguments
+ *      as etcd_watch_ex.  If index_in is NULL, this starts just after the
+ *      last change the handle saw from any of these calls, so a loop that
+ *      calls it over and over won't miss anything; on the first call that
+ *      just means the next change.  A deletion returns ETCD_OK with a NULL
+ *      value.
+ *
+ *      etcd_key_index
+ *      The highest modifiedIndex seen so far, or zero.
+ *
+ *      etcd_key_free
+ *      Throw the handle away.
+ */
+
+typedef void *etcd_key;
+
+etcd_key        etcd_key_prepare (etcd_session session, char *key);
+char *          etcd_key_get     (etcd_key key);
+etcd_result     etcd_key_set     (etcd_key key, char *value, char *precond,
+                                  unsigned int ttl);
+etcd_result     etcd_key_watch   (etcd_key key, char **valuep,
+                                  etcd_index *index_in, etcd_index *index_out);
+etcd_index      etcd_key_index   (etcd_key key);
+void            etcd_key_free    (etcd_key key);
+
+
+/*
+ * Batches
+ *
+ * Queue up any number of gets, sets and deletes, then submit them all at once.
+ * The library keeps up to "window" requests in flight at a time, over
+ * connections that are kept alive from one request to the next, so a large
+ * batch is limited by bandwidth and by how much concurrency the cluster can
+ * take rather than by round-trip time.  Results come back in the order the
+ * operations were queued, no matter what order they finished in.
+ *
+ *      etcd_batch_create
+ *      Start a new (empty) batch for a session.
+ *
+ *      etcd_batch_get, etcd_batch_set, etcd_batch_delete
+ *      Queue an operation, with the same arguments as the corresponding
+ *      blocking call.  The return value is the operation's number within the
+ *      batch, for use with etcd_batch_result, or -1 if we ran out of memory.
+ *
+ *      etcd_batch_submit
+ *      Run everything that hasn't already succeeded, with at most window
+ *      requests outstanding (zero means a reasonable default).  Returns
+ *      ETCD_OK if every operation succeeded, or else the result of the first
+ *      one that didn't.  Calling it again retries only the failures.
+ *
+ *      etcd_batch_result
+ *      Get an operation's result and its modifiedIndex.  For a get, the value
+ *      is handed over to the caller, who must free it.  Either pointer can be
+ *      NULL.
+ *
+ *      etcd_batch_clear
+ *      Throw away all operations and results, but keep the connections so
+ *      the batch can be reused.
+ *
+ *      etcd_batch_free
+ *      Throw away everything, connections included.
+ */
+
+typedef void *etcd_batch;
+
+etcd_batch      etcd_batch_create (etcd_session session);
+int             etcd_batch_get    (etcd_batch batch, char *key);
+int             etcd_batch_set    (etcd_batch batch, char *key, char *value,
+                                   char *precond, unsigned int ttl);
+int             etcd_batch_delete (etcd_batch batch, char *key);
+etcd_result     etcd_batch_submit (etcd_batch batch, unsigned int window);
+size_t          etcd_batch_count  (etcd_batch batch);
+etcd_result     etcd_batch_result (etcd_batch batch, int op_num,
+                                   char **valuep, etcd_index *index);
+void            etcd_batch_clear  (etcd_batch batch);
+void            etcd_batch_free   (etcd_batch batch);
+
+
+/*
+ * Snapshots
+ *
+ * etcd_dump writes everything under a prefix (from one recursive get) to a
+ * compact binary file, and etcd_restore writes it all back using a batch
+ * with the given concurrency.  Only keys with values are saved, not empty
+ * directories.  TTLs are saved as the time remaining when the dump was done.
+ *
+ * The file is laid out so it can be mapped and used in place, without any
+ * parsing, so the etcd_snapshot_* calls can be used to look at a snapshot
+ * without involving a server at all.  The strings they return point into the
+ * mapping, and are only valid until etcd_snapshot_close.
+ *
+ *      etcd_snapshot_count
+ *      Number of keys in the snapshot.
+ *
+ *      etcd_snapshot_key
+ *      The n'th key in sorted order, with its value through valuep (which
+ *      may be NULL).
+ *
+ *      etcd_snapshot_get
+ *      The value for a key, found by binary search, or NULL.
+ */
+
+etcd_result     etcd_dump       (etcd_session session, char *pfx, char *path);
+etcd_result     etcd_restore    (etcd_session session, char *path,
+                                 unsigned int concurrency);
+
+typedef void *etcd_snapshot;
+
+etcd_snapshot   etcd_snapshot_open  (char *path);
+size_t          etcd_snapshot_count (etcd_snapshot snap);
+const char *    etcd_snapshot_key   (etcd_snapshot snap, size_t n,
+                                     const char **valuep);
+const char *    etcd_snapshot_get   (etcd_snapshot snap, char *key);
+void            etcd_snapshot_close (etcd_snapshot snap);
+
+
+/*
+ * Shared caches
+ *
+ * One process on a host publishes everything under a prefix into a file,
+ * normally under /dev/shm, and keeps it up to date from a watch; any number
+ * of other processes map the file and look keys up in it without a lock, a
+ * system call or a server.  So however many workers need the same config
+ * tree, there's one copy of it per host and one watch on the cluster.
+ *
+ *      etcd_shcache_publish
+ *      Load pfx with a recursive get into a new file at path, then start a
+ *      thread that applies changes from a watch.  Returns NULL if the first
+ *      load fails.  slots and data_size are the initial size of the table
+ *      and of the space for keys and values (zero means a reasonable
+ *      default); the file is rewritten bigger whenever either runs out.  Only
+ *      one publisher per file.
+ *
+ *      etcd_shcache_unpublish
+ *      Stop the thread.  The file stays where it is, frozen at whatever it
+ *      last saw, for the readers to carry on with or for you to remove.
+ *
+ *      etcd_shcache_open
+ *      Map a published file for reading.
+ *
+ *      etcd_shcache_get
+ *      Same as etcd_get, but from the file: a newly allocated copy of the
+ *      value (from the global allocator), or NULL if the key isn't there.
+ *      Keys are relative to the root, e.g. "config/db/host" for the prefix
+ *      "config", with or without the leading slash.  Safe to call from any
+ *      number of threads at once.
+ *
+ *      etcd_shcache_index
+ *      The etcd index the file is up to date with, for telling how stale it
+ *      might be.
+ *
+ *      etcd_shcache_close
+ *      Unmap everything.  Files the publisher has replaced are unmapped
+ *      along the way, as soon as no etcd_shcache_get is still reading them.
+ *      Nothing may be using the cache when it's closed.
+ */
+
+typedef void *etcd_shcache;
+typedef void *etcd_shcache_pub;
+
+etcd_shcache_pub etcd_shcache_publish   (etcd_session session, char *pfx,
+                                         char *path, size_t slots,
+                                         size_t data_size);
+void            etcd_shcache_unpublish  (etcd_shcache_pub pub);
+etcd_shcache    etcd_shcache_open       (char *path);
+char *          etcd_shcache_get        (etcd_shcache cache, char *key);
+etcd_index      etcd_shcache_index      (etcd_shcache cache);
+void            etcd_shcache_close      (etcd_shcache cache);
+
+
 /*
  * etcd_leader
  *
@@ -212,3 +786,384 @@ etcd_result     etcd_lock (etcd_session session_as_void, char *key,
 etcd_result     etcd_unlock (etcd_session session_as_void, char *key,
                              char *index);
 
+
+/*
+ * etcd_lease_mgr_start
+ *
+ * Start a background thread to keep locks alive, for programs holding too
+ * many of them to renew each one by hand.  Each lock is renewed at a random
+ * point between a third and a half of the way through its TTL, and the
+ * renewals that fall due together go out as one batch.
+ *
+ *      concurrency
+ *      Most renewals to have in flight at once, or zero for a default.
+ */
+
+typedef void *etcd_lease_mgr;
+
+etcd_lease_mgr  etcd_lease_mgr_start (etcd_session session,
+                                      unsigned int concurrency);
+
+/*
+ * etcd_lease_add
+ *
+ * Start renewing a lock that was just taken or renewed with etcd_lock.  If a
+ * renewal is refused, or no server can be reached before the TTL runs out,
+ * the lock is dropped from the manager and the callback is called from its
+ * thread with the key and index.  Those are only good until it returns, and
+ * the callback mustn't stop the manager.
+ *
+ *      key, ttl, index
+ *      As for etcd_lock.  The key and index are copied.
+ *
+ *      cb, arg
+ *      What to call if the lock is lost, and what to pass it.
+ */
+
+typedef void etcd_lease_cb (void *arg, char *key, char *index);
+
+etcd_result     etcd_lease_add (etcd_lease_mgr mgr, char *key,
+                                unsigned int ttl, char *index,
+                                etcd_lease_cb *cb, void *arg);
+
+/*
+ * etcd_lease_remove
+ *
+ * Stop renewing a lock, without calling its callback.  This doesn't unlock
+ * it; call etcd_unlock afterward for that.  Returns ETCD_NOT_FOUND if the
+ * manager doesn't have that key and index, e.g. because it was already lost.
+ */
+
+etcd_result     etcd_lease_remove (etcd_lease_mgr mgr, char *key,
+                                   char *index);
+
+/*
+ * etcd_lease_mgr_stop
+ *
+ * Stop the thread and forget all remaining locks, which will expire on their
+ * own unless renewed some other way.
+ */
+
+void            etcd_lease_mgr_stop (etcd_lease_mgr mgr);
+
+/*
+ * etcd_queue_open
+ *
+ * Open a work queue kept as in-order keys under a directory.  Any number of
+ * processes can open the same directory to produce or consume; each job goes
+ * to exactly one consumer.  A handle shouldn't be used by more than one
+ * thread at a time, but threads can have one each.
+ */
+
+typedef void *etcd_queue;
+
+etcd_queue      etcd_queue_open (etcd_session session, char *dir);
+
+/*
+ * etcd_enqueue
+ *
+ * Add a job to the end of a queue.
+ *
+ *      ttl
+ *      How long the job may wait to be picked up, or zero for no limit.
+ *
+ *      keyp
+ *      If not NULL, gets the key etcd chose for the job, which the caller
+ *      must free.
+ */
+
+etcd_result     etcd_enqueue (etcd_queue q, char *value, unsigned int ttl,
+                              char **keyp);
+
+/*
+ * etcd_dequeue
+ *
+ * Take a job off a queue, waiting for one if the queue is empty.  Jobs come
+ * out in roughly the order they went in.  Claiming a job deletes it, so if
+ * the consumer dies before finishing the job is gone; producers that care
+ * should have results written somewhere they can check.
+ *
+ *      keyp, valuep
+ *      Get the job's key and value, which the caller must free.
+ *
+ *      timeout_ms
+ *      How long to wait, or zero for forever.  Returns ETCD_TIMEOUT if no
+ *      job turns up in time.
+ */
+
+etcd_result     etcd_dequeue (etcd_queue q, char **keyp, char **valuep,
+                              unsigned int timeout_ms);
+
+/*
+ * etcd_queue_consume
+ *
+ * Call a function with each job from a queue, in a loop.  The key and value
+ * are only good until it returns.  If idle_ms is nonzero and that long goes
+ * by with no jobs, the function is called with both NULL, so it can check
+ * whether it's time to quit.  Returning nonzero stops the loop with ETCD_OK;
+ * errors from etcd stop it with that error.
+ */
+
+typedef int etcd_queue_cb (void *arg, char *key, char *value);
+
+etcd_result     etcd_queue_consume (etcd_queue q, etcd_queue_cb *cb,
+                                    void *arg, unsigned int idle_ms);
+
+/*
+ * etcd_queue_close
+ *
+ * Free a queue handle.  This doesn't touch the queue itself.
+ */
+
+void            etcd_queue_close (etcd_queue q);
+
+/*
+ * Statistics
+ *
+ * Every session counts its requests as they go by, with atomic adds so it
+ * costs next to nothing: a latency histogram for each kind of request and for
+ * each server, plus failovers and bytes on the wire.  A request that retries
+ * on another server counts once per server it tried.
+ *
+ * Histograms are log-linear over microseconds.  Below 16us there's a bucket
+ * per microsecond; above that each power of two is split into 8 buckets, so
+ * none is more than about 12% wide.  Anything past 2^40us lands in the last
+ * bucket.
+ *
+ *      errors
+ *      Requests that never got an answer (connection refused, reset, and so
+ *      on).  What the server said, e.g. "not found", doesn't count.
+ *
+ *      failovers
+ *      How many times one of those sent a request on to the next server.
+ *
+ *      etcd_stats_snapshot
+ *      Copy the current numbers into caller-provided space.  The per-server
+ *      histograms are allocated from the session's allocator; free them
+ *      with etcd_stats_free on the same session.
+ *
+ *      etcd_stats_percentile
+ *      Estimate a percentile (0-100) from a histogram, in microseconds.
+ *
+ *      etcd_stats_bucket_limit
+ *      The largest value, in microseconds, that goes in a bucket.
+ *
+ *      etcd_stats_prometheus
+ *      Render a fresh snapshot in Prometheus text exposition format, for a
+ *      /metrics handler.  The caller must free the result.
+ */
+
+typedef enum {
+        ETCD_STAT_GET,
+        ETCD_STAT_SET,
+        ETCD_STAT_DELETE,
+        ETCD_STAT_WATCH,
+        ETCD_STAT_LOCK,
+        ETCD_STAT_OTHER,                /* stats/leader etc. */
+        ETCD_STAT_NUM_OPS
+} etcd_stat_op;
+
+#define ETCD_STATS_BUCKETS      304
+
+typedef struct {
+        uint64_t        count;
+        uint64_t        errors;
+        uint64_t        sum_us;
+        uint64_t        buckets[ETCD_STATS_BUCKETS];
+} etcd_histogram;
+
+typedef struct {
+        etcd_histogram  ops[ETCD_STAT_NUM_OPS];
+        size_t          num_servers;
+        etcd_histogram  *servers;       /* same order as the server list */
+        uint64_t        failovers;
+        uint64_t        bytes_in;
+        uint64_t        bytes_out;
+} etcd_stats;
+
+etcd_result     etcd_stats_snapshot     (etcd_session session,
+                                         etcd_stats *stats);
+void            etcd_stats_free         (etcd_session session,
+                                         etcd_stats *stats);
+uint64_t        etcd_stats_percentile   (const etcd_histogram *hist,
+                                         double pct);
+uint64_t        etcd_stats_bucket_limit (unsigned int bucket);
+char *          etcd_stats_prometheus   (etcd_session session);
+
+/*
+ * Tracing
+ *
+ * etcd_set_trace installs a function to be called at the start and end of
+ * every HTTP exchange made by the blocking calls (batches aren't traced).  It
+ * runs on whichever thread made the request, so it should be quick and
+ * thread-safe.  The same etcd_trace is passed for both calls, and "user" is
+ * left alone in between, so a hook can keep its own per-request state there.
+ * At the start only method, path, server and attempt are filled in.
+ *
+ *      attempt
+ *      Which server in the list this is, counting from zero.  Requests try
+ *      the servers in order, so anything above zero is a retry.
+ *
+ *      status
+ *      The HTTP status, or zero if there wasn't one; curl_code says why.
+ *
+ *      namelookup_us ... total_us
+ *      curl's phase timings, each measured from the start of the request.
+ *      The server's own time is roughly starttransfer minus connect.
+ *
+ * Passing a NULL cb turns tracing off.  Set the hook while no requests are
+ * in flight on the session, e.g. right after etcd_open.
+ *
+ * etcd_trace_slow is a ready-made hook that writes one line per request that
+ * took at least threshold_ms to fp (stderr if NULL), with the phase timings.
+ * It replaces any other hook, and a zero threshold turns it off.
+ */
+
+typedef enum {
+        ETCD_TRACE_START,
+        ETCD_TRACE_END
+} etcd_trace_event;
+
+typedef struct {
+        const char              *method;
+        const char              *path;          /* and query, if any */
+        const etcd_server       *server;
+        int                     attempt;
+        long                    status;
+        int                     curl_code;
+        uint64_t                namelookup_us;
+        uint64_t                connect_us;
+        uint64_t                starttransfer_us;
+        uint64_t                redirect_us;
+        uint64_t                total_us;
+        void                    *user;
+} etcd_trace;
+
+typedef void etcd_trace_cb (void *arg, etcd_trace_event what,
+                            etcd_trace *trace);
+
+void            etcd_set_trace  (etcd_session session, etcd_trace_cb *cb,
+                                 void *arg);
+void            etcd_trace_slow (etcd_session session,
+                                 unsigned int threshold_ms, FILE *fp);
+
+
+/*
+ * Event-loop integration
+ *
+ * For programs that already run an epoll, libuv or similar loop, and don't
+ * want a client library blocking inside it or starting threads of its own.
+ * Once a session has a loop, it says which sockets to watch and when to wake
+ * it up through two callbacks, and the loop calls back in when one of those
+ * happens.  This is curl's multi_socket interface, and works the same way.
+ *
+ *      etcd_session_set_loop
+ *      Give the session its callbacks.  Call it once, before starting any
+ *      asynchronous requests.
+ *
+ *      socket_cb (arg, fd, what)
+ *      Start (or change) watching fd for ETCD_POLL_IN and/or ETCD_POLL_OUT,
+ *      or stop watching it if what is ETCD_POLL_REMOVE.
+ *
+ *      timer_cb (arg, timeout_ms)
+ *      Arm a one-shot timer for timeout_ms from now, replacing any that's
+ *      already armed.  Zero means as soon as possible, and -1 means disarm.
+ *
+ *      etcd_session_on_fd_ready
+ *      Call when a watched fd is ready, with ETCD_POLL_IN, ETCD_POLL_OUT
+ *      and/or ETCD_POLL_ERR for what happened.
+ *
+ *      etcd_session_on_timeout
+ *      Call when the timer fires.
+ *
+ * The two callbacks must not call back into the library themselves.
+ *
+ * etcd_async_get, etcd_async_set, etcd_async_delete, etcd_async_watch,
+ * etcd_async_lock and etcd_async_unlock work like their blocking
+ * counterparts, except that they return as soon as the request has been
+ * started.  If that fails they return an error and the callback is never
+ * called; otherwise it's called exactly once, from inside
+ * etcd_session_on_fd_ready or etcd_session_on_timeout, with the result and an
+ * event describing it:
+ *
+ *      key
+ *      The key that was fetched, set, deleted, or changed (for a watch).
+ *
+ *      value
+ *      The value from a get or a watch, or NULL for a watch that saw a delete
+ *      or expiry.  For a new lock, the lock index.
+ *
+ *      index
+ *      The key's modifiedIndex.  To keep watching without missing anything,
+ *      start the next watch from here plus one.
+ *
+ *      is_dir, deleted
+ *      For a watch, whether the key is a directory and whether the change
+ *      was a delete or expiry.  A new directory has no value either, so
+ *      check deleted rather than value.
+ *
+ * Everything in the event is only good until the callback returns.  The
+ * callback may start more requests.  Asynchronous sets are never combined,
+ * and a watch is recursive, as with etcd_watch.  Failover to the next server
+ * works the same as for the blocking calls.  Requests still in flight when
+ * the session is closed are called back with ETCD_WTF.
+ *
+ * etcd_async_request is the same thing one level down, for proxies and the
+ * like that pass requests along without looking at them.  It sends method
+ * ("GET", "PUT", "POST" or "DELETE") to path, which is everything after the
+ * server's address (e.g. "v2/keys/foo?wait=true"), with contents as the form
+ * body if it isn't NULL.  The callback gets the HTTP status, X-Etcd-Index and
+ * body of the reply, from whichever server answered; if none did, the result
+ * is ETCD_WTF and the status zero.
+ *
+ * Sidecar servers (see etcd_open_str) are skipped by all of these, so a
+ * session whose only server is a sidecar can't make asynchronous requests.
+ *
+ * All of this has to happen on one thread at a time (normally the loop's),
+ * but the blocking calls can still be used from other threads.
+ */
+
+#define ETCD_POLL_IN            1
+#define ETCD_POLL_OUT           2
+#define ETCD_POLL_REMOVE        4
+#define ETCD_POLL_ERR           8
+
+typedef void etcd_socket_cb (void *arg, int fd, int what);
+typedef void etcd_timer_cb (void *arg, long timeout_ms);
+typedef void etcd_async_cb (void *arg, etcd_result res, etcd_event *ev);
+typedef void etcd_async_raw_cb (void *arg, etcd_result res, long status,
+                                etcd_index etcd_index, const char *body,
+                                size_t len);
+
+etcd_result     etcd_session_set_loop   (etcd_session session,
+                                         etcd_socket_cb *socket_cb,
+                                         etcd_timer_cb *timer_cb, void *arg);
+void            etcd_session_on_fd_ready (etcd_session session, int fd,
+                                          int what);
+void            etcd_session_on_timeout (etcd_session session);
+
+etcd_result     etcd_async_get          (etcd_session session, char *key,
+                                         etcd_async_cb *cb, void *arg);
+etcd_result     etcd_async_set          (etcd_session session, char *key,
+                                         char *value, char *precond,
+                                         unsigned int ttl,
+                                         etcd_async_cb *cb, void *arg);
+etcd_result     etcd_async_delete       (etcd_session session, char *key,
+                                         etcd_async_cb *cb, void *arg);
+etcd_result     etcd_async_watch        (etcd_session session, char *pfx,
+                                         etcd_index *index_in,
+                                         etcd_async_cb *cb, void *arg);
+etcd_result     etcd_async_lock         (etcd_session session, char *key,
+                                         unsigned int ttl, char *index_in,
+                                         etcd_async_cb *cb, void *arg);
+etcd_result     etcd_async_unlock       (etcd_session session, char *key,
+                                         char *index, etcd_async_cb *cb,
+                                         void *arg);
+etcd_result     etcd_async_request      (etcd_session session,
+                                         const char *method, const char *path,
+                                         const char *contents,
+                                         etcd_async_raw_cb *cb, void *arg);
+
+#if defined(__GNUC__)
+#pragma GCC visibility pop
+#endif
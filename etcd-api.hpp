@@ -0,0 +1,773 @@
+/*
+ * Copyright (c) 2013, Red Hat
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.  Redistributions in binary
+ * form must reproduce the above copyright notice, this list of conditions and
+ * the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * C++20 coroutine layer over the C API.  Header-only; link with -letcd as
+ * usual and build with -std=c++20.
+ *
+ * An etcd::Client owns a session and drives its asynchronous requests (see
+ * etcd_session_set_loop) from an epoll loop of its own, so every get, set,
+ * watch or lock is a coroutine suspended on a socket rather than a thread
+ * blocked in curl.  For example:
+ *
+ *      etcd::Task<> job (etcd::Client &c)
+ *      {
+ *              etcd::Event ev = co_await c.get("foo");
+ *              if (ev) {
+ *                      co_await c.set("bar",*ev.value);
+ *              }
+ *              auto w = c.watch("foo");
+ *              while (auto change = co_await w.next()) {
+ *                      ...
+ *              }
+ *      }
+ *
+ *      etcd::Client c("localhost:4001");
+ *      c.spawn(job(c));
+ *      c.run();
+ *
+ * Everything for one Client happens on whichever thread calls its poll, run
+ * or block_on; use one Client per thread to spread load.  fd() is an epoll
+ * descriptor that becomes readable when there's work to do, for nesting the
+ * Client inside some other loop that calls poll(0) when it fires.
+ *
+ * Results are move-only values that own their strings, and a Lock releases
+ * itself when it goes out of scope.  Nothing here throws except to pass on
+ * exceptions from the caller's own coroutines (and std::bad_alloc).  A
+ * Client should only be destroyed once nothing is waiting on it; coroutines
+ * still suspended then are never resumed.
+ */
+
+#ifndef ETCD_API_HPP
+#define ETCD_API_HPP
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+extern "C" {
+#include "etcd-api.h"
+}
+
+namespace etcd {
+
+class Client;
+
+/*
+ * What a request came back with.  Converts to true for ETCD_OK.  The value
+ * is empty for a set or delete, for a watch that saw a delete or expiry or a
+ * new directory, and on failure; "deleted" tells those watch cases apart.
+ * For a lock it's the lock index.
+ */
+struct Event {
+        etcd_result                     res     = ETCD_WTF;
+        std::string                     key;
+        std::optional<std::string>      value;
+        etcd_index                      index   = 0;
+        bool                            is_dir  = false;
+        bool                            deleted = false;
+
+        Event () = default;
+        Event (Event &&) = default;
+        Event &operator= (Event &&) = default;
+        Event (const Event &) = delete;
+        Event &operator= (const Event &) = delete;
+
+        explicit operator bool () const { return res == ETCD_OK; }
+};
+
+
+/*
+ * A lazily started coroutine returning T.  Awaiting it runs it; the awaiting
+ * coroutine picks up again when it finishes, without going back through the
+ * loop.  Use Client::spawn or Client::block_on to start one from outside.
+ */
+template <typename T = void> class Task;
+
+namespace detail {
+
+struct TaskPromiseBase {
+        std::coroutine_handle<>         continuation = std::noop_coroutine();
+        std::exception_ptr              error;
+
+        struct Final {
+                bool await_ready () noexcept { return false; }
+                template <typename P> std::coroutine_handle<>
+                await_suspend (std::coroutine_handle<P> h) noexcept
+                {
+                        return h.promise().continuation;
+                }
+                void await_resume () noexcept {}
+        };
+
+        std::suspend_always initial_suspend () noexcept { return {}; }
+        Final final_suspend () noexcept { return {}; }
+        void unhandled_exception () { error = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+        std::optional<T>                value;
+
+        Task<T> get_return_object ();
+        template <typename U> void return_value (U &&v)
+        {
+                value.emplace(std::forward<U>(v));
+        }
+        T result ()
+        {
+                if (error) {
+                        std::rethrow_exception(error);
+                }
+                return std::move(*value);
+        }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+        Task<void> get_return_object ();
+        void return_void () {}
+        void result ()
+        {
+                if (error) {
+                        std::rethrow_exception(error);
+                }
+        }
+};
+
+/* Waits for a task without taking its result. */
+template <typename P>
+struct Join {
+        std::coroutine_handle<P>        h;
+
+        bool await_ready () noexcept { return h.done(); }
+        std::coroutine_handle<>
+        await_suspend (std::coroutine_handle<> c) noexcept
+        {
+                h.promise().continuation = c;
+                return h;
+        }
+        void await_resume () noexcept {}
+};
+
+/* Runs by itself and cleans up after itself. */
+struct Detached {
+        struct promise_type {
+                Detached get_return_object () { return {}; }
+                std::suspend_never initial_suspend () noexcept { return {}; }
+                std::suspend_never final_suspend () noexcept { return {}; }
+                void return_void () {}
+                void unhandled_exception () { std::terminate(); }
+        };
+};
+
+} // namespace detail
+
+template <typename T>
+class [[nodiscard]] Task {
+public:
+        using promise_type = detail::TaskPromise<T>;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        Task (Task &&o) noexcept : h(std::exchange(o.h,{})) {}
+        Task &operator= (Task &&o) noexcept
+        {
+                if (this != &o) {
+                        if (h) {
+                                h.destroy();
+                        }
+                        h = std::exchange(o.h,{});
+                }
+                return *this;
+        }
+        ~Task ()
+        {
+                if (h) {
+                        h.destroy();
+                }
+        }
+
+        bool await_ready () const noexcept { return false; }
+        std::coroutine_handle<>
+        await_suspend (std::coroutine_handle<> c) noexcept
+        {
+                h.promise().continuation = c;
+                return h;
+        }
+        T await_resume () { return h.promise().result(); }
+
+private:
+        friend promise_type;
+        friend class Client;
+
+        explicit Task (handle_type h) : h(h) {}
+
+        handle_type                     h;
+};
+
+template <typename T>
+Task<T> detail::TaskPromise<T>::get_return_object ()
+{
+        return Task<T>(Task<T>::handle_type::from_promise(*this));
+}
+
+inline Task<void> detail::TaskPromise<void>::get_return_object ()
+{
+        return Task<void>(Task<void>::handle_type::from_promise(*this));
+}
+
+
+/*
+ * An asynchronous generator: each co_await of next() runs the producer up to
+ * its next co_yield, and gives back what it yielded, or nothing once it's
+ * finished.  Client::watch returns one of these.
+ */
+template <typename T>
+class [[nodiscard]] Generator {
+public:
+        struct promise_type {
+                std::optional<T>                current;
+                std::coroutine_handle<>         consumer;
+                std::exception_ptr              error;
+
+                struct Yield {
+                        bool await_ready () noexcept { return false; }
+                        std::coroutine_handle<>
+                        await_suspend (std::coroutine_handle<promise_type> h)
+                                noexcept
+                        {
+                                return h.promise().consumer;
+                        }
+                        void await_resume () noexcept {}
+                };
+
+                Generator get_return_object ()
+                {
+                        return Generator(handle_type::from_promise(*this));
+                }
+                std::suspend_always initial_suspend () noexcept { return {}; }
+                Yield final_suspend () noexcept { return {}; }
+                Yield yield_value (T v)
+                {
+                        current.emplace(std::move(v));
+                        return {};
+                }
+                void return_void () {}
+                void unhandled_exception ()
+                {
+                        error = std::current_exception();
+                }
+        };
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        Generator (Generator &&o) noexcept : h(std::exchange(o.h,{})) {}
+        Generator &operator= (Generator &&o) noexcept
+        {
+                if (this != &o) {
+                        if (h) {
+                                h.destroy();
+                        }
+                        h = std::exchange(o.h,{});
+                }
+                return *this;
+        }
+        ~Generator ()
+        {
+                if (h) {
+                        h.destroy();
+                }
+        }
+
+        auto next ()
+        {
+                struct Next {
+                        handle_type     h;
+
+                        bool await_ready () noexcept { return h.done(); }
+                        std::coroutine_handle<>
+                        await_suspend (std::coroutine_handle<> c) noexcept
+                        {
+                                h.promise().consumer = c;
+                                return h;
+                        }
+                        std::optional<T> await_resume ()
+                        {
+                                std::optional<T> v;
+
+                                if (h.promise().error) {
+                                        std::rethrow_exception(
+                                                h.promise().error);
+                                }
+                                v.swap(h.promise().current);
+                                return v;
+                        }
+                };
+                return Next{h};
+        }
+
+private:
+        explicit Generator (handle_type h) : h(h) {}
+
+        handle_type                     h;
+};
+
+
+/*
+ * A held lock.  Converts to true if it was actually taken.  Dropping it
+ * sends the unlock without waiting for the answer, so the Client's loop has
+ * to keep running for that to get out; co_await unlock() to be sure.
+ */
+class Lock {
+public:
+        Lock () = default;
+        Lock (Lock &&o) noexcept
+                : client(std::exchange(o.client,nullptr)),
+                  key(std::move(o.key)), idx(std::move(o.idx)), res(o.res) {}
+        Lock &operator= (Lock &&o) noexcept
+        {
+                if (this != &o) {
+                        release();
+                        client = std::exchange(o.client,nullptr);
+                        key = std::move(o.key);
+                        idx = std::move(o.idx);
+                        res = o.res;
+                }
+                return *this;
+        }
+        Lock (const Lock &) = delete;
+        Lock &operator= (const Lock &) = delete;
+        ~Lock () { release(); }
+
+        explicit operator bool () const { return client != nullptr; }
+        etcd_result result () const { return res; }
+        const std::string &index () const { return idx; }
+
+        /* These three are only for a lock that's held. */
+        inline auto     renew   (unsigned int ttl);
+        inline auto     unlock  ();
+        inline void     release ();
+
+private:
+        friend class Client;
+
+        Lock (Client *c, std::string k, Event &&ev)
+                : key(std::move(k)), res(ev.res)
+        {
+                if (ev && ev.value) {
+                        client = c;
+                        idx = std::move(*ev.value);
+                }
+        }
+
+        Client                          *client = nullptr;
+        std::string                     key;
+        std::string                     idx;
+        etcd_result                     res     = ETCD_WTF;
+};
+
+
+class Client {
+public:
+        /* Servers as for etcd_open_str, e.g. "host1:4001,host2:4001". */
+        explicit Client (const std::string &servers)
+        {
+                std::string     copy    = servers;
+                epoll_event     ev      = {};
+
+                epfd = epoll_create1(EPOLL_CLOEXEC);
+                tfd = timerfd_create(CLOCK_MONOTONIC,
+                                     TFD_NONBLOCK|TFD_CLOEXEC);
+                if ((epfd < 0) || (tfd < 0)) {
+                        return;
+                }
+                ev.events = EPOLLIN;
+                ev.data.fd = tfd;
+                if (epoll_ctl(epfd,EPOLL_CTL_ADD,tfd,&ev) != 0) {
+                        return;
+                }
+                session = etcd_open_str(copy.data());
+                if (session && (etcd_session_set_loop(session,on_socket,
+                                                      on_timer,this)
+                                != ETCD_OK)) {
+                        etcd_close_str(session);
+                        session = nullptr;
+                }
+        }
+
+        Client (const Client &) = delete;
+        Client &operator= (const Client &) = delete;
+
+        ~Client ()
+        {
+                if (session) {
+                        /* Anything in flight gets called back here. */
+                        etcd_close_str(session);
+                }
+                if (tfd >= 0) {
+                        close(tfd);
+                }
+                if (epfd >= 0) {
+                        close(epfd);
+                }
+        }
+
+        /* False if the session couldn't be set up. */
+        bool ok () const { return session != nullptr; }
+
+        /* For the C API, e.g. statistics or blocking calls from elsewhere. */
+        etcd_session handle () const { return session; }
+
+        /* Readable when poll has something to do. */
+        int fd () const { return epfd; }
+
+        auto get (std::string key)
+        {
+                return op([this,key] (etcd_async_cb *cb, void *arg) mutable {
+                        return etcd_async_get(session,key.data(),cb,arg);
+                });
+        }
+
+        /* prev, if given, is a prevValue precondition. */
+        auto set (std::string key, std::string value, unsigned int ttl = 0,
+                  std::optional<std::string> prev = std::nullopt)
+        {
+                return op([this,key,value,ttl,prev]
+                          (etcd_async_cb *cb, void *arg) mutable {
+                        return etcd_async_set(session,key.data(),
+                                              value.data(),
+                                              prev ? prev->data() : nullptr,
+                                              ttl,cb,arg);
+                });
+        }
+
+        auto del (std::string key)
+        {
+                return op([this,key] (etcd_async_cb *cb, void *arg) mutable {
+                        return etcd_async_delete(session,key.data(),cb,arg);
+                });
+        }
+
+        /*
+         * Every change under a prefix, from index "from" on (or from now, if
+         * zero).  An error is passed on as an event and ends the watch; in
+         * particular ETCD_INDEX_CLEARED means it fell too far behind and the
+         * caller needs to get the current state and start again.
+         */
+        Generator<Event> watch (std::string pfx, etcd_index from = 0)
+        {
+                Event   ev;
+
+                /*
+                 * pfx and from live in the coroutine frame, so capture them
+                 * by reference.  gcc 12 gets the destruction of by-value
+                 * string captures wrong in a lambda temporary inside a
+                 * coroutine.
+                 */
+                for (;;) {
+                        ev = co_await op([this,&pfx,&from]
+                                         (etcd_async_cb *cb, void *arg) {
+                                return etcd_async_watch(session,pfx.data(),
+                                                        from ? &from : nullptr,
+                                                        cb,arg);
+                        });
+                        if (!ev) {
+                                co_yield std::move(ev);
+                                co_return;
+                        }
+                        from = ev.index + 1;
+                        co_yield std::move(ev);
+                }
+        }
+
+        /* Waits until the lock is ours (or the attempt fails). */
+        Task<Lock> lock (std::string key, unsigned int ttl)
+        {
+                Event   ev;
+
+                ev = co_await op([this,&key,ttl]
+                                 (etcd_async_cb *cb, void *arg) {
+                        return etcd_async_lock(session,key.data(),ttl,nullptr,
+                                               cb,arg);
+                });
+                co_return Lock(this,std::move(key),std::move(ev));
+        }
+
+        /*
+         * Start a task in the background.  It runs until its first
+         * suspension before this returns.  An exception escaping it
+         * terminates the program.
+         */
+        void spawn (Task<void> task)
+        {
+                run_detached(std::move(task));
+        }
+
+        /* Run the loop until a task finishes, and return its result. */
+        template <typename T>
+        T block_on (Task<T> task)
+        {
+                bool    done    = false;
+
+                run_until(task,done);
+                while (!done) {
+                        poll(-1);
+                }
+                return task.h.promise().result();
+        }
+
+        /*
+         * One round of the loop: wait up to timeout_ms (-1 for as long as it
+         * takes) for sockets or the timer, hand what happened to the
+         * session, then resume whatever that completed.  Returns false if
+         * there was nothing to wait for.
+         */
+        bool poll (int timeout_ms)
+        {
+                epoll_event     events[64];
+                uint64_t        ticks;
+                int             n;
+                int             what;
+
+                if (!ready.empty()) {
+                        timeout_ms = 0;
+                }
+                else if (!pending && !armed) {
+                        return false;
+                }
+
+                n = epoll_wait(epfd,events,64,timeout_ms);
+                for (int i = 0; i < n; ++i) {
+                        if (events[i].data.fd == tfd) {
+                                if (read(tfd,&ticks,sizeof(ticks)) > 0) {
+                                        armed = false;
+                                        etcd_session_on_timeout(session);
+                                }
+                                continue;
+                        }
+                        what = 0;
+                        if (events[i].events & EPOLLIN) {
+                                what |= ETCD_POLL_IN;
+                        }
+                        if (events[i].events & EPOLLOUT) {
+                                what |= ETCD_POLL_OUT;
+                        }
+                        if (events[i].events & (EPOLLERR|EPOLLHUP)) {
+                                what |= ETCD_POLL_ERR;
+                        }
+                        etcd_session_on_fd_ready(session,events[i].data.fd,
+                                                 what);
+                }
+
+                resume_ready();
+                return true;
+        }
+
+        /* Run the loop until every spawned task has finished. */
+        void run ()
+        {
+                while (live && poll(-1)) {
+                }
+        }
+
+private:
+        friend class Lock;
+
+        /*
+         * Awaitable for one asynchronous request.  The C callback only
+         * queues the coroutine, and poll resumes it once the session has
+         * returned, so a coroutine never runs inside the C library.
+         */
+        template <typename Start>
+        class Op {
+        public:
+                Op (Client &c, Start s) : client(c), start(std::move(s)) {}
+
+                bool await_ready () noexcept { return false; }
+                bool await_suspend (std::coroutine_handle<> h)
+                {
+                        waiter = h;
+                        ev.res = start(done,this);
+                        if (ev.res != ETCD_OK) {
+                                /* Never started, so carry straight on. */
+                                return false;
+                        }
+                        ++client.pending;
+                        return true;
+                }
+                Event await_resume () { return std::move(ev); }
+
+        private:
+                static void done (void *arg, etcd_result res, etcd_event *e)
+                {
+                        Op      *self   = static_cast<Op *>(arg);
+
+                        self->ev.res = res;
+                        self->ev.key = e->key ? e->key : "";
+                        if (e->value) {
+                                self->ev.value.emplace(e->value);
+                        }
+                        self->ev.index = e->index;
+                        self->ev.is_dir = e->is_dir;
+                        self->ev.deleted = e->deleted;
+                        --self->client.pending;
+                        self->client.ready.push_back(self->waiter);
+                }
+
+                Client                          &client;
+                Start                           start;
+                std::coroutine_handle<>         waiter;
+                Event                           ev;
+        };
+
+        template <typename Start>
+        Op<Start> op (Start s)
+        {
+                return Op<Start>(*this,std::move(s));
+        }
+
+        static void on_socket (void *arg, int fd, int what)
+        {
+                Client          *self   = static_cast<Client *>(arg);
+                epoll_event     ev      = {};
+
+                if (what & ETCD_POLL_REMOVE) {
+                        epoll_ctl(self->epfd,EPOLL_CTL_DEL,fd,nullptr);
+                        return;
+                }
+                if (what & ETCD_POLL_IN) {
+                        ev.events |= EPOLLIN;
+                }
+                if (what & ETCD_POLL_OUT) {
+                        ev.events |= EPOLLOUT;
+                }
+                ev.data.fd = fd;
+                if (epoll_ctl(self->epfd,EPOLL_CTL_MOD,fd,&ev) != 0) {
+                        epoll_ctl(self->epfd,EPOLL_CTL_ADD,fd,&ev);
+                }
+        }
+
+        static void on_timer (void *arg, long timeout_ms)
+        {
+                Client          *self   = static_cast<Client *>(arg);
+                itimerspec      its     = {};
+
+                if (timeout_ms >= 0) {
+                        /* All zeroes would disarm it, so "now" is 1ns. */
+                        its.it_value.tv_sec = timeout_ms / 1000;
+                        its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L;
+                        if (!timeout_ms) {
+                                its.it_value.tv_nsec = 1;
+                        }
+                }
+                self->armed = (timeout_ms >= 0);
+                timerfd_settime(self->tfd,0,&its,nullptr);
+        }
+
+        void resume_ready ()
+        {
+                std::vector<std::coroutine_handle<>>    now;
+
+                /* Anything these start goes in the next round. */
+                now.swap(ready);
+                for (auto h : now) {
+                        h.resume();
+                }
+        }
+
+        detail::Detached run_detached (Task<void> task)
+        {
+                ++live;
+                co_await detail::Join<Task<void>::promise_type>{task.h};
+                --live;
+                task.h.promise().result();
+        }
+
+        template <typename T>
+        detail::Detached run_until (Task<T> &task, bool &done)
+        {
+                co_await detail::Join<typename Task<T>::promise_type>{task.h};
+                done = true;
+        }
+
+        etcd_session                            session = nullptr;
+        int                                     epfd    = -1;
+        int                                     tfd     = -1;
+        bool                                    armed   = false;
+        size_t                                  pending = 0;
+        size_t                                  live    = 0;
+        std::vector<std::coroutine_handle<>>    ready;
+};
+
+
+inline auto
+Lock::renew (unsigned int ttl)
+{
+        return client->op([this,ttl] (etcd_async_cb *cb, void *arg) {
+                return etcd_async_lock(client->session,key.data(),ttl,
+                                       idx.data(),cb,arg);
+        });
+}
+
+
+inline void
+Lock::release ()
+{
+        auto    forget  = [] (void *arg, etcd_result, etcd_event *) {
+                --static_cast<Client *>(arg)->pending;
+        };
+
+        if (client) {
+                if (etcd_async_unlock(client->session,key.data(),idx.data(),
+                                      forget,client) == ETCD_OK) {
+                        ++client->pending;
+                }
+                client = nullptr;
+        }
+}
+
+
+/* Gives the lock up and waits for the answer. */
+inline auto
+Lock::unlock ()
+{
+        Client  *c      = std::exchange(client,nullptr);
+
+        return c->op([c,key = key,idx = idx] (etcd_async_cb *cb, void *arg)
+                     mutable {
+                return etcd_async_unlock(c->session,key.data(),idx.data(),cb,
+                                         arg);
+        });
+}
+
+} // namespace etcd
+
+#endif
@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2013, Red Hat
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.  Redistributions in binary
+ * form must reproduce the above copyright notice, this list of conditions and
+ * the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Load generator.  A number of threads, each with its own session, issue a
+ * weighted mix of operations for a fixed time and record every latency in a
+ * log-linear histogram.  At the end it prints ops/s and p50/p99/p999 for
+ * each kind of operation.  Without -s it runs its own etcd-mock, so it works
+ * offline and the numbers can be compared from one change to the next; -u
+ * talks to that over a Unix socket instead of loopback TCP, to see what the
+ * transport itself costs.
+ *
+ * The operations are:
+ *
+ *      get     etcd_get of a random key from the preloaded set
+ *      set     etcd_set of a random key from the same set
+ *      watch   etcd_watch_ex on a key private to the thread, for a change
+ *              the thread has just made (the set isn't counted)
+ *      lock    etcd_lock on a random name from a small set, so there's
+ *              some contention; the unlock isn't counted
+ */
+
+#define _GNU_SOURCE     /* for asprintf */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "etcd-api.h"
+
+#define DEFAULT_THREADS         8
+#define DEFAULT_SECONDS         5
+#define DEFAULT_KEYS            1000
+#define DEFAULT_LOCKS           16
+#define DEFAULT_SIZE            64
+#define DEFAULT_PORT            4903
+#define DEFAULT_MIX             "get=80,set=20"
+#define LOCK_TTL                5
+
+/*
+ * Histogram buckets: values below 2^SUB_BITS nanoseconds get a bucket each,
+ * and above that every power of two is split into 2^SUB_BITS buckets, so no
+ * bucket is more than about 3% wide.
+ */
+#define SUB_BITS                5
+#define SUB_COUNT               (1 << SUB_BITS)
+#define NUM_BUCKETS             ((64 - SUB_BITS + 1) * SUB_COUNT)
+
+enum { OP_GET, OP_SET, OP_WATCH, OP_LOCK, NUM_OPS };
+
+static const char *op_names[NUM_OPS] = { "get", "set", "watch", "lock" };
+
+typedef struct {
+        uint64_t        count;
+        uint64_t        errors;
+        uint64_t        buckets[NUM_BUCKETS];
+} histogram;
+
+typedef struct {
+        pthread_t       tid;
+        int             num;
+        unsigned int    seed;
+        histogram       hist[NUM_OPS];
+} worker;
+
+static char             *servers;
+static char             *sock_path;
+static char             *dir;
+static unsigned int     mix[NUM_OPS];
+static unsigned int     mix_total;
+static int              num_keys        = DEFAULT_KEYS;
+static int              num_locks       = DEFAULT_LOCKS;
+static int              value_size      = DEFAULT_SIZE;
+static char             *value;
+static volatile int     stop;
+
+static uint64_t
+now_ns (void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int
+bucket_of (uint64_t v)
+{
+        unsigned int    shift;
+
+        if (v < 2 * SUB_COUNT) {
+                return (unsigned int)v;
+        }
+        shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        return shift * SUB_COUNT + (unsigned int)(v >> shift);
+}
+
+/* The middle of a bucket, which is as close as we can get. */
+static uint64_t
+bucket_value (unsigned int b)
+{
+        unsigned int    shift;
+        uint64_t        low;
+
+        if (b < 2 * SUB_COUNT) {
+                return b;
+        }
+        shift = b / SUB_COUNT - 1;
+        low = (uint64_t)(b % SUB_COUNT + SUB_COUNT) << shift;
+        return low + ((1ULL << shift) >> 1);
+}
+
+static void
+record (histogram *h, uint64_t ns, etcd_result res)
+{
+        if (res != ETCD_OK) {
+                ++h->errors;
+                return;
+        }
+        ++h->count;
+        ++h->buckets[bucket_of(ns)];
+}
+
+static uint64_t
+percentile (histogram *h, double pct)
+{
+        uint64_t        want;
+        uint64_t        seen    = 0;
+        unsigned int    b;
+
+        if (!h->count) {
+                return 0;
+        }
+        want = (uint64_t)(h->count * pct / 100.0);
+        if (want >= h->count) {
+                want = h->count - 1;
+        }
+        for (b = 0; b < NUM_BUCKETS; ++b) {
+                seen += h->buckets[b];
+                if (seen > want) {
+                        return bucket_value(b);
+                }
+        }
+        return 0;
+}
+
+static char *
+key_name (int i)
+{
+        char    *key;
+
+        if (asprintf(&key,"%s/k%06d",dir,i) < 0) {
+                return NULL;
+        }
+        return key;
+}
+
+/* Find where to watch our own key from, after making sure it exists. */
+static etcd_index
+watch_start (etcd_session session, char *own)
+{
+        etcd_node       node;
+        etcd_index      index   = 0;
+
+        etcd_set(session,own,value,NULL,0);
+        memset(&node,0,sizeof(node));
+        if (etcd_get_ex(session,own,&node) == ETCD_OK) {
+                index = node.etcd_index + 1;
+        }
+        free(node.value);
+        return index;
+}
+
+static void *
+run_worker (void *arg)
+{
+        worker          *w      = arg;
+        etcd_session    session;
+        char            *names;
+        char            *key;
+        char            *own;
+        char            *lock_name;
+        char            *got;
+        char            *index;
+        etcd_index      watch_index     = 0;
+        etcd_result     res;
+        unsigned int    pick;
+        uint64_t        t0;
+        int             op;
+
+        names = strdup(servers);
+        session = names ? etcd_open_str(names) : NULL;
+        if (!session || (asprintf(&own,"%s/w%d",dir,w->num) < 0)) {
+                fprintf(stderr,"worker %d couldn't start\n",w->num);
+                return NULL;
+        }
+
+        if (mix[OP_WATCH]) {
+                watch_index = watch_start(session,own);
+        }
+
+        while (!stop) {
+                pick = (unsigned int)rand_r(&w->seed) % mix_total;
+                for (op = 0; pick >= mix[op]; ++op) {
+                        pick -= mix[op];
+                }
+
+                switch (op) {
+                case OP_GET:
+                        key = key_name(rand_r(&w->seed)%num_keys);
+                        t0 = now_ns();
+                        got = etcd_get(session,key);
+                        record(&w->hist[op],now_ns()-t0,
+                               got ? ETCD_OK : ETCD_NOT_FOUND);
+                        free(got);
+                        free(key);
+                        break;
+                case OP_SET:
+                        key = key_name(rand_r(&w->seed)%num_keys);
+                        t0 = now_ns();
+                        res = etcd_set(session,key,value,NULL,0);
+                        record(&w->hist[op],now_ns()-t0,res);
+                        free(key);
+                        break;
+                case OP_WATCH:
+                        if (etcd_set(session,own,value,NULL,0) != ETCD_OK) {
+                                record(&w->hist[op],0,ETCD_WTF);
+                                break;
+                        }
+                        key = got = NULL;
+                        t0 = now_ns();
+                        res = etcd_watch_ex(session,own,&key,&got,
+                                            &watch_index,&watch_index);
+                        record(&w->hist[op],now_ns()-t0,res);
+                        if (res == ETCD_OK) {
+                                ++watch_index;
+                        }
+                        else {
+                                watch_index = watch_start(session,own);
+                        }
+                        free(key);
+                        free(got);
+                        break;
+                case OP_LOCK:
+                        if (asprintf(&lock_name,"%s/l%d",dir,
+                                     rand_r(&w->seed)%num_locks) < 0) {
+                                break;
+                        }
+                        index = NULL;
+                        t0 = now_ns();
+                        res = etcd_lock(session,lock_name,LOCK_TTL,NULL,
+                                        &index);
+                        record(&w->hist[op],now_ns()-t0,res);
+                        if (index) {
+                                etcd_unlock(session,lock_name,index);
+                                free(index);
+                        }
+                        free(lock_name);
+                        break;
+                }
+        }
+
+        free(own);
+        etcd_close_str(session);
+        return NULL;
+}
+
+/* Load the keys that get and set work on, through the batch API. */
+static int
+preload (void)
+{
+        char            *names;
+        etcd_session    session;
+        etcd_batch      batch;
+        char            *key;
+        etcd_result     res;
+        int             i;
+
+        names = strdup(servers);
+        session = names ? etcd_open_str(names) : NULL;
+        batch = session ? etcd_batch_create(session) : NULL;
+        if (!batch) {
+                return -1;
+        }
+        for (i = 0; i < num_keys; ++i) {
+                key = key_name(i);
+                if (!key || (etcd_batch_set(batch,key,value,NULL,0) < 0)) {
+                        free(key);
+                        return -1;
+                }
+                free(key);
+        }
+        res = etcd_batch_submit(batch,64);
+        etcd_batch_free(batch);
+        etcd_close_str(session);
+        return (res == ETCD_OK) ? 0 : -1;
+}
+
+/* Parse something like "get=70,set=20,watch=5,lock=5". */
+static int
+parse_mix (char *spec)
+{
+        char    *copy;
+        char    *item;
+        char    *save;
+        char    *eq;
+        int     op;
+
+        memset(mix,0,sizeof(mix));
+        copy = strdup(spec);
+        if (!copy) {
+                return -1;
+        }
+        for (item = strtok_r(copy,",",&save); item;
+             item = strtok_r(NULL,",",&save)) {
+                eq = strchr(item,'=');
+                if (!eq) {
+                        break;
+                }
+                *(eq++) = '\0';
+                for (op = 0; op < NUM_OPS; ++op) {
+                        if (!strcmp(item,op_names[op])) {
+                                break;
+                        }
+                }
+                if (op == NUM_OPS) {
+                        break;
+                }
+                mix[op] = strtoul(eq,NULL,10);
+        }
+        free(copy);
+        if (item) {
+                fprintf(stderr,"bad mix item %s\n",item);
+                return -1;
+        }
+
+        mix_total = 0;
+        for (op = 0; op < NUM_OPS; ++op) {
+                mix_total += mix[op];
+        }
+        return mix_total ? 0 : -1;
+}
+
+static int
+wait_for_server (unsigned short port)
+{
+        struct sockaddr_in      sin;
+        int                     fd;
+        int                     tries;
+
+        memset(&sin,0,sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        for (tries = 0; tries < 100; ++tries) {
+                fd = socket(AF_INET,SOCK_STREAM,0);
+                if (fd < 0) {
+                        return -1;
+                }
+                if (connect(fd,(struct sockaddr *)&sin,sizeof(sin)) == 0) {
+                        close(fd);
+                        return 0;
+                }
+                close(fd);
+                usleep(50000);
+        }
+        return -1;
+}
+
+static void
+print_line (const char *name, histogram *h, double secs)
+{
+        printf("%-6s %10"PRIu64" %10.0f %9.1f %9.1f %9.1f %8"PRIu64"\n",
+               name,h->count,h->count/secs,percentile(h,50)/1e3,
+               percentile(h,99)/1e3,percentile(h,99.9)/1e3,h->errors);
+}
+
+struct option my_opts[] = {
+        { "concurrency",        required_argument,      NULL,   'c' },
+        { "duration",           required_argument,      NULL,   'd' },
+        { "help",               no_argument,            NULL,   'h' },
+        { "keys",               required_argument,      NULL,   'k' },
+        { "locks",              required_argument,      NULL,   'l' },
+        { "mix",                required_argument,      NULL,   'm' },
+        { "port",               required_argument,      NULL,   'p' },
+        { "servers",            required_argument,      NULL,   's' },
+        { "size",               required_argument,      NULL,   'z' },
+        { "unix",               required_argument,      NULL,   'u' },
+        { NULL }
+};
+
+static int
+print_usage (char *prog)
+{
+        fprintf(stderr,"Usage: %s [options]\n",prog);
+        fprintf(stderr,"  -c|--concurrency CCC  threads, default %d\n",
+                DEFAULT_THREADS);
+        fprintf(stderr,"  -d|--duration    DDD  default %d s\n",
+                DEFAULT_SECONDS);
+        fprintf(stderr,"  -k|--keys        KKK  default %d\n",DEFAULT_KEYS);
+        fprintf(stderr,"  -l|--locks       LLL  lock names, default %d\n",
+                DEFAULT_LOCKS);
+        fprintf(stderr,"  -m|--mix         MMM  default %s\n",DEFAULT_MIX);
+        fprintf(stderr,"  -p|--port        PPP  for etcd-mock, default %d\n",
+                DEFAULT_PORT);
+        fprintf(stderr,"  -s|--servers     SSS  use these instead of "
+                       "etcd-mock\n");
+        fprintf(stderr,"  -u|--unix        UUU  reach etcd-mock through this "
+                       "socket\n");
+        fprintf(stderr,"  -z|--size        ZZZ  value size, default %d\n",
+                DEFAULT_SIZE);
+        fprintf(stderr,"The mix weights get, set, watch and lock, e.g. "
+                       "get=70,set=20,watch=5,lock=5.\n");
+        fprintf(stderr,"Without -s, run from the build directory; it starts "
+                       "./etcd-mock.\n");
+        return EXIT_FAILURE;
+}
+
+int
+main (int argc, char **argv)
+{
+        int             num_threads     = DEFAULT_THREADS;
+        int             seconds         = DEFAULT_SECONDS;
+        char            *mix_spec       = DEFAULT_MIX;
+        unsigned short  port            = DEFAULT_PORT;
+        char            port_str[16];
+        char            *mock_args[]    = { "./etcd-mock", "-p", port_str,
+                                            NULL, NULL, NULL };
+        char            *cwd;
+        pid_t           mock            = 0;
+        worker          *workers;
+        histogram       *total;
+        histogram       all;
+        uint64_t        t0;
+        double          secs;
+        int             opt;
+        int             op;
+        int             i;
+        unsigned int    b;
+
+        for (;;) {
+                opt = getopt_long(argc,argv,"c:d:hk:l:m:p:s:u:z:",my_opts,
+                                  NULL);
+                if (opt == (-1)) {
+                        break;
+                }
+                switch (opt) {
+                case 'c':
+                        num_threads = strtol(optarg,NULL,10);
+                        break;
+                case 'd':
+                        seconds = strtol(optarg,NULL,10);
+                        break;
+                case 'k':
+                        num_keys = strtol(optarg,NULL,10);
+                        break;
+                case 'l':
+                        num_locks = strtol(optarg,NULL,10);
+                        break;
+                case 'm':
+                        mix_spec = optarg;
+                        break;
+                case 'p':
+                        port = (unsigned short)strtoul(optarg,NULL,10);
+                        break;
+                case 's':
+                        servers = optarg;
+                        break;
+                case 'u':
+                        sock_path = optarg;
+                        break;
+                case 'z':
+                        value_size = strtol(optarg,NULL,10);
+                        break;
+                default:
+                        return print_usage(argv[0]);
+                }
+        }
+        if ((num_threads < 1) || (seconds < 1) || (num_keys < 1)
+                              || (num_locks < 1) || (value_size < 0)
+                              || (sock_path && servers)
+                              || (parse_mix(mix_spec) != 0)) {
+                return print_usage(argv[0]);
+        }
+
+        signal(SIGPIPE,SIG_IGN);
+        if (asprintf(&dir,"etcd-bench/%d",(int)getpid()) < 0) {
+                return EXIT_FAILURE;
+        }
+        value = malloc(value_size+1);
+        workers = calloc(num_threads,sizeof(*workers));
+        if (!value || !workers) {
+                return EXIT_FAILURE;
+        }
+        memset(value,'x',value_size);
+        value[value_size] = '\0';
+
+        if (!servers) {
+                snprintf(port_str,sizeof(port_str),"%u",port);
+                if (sock_path) {
+                        /* The library only takes absolute socket paths. */
+                        if (sock_path[0] != '/') {
+                                cwd = getcwd(NULL,0);
+                                if (!cwd || (asprintf(&sock_path,"%s/%s",cwd,
+                                                      sock_path) < 0)) {
+                                        return EXIT_FAILURE;
+                                }
+                                free(cwd);
+                        }
+                        mock_args[3] = "-u";
+                        mock_args[4] = sock_path;
+                }
+                mock = fork();
+                if (mock == 0) {
+                        execv(mock_args[0],mock_args);
+                        perror(mock_args[0]);
+                        _exit(127);
+                }
+                if ((mock < 0) || (wait_for_server(port) != 0)) {
+                        fprintf(stderr,"couldn't start etcd-mock\n");
+                        return EXIT_FAILURE;
+                }
+                if (sock_path) {
+                        servers = sock_path;
+                }
+                else if (asprintf(&servers,"127.0.0.1:%u",port) < 0) {
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if ((mix[OP_GET] || mix[OP_SET]) && (preload() != 0)) {
+                fprintf(stderr,"couldn't load %d keys\n",num_keys);
+                goto out;
+        }
+
+        t0 = now_ns();
+        for (i = 0; i < num_threads; ++i) {
+                workers[i].num = i;
+                workers[i].seed = (unsigned int)getpid() * 31 + i;
+                pthread_create(&workers[i].tid,NULL,run_worker,&workers[i]);
+        }
+        sleep(seconds);
+        stop = 1;
+        for (i = 0; i < num_threads; ++i) {
+                pthread_join(workers[i].tid,NULL);
+        }
+        secs = (now_ns() - t0) / 1e9;
+
+        printf("%d threads, %.1fs, mix %s, %d keys of %d bytes, over %s\n",
+               num_threads,secs,mix_spec,num_keys,value_size,
+               (servers[0] == '/') ? "a Unix socket" : "TCP");
+        printf("%-6s %10s %10s %9s %9s %9s %8s\n","op","count","ops/s",
+               "p50(us)","p99(us)","p999(us)","errors");
+        memset(&all,0,sizeof(all));
+        for (op = 0; op < NUM_OPS; ++op) {
+                if (!mix[op]) {
+                        continue;
+                }
+                total = &workers[0].hist[op];
+                for (i = 1; i < num_threads; ++i) {
+                        total->count += workers[i].hist[op].count;
+                        total->errors += workers[i].hist[op].errors;
+                        for (b = 0; b < NUM_BUCKETS; ++b) {
+                                total->buckets[b] +=
+                                        workers[i].hist[op].buckets[b];
+                        }
+                }
+                print_line(op_names[op],total,secs);
+                all.count += total->count;
+                all.errors += total->errors;
+                for (b = 0; b < NUM_BUCKETS; ++b) {
+                        all.buckets[b] += total->buckets[b];
+                }
+        }
+        print_line("all",&all,secs);
+
+out:
+        if (mock > 0) {
+                kill(mock,SIGTERM);
+                waitpid(mock,NULL,0);
+                if (sock_path) {
+                        unlink(sock_path);
+                }
+        }
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,1907 @@
+/*
+ * Copyright (c) 2013, Red Hat
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.  Redistributions in binary
+ * form must reproduce the above copyright notice, this list of conditions and
+ * the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A stand-in for a single etcd server, good enough to run leader, etcd-test
+ * and the benchmarks against without a real cluster.  It speaks the v2 keys
+ * API - get (plain, recursive and sorted), wait/waitIndex watches, set with
+ * ttl/prevValue/prevIndex/prevExist/refresh, in-order POST, and delete - plus
+ * the lock module and enough of the stats endpoints for etcd_leader, from one
+ * thread, keeping everything in memory.  Nothing is persisted and there's
+ * no raft, so it's for measuring the client, not for keeping data in.
+ */
+
+#define _GNU_SOURCE     /* for asprintf */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_PORT    4001
+#define DEFAULT_HISTORY 1000    /* same as etcd's event history */
+#define MAX_REQUEST     (64 * 1024 * 1024)
+#define MAX_PARAMS      32
+#define NUM_LISTENERS   2       /* TCP, and optionally a Unix socket */
+
+#define EC_KEY_NOT_FOUND        100
+#define EC_TEST_FAILED          101
+#define EC_NOT_FILE             102
+#define EC_NOT_DIR              104
+#define EC_NODE_EXIST           105
+#define EC_ROOT_RONLY           107
+#define EC_DIR_NOT_EMPTY        108
+#define EC_TTL_NAN              203
+#define EC_INVALID_FIELD        209
+#define EC_INDEX_CLEARED        401
+
+typedef struct {
+        char    *data;
+        size_t  len;
+        size_t  size;
+} buf;
+
+/*
+ * The key space is a real tree, so listing a directory only costs as much as
+ * its children, plus a hash on the full path for everything else.  Nodes
+ * with a TTL are also on a list of their own so expiry doesn't have to look
+ * at every key.
+ */
+typedef struct node {
+        struct node     *hnext;         /* hash chain */
+        struct node     *parent;
+        struct node     *child;         /* first child */
+        struct node     *last;          /* last child */
+        struct node     *prev;          /* siblings */
+        struct node     *next;
+        struct node     *tprev;         /* on the TTL list */
+        struct node     *tnext;
+        size_t          nchildren;
+        char            *key;
+        char            *value;
+        int             dir;
+        uint64_t        created;
+        uint64_t        modified;
+        uint64_t        expires;        /* ms since the epoch, or zero */
+} node;
+
+typedef struct {
+        uint64_t        index;
+        char            *key;
+        int             dir;            /* whole subtree went away */
+        char            *body;          /* exactly what a watcher gets */
+} event;
+
+typedef struct {
+        int             fd;
+        buf             in;
+        buf             out;
+        size_t          out_pos;
+        int             closing;        /* once the output is flushed */
+        int             continued;      /* sent 100 Continue already */
+        int             waiting;        /* parked in a watch or lock */
+        char            *wkey;
+        int             wrecursive;
+        uint64_t        windex;
+        char            *lname;         /* lock being waited for */
+        uint64_t        lttl;
+        uint64_t        lseq;           /* to take waiters in order */
+} conn;
+
+/*
+ * Locks live apart from the keys, since all anyone can see of them is the
+ * holder's index.  One is only kept around while it's held.
+ */
+typedef struct lock {
+        struct lock     *next;
+        char            *name;
+        uint64_t        index;
+        uint64_t        expires;
+} lock;
+
+typedef struct {
+        char    *name;
+        char    *value;
+} param;
+
+typedef struct {
+        param   p[MAX_PARAMS];
+        size_t  n;
+} params;
+
+static node     **table;
+static size_t   nbuckets;
+static size_t   nnodes;
+static node     *root;
+static node     *ttl_list;
+static uint64_t next_expiry;
+
+static uint64_t cur_index;
+
+static lock     *locks;
+static uint64_t lock_seq;
+
+static event    *hist;
+static size_t   hist_size       = DEFAULT_HISTORY;
+static size_t   hist_count;
+static size_t   hist_head;      /* oldest */
+static int      hist_dropped;
+
+static conn     **conns;
+static size_t   nconns;
+static size_t   max_conns;
+
+static int      verbose;
+static char     *my_name        = "etcd-mock";
+static char     *my_addr        = "127.0.0.1";
+static int      my_port         = DEFAULT_PORT;
+static char     *my_path;
+static uint64_t start_time;
+
+
+static void *
+xmalloc (size_t size)
+{
+        void    *p      = malloc(size);
+
+        if (!p) {
+                fprintf(stderr,"out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        return p;
+}
+
+
+static char *
+xstrdup (const char *s)
+{
+        char    *p      = strdup(s);
+
+        if (!p) {
+                fprintf(stderr,"out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        return p;
+}
+
+
+static uint64_t
+now_ms (void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME,&now);
+        return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+
+/*
+ * Output buffers.
+ */
+
+static void
+buf_add (buf *b, const char *data, size_t len)
+{
+        size_t  size;
+        char    *p;
+
+        if ((b->len + len + 1) > b->size) {
+                size = b->size ? b->size : 256;
+                while ((b->len + len + 1) > size) {
+                        size *= 2;
+                }
+                p = realloc(b->data,size);
+                if (!p) {
+                        fprintf(stderr,"out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+                b->data = p;
+                b->size = size;
+        }
+        memcpy(b->data+b->len,data,len);
+        b->len += len;
+        b->data[b->len] = '\0';
+}
+
+
+static void
+buf_printf (buf *b, const char *fmt, ...)
+{
+        va_list ap;
+        char    *s;
+        int     len;
+
+        va_start(ap,fmt);
+        len = vasprintf(&s,fmt,ap);
+        va_end(ap);
+        if (len < 0) {
+                fprintf(stderr,"out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        buf_add(b,s,len);
+        free(s);
+}
+
+
+static void
+buf_json_str (buf *b, const char *s)
+{
+        const char      *run    = s;
+        char            esc[8];
+
+        buf_add(b,"\"",1);
+        for (; *s; ++s) {
+                if ((*s != '"') && (*s != '\\') && ((unsigned char)*s >= 0x20)) {
+                        continue;
+                }
+                buf_add(b,run,s-run);
+                switch (*s) {
+                case '"':       buf_add(b,"\\\"",2);    break;
+                case '\\':      buf_add(b,"\\\\",2);    break;
+                case '\n':      buf_add(b,"\\n",2);     break;
+                case '\r':      buf_add(b,"\\r",2);     break;
+                case '\t':      buf_add(b,"\\t",2);     break;
+                default:
+                        snprintf(esc,sizeof(esc),"\\u%04x",(unsigned char)*s);
+                        buf_add(b,esc,6);
+                }
+                run = s + 1;
+        }
+        buf_add(b,run,s-run);
+        buf_add(b,"\"",1);
+}
+
+
+/*
+ * Requests.
+ */
+
+static int
+unhex (char c)
+{
+        if ((c >= '0') && (c <= '9')) {
+                return c - '0';
+        }
+        if ((c >= 'a') && (c <= 'f')) {
+                return c - 'a' + 10;
+        }
+        if ((c >= 'A') && (c <= 'F')) {
+                return c - 'A' + 10;
+        }
+        return -1;
+}
+
+
+/* In place, since decoding never makes anything longer. */
+static void
+url_decode (char *s, int form)
+{
+        char    *out    = s;
+        int     hi;
+        int     lo;
+
+        for (; *s; ++s) {
+                if ((*s == '%') && ((hi = unhex(s[1])) >= 0)
+                                && ((lo = unhex(s[2])) >= 0)) {
+                        *(out++) = (char)((hi << 4) | lo);
+                        s += 2;
+                }
+                else if (form && (*s == '+')) {
+                        *(out++) = ' ';
+                }
+                else {
+                        *(out++) = *s;
+                }
+        }
+        *out = '\0';
+}
+
+
+/* Both '&' and ';' separate fields, since the library uses the latter. */
+static void
+parse_params (char *s, params *p)
+{
+        char    *field;
+        char    *eq;
+
+        while (s && *s && (p->n < MAX_PARAMS)) {
+                field = s;
+                s += strcspn(s,"&;");
+                if (*s) {
+                        *(s++) = '\0';
+                }
+                if (!*field) {
+                        continue;
+                }
+                eq = strchr(field,'=');
+                if (eq) {
+                        *(eq++) = '\0';
+                }
+                else {
+                        eq = field + strlen(field);
+                }
+                url_decode(field,1);
+                url_decode(eq,1);
+                p->p[p->n].name = field;
+                p->p[p->n].value = eq;
+                ++p->n;
+        }
+}
+
+
+/* Later fields win, so a form body overrides the query string. */
+static const char *
+get_param (params *p, const char *name)
+{
+        size_t  i;
+
+        for (i = p->n; i-- > 0; ) {
+                if (!strcmp(p->p[i].name,name)) {
+                        return p->p[i].value;
+                }
+        }
+        return NULL;
+}
+
+
+static int
+param_is (params *p, const char *name, const char *value)
+{
+        const char      *v      = get_param(p,name);
+
+        return v && !strcmp(v,value);
+}
+
+
+/*
+ * The key space.
+ */
+
+static size_t
+hash_key (const char *key)
+{
+        size_t  h       = 14695981039346656037ULL;
+
+        while (*key) {
+                h = (h ^ (unsigned char)*(key++)) * 1099511628211ULL;
+        }
+        return h;
+}
+
+
+static node *
+lookup (const char *key)
+{
+        node    *n;
+
+        for (n = table[hash_key(key)%nbuckets]; n; n = n->hnext) {
+                if (!strcmp(n->key,key)) {
+                        return n;
+                }
+        }
+        return NULL;
+}
+
+
+static void
+hash_grow (void)
+{
+        node    **nt;
+        node    *n;
+        node    *next;
+        size_t  nb      = nbuckets * 2;
+        size_t  i;
+
+        nt = calloc(nb,sizeof(*nt));
+        if (!nt) {
+                return;
+        }
+        for (i = 0; i < nbuckets; ++i) {
+                for (n = table[i]; n; n = next) {
+                        next = n->hnext;
+                        n->hnext = nt[hash_key(n->key)%nb];
+                        nt[hash_key(n->key)%nb] = n;
+                }
+        }
+        free(table);
+        table = nt;
+        nbuckets = nb;
+}
+
+
+static void
+ttl_set (node *n, uint64_t expires)
+{
+        if (n->expires && !expires) {
+                if (n->tprev) {
+                        n->tprev->tnext = n->tnext;
+                }
+                else {
+                        ttl_list = n->tnext;
+                }
+                if (n->tnext) {
+                        n->tnext->tprev = n->tprev;
+                }
+                n->tprev = n->tnext = NULL;
+        }
+        else if (!n->expires && expires) {
+                n->tnext = ttl_list;
+                if (ttl_list) {
+                        ttl_list->tprev = n;
+                }
+                ttl_list = n;
+        }
+        n->expires = expires;
+        if (expires && (!next_expiry || (expires < next_expiry))) {
+                next_expiry = expires;
+        }
+}
+
+
+static node *
+node_create (node *parent, const char *key, int dir)
+{
+        node    *n;
+        size_t  b;
+
+        n = xmalloc(sizeof(*n));
+        memset(n,0,sizeof(*n));
+        n->key = xstrdup(key);
+        n->dir = dir;
+        n->created = n->modified = cur_index;
+
+        if (parent) {
+                n->parent = parent;
+                n->prev = parent->last;
+                if (parent->last) {
+                        parent->last->next = n;
+                }
+                else {
+                        parent->child = n;
+                }
+                parent->last = n;
+                ++parent->nchildren;
+        }
+
+        if (nnodes >= nbuckets) {
+                hash_grow();
+        }
+        b = hash_key(key) % nbuckets;
+        n->hnext = table[b];
+        table[b] = n;
+        ++nnodes;
+
+        return n;
+}
+
+
+static void
+node_destroy (node *n)
+{
+        node    **pp;
+
+        while (n->child) {
+                node_destroy(n->child);
+        }
+
+        if (n->parent) {
+                if (n->prev) {
+                        n->prev->next = n->next;
+                }
+                else {
+                        n->parent->child = n->next;
+                }
+                if (n->next) {
+                        n->next->prev = n->prev;
+                }
+                else {
+                        n->parent->last = n->prev;
+                }
+                --n->parent->nchildren;
+        }
+
+        for (pp = &table[hash_key(n->key)%nbuckets]; *pp; pp = &(*pp)->hnext) {
+                if (*pp == n) {
+                        *pp = n->hnext;
+                        break;
+                }
+        }
+        --nnodes;
+
+        ttl_set(n,0);
+        free(n->key);
+        free(n->value);
+        free(n);
+}
+
+
+/*
+ * Make sure every ancestor of key is a directory, creating any that are
+ * missing.  With create unset, just check that it could be done.
+ */
+static node *
+make_parents (const char *key, int create)
+{
+        char    *path   = xstrdup(key);
+        char    *slash;
+        node    *parent = root;
+        node    *n;
+
+        for (slash = strchr(path+1,'/'); slash; slash = strchr(slash+1,'/')) {
+                *slash = '\0';
+                n = lookup(path);
+                if (!n) {
+                        if (!create) {
+                                break;
+                        }
+                        n = node_create(parent,path,1);
+                }
+                else if (!n->dir) {
+                        parent = NULL;
+                        break;
+                }
+                parent = n;
+                *slash = '/';
+        }
+
+        free(path);
+        return parent;
+}
+
+
+/* Normalize a key: leading slash, no doubled or trailing ones. */
+static char *
+clean_key (const char *raw)
+{
+        char    *key    = xmalloc(strlen(raw)+2);
+        char    *out    = key;
+
+        *(out++) = '/';
+        for (; *raw; ++raw) {
+                if ((*raw == '/') && (out[-1] == '/')) {
+                        continue;
+                }
+                *(out++) = *raw;
+        }
+        if ((out > key+1) && (out[-1] == '/')) {
+                --out;
+        }
+        *out = '\0';
+        return key;
+}
+
+
+static void
+node_json (buf *b, node *n, int depth, int sorted);
+
+static int
+compare_nodes (const void *a, const void *b)
+{
+        return strcmp((*(node **)a)->key,(*(node **)b)->key);
+}
+
+
+static void
+children_json (buf *b, node *n, int depth, int sorted)
+{
+        node    **kids;
+        node    *kid;
+        size_t  i       = 0;
+
+        buf_add(b,",\"nodes\":[",10);
+        if (sorted && (n->nchildren > 1)) {
+                kids = xmalloc(n->nchildren*sizeof(*kids));
+                for (kid = n->child; kid; kid = kid->next) {
+                        kids[i++] = kid;
+                }
+                qsort(kids,n->nchildren,sizeof(*kids),compare_nodes);
+                for (i = 0; i < n->nchildren; ++i) {
+                        if (i) {
+                                buf_add(b,",",1);
+                        }
+                        node_json(b,kids[i],depth,sorted);
+                }
+                free(kids);
+        }
+        else {
+                for (kid = n->child; kid; kid = kid->next) {
+                        if (kid != n->child) {
+                                buf_add(b,",",1);
+                        }
+                        node_json(b,kid,depth,sorted);
+                }
+        }
+        buf_add(b,"]",1);
+}
+
+
+/* Depth is how many levels of children to include; negative means all. */
+static void
+node_json (buf *b, node *n, int depth, int sorted)
+{
+        char            stamp[32];
+        time_t          secs;
+        struct tm       tm;
+        uint64_t        now;
+
+        buf_add(b,"{\"key\":",7);
+        buf_json_str(b,n->key);
+        if (n->dir) {
+                buf_add(b,",\"dir\":true",11);
+        }
+        else {
+                buf_add(b,",\"value\":",9);
+                buf_json_str(b,n->value ? n->value : "");
+        }
+        if (n->expires) {
+                secs = (time_t)(n->expires / 1000);
+                gmtime_r(&secs,&tm);
+                strftime(stamp,sizeof(stamp),"%Y-%m-%dT%H:%M:%S",&tm);
+                now = now_ms();
+                buf_printf(b,",\"expiration\":\"%s.%03uZ\",\"ttl\":%"PRIu64,
+                           stamp,(unsigned)(n->expires%1000),
+                           (n->expires > now) ? (n->expires-now+999)/1000 : 0);
+        }
+        if (n->dir && depth && n->child) {
+                children_json(b,n,(depth > 0) ? depth-1 : depth,sorted);
+        }
+        if (n != root) {
+                buf_printf(b,",\"modifiedIndex\":%"PRIu64
+                             ",\"createdIndex\":%"PRIu64,
+                           n->modified,n->created);
+        }
+        buf_add(b,"}",1);
+}
+
+
+/*
+ * Connections and responses.
+ */
+
+static const char *
+status_text (int status)
+{
+        switch (status) {
+        case 200:       return "OK";
+        case 201:       return "Created";
+        case 400:       return "Bad Request";
+        case 403:       return "Forbidden";
+        case 404:       return "Not Found";
+        case 405:       return "Method Not Allowed";
+        case 412:       return "Precondition Failed";
+        case 431:       return "Request Header Fields Too Large";
+        case 500:       return "Internal Server Error";
+        }
+        return "Unknown";
+}
+
+
+static void
+reply (conn *c, int status, const char *type, buf *body)
+{
+        buf_printf(&c->out,"HTTP/1.1 %d %s\r\n"
+                           "Content-Type: %s\r\n"
+                           "X-Etcd-Index: %"PRIu64"\r\n"
+                           "Content-Length: %zu\r\n"
+                           "%s"
+                           "\r\n",
+                   status,status_text(status),type,cur_index,body->len,
+                   c->closing ? "Connection: close\r\n" : "");
+        buf_add(&c->out,body->data ? body->data : "",body->len);
+}
+
+
+static void
+reply_json (conn *c, int status, buf *body)
+{
+        reply(c,status,"application/json",body);
+}
+
+
+static void
+reply_error (conn *c, int code, const char *message, const char *cause)
+{
+        buf     b       = { NULL };
+        int     status;
+
+        switch (code) {
+        case EC_KEY_NOT_FOUND:
+                status = 404;
+                break;
+        case EC_TEST_FAILED:
+        case EC_NODE_EXIST:
+                status = 412;
+                break;
+        case EC_NOT_FILE:
+        case EC_NOT_DIR:
+        case EC_ROOT_RONLY:
+        case EC_DIR_NOT_EMPTY:
+                status = 403;
+                break;
+        default:
+                status = 400;
+        }
+
+        buf_printf(&b,"{\"errorCode\":%d,\"message\":",code);
+        buf_json_str(&b,message);
+        buf_add(&b,",\"cause\":",9);
+        buf_json_str(&b,cause);
+        buf_printf(&b,",\"index\":%"PRIu64"}\n",cur_index);
+        reply_json(c,status,&b);
+        free(b.data);
+}
+
+
+/*
+ * Events and watches.
+ */
+
+static int
+event_matches (event *ev, const char *key, int recursive)
+{
+        size_t  len;
+
+        if (!strcmp(ev->key,key)) {
+                return 1;
+        }
+        if (recursive) {
+                if (!strcmp(key,"/")) {
+                        return 1;
+                }
+                len = strlen(key);
+                if (!strncmp(ev->key,key,len) && (ev->key[len] == '/')) {
+                        return 1;
+                }
+        }
+        /* Taking away a directory takes away everything under it. */
+        if (ev->dir) {
+                len = strlen(ev->key);
+                if (!strncmp(key,ev->key,len) && (key[len] == '/')) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+
+static void
+watch_fire (conn *c, event *ev)
+{
+        buf     b       = { NULL };
+
+        buf_add(&b,ev->body,strlen(ev->body));
+        reply_json(c,200,&b);
+        free(b.data);
+        free(c->wkey);
+        c->wkey = NULL;
+        c->waiting = 0;
+}
+
+
+static void
+add_event (const char *key, int dir, buf *body)
+{
+        event   *ev;
+        size_t  i;
+
+        if (hist_count == hist_size) {
+                ev = &hist[hist_head];
+                free(ev->key);
+                free(ev->body);
+                hist_head = (hist_head + 1) % hist_size;
+                --hist_count;
+                hist_dropped = 1;
+        }
+        ev = &hist[(hist_head+hist_count)%hist_size];
+        ev->index = cur_index;
+        ev->key = xstrdup(key);
+        ev->dir = dir;
+        ev->body = xstrdup(body->data);
+        ++hist_count;
+
+        for (i = 0; i < nconns; ++i) {
+                if (conns[i]->wkey && (ev->index >= conns[i]->windex)
+                                      && event_matches(ev,conns[i]->wkey,
+                                                       conns[i]->wrecursive)) {
+                        watch_fire(conns[i],ev);
+                }
+        }
+}
+
+
+static void
+do_watch (conn *c, const char *key, params *p)
+{
+        const char      *wi     = get_param(p,"waitIndex");
+        uint64_t        windex;
+        event           *ev;
+        size_t          i;
+        char            cause[96];
+
+        windex = wi ? strtoull(wi,NULL,10) : 0;
+        if (!windex) {
+                windex = cur_index + 1;
+        }
+
+        c->wkey = xstrdup(key);
+        c->wrecursive = param_is(p,"recursive","true");
+        c->windex = windex;
+        c->waiting = 1;
+
+        if (hist_count && hist_dropped && (windex < hist[hist_head].index)) {
+                snprintf(cause,sizeof(cause),
+                         "the requested history has been cleared [%"PRIu64
+                         "/%"PRIu64"]",hist[hist_head].index,windex);
+                free(c->wkey);
+                c->wkey = NULL;
+                c->waiting = 0;
+                reply_error(c,EC_INDEX_CLEARED,"The event in requested index "
+                            "is outdated and cleared",cause);
+                return;
+        }
+
+        for (i = 0; i < hist_count; ++i) {
+                ev = &hist[(hist_head+i)%hist_size];
+                if ((ev->index >= windex)
+                                && event_matches(ev,key,c->wrecursive)) {
+                        watch_fire(c,ev);
+                        return;
+                }
+        }
+}
+
+
+static void lock_expire (uint64_t now);
+
+static void
+expire_due (void)
+{
+        uint64_t        now     = now_ms();
+        node            *n;
+        buf             b;
+
+        if (!next_expiry || (now < next_expiry)) {
+                return;
+        }
+
+        /*
+         * Start over after each one, because taking away a directory can take
+         * other members of the list with it.
+         */
+        for (;;) {
+                for (n = ttl_list; n && (n->expires > now); n = n->tnext) {
+                        continue;
+                }
+                if (!n) {
+                        break;
+                }
+                ++cur_index;
+                memset(&b,0,sizeof(b));
+                buf_add(&b,"{\"action\":\"expire\",\"node\":{\"key\":",33);
+                buf_json_str(&b,n->key);
+                buf_printf(&b,"%s,\"modifiedIndex\":%"PRIu64
+                              ",\"createdIndex\":%"PRIu64"},\"prevNode\":",
+                           n->dir ? ",\"dir\":true" : "",cur_index,
+                           n->created);
+                node_json(&b,n,0,0);
+                buf_add(&b,"}\n",2);
+                add_event(n->key,n->dir,&b);
+                free(b.data);
+                node_destroy(n);
+        }
+
+        next_expiry = 0;
+        for (n = ttl_list; n; n = n->tnext) {
+                if (!next_expiry || (n->expires < next_expiry)) {
+                        next_expiry = n->expires;
+                }
+        }
+        lock_expire(now);
+}
+
+
+/*
+ * The keys API proper.
+ */
+
+static void
+do_get (conn *c, const char *key, params *p)
+{
+        node    *n;
+        buf     b       = { NULL };
+
+        if (param_is(p,"wait","true")) {
+                do_watch(c,key,p);
+                return;
+        }
+
+        n = lookup(key);
+        if (!n) {
+                reply_error(c,EC_KEY_NOT_FOUND,"Key not found",key);
+                return;
+        }
+
+        buf_add(&b,"{\"action\":\"get\",\"node\":",23);
+        node_json(&b,n,param_is(p,"recursive","true") ? -1 : 1,
+                  param_is(p,"sorted","true"));
+        buf_add(&b,"}\n",2);
+        reply_json(c,200,&b);
+        free(b.data);
+}
+
+
+/* Check prevValue and prevIndex, returning an error code or zero. */
+static int
+check_prev (conn *c, node *n, const char *key, params *p)
+{
+        const char      *pv     = get_param(p,"prevValue");
+        const char      *pi     = get_param(p,"prevIndex");
+        char            *cause;
+
+        if (!pv && !pi) {
+                return 0;
+        }
+        if (!n) {
+                reply_error(c,EC_KEY_NOT_FOUND,"Key not found",key);
+                return EC_KEY_NOT_FOUND;
+        }
+        if (n->dir) {
+                reply_error(c,EC_NOT_FILE,"Not a file",key);
+                return EC_NOT_FILE;
+        }
+        if (pv && strcmp(pv,n->value)) {
+                if (asprintf(&cause,"[%s != %s]",pv,n->value) < 0) {
+                        cause = NULL;
+                }
+                reply_error(c,EC_TEST_FAILED,"Compare failed",
+                            cause ? cause : key);
+                free(cause);
+                return EC_TEST_FAILED;
+        }
+        if (pi && (strtoull(pi,NULL,10) != n->modified)) {
+                if (asprintf(&cause,"[%s != %"PRIu64"]",pi,n->modified) < 0) {
+                        cause = NULL;
+                }
+                reply_error(c,EC_TEST_FAILED,"Compare failed",
+                            cause ? cause : key);
+                free(cause);
+                return EC_TEST_FAILED;
+        }
+        return 0;
+}
+
+
+static void
+do_put (conn *c, const char *key, params *p, int post)
+{
+        const char      *value  = get_param(p,"value");
+        const char      *ttl_s  = get_param(p,"ttl");
+        const char      *pe     = get_param(p,"prevExist");
+        int             is_dir  = param_is(p,"dir","true");
+        uint64_t        expires = 0;
+        node            *n;
+        node            *parent;
+        buf             prev    = { NULL };
+        buf             b       = { NULL };
+        const char      *action;
+        char            *new_key        = NULL;
+        char            *end;
+        int             created;
+
+        if (!strcmp(key,"/") && !post) {
+                reply_error(c,EC_ROOT_RONLY,"Root is read only","/");
+                return;
+        }
+        if (ttl_s && *ttl_s) {
+                expires = strtoull(ttl_s,&end,10);
+                if (*end) {
+                        reply_error(c,EC_TTL_NAN,"The given TTL in POST form "
+                                    "is not a number","Update");
+                        return;
+                }
+                expires = now_ms() + expires * 1000;
+        }
+
+        n = lookup(key);
+
+        if (param_is(p,"refresh","true")) {
+                if (value) {
+                        reply_error(c,EC_INVALID_FIELD,"Invalid field",
+                                    "value provided on refresh");
+                        return;
+                }
+                if (!n) {
+                        reply_error(c,EC_KEY_NOT_FOUND,"Key not found",key);
+                        return;
+                }
+                if (check_prev(c,n,key,p)) {
+                        return;
+                }
+                /* A new index, but no event: that's the point of it. */
+                node_json(&prev,n,0,0);
+                n->modified = ++cur_index;
+                ttl_set(n,expires);
+                buf_add(&b,"{\"action\":\"update\",\"node\":",26);
+                node_json(&b,n,0,0);
+                buf_printf(&b,",\"prevNode\":%s}\n",prev.data);
+                reply_json(c,200,&b);
+                goto done;
+        }
+
+        if (post) {
+                if (n && !n->dir) {
+                        reply_error(c,EC_NOT_DIR,"Not a directory",key);
+                        return;
+                }
+                if (asprintf(&new_key,"%s%s%020"PRIu64,key,
+                             strcmp(key,"/") ? "/" : "",cur_index+1) < 0) {
+                        return;
+                }
+                key = new_key;
+                n = NULL;
+        }
+        else {
+                if (pe && !strcmp(pe,"true") && !n) {
+                        reply_error(c,EC_KEY_NOT_FOUND,"Key not found",key);
+                        return;
+                }
+                if (pe && !strcmp(pe,"false") && n) {
+                        reply_error(c,EC_NODE_EXIST,"Key already exists",key);
+                        return;
+                }
+                if (check_prev(c,n,key,p)) {
+                        return;
+                }
+                if (n && n->dir && !(is_dir && pe && !strcmp(pe,"true"))) {
+                        reply_error(c,EC_NOT_FILE,"Not a file",key);
+                        return;
+                }
+                if (n && !n->dir && is_dir) {
+                        reply_error(c,EC_NOT_DIR,"Not a directory",key);
+                        return;
+                }
+        }
+        if (!n && !make_parents(key,0)) {
+                reply_error(c,EC_NOT_DIR,"Not a directory",key);
+                goto done;
+        }
+
+        ++cur_index;
+        created = !n;
+        if (n) {
+                node_json(&prev,n,0,0);
+        }
+        else {
+                parent = make_parents(key,1);
+                n = node_create(parent,key,is_dir);
+        }
+        if (!n->dir) {
+                free(n->value);
+                n->value = xstrdup(value ? value : "");
+        }
+        n->modified = cur_index;
+        ttl_set(n,expires);
+
+        if (post || (pe && !strcmp(pe,"false"))) {
+                action = "create";
+        }
+        else if (get_param(p,"prevValue") || get_param(p,"prevIndex")) {
+                action = "compareAndSwap";
+        }
+        else if (pe && !strcmp(pe,"true")) {
+                action = "update";
+        }
+        else {
+                action = "set";
+        }
+
+        buf_printf(&b,"{\"action\":\"%s\",\"node\":",action);
+        node_json(&b,n,0,0);
+        if (prev.len) {
+                buf_printf(&b,",\"prevNode\":%s",prev.data);
+        }
+        buf_add(&b,"}\n",2);
+        add_event(key,0,&b);
+        reply_json(c,created ? 201 : 200,&b);
+
+done:
+        free(new_key);
+        free(prev.data);
+        free(b.data);
+}
+
+
+static void
+do_delete (conn *c, const char *key, params *p)
+{
+        node            *n;
+        int             recursive       = param_is(p,"recursive","true");
+        buf             b               = { NULL };
+
+        if (!strcmp(key,"/")) {
+                reply_error(c,EC_ROOT_RONLY,"Root is read only","/");
+                return;
+        }
+        n = lookup(key);
+        if (!n) {
+                reply_error(c,EC_KEY_NOT_FOUND,"Key not found",key);
+                return;
+        }
+        if (n->dir && !recursive) {
+                if (!param_is(p,"dir","true")) {
+                        reply_error(c,EC_NOT_FILE,"Not a file",key);
+                        return;
+                }
+                if (n->child) {
+                        reply_error(c,EC_DIR_NOT_EMPTY,"Directory not empty",
+                                    key);
+                        return;
+                }
+        }
+        if (check_prev(c,n,key,p)) {
+                return;
+        }
+
+        ++cur_index;
+        buf_printf(&b,"{\"action\":\"%s\",\"node\":{\"key\":",
+                   (get_param(p,"prevValue") || get_param(p,"prevIndex"))
+                        ? "compareAndDelete" : "delete");
+        buf_json_str(&b,key);
+        buf_printf(&b,"%s,\"modifiedIndex\":%"PRIu64",\"createdIndex\":%"PRIu64
+                      "},\"prevNode\":",
+                   n->dir ? ",\"dir\":true" : "",cur_index,n->created);
+        node_json(&b,n,0,0);
+        buf_add(&b,"}\n",2);
+        add_event(key,n->dir,&b);
+        node_destroy(n);
+        reply_json(c,200,&b);
+        free(b.data);
+}
+
+
+/*
+ * The lock module.  POST waits for the lock and answers with the holder's
+ * index, PUT renews and DELETE releases given that index, and GET says who
+ * has it.  Waiters are parked just like watches and served in the order they
+ * asked.
+ */
+
+static void
+reply_text (conn *c, int status, const char *text)
+{
+        buf     b       = { NULL };
+
+        buf_printf(&b,"%s",text);
+        reply(c,status,"text/plain",&b);
+        free(b.data);
+}
+
+
+static lock **
+lock_find (const char *name)
+{
+        lock    **pp;
+
+        for (pp = &locks; *pp; pp = &(*pp)->next) {
+                if (!strcmp((*pp)->name,name)) {
+                        break;
+                }
+        }
+        return pp;
+}
+
+
+static void
+lock_set_ttl (lock *l, uint64_t ttl)
+{
+        l->expires = now_ms() + ttl * 1000;
+        if (!next_expiry || (l->expires < next_expiry)) {
+                next_expiry = l->expires;
+        }
+}
+
+
+/* Hand a free lock to whoever has been waiting longest, if anyone. */
+static void
+lock_grant (const char *name)
+{
+        conn    *w      = NULL;
+        lock    *l;
+        char    text[24];
+        size_t  i;
+
+        if (*lock_find(name)) {
+                return;
+        }
+        for (i = 0; i < nconns; ++i) {
+                if (conns[i]->lname && !strcmp(conns[i]->lname,name)
+                                    && (!w || (conns[i]->lseq < w->lseq))) {
+                        w = conns[i];
+                }
+        }
+        if (!w) {
+                return;
+        }
+
+        l = xmalloc(sizeof(*l));
+        l->name = w->lname;
+        l->index = ++cur_index;
+        lock_set_ttl(l,w->lttl);
+        l->next = locks;
+        locks = l;
+
+        w->lname = NULL;
+        w->waiting = 0;
+        snprintf(text,sizeof(text),"%"PRIu64,l->index);
+        reply_text(w,200,text);
+}
+
+
+static void
+lock_release (lock **pp)
+{
+        lock    *l      = *pp;
+
+        *pp = l->next;
+        lock_grant(l->name);
+        free(l->name);
+        free(l);
+}
+
+
+static void
+lock_expire (uint64_t now)
+{
+        lock    **pp;
+
+        /* Releasing can grant, which changes the list, so start over. */
+        for (;;) {
+                for (pp = &locks; *pp; pp = &(*pp)->next) {
+                        if ((*pp)->expires <= now) {
+                                break;
+                        }
+                }
+                if (!*pp) {
+                        break;
+                }
+                if (verbose) {
+                        fprintf(stderr,"lock %s expired\n",(*pp)->name);
+                }
+                lock_release(pp);
+        }
+
+        for (pp = &locks; *pp; pp = &(*pp)->next) {
+                if (!next_expiry || ((*pp)->expires < next_expiry)) {
+                        next_expiry = (*pp)->expires;
+                }
+        }
+}
+
+
+static void
+do_lock (conn *c, const char *method, const char *name, params *p)
+{
+        const char      *ttl_s  = get_param(p,"ttl");
+        const char      *idx_s  = get_param(p,"index");
+        uint64_t        ttl     = ttl_s ? strtoull(ttl_s,NULL,10) : 0;
+        lock            **pp    = lock_find(name);
+        char            text[24];
+
+        if (!strcmp(method,"GET")) {
+                text[0] = '\0';
+                if (*pp) {
+                        snprintf(text,sizeof(text),"%"PRIu64,(*pp)->index);
+                }
+                reply_text(c,200,text);
+                return;
+        }
+
+        if (!strcmp(method,"POST")) {
+                if (!ttl) {
+                        reply_text(c,500,"Invalid TTL");
+                        return;
+                }
+                c->lname = xstrdup(name);
+                c->lttl = ttl;
+                c->lseq = ++lock_seq;
+                c->waiting = 1;
+                lock_grant(name);
+                return;
+        }
+
+        if (!*pp || !idx_s || (strtoull(idx_s,NULL,10) != (*pp)->index)) {
+                reply_text(c,500,"Renew lock error");
+                return;
+        }
+        if (!strcmp(method,"PUT")) {
+                if (!ttl) {
+                        reply_text(c,500,"Invalid TTL");
+                        return;
+                }
+                lock_set_ttl(*pp,ttl);
+                snprintf(text,sizeof(text),"%"PRIu64,(*pp)->index);
+                reply_text(c,200,text);
+        }
+        else if (!strcmp(method,"DELETE")) {
+                lock_release(pp);
+                reply_text(c,200,"");
+        }
+        else {
+                reply_text(c,405,"Method Not Allowed\n");
+        }
+}
+
+
+/*
+ * Stats, such as they are.  There's only one member and it's the leader.
+ */
+
+static void
+do_stats (conn *c, const char *what)
+{
+        buf     b       = { NULL };
+
+        if (!strcmp(what,"leader")) {
+                buf_add(&b,"{\"leader\":",10);
+                buf_json_str(&b,my_name);
+                buf_add(&b,",\"followers\":{}}\n",17);
+        }
+        else if (!strcmp(what,"self")) {
+                buf_add(&b,"{\"name\":",8);
+                buf_json_str(&b,my_name);
+                buf_add(&b,",\"id\":",6);
+                buf_json_str(&b,my_name);
+                buf_printf(&b,",\"state\":\"StateLeader\",\"leaderInfo\":"
+                              "{\"leader\":");
+                buf_json_str(&b,my_name);
+                buf_printf(&b,",\"uptime\":\"%"PRIu64"ms\"}}\n",
+                           now_ms()-start_time);
+        }
+        else {
+                buf_printf(&b,"404 page not found\n");
+                reply(c,404,"text/plain",&b);
+                free(b.data);
+                return;
+        }
+        reply_json(c,200,&b);
+        free(b.data);
+}
+
+
+static void
+handle (conn *c, char *method, char *target, char *body)
+{
+        params  p       = { .n = 0 };
+        char    *query;
+        char    *key;
+        buf     b       = { NULL };
+
+        if (verbose) {
+                fprintf(stderr,"%s %s\n",method,target);
+        }
+
+        query = strchr(target,'?');
+        if (query) {
+                *(query++) = '\0';
+        }
+        parse_params(query,&p);
+        parse_params(body,&p);
+        url_decode(target,0);
+
+        expire_due();
+
+        if (!strncmp(target,"/v2/keys",8)
+                        && ((target[8] == '/') || (target[8] == '\0'))) {
+                key = clean_key(target+8);
+                if (!strcmp(method,"GET")) {
+                        do_get(c,key,&p);
+                }
+                else if (!strcmp(method,"PUT")) {
+                        do_put(c,key,&p,0);
+                }
+                else if (!strcmp(method,"POST")) {
+                        do_put(c,key,&p,1);
+                }
+                else if (!strcmp(method,"DELETE")) {
+                        do_delete(c,key,&p);
+                }
+                else {
+                        buf_printf(&b,"Method Not Allowed\n");
+                        reply(c,405,"text/plain",&b);
+                }
+                free(key);
+        }
+        else if (!strncmp(target,"/mod/v2/lock/",13)) {
+                key = clean_key(target+13);
+                do_lock(c,method,key,&p);
+                free(key);
+        }
+        else if (!strncmp(target,"/v2/stats/",10)) {
+                do_stats(c,target+10);
+        }
+        else if (!strcmp(target,"/v2/machines")) {
+                buf_printf(&b,"http://%s:%d",my_addr,my_port);
+                reply(c,200,"text/plain",&b);
+        }
+        else if (!strcmp(target,"/version")) {
+                buf_printf(&b,"{\"etcdserver\":\"2.3.0\","
+                              "\"etcdcluster\":\"2.3.0\"}");
+                reply_json(c,200,&b);
+        }
+        else {
+                buf_printf(&b,"404 page not found\n");
+                reply(c,404,"text/plain",&b);
+        }
+
+        free(b.data);
+}
+
+
+/*
+ * Pull complete requests out of the input buffer for as long as there are
+ * any, stopping if one of them parks the connection in a watch.
+ */
+static void
+process_input (conn *c)
+{
+        char    *end;
+        char    *line;
+        char    *method;
+        char    *target;
+        char    *version;
+        char    *body;
+        size_t  head_len;
+        size_t  body_len;
+        int     expect;
+        int     keep_alive;
+        char    save;
+
+        while (!c->waiting && !c->closing && c->in.len) {
+                end = strstr(c->in.data,"\r\n\r\n");
+                if (!end) {
+                        if (c->in.len > MAX_REQUEST) {
+                                c->closing = 1;
+                                reply(c,431,"text/plain",&(buf){ NULL });
+                        }
+                        return;
+                }
+                head_len = end - c->in.data + 4;
+
+                /* Headers first, without disturbing the buffer yet. */
+                body_len = 0;
+                expect = 0;
+                keep_alive = -1;
+                for (line = strstr(c->in.data,"\r\n"); line && (line < end);
+                     line = strstr(line+2,"\r\n")) {
+                        if (!strncasecmp(line+2,"Content-Length:",15)) {
+                                body_len = strtoul(line+17,NULL,10);
+                        }
+                        else if (!strncasecmp(line+2,"Expect:",7)) {
+                                expect = 1;
+                        }
+                        else if (!strncasecmp(line+2,"Connection:",11)) {
+                                keep_alive = !!strncasecmp(line+13+
+                                                strspn(line+13," "),"close",5);
+                        }
+                }
+                if (body_len > MAX_REQUEST) {
+                        c->closing = 1;
+                        reply(c,431,"text/plain",&(buf){ NULL });
+                        return;
+                }
+                if (c->in.len < (head_len + body_len)) {
+                        if (expect && !c->continued) {
+                                buf_printf(&c->out,
+                                           "HTTP/1.1 100 Continue\r\n\r\n");
+                                c->continued = 1;
+                        }
+                        return;
+                }
+                c->continued = 0;
+
+                /* Now carve it up. */
+                method = c->in.data;
+                line = strstr(method,"\r\n");
+                *line = '\0';
+                target = strchr(method,' ');
+                version = target ? strchr(target+1,' ') : NULL;
+                if (!version) {
+                        c->closing = 1;
+                        return;
+                }
+                *(target++) = '\0';
+                *(version++) = '\0';
+                if (keep_alive < 0) {
+                        keep_alive = !!strcmp(version,"HTTP/1.0");
+                }
+                c->closing = !keep_alive;
+
+                body = c->in.data + head_len;
+                save = body[body_len];
+                body[body_len] = '\0';
+                handle(c,method,target,body);
+                body[body_len] = save;
+
+                memmove(c->in.data,c->in.data+head_len+body_len,
+                        c->in.len-head_len-body_len+1);
+                c->in.len -= head_len + body_len;
+        }
+}
+
+
+static void
+conn_free (conn *c)
+{
+        close(c->fd);
+        free(c->in.data);
+        free(c->out.data);
+        free(c->wkey);
+        free(c->lname);
+        free(c);
+}
+
+
+static int
+listen_on (const char *addr, unsigned short port)
+{
+        struct sockaddr_in      sin;
+        int                     fd;
+        int                     one     = 1;
+
+        memset(&sin,0,sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        if (inet_pton(AF_INET,addr,&sin.sin_addr) != 1) {
+                fprintf(stderr,"bad address %s\n",addr);
+                return -1;
+        }
+
+        fd = socket(AF_INET,SOCK_STREAM,0);
+        if (fd < 0) {
+                perror("socket");
+                return -1;
+        }
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+        if (bind(fd,(struct sockaddr *)&sin,sizeof(sin)) < 0) {
+                perror("bind");
+                close(fd);
+                return -1;
+        }
+        if (listen(fd,1024) < 0) {
+                perror("listen");
+                close(fd);
+                return -1;
+        }
+        fcntl(fd,F_SETFL,O_NONBLOCK);
+        return fd;
+}
+
+
+/* Same as listen_on, for a Unix socket; anything already at path goes. */
+static int
+listen_unix (const char *path)
+{
+        struct sockaddr_un      sun;
+        int                     fd;
+
+        memset(&sun,0,sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+                fprintf(stderr,"path too long: %s\n",path);
+                return -1;
+        }
+        strcpy(sun.sun_path,path);
+        unlink(path);
+
+        fd = socket(AF_UNIX,SOCK_STREAM,0);
+        if (fd < 0) {
+                perror("socket");
+                return -1;
+        }
+        if (bind(fd,(struct sockaddr *)&sun,sizeof(sun)) < 0) {
+                perror("bind");
+                close(fd);
+                return -1;
+        }
+        if (listen(fd,1024) < 0) {
+                perror("listen");
+                close(fd);
+                return -1;
+        }
+        fcntl(fd,F_SETFL,O_NONBLOCK);
+        return fd;
+}
+
+
+static void
+accept_all (int lfd)
+{
+        conn    **nc;
+        conn    *c;
+        int     fd;
+        int     one     = 1;
+
+        while ((fd = accept(lfd,NULL,NULL)) >= 0) {
+                if (nconns == max_conns) {
+                        max_conns = max_conns ? max_conns * 2 : 64;
+                        nc = realloc(conns,max_conns*sizeof(*nc));
+                        if (!nc) {
+                                close(fd);
+                                return;
+                        }
+                        conns = nc;
+                }
+                fcntl(fd,F_SETFL,O_NONBLOCK);
+                /* This just fails on a Unix socket, which is fine. */
+                setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+                c = xmalloc(sizeof(*c));
+                memset(c,0,sizeof(*c));
+                c->fd = fd;
+                conns[nconns++] = c;
+        }
+}
+
+
+/* Returns zero if the connection should be dropped. */
+static int
+conn_read (conn *c)
+{
+        char    chunk[65536];
+        ssize_t len;
+
+        for (;;) {
+                len = read(c->fd,chunk,sizeof(chunk));
+                if (len > 0) {
+                        buf_add(&c->in,chunk,len);
+                        continue;
+                }
+                if (len == 0) {
+                        return 0;
+                }
+                return (errno == EAGAIN) || (errno == EINTR);
+        }
+}
+
+
+/* Returns zero if the connection should be dropped. */
+static int
+conn_write (conn *c)
+{
+        ssize_t len;
+
+        while (c->out_pos < c->out.len) {
+                len = write(c->fd,c->out.data+c->out_pos,
+                            c->out.len-c->out_pos);
+                if (len < 0) {
+                        return (errno == EAGAIN) || (errno == EINTR);
+                }
+                c->out_pos += len;
+        }
+        c->out.len = c->out_pos = 0;
+        return !c->closing;
+}
+
+
+static int
+print_usage (char *prog)
+{
+        fprintf(stderr,"Usage: %s [options]\n",prog);
+        fprintf(stderr,"  -a|--address  AAA  default 127.0.0.1\n");
+        fprintf(stderr,"  -H|--history  HHH  default %d events\n",
+                DEFAULT_HISTORY);
+        fprintf(stderr,"  -n|--name     NNN  default etcd-mock\n");
+        fprintf(stderr,"  -p|--port     PPP  default %d\n",DEFAULT_PORT);
+        fprintf(stderr,"  -u|--unix     UUU  also listen on this socket\n");
+        fprintf(stderr,"  -v|--verbose       log each request\n");
+        return EXIT_FAILURE;
+}
+
+
+struct option my_opts[] = {
+        { "address",    required_argument,      NULL,   'a' },
+        { "help",       no_argument,            NULL,   'h' },
+        { "history",    required_argument,      NULL,   'H' },
+        { "name",       required_argument,      NULL,   'n' },
+        { "port",       required_argument,      NULL,   'p' },
+        { "unix",       required_argument,      NULL,   'u' },
+        { "verbose",    no_argument,            NULL,   'v' },
+        { NULL }
+};
+
+int
+main (int argc, char **argv)
+{
+        struct pollfd   *pfds   = NULL;
+        size_t          max_pfds        = 0;
+        int             lfd[NUM_LISTENERS];
+        int             opt;
+        int             timeout;
+        uint64_t        now;
+        size_t          i;
+        size_t          j;
+        conn            *c;
+        int             keep;
+
+        for (;;) {
+                opt = getopt_long(argc,argv,"a:hH:n:p:u:v",my_opts,NULL);
+                if (opt == (-1)) {
+                        break;
+                }
+                switch (opt) {
+                case 'a':
+                        my_addr = optarg;
+                        break;
+                case 'H':
+                        hist_size = strtoul(optarg,NULL,10);
+                        if (!hist_size) {
+                                return print_usage(argv[0]);
+                        }
+                        break;
+                case 'n':
+                        my_name = optarg;
+                        break;
+                case 'p':
+                        my_port = (unsigned short)strtoul(optarg,NULL,10);
+                        break;
+                case 'u':
+                        my_path = optarg;
+                        break;
+                case 'v':
+                        verbose = 1;
+                        break;
+                default:
+                        return print_usage(argv[0]);
+                }
+        }
+
+        signal(SIGPIPE,SIG_IGN);
+        start_time = now_ms();
+
+        nbuckets = 1024;
+        table = calloc(nbuckets,sizeof(*table));
+        hist = calloc(hist_size,sizeof(*hist));
+        if (!table || !hist) {
+                fprintf(stderr,"out of memory\n");
+                return EXIT_FAILURE;
+        }
+        root = node_create(NULL,"/",1);
+
+        /*
+         * The Unix socket goes first, so that anyone waiting for the port to
+         * answer can use both from then on.  poll skips negative descriptors,
+         * so not having one is no problem.
+         */
+        lfd[1] = -1;
+        if (my_path) {
+                lfd[1] = listen_unix(my_path);
+                if (lfd[1] < 0) {
+                        return EXIT_FAILURE;
+                }
+        }
+        lfd[0] = listen_on(my_addr,my_port);
+        if (lfd[0] < 0) {
+                return EXIT_FAILURE;
+        }
+
+        for (;;) {
+                expire_due();
+
+                if ((nconns + NUM_LISTENERS) > max_pfds) {
+                        max_pfds = (nconns + NUM_LISTENERS) * 2;
+                        pfds = realloc(pfds,max_pfds*sizeof(*pfds));
+                        if (!pfds) {
+                                fprintf(stderr,"out of memory\n");
+                                return EXIT_FAILURE;
+                        }
+                }
+                for (i = 0; i < NUM_LISTENERS; ++i) {
+                        pfds[i].fd = lfd[i];
+                        pfds[i].events = POLLIN;
+                }
+                for (i = 0; i < nconns; ++i) {
+                        pfds[i+NUM_LISTENERS].fd = conns[i]->fd;
+                        pfds[i+NUM_LISTENERS].events = POLLIN;
+                        if (conns[i]->out.len) {
+                                pfds[i+NUM_LISTENERS].events |= POLLOUT;
+                        }
+                }
+
+                timeout = -1;
+                if (next_expiry) {
+                        now = now_ms();
+                        timeout = (next_expiry > now)
+                                ? (int)(next_expiry - now) : 0;
+                }
+                if (poll(pfds,nconns+NUM_LISTENERS,timeout) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        perror("poll");
+                        return EXIT_FAILURE;
+                }
+
+                /*
+                 * Events from one connection can complete watches on any
+                 * other, so write out everything that has output pending
+                 * rather than trusting revents alone.
+                 */
+                for (i = 0; i < nconns; ++i) {
+                        c = conns[i];
+                        if (!(pfds[i+NUM_LISTENERS].revents
+                                        & (POLLIN|POLLHUP|POLLERR))) {
+                                continue;
+                        }
+                        if (conn_read(c)) {
+                                process_input(c);
+                        }
+                        else {
+                                c->closing = 1;
+                                c->out.len = c->out_pos = 0;
+                        }
+                }
+                for (i = j = 0; i < nconns; ++i) {
+                        c = conns[i];
+                        keep = !c->closing || c->out.len;
+                        if (c->out.len) {
+                                keep = conn_write(c);
+                                if (keep && !c->waiting) {
+                                        /* Finishing a watch can free up more. */
+                                        process_input(c);
+                                        if (c->out.len) {
+                                                keep = conn_write(c);
+                                        }
+                                }
+                        }
+                        if (keep) {
+                                conns[j++] = c;
+                        }
+                        else {
+                                conn_free(c);
+                        }
+                }
+                nconns = j;
+
+                for (i = 0; i < NUM_LISTENERS; ++i) {
+                        if (pfds[i].revents & POLLIN) {
+                                accept_all(lfd[i]);
+                        }
+                }
+        }
+}
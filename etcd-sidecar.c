@@ -0,0 +1,734 @@
+/*
+ * Copyright (c) 2013, Red Hat
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.  Redistributions in binary
+ * form must reproduce the above copyright notice, this list of conditions and
+ * the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A per-host daemon that lets any number of local processes share one warm
+ * set of connections to the cluster.  Clients point libetcd at it with a
+ * "sidecar:/path" server and otherwise use the ordinary API; the protocol is
+ * in etcd-sidecar.h.  An identical watch from a given index (a GET with
+ * wait=true and waitIndex) that arrives while one is already outstanding
+ * rides along with it, so a hundred processes watching the same key cost the
+ * cluster one watch, and the answer is encoded once and copied to each.  Any
+ * other GET, including a watch from "now", only rides along if no write has
+ * gone out since the one it would share, so that a client always sees its
+ * own writes.  Everything else goes straight through.  It's all one thread,
+ * on epoll, using the library's event-loop interface.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "etcd-api.h"
+#include "etcd-sidecar.h"
+
+#define DEFAULT_SERVERS "127.0.0.1:4001"
+#define NUM_BUCKETS     1024
+#define MAX_EVENTS      64
+
+typedef struct {
+        char    *data;
+        size_t  len;
+        size_t  size;
+} buf;
+
+struct pending;
+
+typedef struct client {
+        int             fd;
+        buf             in;
+        buf             out;
+        size_t          out_pos;
+        int             closing;        /* once the output is flushed */
+        struct pending  *waiting;       /* what we're waiting on, if any */
+        struct client   *wnext;         /* others waiting on the same */
+} client;
+
+/*
+ * One request to the cluster, and everyone waiting for its answer.  Only
+ * GETs are shared, so only they go in the table.  A request can outlive all
+ * its waiters, since there's no taking it back once it's started; anyone
+ * asking the same thing in the meantime can still share it (see above).
+ */
+typedef struct pending {
+        struct pending  *hnext;
+        char            *path;
+        int             shared;         /* in the table */
+        uint64_t        writes;         /* writes_started when it went out */
+        client          *waiters;
+} pending;
+
+static etcd_session     session;
+static int              epfd;
+static int              lfd;
+static client           **clients;      /* by fd */
+static size_t           max_clients;
+static pending          *table[NUM_BUCKETS];
+static uint64_t         writes_started;
+static int64_t          timer_due       = -1;
+static volatile sig_atomic_t stopping;
+static int              verbose;
+static char             *my_path        = SC_DEFAULT_PATH;
+static uint64_t         n_requests;
+static uint64_t         n_shared;
+
+
+static void *
+xmalloc (size_t size)
+{
+        void    *p      = malloc(size);
+
+        if (!p) {
+                fprintf(stderr,"out of memory\n");
+                exit(EXIT_FAILURE);
+        }
+        return p;
+}
+
+
+static int64_t
+now_ms (void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static void
+buf_add (buf *b, const void *data, size_t len)
+{
+        size_t  size;
+        char    *p;
+
+        if ((b->len + len) > b->size) {
+                size = b->size ? b->size : 256;
+                while ((b->len + len) > size) {
+                        size *= 2;
+                }
+                p = realloc(b->data,size);
+                if (!p) {
+                        fprintf(stderr,"out of memory\n");
+                        exit(EXIT_FAILURE);
+                }
+                b->data = p;
+                b->size = size;
+        }
+        memcpy(b->data+b->len,data,len);
+        b->len += len;
+}
+
+
+static void
+buf_consume (buf *b, size_t len)
+{
+        memmove(b->data,b->data+len,b->len-len);
+        b->len -= len;
+}
+
+
+static size_t
+hash_path (const char *path)
+{
+        size_t  h       = 5381;
+
+        while (*path) {
+                h = (h * 33) ^ (unsigned char)*path++;
+        }
+        return h % NUM_BUCKETS;
+}
+
+
+/*
+ * Event-loop glue.  Client sockets are in clients[], the listener is lfd,
+ * and anything else epoll tells us about must be one of curl's.
+ */
+
+static void
+socket_cb (void *arg, int fd, int what)
+{
+        struct epoll_event      ev;
+
+        if (what & ETCD_POLL_REMOVE) {
+                (void)epoll_ctl(epfd,EPOLL_CTL_DEL,fd,NULL);
+                return;
+        }
+        memset(&ev,0,sizeof(ev));
+        ev.data.fd = fd;
+        if (what & ETCD_POLL_IN) {
+                ev.events |= EPOLLIN;
+        }
+        if (what & ETCD_POLL_OUT) {
+                ev.events |= EPOLLOUT;
+        }
+        if (epoll_ctl(epfd,EPOLL_CTL_MOD,fd,&ev) < 0) {
+                (void)epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev);
+        }
+}
+
+
+static void
+timer_cb (void *arg, long timeout_ms)
+{
+        timer_due = (timeout_ms < 0) ? -1 : now_ms() + timeout_ms;
+}
+
+
+static void
+client_watch (client *c)
+{
+        struct epoll_event      ev;
+
+        memset(&ev,0,sizeof(ev));
+        ev.data.fd = c->fd;
+        ev.events = EPOLLIN;
+        if (c->out.len) {
+                ev.events |= EPOLLOUT;
+        }
+        (void)epoll_ctl(epfd,EPOLL_CTL_MOD,c->fd,&ev);
+}
+
+
+static void
+client_free (client *c)
+{
+        client  **wp;
+
+        if (c->waiting) {
+                for (wp = &c->waiting->waiters; *wp; wp = &(*wp)->wnext) {
+                        if (*wp == c) {
+                                *wp = c->wnext;
+                                break;
+                        }
+                }
+        }
+        if (verbose) {
+                fprintf(stderr,"client %d gone\n",c->fd);
+        }
+        clients[c->fd] = NULL;
+        close(c->fd);
+        free(c->in.data);
+        free(c->out.data);
+        free(c);
+}
+
+
+/* Returns zero if the client went away. */
+static int
+client_write (client *c)
+{
+        ssize_t n;
+
+        while (c->out_pos < c->out.len) {
+                n = write(c->fd,c->out.data+c->out_pos,c->out.len-c->out_pos);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno == EAGAIN) {
+                                client_watch(c);
+                                return 1;
+                        }
+                        client_free(c);
+                        return 0;
+                }
+                c->out_pos += n;
+        }
+        c->out.len = c->out_pos = 0;
+        if (c->closing) {
+                client_free(c);
+                return 0;
+        }
+        client_watch(c);
+        return 1;
+}
+
+
+static void client_process (client *c);
+
+static void
+request_done (void *arg, etcd_result res, long status, etcd_index etcd_index,
+              const char *body, size_t len)
+{
+        pending         *p      = arg;
+        pending         **pp;
+        client          *c;
+        client          *next;
+        unsigned char   hdr[4+SC_RSP_HEAD];
+
+        if (p->shared) {
+                for (pp = &table[hash_path(p->path)]; *pp; pp = &(*pp)->hnext) {
+                        if (*pp == p) {
+                                *pp = p->hnext;
+                                break;
+                        }
+                }
+        }
+
+        if ((res != ETCD_OK) || (status < 0) || (status > 0xffff)) {
+                status = 0;
+                len = 0;
+        }
+        if (len > (SC_MAX_MESSAGE - SC_RSP_HEAD)) {
+                status = 0;
+                len = 0;
+        }
+        sc_put32(hdr,SC_RSP_HEAD+len);
+        sc_put16(hdr+4,status);
+        sc_put64(hdr+6,etcd_index);
+
+        for (c = p->waiters; c; c = next) {
+                next = c->wnext;
+                c->waiting = NULL;
+                c->wnext = NULL;
+                buf_add(&c->out,hdr,sizeof(hdr));
+                buf_add(&c->out,body,len);
+                if (client_write(c)) {
+                        /* It might have sent its next request already. */
+                        client_process(c);
+                }
+        }
+
+        free(p->path);
+        free(p);
+}
+
+
+/*
+ * This copies everything it needs out of the message.  A request that
+ * couldn't even be started comes back, for the caller to fail once it's done
+ * with the input; failing it here could start on the next message early.
+ */
+static pending *
+request_start (client *c, unsigned int method, const char *path,
+               size_t path_len, const char *body, size_t body_len)
+{
+        pending         *p;
+        char            *contents       = NULL;
+        const char      *query;
+        size_t          h               = 0;
+
+        ++n_requests;
+        p = xmalloc(sizeof(*p));
+        memset(p,0,sizeof(*p));
+        p->path = xmalloc(path_len+1);
+        memcpy(p->path,path,path_len);
+        p->path[path_len] = '\0';
+
+        if (method == SC_GET) {
+                h = hash_path(p->path);
+                for (p->hnext = table[h]; p->hnext;
+                     p->hnext = p->hnext->hnext) {
+                        if (!strcmp(p->hnext->path,p->path)) {
+                                break;
+                        }
+                }
+                /*
+                 * The newest one comes first.  A watch from a given index
+                 * gets the same answer whenever it went out, but a plain GET
+                 * or a watch from "now" started before our write could come
+                 * back with what was there before it, or with the write
+                 * itself as news.
+                 */
+                query = strchr(p->path,'?');
+                if (p->hnext && (p->hnext->writes != writes_started) &&
+                    !(query && strstr(query,"wait=true") &&
+                      strstr(query,"waitIndex="))) {
+                        p->hnext = NULL;
+                }
+                if (p->hnext) {
+                        /* Already on its way, so just wait for it too. */
+                        c->waiting = p->hnext;
+                        c->wnext = p->hnext->waiters;
+                        p->hnext->waiters = c;
+                        ++n_shared;
+                        if (verbose) {
+                                fprintf(stderr,"client %d shares %s\n",c->fd,
+                                        p->path);
+                        }
+                        free(p->path);
+                        free(p);
+                        return NULL;
+                }
+        }
+        else {
+                ++writes_started;
+                if (body_len) {
+                        contents = xmalloc(body_len+1);
+                        memcpy(contents,body,body_len);
+                        contents[body_len] = '\0';
+                }
+        }
+
+        if (verbose) {
+                fprintf(stderr,"client %d %s %s\n",c->fd,sc_methods[method],
+                        p->path);
+        }
+        c->waiting = p;
+        p->waiters = c;
+        if (method == SC_GET) {
+                p->shared = 1;
+                p->writes = writes_started;
+                p->hnext = table[h];
+                table[h] = p;
+        }
+        if (etcd_async_request(session,sc_methods[method],p->path,contents,
+                               request_done,p) == ETCD_OK) {
+                p = NULL;
+        }
+        free(contents);
+        return p;
+}
+
+
+/*
+ * Take requests off the front of the input, one at a time; the next isn't
+ * looked at until the current one has been answered.
+ */
+static void
+client_process (client *c)
+{
+        const unsigned char     *msg;
+        uint32_t                len;
+        size_t                  path_len;
+        pending                 *failed;
+
+        while (!c->waiting && !c->closing && (c->in.len >= 4)) {
+                msg = (const unsigned char *)c->in.data;
+                len = sc_get32(msg);
+                if ((len < SC_REQ_HEAD) || (len > SC_MAX_MESSAGE) ||
+                    (msg[4] >= SC_NUM_METHODS)) {
+                        c->closing = 1;
+                        break;
+                }
+                if (c->in.len < (4 + (size_t)len)) {
+                        break;
+                }
+                path_len = sc_get16(msg+5);
+                if (path_len > (len - SC_REQ_HEAD)) {
+                        c->closing = 1;
+                        break;
+                }
+                failed = request_start(c,msg[4],
+                                       (const char *)msg+4+SC_REQ_HEAD,
+                                       path_len,
+                                       (const char *)msg+4+SC_REQ_HEAD
+                                               +path_len,
+                                       len-SC_REQ_HEAD-path_len);
+                buf_consume(&c->in,4+len);
+                if (failed) {
+                        /* This answers c, and goes on to its next request. */
+                        request_done(failed,ETCD_WTF,0,0,NULL,0);
+                        return;
+                }
+        }
+
+        if (c->closing && !c->out.len) {
+                client_free(c);
+        }
+}
+
+
+static void
+client_read (client *c)
+{
+        char    tmp[65536];
+        ssize_t n;
+
+        for (;;) {
+                n = read(c->fd,tmp,sizeof(tmp));
+                if (n > 0) {
+                        buf_add(&c->in,tmp,n);
+                        continue;
+                }
+                if ((n < 0) && (errno == EINTR)) {
+                        continue;
+                }
+                if ((n < 0) && (errno == EAGAIN)) {
+                        break;
+                }
+                /* EOF or error: nobody's left to answer. */
+                client_free(c);
+                return;
+        }
+        client_process(c);
+}
+
+
+static void
+accept_all (void)
+{
+        struct epoll_event      ev;
+        client                  **nc;
+        client                  *c;
+        size_t                  size;
+        int                     fd;
+
+        for (;;) {
+                fd = accept4(lfd,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC);
+                if (fd < 0) {
+                        return;
+                }
+                if ((size_t)fd >= max_clients) {
+                        size = max_clients ? max_clients : 64;
+                        while ((size_t)fd >= size) {
+                                size *= 2;
+                        }
+                        nc = realloc(clients,size*sizeof(*clients));
+                        if (!nc) {
+                                close(fd);
+                                continue;
+                        }
+                        memset(nc+max_clients,0,
+                               (size-max_clients)*sizeof(*clients));
+                        clients = nc;
+                        max_clients = size;
+                }
+                c = xmalloc(sizeof(*c));
+                memset(c,0,sizeof(*c));
+                c->fd = fd;
+                memset(&ev,0,sizeof(ev));
+                ev.data.fd = fd;
+                ev.events = EPOLLIN;
+                if (epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev) < 0) {
+                        close(fd);
+                        free(c);
+                        continue;
+                }
+                clients[fd] = c;
+                if (verbose) {
+                        fprintf(stderr,"client %d connected\n",fd);
+                }
+        }
+}
+
+
+static int
+listen_unix (const char *path)
+{
+        struct sockaddr_un      sun;
+        int                     fd;
+
+        memset(&sun,0,sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+                fprintf(stderr,"path too long: %s\n",path);
+                return -1;
+        }
+        strcpy(sun.sun_path,path);
+        unlink(path);
+
+        fd = socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+        if (fd < 0) {
+                perror("socket");
+                return -1;
+        }
+        if (bind(fd,(struct sockaddr *)&sun,sizeof(sun)) < 0) {
+                perror("bind");
+                close(fd);
+                return -1;
+        }
+        if (listen(fd,1024) < 0) {
+                perror("listen");
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+
+static void
+on_signal (int sig)
+{
+        stopping = 1;
+}
+
+
+static int
+print_usage (char *prog)
+{
+        fprintf(stderr,"Usage: %s [options]\n",prog);
+        fprintf(stderr,"  -D|--discover MMM  refresh the server list every"
+                       " MMM ms\n");
+        fprintf(stderr,"  -s|--servers  SSS  default %s\n",DEFAULT_SERVERS);
+        fprintf(stderr,"  -u|--unix     UUU  default %s\n",SC_DEFAULT_PATH);
+        fprintf(stderr,"  -v|--verbose       log each request\n");
+        return EXIT_FAILURE;
+}
+
+
+struct option my_opts[] = {
+        { "discover",   required_argument,      NULL,   'D' },
+        { "help",       no_argument,            NULL,   'h' },
+        { "servers",    required_argument,      NULL,   's' },
+        { "unix",       required_argument,      NULL,   'u' },
+        { "verbose",    no_argument,            NULL,   'v' },
+        { NULL }
+};
+
+int
+main (int argc, char **argv)
+{
+        struct epoll_event      events[MAX_EVENTS];
+        char                    *servers        = DEFAULT_SERVERS;
+        unsigned int            discover_ms     = 0;
+        int                     opt;
+        int                     timeout;
+        int                     n;
+        int                     i;
+        int                     fd;
+        int64_t                 now;
+
+        for (;;) {
+                opt = getopt_long(argc,argv,"D:hs:u:v",my_opts,NULL);
+                if (opt == (-1)) {
+                        break;
+                }
+                switch (opt) {
+                case 'D':
+                        discover_ms = strtoul(optarg,NULL,10);
+                        break;
+                case 's':
+                        servers = optarg;
+                        break;
+                case 'u':
+                        my_path = optarg;
+                        break;
+                case 'v':
+                        verbose = 1;
+                        break;
+                default:
+                        return print_usage(argv[0]);
+                }
+        }
+
+        signal(SIGPIPE,SIG_IGN);
+        signal(SIGINT,on_signal);
+        signal(SIGTERM,on_signal);
+
+        session = etcd_open_str(servers);
+        if (!session) {
+                fprintf(stderr,"bad server list: %s\n",servers);
+                return EXIT_FAILURE;
+        }
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+                perror("epoll_create1");
+                return EXIT_FAILURE;
+        }
+        if (etcd_session_set_loop(session,socket_cb,timer_cb,NULL)
+                        != ETCD_OK) {
+                fprintf(stderr,"could not set up the event loop\n");
+                return EXIT_FAILURE;
+        }
+        if (discover_ms && (etcd_set_discovery(session,discover_ms)
+                                != ETCD_OK)) {
+                fprintf(stderr,"could not start discovery\n");
+                return EXIT_FAILURE;
+        }
+
+        lfd = listen_unix(my_path);
+        if (lfd < 0) {
+                return EXIT_FAILURE;
+        }
+        memset(&events[0],0,sizeof(events[0]));
+        events[0].data.fd = lfd;
+        events[0].events = EPOLLIN;
+        if (epoll_ctl(epfd,EPOLL_CTL_ADD,lfd,&events[0]) < 0) {
+                perror("epoll_ctl");
+                return EXIT_FAILURE;
+        }
+
+        while (!stopping) {
+                timeout = -1;
+                if (timer_due >= 0) {
+                        now = now_ms();
+                        timeout = (timer_due > now) ? (int)(timer_due - now)
+                                                    : 0;
+                }
+                n = epoll_wait(epfd,events,MAX_EVENTS,timeout);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        perror("epoll_wait");
+                        break;
+                }
+
+                for (i = 0; i < n; ++i) {
+                        fd = events[i].data.fd;
+                        if (fd == lfd) {
+                                accept_all();
+                        }
+                        else if (((size_t)fd < max_clients) && clients[fd]) {
+                                if (events[i].events & EPOLLOUT) {
+                                        if (!client_write(clients[fd])) {
+                                                continue;
+                                        }
+                                }
+                                if (events[i].events
+                                                & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+                                        client_read(clients[fd]);
+                                }
+                        }
+                        else {
+                                etcd_session_on_fd_ready(session,fd,
+                                        ((events[i].events & EPOLLIN)
+                                                ? ETCD_POLL_IN : 0) |
+                                        ((events[i].events & EPOLLOUT)
+                                                ? ETCD_POLL_OUT : 0) |
+                                        ((events[i].events
+                                                & (EPOLLERR|EPOLLHUP))
+                                                ? ETCD_POLL_ERR : 0));
+                        }
+                }
+
+                if ((timer_due >= 0) && (now_ms() >= timer_due)) {
+                        timer_due = -1;
+                        etcd_session_on_timeout(session);
+                }
+        }
+
+        if (verbose) {
+                fprintf(stderr,"%" PRIu64 " requests, %" PRIu64 " shared\n",
+                        n_requests,n_shared);
+        }
+        unlink(my_path);
+        etcd_close(session);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2013, Red Hat
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.  Redistributions in binary
+ * form must reproduce the above copyright notice, this list of conditions and
+ * the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The etcd-sidecar wire protocol, shared by the daemon and the library's
+ * thin-client mode (a "sidecar:/path" server).  A client sends one request
+ * and waits for the response before sending another.  Every message is a
+ * 32-bit length of the rest, then the rest; all integers are big-endian.
+ *
+ *      request         u8 method, u16 path length, path, body
+ *      response        u16 HTTP status, u64 X-Etcd-Index, body
+ *
+ * The path is everything after the server's address, as for
+ * etcd_async_request, and the body is whatever's left of the message.  A
+ * status of zero means no server in the daemon's list answered.
+ */
+
+#if !defined(ETCD_SIDECAR_H)
+#define ETCD_SIDECAR_H
+
+#include <stdint.h>
+
+#define SC_GET                  0
+#define SC_PUT                  1
+#define SC_POST                 2
+#define SC_DELETE               3
+#define SC_NUM_METHODS          4
+
+#define SC_REQ_HEAD             3       /* method and path length */
+#define SC_RSP_HEAD             10      /* status and index */
+#define SC_MAX_MESSAGE          (64 * 1024 * 1024)
+#define SC_DEFAULT_PATH         "/tmp/etcd-sidecar.sock"
+
+static const char *const sc_methods[SC_NUM_METHODS] = {
+        "GET", "PUT", "POST", "DELETE"
+};
+
+static inline void
+sc_put16 (unsigned char *p, uint16_t v)
+{
+        p[0] = v >> 8;
+        p[1] = v;
+}
+
+static inline void
+sc_put32 (unsigned char *p, uint32_t v)
+{
+        sc_put16(p,v>>16);
+        sc_put16(p+2,v);
+}
+
+static inline void
+sc_put64 (unsigned char *p, uint64_t v)
+{
+        sc_put32(p,v>>32);
+        sc_put32(p+4,v);
+}
+
+static inline uint16_t
+sc_get16 (const unsigned char *p)
+{
+        return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t
+sc_get32 (const unsigned char *p)
+{
+        return ((uint32_t)sc_get16(p) << 16) | sc_get16(p+2);
+}
+
+static inline uint64_t
+sc_get64 (const unsigned char *p)
+{
+        return ((uint64_t)sc_get32(p) << 32) | sc_get32(p+4);
+}
+
+#endif
@@ -24,29 +24,39 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE     /* for getline */
+
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include "etcd-api.h"
 
+#define LOAD_CHUNK      1024    /* records per batch, at minimum */
+
 
 int
 do_get (etcd_session sess, char *key)
 {
-        char            *value;       
+        etcd_node       node;
 
         printf("getting %s\n",key);
 
-        value = etcd_get(sess,key);
-        if (!value) {
+        if (etcd_get_ex(sess,key,&node) != ETCD_OK) {
                 fprintf(stderr,"etcd_get failed\n");
                 return !0;
         }
 
-        printf("got value: %s\n",value);
-        free(value);
+        printf("got value: %s\n",node.value);
+        printf("  modified index = %"PRIu64", etcd index = %"PRIu64"\n",
+               node.modified_index,node.etcd_index);
+        if (node.ttl) {
+                printf("  ttl = %"PRId64"\n",node.ttl);
+        }
+        free(node.value);
         return 0;
 }
 
@@ -56,14 +66,14 @@ do_watch (etcd_session sess, char *pfx, char *index_str)
 {
         char            *key;
         char            *value;       
-        int             index_i;
-        int             *indexp;
+        etcd_index      index_i;
+        etcd_index      *indexp;
         etcd_result     res;
 
         printf("getting %s\n",pfx);
 
         if (index_str) {
-                index_i = (int)strtol(index_str,NULL,10);
+                index_i = strtoull(index_str,NULL,10);
                 indexp = &index_i;
         }
         else {
@@ -71,12 +81,12 @@ do_watch (etcd_session sess, char *pfx, char *index_str)
         }
 
         for (;;) {
-                res = etcd_watch(sess,pfx,&key,&value,indexp,&index_i);
+                res = etcd_watch_ex(sess,pfx,&key,&value,indexp,&index_i);
                 if (res != ETCD_OK) {
                         fprintf(stderr,"etcd_watch failed\n");
                         return !0;
                 }
-                printf("index is %d\n",index_i++);
+                printf("index is %"PRIu64"\n",index_i++);
                 if (key) {
                         if (value) {
                                 printf("key %s was set to %s\n",key,value);
@@ -129,6 +139,58 @@ do_set (etcd_session sess, char *key, char *value, char *precond, char *ttl)
 }
 
 
+int
+do_refresh (etcd_session sess, char *key, char *ttl, char *index_str)
+{
+        etcd_index      index   = 0;
+
+        printf("refreshing %s for %s\n",key,ttl);
+        if (index_str) {
+                index = strtoull(index_str,NULL,10);
+                printf("  index = %"PRIu64"\n",index);
+        }
+
+        if (etcd_refresh_ttl(sess,key,strtoul(ttl,NULL,10),&index) != ETCD_OK) {
+                fprintf(stderr,"etcd_refresh_ttl failed\n");
+                return !0;
+        }
+
+        printf("new index is %"PRIu64"\n",index);
+        return 0;
+}
+
+
+int
+do_cas (etcd_session sess, char *key, char *value, char *ttl,
+        char *index_str)
+{
+        etcd_index      index   = 0;
+        etcd_result     res;
+
+        printf("swapping %s to %s\n",key,value);
+        if (index_str) {
+                index = strtoull(index_str,NULL,10);
+                printf("  index = %"PRIu64"\n",index);
+        }
+        else {
+                printf("  only if it doesn't exist yet\n");
+        }
+
+        res = etcd_cas(sess,key,value,&index,ttl?strtoul(ttl,NULL,10):0);
+        if (res == ETCD_PRECOND_FAILED) {
+                fprintf(stderr,"someone else got there first\n");
+                return !0;
+        }
+        if (res != ETCD_OK) {
+                fprintf(stderr,"etcd_cas failed\n");
+                return !0;
+        }
+
+        printf("new index is %"PRIu64"\n",index);
+        return 0;
+}
+
+
 int
 do_lock (etcd_session sess, char *key, char *ttl, char *index_in)
 {
@@ -215,7 +277,232 @@ do_leader (etcd_session sess)
 }
 
 
+static double
+now (void)
+{
+        struct timeval  tv;
+
+        gettimeofday(&tv,NULL);
+        return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/*
+ * Submit whatever has been queued, and report (but otherwise ignore) any
+ * failures so that one bad record doesn't stop a large load.
+ */
+static void
+load_flush (etcd_batch batch, unsigned int concurrency, char **keys,
+            unsigned long *ok, unsigned long *failed)
+{
+        size_t          i;
+        size_t          count   = etcd_batch_count(batch);
+        etcd_result     res;
+
+        (void)etcd_batch_submit(batch,concurrency);
+
+        for (i = 0; i < count; ++i) {
+                res = etcd_batch_result(batch,(int)i,NULL,NULL);
+                if (res == ETCD_OK) {
+                        ++*ok;
+                }
+                else {
+                        fprintf(stderr,"failed to set %s (%d)\n",keys[i],res);
+                        ++*failed;
+                }
+                free(keys[i]);
+        }
+
+        etcd_batch_clear(batch);
+}
+
+
+/*
+ * Each line is a key, some white space, and then the rest of the line is the
+ * value.  We only ever hold one chunk of records in memory, so the input can
+ * be as large as you like.
+ */
+int
+do_load (etcd_session sess, char *path, char *ttl, char *concurrency_str)
+{
+        FILE            *fp;
+        etcd_batch      batch;
+        char            *line   = NULL;
+        size_t          line_size = 0;
+        ssize_t         len;
+        char            *key;
+        char            *value;
+        char            **keys;
+        size_t          chunk;
+        size_t          queued  = 0;
+        unsigned int    concurrency;
+        unsigned long   ttl_num;
+        unsigned long   ok      = 0;
+        unsigned long   failed  = 0;
+        unsigned long long bytes = 0;
+        double          start;
+        double          elapsed;
+
+        concurrency = concurrency_str ? strtoul(concurrency_str,NULL,10) : 16;
+        if (!concurrency) {
+                concurrency = 1;
+        }
+        ttl_num = ttl ? strtoul(ttl,NULL,10) : 0;
+        chunk = concurrency * 64;
+        if (chunk < LOAD_CHUNK) {
+                chunk = LOAD_CHUNK;
+        }
+
+        if (!path || !strcmp(path,"-")) {
+                fp = stdin;
+        }
+        else {
+                fp = fopen(path,"r");
+                if (!fp) {
+                        perror(path);
+                        return !0;
+                }
+        }
+
+        batch = etcd_batch_create(sess);
+        keys = calloc(chunk,sizeof(*keys));
+        if (!batch || !keys) {
+                fprintf(stderr,"failed to set up batch\n");
+                free(keys);
+                if (batch) {
+                        etcd_batch_free(batch);
+                }
+                if (fp != stdin) {
+                        fclose(fp);
+                }
+                return !0;
+        }
+
+        printf("loading %s with %u requests in flight\n",
+               (fp == stdin) ? "stdin" : path,concurrency);
+        start = now();
+
+        while ((len = getline(&line,&line_size,fp)) >= 0) {
+                if ((len > 0) && (line[len-1] == '\n')) {
+                        line[--len] = '\0';
+                }
+                key = line + strspn(line," \t");
+                if (!*key || (*key == '#')) {
+                        continue;
+                }
+                value = key + strcspn(key," \t");
+                if (*value) {
+                        *value++ = '\0';
+                        value += strspn(value," \t");
+                }
+                keys[queued] = strdup(key);
+                if (!keys[queued] ||
+                    (etcd_batch_set(batch,key,value,NULL,ttl_num) < 0)) {
+                        fprintf(stderr,"out of memory at %s\n",key);
+                        free(keys[queued]);
+                        break;
+                }
+                bytes += strlen(key) + strlen(value);
+                if (++queued == chunk) {
+                        load_flush(batch,concurrency,keys,&ok,&failed);
+                        queued = 0;
+                }
+        }
+        if (queued) {
+                load_flush(batch,concurrency,keys,&ok,&failed);
+        }
+
+        elapsed = now() - start;
+        printf("loaded %lu keys (%lu failed) in %.3f seconds\n",
+               ok,failed,elapsed);
+        if (elapsed > 0) {
+                printf("  %.1f keys/s, %.1f KB/s\n",(ok+failed)/elapsed,
+                       bytes/1024.0/elapsed);
+        }
+
+        free(line);
+        free(keys);
+        etcd_batch_free(batch);
+        if (fp != stdin) {
+                fclose(fp);
+        }
+        return failed ? !0 : 0;
+}
+
+
+int
+do_dump (etcd_session sess, char *pfx, char *path)
+{
+        printf("dumping %s to %s\n",pfx,path);
+
+        if (etcd_dump(sess,pfx,path) != ETCD_OK) {
+                fprintf(stderr,"etcd_dump failed\n");
+                return !0;
+        }
+
+        return 0;
+}
+
+
+int
+do_restore (etcd_session sess, char *path, char *concurrency_str)
+{
+        unsigned int    concurrency;
+        double          start;
+
+        concurrency = concurrency_str ? strtoul(concurrency_str,NULL,10) : 16;
+        printf("restoring %s with %u requests in flight\n",path,concurrency);
+
+        start = now();
+        if (etcd_restore(sess,path,concurrency) != ETCD_OK) {
+                fprintf(stderr,"etcd_restore failed\n");
+                return !0;
+        }
+
+        printf("restored in %.3f seconds\n",now()-start);
+        return 0;
+}
+
+
+/* This one doesn't need a server at all. */
+int
+do_query (char *path, char *key)
+{
+        etcd_snapshot   snap;
+        const char      *k;
+        const char      *v;
+        size_t          i;
+
+        snap = etcd_snapshot_open(path);
+        if (!snap) {
+                fprintf(stderr,"%s is not a valid snapshot\n",path);
+                return !0;
+        }
+
+        if (key) {
+                v = etcd_snapshot_get(snap,key);
+                if (v) {
+                        printf("%s %s\n",key,v);
+                }
+                else {
+                        fprintf(stderr,"%s not found\n",key);
+                }
+        }
+        else {
+                for (i = 0; i < etcd_snapshot_count(snap); ++i) {
+                        k = etcd_snapshot_key(snap,i,&v);
+                        printf("%s %s\n",k,v);
+                }
+                v = "";
+        }
+
+        etcd_snapshot_close(snap);
+        return v ? 0 : !0;
+}
+
+
 struct option my_opts[] = {
+        { "concurrency",required_argument,      NULL,   'c' },
         { "index",      required_argument,      NULL,   'w' },
         { "precond",    required_argument,      NULL,   'p' },
         { "servers",    required_argument,      NULL,   's' },
@@ -230,15 +517,24 @@ print_usage (char *prog)
         fprintf (stderr, "Valid commands:\n");
         fprintf (stderr, "  get       KEY\n");
         fprintf (stderr, "  set       [-p precond] [-t ttl] KEY VALUE\n");
+        fprintf (stderr, "  refresh   -t ttl [-i index] KEY\n");
+        fprintf (stderr, "  cas       [-i index] [-t ttl] KEY VALUE\n");
         fprintf (stderr, "  delete    KEY\n");
         fprintf (stderr, "  watch     [-i index] KEY\n");
         fprintf (stderr, "  leader\n");
         fprintf (stderr, "  lock     -t ttl [-i index] KEY\n");
         fprintf (stderr, "  unlock    -i index KEY\n");
+        fprintf (stderr, "  load      [-c concurrency] [-t ttl] [FILE]\n");
+        fprintf (stderr, "  dump      KEY FILE\n");
+        fprintf (stderr, "  restore   [-c concurrency] FILE\n");
+        fprintf (stderr, "  query     FILE [KEY]\n");
         fprintf (stderr, "Server list is host:port pairs separated by comma,\n"
                          "semicolon, or white space.  If not given on the\n"
                          "command line, ETCD_SERVERS will be used from the\n"
                          "environment instead.\n");
+        fprintf (stderr, "Load reads KEY VALUE lines from FILE (or stdin).\n");
+        fprintf (stderr, "Query reads a snapshot from dump, and doesn't need\n"
+                         "any servers.\n");
 
         return !0;
 }
@@ -252,16 +548,20 @@ main (int argc, char **argv)
         char            *precond        = NULL;
         char            *ttl            = NULL;
         char            *index_str      = NULL;
+        char            *concurrency    = NULL;
         etcd_session    sess;
         int             res             = !0;
         int             parsed          = 0;
 
         for (;;) {
-                opt = getopt_long(argc,argv,"i:p:s:t:",my_opts,NULL);
+                opt = getopt_long(argc,argv,"c:i:p:s:t:",my_opts,NULL);
                 if (opt == (-1)) {
                         break;
                 }
                 switch (opt) {
+                case 'c':
+                        concurrency = optarg;
+                        break;
                 case 'i':
                         index_str = optarg;
                         break;
@@ -279,10 +579,16 @@ main (int argc, char **argv)
                 }
         }
 
-        if (!servers) {
+        if (optind == argc) {
                 return print_usage(argv[0]);
         }
-        if (optind == argc) {
+        if (!strcasecmp(argv[optind],"query")) {
+                if (((argc-optind) == 2) || ((argc-optind) == 3)) {
+                        return do_query(argv[optind+1],argv[optind+2]);
+                }
+                return print_usage(argv[0]);
+        }
+        if (!servers) {
                 return print_usage(argv[0]);
         }
 
@@ -309,6 +615,21 @@ main (int argc, char **argv)
                 }
         }
 
+        else if (!strcasecmp(command,"refresh")) {
+                if (((argc-optind) == 1) && !precond && ttl) {
+                        parsed = 1;
+                        res = do_refresh(sess,argv[optind],ttl,index_str);
+                }
+        }
+
+        else if (!strcasecmp(command,"cas")) {
+                if (((argc-optind) == 2) && !precond) {
+                        parsed = 1;
+                        res = do_cas(sess,argv[optind],argv[optind+1],ttl,
+                                     index_str);
+                }
+        }
+
         else if (!strcasecmp(command,"delete")) {
                 if (((argc-optind) == 1) && !precond && !ttl && !index_str) {
                         parsed = 1;
@@ -344,6 +665,29 @@ main (int argc, char **argv)
                 }
         }
 
+        else if (!strcasecmp(command,"load")) {
+                if (((argc-optind) <= 1) && !precond && !index_str) {
+                        parsed = 1;
+                        res = do_load(sess,(argc > optind) ? argv[optind]
+                                                           : NULL,
+                                      ttl,concurrency);
+                }
+        }
+
+        else if (!strcasecmp(command,"dump")) {
+                if (((argc-optind) == 2) && !precond && !ttl && !index_str) {
+                        parsed = 1;
+                        res = do_dump(sess,argv[optind],argv[optind+1]);
+                }
+        }
+
+        else if (!strcasecmp(command,"restore")) {
+                if (((argc-optind) == 1) && !precond && !ttl && !index_str) {
+                        parsed = 1;
+                        res = do_restore(sess,argv[optind],concurrency);
+                }
+        }
+
         etcd_close_str(sess);
         return parsed ? res : print_usage(argv[0]);
 }
@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2013, Red Hat
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.  Redistributions in binary
+ * form must reproduce the above copyright notice, this list of conditions and
+ * the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Failover benchmark for leader.  Runs several leader instances against one
+ * server (by default a private etcd-mock), then repeatedly kills whichever
+ * one is leader and times how long it takes for another to take over.  The
+ * kills land at random points in the renewal interval, since where the last
+ * renewal was is most of what decides how long the vote takes to expire.
+ */
+
+#define _GNU_SOURCE     /* for asprintf */
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define DEFAULT_INSTANCES       3
+#define DEFAULT_ROUNDS          10
+#define DEFAULT_TTL             1
+#define DEFAULT_INTERVAL        300
+#define DEFAULT_PORT            4901
+#define MAX_INSTANCES           64
+
+typedef struct {
+        pid_t   pid;
+        int     fd;             /* its stdout */
+        char    name[16];
+        char    line[256];
+        size_t  len;
+} instance;
+
+static instance inst[MAX_INSTANCES];
+static int      num_inst;
+static char     *servers;
+static char     *key;
+static char     ttl_str[16];
+static char     interval_str[16];
+
+static double
+now (void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t
+spawn (char **args, int *out_fd)
+{
+        int     pfd[2];
+        pid_t   pid;
+
+        if (out_fd && (pipe(pfd) < 0)) {
+                return -1;
+        }
+        pid = fork();
+        if (pid == 0) {
+                if (out_fd) {
+                        dup2(pfd[1],1);
+                        close(pfd[0]);
+                        close(pfd[1]);
+                }
+                execv(args[0],args);
+                perror(args[0]);
+                _exit(127);
+        }
+        if (out_fd) {
+                close(pfd[1]);
+                if (pid < 0) {
+                        close(pfd[0]);
+                }
+                else {
+                        *out_fd = pfd[0];
+                }
+        }
+        return pid;
+}
+
+static int
+start_instance (int i)
+{
+        char    *args[]  = { "./leader", "-s", servers, "-k", key,
+                             "-n", inst[i].name, "-t", ttl_str,
+                             "-i", interval_str, NULL };
+
+        snprintf(inst[i].name,sizeof(inst[i].name),"node%d",i);
+        inst[i].len = 0;
+        inst[i].pid = spawn(args,&inst[i].fd);
+        return (inst[i].pid < 0) ? -1 : 0;
+}
+
+static void
+stop_instance (int i)
+{
+        kill(inst[i].pid,SIGKILL);
+        waitpid(inst[i].pid,NULL,0);
+        close(inst[i].fd);
+        inst[i].pid = 0;
+        inst[i].fd = -1;
+}
+
+/*
+ * Wait for any live instance to say someone other than "not" is leader, and
+ * return which instance that is.
+ */
+static int
+wait_for_leader (const char *not, double timeout)
+{
+        struct pollfd   pfds[MAX_INSTANCES];
+        double          deadline        = now() + timeout;
+        ssize_t         len;
+        char            *nl;
+        int             i;
+        int             j;
+
+        while (now() < deadline) {
+                for (i = 0; i < num_inst; ++i) {
+                        pfds[i].fd = inst[i].fd;
+                        pfds[i].events = POLLIN;
+                }
+                if (poll(pfds,num_inst,
+                         (int)((deadline-now())*1000)+1) < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return -1;
+                }
+                for (i = 0; i < num_inst; ++i) {
+                        if (!(pfds[i].revents & (POLLIN|POLLHUP))) {
+                                continue;
+                        }
+                        len = read(inst[i].fd,inst[i].line+inst[i].len,
+                                   sizeof(inst[i].line)-inst[i].len-1);
+                        if (len <= 0) {
+                                fprintf(stderr,"%s went away\n",inst[i].name);
+                                return -1;
+                        }
+                        inst[i].len += len;
+                        inst[i].line[inst[i].len] = '\0';
+                        while ((nl = strchr(inst[i].line,'\n'))) {
+                                *nl = '\0';
+                                if (!strncmp(inst[i].line,"leader is ",10)) {
+                                        for (j = 0; j < num_inst; ++j) {
+                                                if (strcmp(inst[j].name,
+                                                           inst[i].line+10)) {
+                                                        continue;
+                                                }
+                                                if (!not || strcmp(not,
+                                                        inst[j].name)) {
+                                                        return j;
+                                                }
+                                        }
+                                }
+                                inst[i].len -= nl + 1 - inst[i].line;
+                                memmove(inst[i].line,nl+1,inst[i].len+1);
+                        }
+                        if (inst[i].len == (sizeof(inst[i].line)-1)) {
+                                /* Some silly long line; just drop it. */
+                                inst[i].len = 0;
+                        }
+                }
+        }
+
+        return -1;
+}
+
+static int
+wait_for_server (unsigned short port)
+{
+        struct sockaddr_in      sin;
+        int                     fd;
+        int                     tries;
+
+        memset(&sin,0,sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        for (tries = 0; tries < 100; ++tries) {
+                fd = socket(AF_INET,SOCK_STREAM,0);
+                if (fd < 0) {
+                        return -1;
+                }
+                if (connect(fd,(struct sockaddr *)&sin,sizeof(sin)) == 0) {
+                        close(fd);
+                        return 0;
+                }
+                close(fd);
+                usleep(50000);
+        }
+        return -1;
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+        double  x       = *(const double *)a;
+        double  y       = *(const double *)b;
+
+        return (x < y) ? -1 : (x > y);
+}
+
+struct option my_opts[] = {
+        { "help",       no_argument,            NULL,   'h' },
+        { "interval",   required_argument,      NULL,   'i' },
+        { "instances",  required_argument,      NULL,   'n' },
+        { "port",       required_argument,      NULL,   'p' },
+        { "rounds",     required_argument,      NULL,   'r' },
+        { "servers",    required_argument,      NULL,   's' },
+        { "ttl",        required_argument,      NULL,   't' },
+        { NULL }
+};
+
+static int
+print_usage (char *prog)
+{
+        fprintf(stderr,"Usage: %s [options]\n",prog);
+        fprintf(stderr,"  -i|--interval  III  default %d ms\n",
+                DEFAULT_INTERVAL);
+        fprintf(stderr,"  -n|--instances NNN  default %d\n",
+                DEFAULT_INSTANCES);
+        fprintf(stderr,"  -p|--port      PPP  for etcd-mock, default %d\n",
+                DEFAULT_PORT);
+        fprintf(stderr,"  -r|--rounds    RRR  default %d\n",DEFAULT_ROUNDS);
+        fprintf(stderr,"  -s|--servers   SSS  use these instead of etcd-mock\n");
+        fprintf(stderr,"  -t|--ttl       TTT  default %d s\n",DEFAULT_TTL);
+        fprintf(stderr,"Run from the build directory; it starts ./leader and "
+                       "./etcd-mock.\n");
+        return EXIT_FAILURE;
+}
+
+int
+main (int argc, char **argv)
+{
+        unsigned int    ttl             = DEFAULT_TTL;
+        unsigned int    interval        = DEFAULT_INTERVAL;
+        unsigned short  port            = DEFAULT_PORT;
+        int             rounds          = DEFAULT_ROUNDS;
+        char            port_str[16];
+        char            *mock_args[]    = { "./etcd-mock", "-p", port_str,
+                                            NULL };
+        pid_t           mock            = 0;
+        double          *times;
+        double          t0;
+        double          total           = 0;
+        int             leader;
+        int             next;
+        int             done            = 0;
+        int             opt;
+        int             i;
+
+        num_inst = DEFAULT_INSTANCES;
+        for (;;) {
+                opt = getopt_long(argc,argv,"hi:n:p:r:s:t:",my_opts,NULL);
+                if (opt == (-1)) {
+                        break;
+                }
+                switch (opt) {
+                case 'i':
+                        interval = strtoul(optarg,NULL,10);
+                        break;
+                case 'n':
+                        num_inst = strtol(optarg,NULL,10);
+                        break;
+                case 'p':
+                        port = (unsigned short)strtoul(optarg,NULL,10);
+                        break;
+                case 'r':
+                        rounds = strtol(optarg,NULL,10);
+                        break;
+                case 's':
+                        servers = optarg;
+                        break;
+                case 't':
+                        ttl = strtoul(optarg,NULL,10);
+                        break;
+                default:
+                        return print_usage(argv[0]);
+                }
+        }
+        if ((num_inst < 2) || (num_inst > MAX_INSTANCES) || (rounds < 1)
+                           || !ttl || !interval
+                           || (interval >= (ttl * 1000))) {
+                return print_usage(argv[0]);
+        }
+
+        signal(SIGPIPE,SIG_IGN);
+        snprintf(ttl_str,sizeof(ttl_str),"%u",ttl);
+        snprintf(interval_str,sizeof(interval_str),"%u",interval);
+        if (asprintf(&key,"leader-bench/%d",(int)getpid()) < 0) {
+                return EXIT_FAILURE;
+        }
+
+        if (!servers) {
+                snprintf(port_str,sizeof(port_str),"%u",port);
+                mock = spawn(mock_args,NULL);
+                if ((mock < 0) || (wait_for_server(port) != 0)) {
+                        fprintf(stderr,"couldn't start etcd-mock\n");
+                        return EXIT_FAILURE;
+                }
+                if (asprintf(&servers,"127.0.0.1:%u",port) < 0) {
+                        return EXIT_FAILURE;
+                }
+        }
+
+        times = calloc(rounds,sizeof(*times));
+        if (!times) {
+                return EXIT_FAILURE;
+        }
+        for (i = 0; i < num_inst; ++i) {
+                if (start_instance(i) != 0) {
+                        fprintf(stderr,"couldn't start leader\n");
+                        goto out;
+                }
+        }
+
+        leader = wait_for_leader(NULL,ttl*5.0);
+        if (leader < 0) {
+                fprintf(stderr,"nobody was elected\n");
+                goto out;
+        }
+        printf("%d instances, ttl %us, renewal every %ums; first leader %s\n",
+               num_inst,ttl,interval,inst[leader].name);
+
+        srandom(getpid());
+        for (done = 0; done < rounds; ++done) {
+                /* Let it renew once, then kill it somewhere in the cycle. */
+                usleep((interval + random() % interval) * 1000);
+                stop_instance(leader);
+                t0 = now();
+                next = wait_for_leader(inst[leader].name,ttl*5.0);
+                times[done] = now() - t0;
+                if (next < 0) {
+                        fprintf(stderr,"no new leader after %s died\n",
+                                inst[leader].name);
+                        break;
+                }
+                printf("round %d: %s -> %s in %.3fs\n",done+1,
+                       inst[leader].name,inst[next].name,times[done]);
+                total += times[done];
+                if (start_instance(leader) != 0) {
+                        fprintf(stderr,"couldn't restart %s\n",
+                                inst[leader].name);
+                        ++done;
+                        break;
+                }
+                leader = next;
+        }
+
+        if (done) {
+                qsort(times,done,sizeof(*times),compare_doubles);
+                printf("failover over %d rounds: min %.3fs median %.3fs "
+                       "mean %.3fs max %.3fs\n",done,times[0],times[done/2],
+                       total/done,times[done-1]);
+        }
+
+out:
+        for (i = 0; i < num_inst; ++i) {
+                if (inst[i].pid > 0) {
+                        stop_instance(i);
+                }
+        }
+        if (mock > 0) {
+                kill(mock,SIGTERM);
+                waitpid(mock,NULL,0);
+        }
+        return (done == rounds) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
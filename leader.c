@@ -24,12 +24,15 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE     /* for asprintf */
+
 #include <getopt.h>
 #include <limits.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 
@@ -38,14 +41,20 @@
 #define VOTE_ELEMS      4       /* Whole match plus three actual pieces. */
 #define DEFAULT_FITNESS 42
 #define DEFAULT_KEY     "nsr"
-#define LEADER_TTL      5       /* TBD: make this tunable */
+#define DEFAULT_TTL     5       /* seconds */
+#define DEFAULT_INTERVAL 1000   /* ms between renewals */
+#define RETRY_MS        100     /* after a failed request */
 
 enum { NO_LEADER, TENTATIVE, CONFIRMED } leader_state_t;
 
-regex_t vote_re;
-char    *me;
-long    my_fitness;
-int     i_am_leader;
+regex_t         vote_re;
+char            *me;
+long            my_fitness;
+int             i_am_leader;
+unsigned int    leader_ttl;
+unsigned int    interval_ms;
+etcd_index      vote_index;     /* modifiedIndex of our confirmed vote */
+etcd_index      watch_index;    /* where to pick up watching the vote */
 
 void
 LeaderCallback (void)
@@ -53,26 +62,59 @@ LeaderCallback (void)
         printf ("Bow down before me!\n");
 }
 
+int
+WatchLeaderChanges (etcd_session etcd, char *key)
+{
+        char            *nkey   = NULL;
+        char            *nval   = NULL;
+        etcd_index      index;
+        etcd_result     res;
+
+        /*
+         * Renewals don't generate events, so this only returns when someone
+         * votes or the vote expires.  Starting from the index of our last
+         * GET means nothing can slip by in between.
+         */
+        res = etcd_watch_ex(etcd,key,&nkey,&nval,&watch_index,&index);
+        if (res == ETCD_OK) {
+                free(nkey);
+                free(nval);
+        }
+        else if (res != ETCD_INDEX_CLEARED) {
+                /* Nothing to do but try again after a breather. */
+                fprintf (stderr, "%s: etcd_watch failed\n", __func__);
+                usleep(RETRY_MS*1000);
+        }
+
+        return EXIT_SUCCESS;
+}
+
 int
 GetCurrentLeader (etcd_session etcd, char *key)
 {
-        char            *text   = NULL;
-        int             res;
+        etcd_node       node;
+        etcd_result     res;
+        char            *text;
         regmatch_t      matches[VOTE_ELEMS];
         char            *nominee;
         long            state;
         long            fitness;
         char            *vote   = NULL;
         int             retval  = EXIT_FAILURE;
-        int             valid_text;
 
         for (;;) {
-                
-                if (text) {
+                memset(&node,0,sizeof(node));
+                res = etcd_get_ex(etcd,key,&node);
+                text = node.value;
+                if ((res != ETCD_OK) && (res != ETCD_NOT_FOUND)) {
+                        fprintf (stderr, "%s: failed to get vote\n",
+                                 __func__);
                         free(text);
+                        usleep(RETRY_MS*1000);
+                        continue;
                 }
-                
-                text = etcd_get(etcd,key);
+                watch_index = node.etcd_index + 1;
+
                 if (text) {
                         if (regexec(&vote_re,text,VOTE_ELEMS,matches,0) != 0) {
                                 fprintf (stderr, "%s: got malformed vote %s\n",
@@ -97,6 +139,7 @@ GetCurrentLeader (etcd_session etcd, char *key)
                         if (strcmp(nominee,me) == 0) {
                                 LeaderCallback();
                                 i_am_leader = 1;
+                                vote_index = node.modified_index;
                         }
                         else {
                                 i_am_leader = 0;
@@ -107,85 +150,56 @@ GetCurrentLeader (etcd_session etcd, char *key)
 
                 /* TBD: override based on fitness */
                 if ((state >= TENTATIVE) && (strcmp(nominee,me) != 0)) {
-                        sleep(1);
+                        /* Someone else is on the way; see how it turns out. */
+                        free(text);
+                        text = NULL;
+                        WatchLeaderChanges(etcd,key);
                         continue;
                 }
 
-                if (vote) {
-                        free(vote);
-                }
-
+                free(vote);
                 if (asprintf(&vote,"%s,%ld,%ld",me,state+1,my_fitness) < 0) {
                         fprintf (stderr, "%s: failed to construct vote\n",
                                  __func__);
+                        vote = NULL;
                         break;
                 }
 
-                if (text) {
-                        text[matches[1].rm_eo] = ',';
-                        text[matches[2].rm_eo] = ',';
-                }
-                if (etcd_set(etcd,key,vote,text,LEADER_TTL) != ETCD_OK) {
+                /*
+                 * Losing a race here just means somebody else's vote got in
+                 * first, so go back and look at it.  Winning one means our
+                 * own TENTATIVE vote is there to be confirmed straight away.
+                 * With no vote at all, an index of zero means we only win if
+                 * there still isn't one.
+                 */
+                res = etcd_cas(etcd,key,vote,&node.modified_index,leader_ttl);
+                if ((res != ETCD_OK) && (res != ETCD_PRECOND_FAILED) &&
+                    (res != ETCD_NOT_FOUND)) {
                         fprintf (stderr, "%s: failed to cast vote\n",
                                  __func__);
-                        break;
+                        usleep(RETRY_MS*1000);
                 }
-                
-                /* TBD: early return if we just went CONFIRMED? */
-                sleep(1);
-        }
-
-        if (text) {
                 free(text);
+                text = NULL;
         }
-        if (vote) {
-                free(vote);
-        }
+
+        free(text);
+        free(vote);
         return retval;
 }
 
 int
 Confirm (etcd_session etcd, char *key)
 {
-        char    *vote;
-
-        if (asprintf(&vote,"%s,%ld,%ld",me,CONFIRMED,my_fitness) < 0) {
-                fprintf (stderr, "%s: failed to construct confirmation\n",
-                         __func__);
-                return EXIT_FAILURE;
-        }
-
-        if (etcd_set(etcd,key,vote,vote,LEADER_TTL) != ETCD_OK) {
+        /*
+         * Our vote is already there, so all we need is a new TTL.  Tying
+         * that to the vote's index means we fail if anyone has replaced it,
+         * and a refresh doesn't wake up the followers' watches.
+         */
+        if (etcd_refresh_ttl(etcd,key,leader_ttl,&vote_index) != ETCD_OK) {
                 fprintf (stderr, "%s: failed to confirm\n", __func__);
-                free(vote);
                 return EXIT_FAILURE;
         }
-        
-        free(vote);
-        return EXIT_SUCCESS;
-}
-
-int
-WatchLeaderChanges (etcd_session etcd, char *key)
-{
-#if 0
-        char    *nkey;
-        char    *nval;
-
-        if (etcd_watch(etcd,key,&nkey,&nval,NULL,NULL) != ETCD_OK) {
-                fprintf (stderr, "%s: etcd_watch failed\n", __func__);
-                return EXIT_FAILURE;
-        }
-
-        if (nval) {
-                printf ("new value = %s\n",nval);
-                free(nval);
-        }
-        else {
-                printf("value deleted\n");
-        }
-        free(nkey);
-#endif
 
         return EXIT_SUCCESS;
 }
@@ -193,9 +207,11 @@ WatchLeaderChanges (etcd_session etcd, char *key)
 struct option my_opts[] = {
         { "fitness",    required_argument,      NULL,   'f' },
         { "help",       no_argument,            NULL,   'h' },
+        { "interval",   required_argument,      NULL,   'i' },
         { "key",        required_argument,      NULL,   'k' },
         { "nodename",   required_argument,      NULL,   'n' },
         { "servers",    required_argument,      NULL,   's' },
+        { "ttl",        required_argument,      NULL,   't' },
         { NULL }
 };
 
@@ -204,9 +220,12 @@ print_usage (char *prog)
 {
         fprintf (stderr, "Usage: %s [options]\n", prog);
         fprintf (stderr, "  -f|--fitness  FFF  default %d\n", DEFAULT_FITNESS);
+        fprintf (stderr, "  -i|--interval III  default %d ms\n",
+                 DEFAULT_INTERVAL);
         fprintf (stderr, "  -k|--key      KKK  default %s\n", DEFAULT_KEY);
         fprintf (stderr, "  -n|--nodename NNN  default gethostname()\n");
         fprintf (stderr, "  -s|--servers  SSS  default $ETCD_SERVERS\n");
+        fprintf (stderr, "  -t|--ttl      TTT  default %d s\n", DEFAULT_TTL);
         return EXIT_FAILURE;
 }
 
@@ -220,8 +239,10 @@ main (int argc, char **argv)
         char            *server_list;
 
         /* Set defaults. */
-        my_fitness = 42;
+        my_fitness = DEFAULT_FITNESS;
         key = DEFAULT_KEY;
+        leader_ttl = DEFAULT_TTL;
+        interval_ms = DEFAULT_INTERVAL;
         if (gethostname(hostname_raw,HOST_NAME_MAX) != 0) {
                 fprintf (stderr, "failed to get host name\n");
                 return EXIT_FAILURE;
@@ -232,7 +253,7 @@ main (int argc, char **argv)
 
         /* TBD: better argument processing */
         for (;;) {
-                opt = getopt_long(argc,argv,"f:hk:n:s:",my_opts,NULL);
+                opt = getopt_long(argc,argv,"f:hi:k:n:s:t:",my_opts,NULL);
                 if (opt == (-1)) {
                         break;
                 }
@@ -242,6 +263,9 @@ main (int argc, char **argv)
                         break;
                 case 'h':
                         return print_usage(argv[0]);
+                case 'i':
+                        interval_ms = strtoul(optarg,NULL,10);
+                        break;
                 case 'k':
                         key = optarg;
                         break;
@@ -251,14 +275,24 @@ main (int argc, char **argv)
                 case 's':
                         server_list = optarg;
                         break;
+                case 't':
+                        leader_ttl = strtoul(optarg,NULL,10);
+                        break;
                 default:
                         return print_usage(argv[0]);
                 }
         }
 
-        if (!server_list) {
+        if (!server_list || !leader_ttl || !interval_ms) {
                 return print_usage(argv[0]);
         }
+        if (interval_ms >= (leader_ttl * 1000)) {
+                fprintf (stderr, "interval must be shorter than the TTL\n");
+                return EXIT_FAILURE;
+        }
+
+        /* Whoever's reading this may be a pipe, e.g. leader-bench. */
+        setvbuf(stdout,NULL,_IOLBF,0);
 
         if (regcomp(&vote_re,"([^,]+),([^,]+),([^,]+)",REG_EXTENDED) != 0) {
                 fprintf (stderr, "Failed to set up vote regex\n");
@@ -277,23 +311,14 @@ main (int argc, char **argv)
                 }
                 if (i_am_leader) {
                         do {
-                                sleep(1);
+                                usleep(interval_ms*1000);
                         } while (Confirm(etcd,key) == EXIT_SUCCESS);
+                        i_am_leader = 0;
                 }
                 else {
                         /*
-                         * This doesn't really work, because an update to
-                         * refresh the TTL will generate an event even if the
-                         * value remains unchanged.  Even if that weren't the
-                         * case, issuing a watch without having the last index
-                         * in hand would be racy; something could change after
-                         * we called GET in GetCurrentLeader but before we
-                         * call WATCH in WatchLeaderChanges, and we'd miss the
-                         * notification.  When etcd supports a TTL refresh that
-                         * doesn't generate an event, and our API supports
-                         * returning an index along with a value from GET, then
-                         * we can enable this.  Until then it's just a no-op
-                         * placeholder.
+                         * Now that renewals don't generate events, this only
+                         * wakes up when the vote changes or expires.
                          */
                         if (WatchLeaderChanges(etcd,key) != EXIT_SUCCESS) {
                                 break;
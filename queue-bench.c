@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2013, Red Hat
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.  Redistributions in binary
+ * form must reproduce the above copyright notice, this list of conditions and
+ * the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Throughput benchmark for the queue API.  Producer threads push a fixed
+ * number of jobs through one queue while consumer threads drain it, each
+ * thread with its own session.  Reports how fast jobs went in and how fast
+ * they came out, and checks that every job was consumed exactly once.
+ */
+
+#define _GNU_SOURCE     /* for asprintf */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "etcd-api.h"
+
+#define DEFAULT_PRODUCERS       2
+#define DEFAULT_CONSUMERS       4
+#define DEFAULT_JOBS            10000
+#define DEFAULT_SIZE            64
+#define DEFAULT_PORT            4902
+#define IDLE_MS                 200
+
+static char             *servers;
+static char             *dir;
+static int              num_prod        = DEFAULT_PRODUCERS;
+static int              num_cons        = DEFAULT_CONSUMERS;
+static int              num_jobs        = DEFAULT_JOBS;
+static int              value_size      = DEFAULT_SIZE;
+static unsigned int     *seen;
+static int              next_job;
+static int              produced;
+static int              consumed;
+static int              errors;
+static int              prod_done;
+static double           last_in;
+
+static double
+now (void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Sessions and queues aren't meant to be shared between threads, so each
+ * thread opens its own.
+ */
+static etcd_queue
+open_queue (etcd_session *sessionp)
+{
+        char    *names;
+
+        names = strdup(servers);
+        if (!names) {
+                return NULL;
+        }
+        *sessionp = etcd_open_str(names);
+        if (!*sessionp) {
+                free(names);
+                return NULL;
+        }
+        return etcd_queue_open(*sessionp,dir);
+}
+
+static void
+close_queue (etcd_queue q, etcd_session session)
+{
+        if (q) {
+                etcd_queue_close(q);
+        }
+        if (session) {
+                etcd_close_str(session);
+        }
+}
+
+static void *
+producer (void *arg)
+{
+        etcd_session    session = NULL;
+        etcd_queue      q;
+        char            *value;
+        int             job;
+        double          t;
+
+        q = open_queue(&session);
+        value = malloc(value_size+1);
+        if (!q || !value) {
+                fprintf(stderr,"producer couldn't open queue\n");
+                __atomic_add_fetch(&prod_done,1,__ATOMIC_SEQ_CST);
+                free(value);
+                close_queue(q,session);
+                return NULL;
+        }
+        memset(value,'x',value_size);
+        value[value_size] = '\0';
+
+        for (;;) {
+                job = __atomic_fetch_add(&next_job,1,__ATOMIC_RELAXED);
+                if (job >= num_jobs) {
+                        break;
+                }
+                snprintf(value,value_size+1,"%08d",job);
+                if (value_size > 8) {
+                        value[8] = 'x';
+                }
+                if (etcd_enqueue(q,value,0,NULL) != ETCD_OK) {
+                        fprintf(stderr,"enqueue of job %d failed\n",job);
+                        __atomic_add_fetch(&errors,1,__ATOMIC_RELAXED);
+                        continue;
+                }
+                __atomic_add_fetch(&produced,1,__ATOMIC_RELAXED);
+        }
+
+        t = now();
+        if (__atomic_add_fetch(&prod_done,1,__ATOMIC_SEQ_CST) == num_prod) {
+                last_in = t;
+        }
+        free(value);
+        close_queue(q,session);
+        return NULL;
+}
+
+static int
+consume_one (void *arg, char *key, char *value)
+{
+        int     job;
+
+        if (key) {
+                job = (int)strtol(value,NULL,10);
+                if ((job < 0) || (job >= num_jobs)) {
+                        fprintf(stderr,"bogus job %s = %.16s\n",key,value);
+                        __atomic_add_fetch(&errors,1,__ATOMIC_RELAXED);
+                }
+                else {
+                        __atomic_add_fetch(&seen[job],1,__ATOMIC_RELAXED);
+                }
+                __atomic_add_fetch(&consumed,1,__ATOMIC_RELAXED);
+        }
+
+        /* Quit once the producers are done and all they made came out. */
+        return (__atomic_load_n(&prod_done,__ATOMIC_SEQ_CST) == num_prod)
+            && (__atomic_load_n(&consumed,__ATOMIC_SEQ_CST)
+                >= __atomic_load_n(&produced,__ATOMIC_SEQ_CST));
+}
+
+static void *
+consumer (void *arg)
+{
+        etcd_session    session = NULL;
+        etcd_queue      q;
+        etcd_result     res;
+
+        q = open_queue(&session);
+        if (!q) {
+                fprintf(stderr,"consumer couldn't open queue\n");
+                close_queue(q,session);
+                return NULL;
+        }
+
+        res = etcd_queue_consume(q,consume_one,NULL,IDLE_MS);
+        if (res != ETCD_OK) {
+                fprintf(stderr,"dequeue failed (%d)\n",res);
+        }
+
+        close_queue(q,session);
+        return NULL;
+}
+
+static int
+wait_for_server (unsigned short port)
+{
+        struct sockaddr_in      sin;
+        int                     fd;
+        int                     tries;
+
+        memset(&sin,0,sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        for (tries = 0; tries < 100; ++tries) {
+                fd = socket(AF_INET,SOCK_STREAM,0);
+                if (fd < 0) {
+                        return -1;
+                }
+                if (connect(fd,(struct sockaddr *)&sin,sizeof(sin)) == 0) {
+                        close(fd);
+                        return 0;
+                }
+                close(fd);
+                usleep(50000);
+        }
+        return -1;
+}
+
+struct option my_opts[] = {
+        { "consumers",  required_argument,      NULL,   'c' },
+        { "help",       no_argument,            NULL,   'h' },
+        { "dir",        required_argument,      NULL,   'k' },
+        { "jobs",       required_argument,      NULL,   'n' },
+        { "producers",  required_argument,      NULL,   'P' },
+        { "port",       required_argument,      NULL,   'p' },
+        { "servers",    required_argument,      NULL,   's' },
+        { "size",       required_argument,      NULL,   'z' },
+        { NULL }
+};
+
+static int
+print_usage (char *prog)
+{
+        fprintf(stderr,"Usage: %s [options]\n",prog);
+        fprintf(stderr,"  -c|--consumers CCC  default %d\n",
+                DEFAULT_CONSUMERS);
+        fprintf(stderr,"  -k|--dir       KKK  default queue-bench/PID\n");
+        fprintf(stderr,"  -n|--jobs      NNN  default %d\n",DEFAULT_JOBS);
+        fprintf(stderr,"  -P|--producers PPP  default %d\n",
+                DEFAULT_PRODUCERS);
+        fprintf(stderr,"  -p|--port      PPP  for etcd-mock, default %d\n",
+                DEFAULT_PORT);
+        fprintf(stderr,"  -s|--servers   SSS  use these instead of etcd-mock\n");
+        fprintf(stderr,"  -z|--size      ZZZ  value size, default %d\n",
+                DEFAULT_SIZE);
+        fprintf(stderr,"Without -s, run from the build directory; it starts "
+                       "./etcd-mock.\n");
+        return EXIT_FAILURE;
+}
+
+int
+main (int argc, char **argv)
+{
+        unsigned short  port            = DEFAULT_PORT;
+        char            port_str[16];
+        char            *mock_args[]    = { "./etcd-mock", "-p", port_str,
+                                            NULL };
+        pid_t           mock            = 0;
+        pthread_t       *threads;
+        double          t0;
+        double          t1;
+        int             missing         = 0;
+        int             dups            = 0;
+        int             opt;
+        int             i;
+
+        for (;;) {
+                opt = getopt_long(argc,argv,"c:hk:n:P:p:s:z:",my_opts,NULL);
+                if (opt == (-1)) {
+                        break;
+                }
+                switch (opt) {
+                case 'c':
+                        num_cons = strtol(optarg,NULL,10);
+                        break;
+                case 'k':
+                        dir = optarg;
+                        break;
+                case 'n':
+                        num_jobs = strtol(optarg,NULL,10);
+                        break;
+                case 'P':
+                        num_prod = strtol(optarg,NULL,10);
+                        break;
+                case 'p':
+                        port = (unsigned short)strtoul(optarg,NULL,10);
+                        break;
+                case 's':
+                        servers = optarg;
+                        break;
+                case 'z':
+                        value_size = strtol(optarg,NULL,10);
+                        break;
+                default:
+                        return print_usage(argv[0]);
+                }
+        }
+        if ((num_prod < 1) || (num_cons < 1) || (num_jobs < 1)
+                           || (value_size < 8)) {
+                return print_usage(argv[0]);
+        }
+
+        signal(SIGPIPE,SIG_IGN);
+        if (!dir && (asprintf(&dir,"queue-bench/%d",(int)getpid()) < 0)) {
+                return EXIT_FAILURE;
+        }
+        seen = calloc(num_jobs,sizeof(*seen));
+        threads = calloc(num_prod+num_cons,sizeof(*threads));
+        if (!seen || !threads) {
+                return EXIT_FAILURE;
+        }
+
+        if (!servers) {
+                snprintf(port_str,sizeof(port_str),"%u",port);
+                mock = fork();
+                if (mock == 0) {
+                        execv(mock_args[0],mock_args);
+                        perror(mock_args[0]);
+                        _exit(127);
+                }
+                if ((mock < 0) || (wait_for_server(port) != 0)) {
+                        fprintf(stderr,"couldn't start etcd-mock\n");
+                        return EXIT_FAILURE;
+                }
+                if (asprintf(&servers,"127.0.0.1:%u",port) < 0) {
+                        return EXIT_FAILURE;
+                }
+        }
+
+        t0 = now();
+        for (i = 0; i < num_cons; ++i) {
+                pthread_create(&threads[i],NULL,consumer,NULL);
+        }
+        for (i = 0; i < num_prod; ++i) {
+                pthread_create(&threads[num_cons+i],NULL,producer,NULL);
+        }
+        for (i = 0; i < num_prod+num_cons; ++i) {
+                pthread_join(threads[i],NULL);
+        }
+        t1 = now();
+
+        for (i = 0; i < num_jobs; ++i) {
+                if (seen[i] == 0) {
+                        ++missing;
+                }
+                else if (seen[i] > 1) {
+                        dups += seen[i] - 1;
+                }
+        }
+
+        printf("%d producers, %d consumers, %d jobs of %d bytes\n",
+               num_prod,num_cons,num_jobs,value_size);
+        printf("enqueued %d in %.3fs (%.0f/s)\n",produced,last_in-t0,
+               produced/(last_in-t0));
+        printf("dequeued %d in %.3fs (%.0f/s)\n",consumed,t1-t0,
+               consumed/(t1-t0));
+        printf("%d missing, %d duplicates, %d errors\n",missing,dups,errors);
+
+        if (mock > 0) {
+                kill(mock,SIGTERM);
+                waitpid(mock,NULL,0);
+        }
+        return (missing || dups || errors) ? EXIT_FAILURE : EXIT_SUCCESS;
+}